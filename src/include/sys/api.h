@@ -203,6 +203,9 @@ extern int visopsys_in_kernel;
 #define _fnum_memoryReleaseAllByProcId			0x5002
 #define _fnum_memoryGetStats					0x5003
 #define _fnum_memoryGetBlocks					0x5004
+#define _fnum_memoryReserve						0x5005
+#define _fnum_memoryMapFile						0x5006
+#define _fnum_memoryGetCacheStats				0x5007
 
 // Multitasker functions.  All are in the 0x6000-0x6FFF range.
 #define _fnum_multitaskerCreateProcess			0x6000
@@ -236,6 +239,8 @@ extern int visopsys_in_kernel;
 #define _fnum_multitaskerGetIoPerm				0x601C
 #define _fnum_multitaskerSetIoPerm				0x601D
 #define _fnum_multitaskerStackTrace				0x601E
+#define _fnum_multitaskerSchedTrace				0x601F
+#define _fnum_multitaskerSchedTraceRead			0x6020
 
 // Loader functions.  All are in the 0x7000-0x7FFF range.
 #define _fnum_loaderLoad						0x7000
@@ -623,6 +628,9 @@ int memoryRelease(void *);
 int memoryReleaseAllByProcId(int);
 int memoryGetStats(memoryStats *, int);
 int memoryGetBlocks(memoryBlock *, unsigned, int);
+void *memoryReserve(unsigned, const char *);
+void *memoryMapFile(file *, unsigned, unsigned, int);
+int memoryGetCacheStats(memoryCacheStats *, int);
 
 //
 // Multitasker functions
@@ -658,6 +666,8 @@ int multitaskerSignalRead(int);
 int multitaskerGetIoPerm(int, int);
 int multitaskerSetIoPerm(int, int, int);
 int multitaskerStackTrace(int);
+int multitaskerSchedTrace(int);
+int multitaskerSchedTraceRead(schedTraceEvent *, unsigned);
 
 //
 // Loader functions
@@ -134,6 +134,15 @@ typedef struct {
 	unsigned readKbytes;
 	unsigned writeTimeMs;
 	unsigned writeKbytes;
+	// Read-ahead, and how much of it was used, or not.
+	unsigned readAheadKbytes;
+	unsigned readAheadHitKbytes;
+	unsigned readAheadWasteKbytes;
+	// I/O request queue
+	unsigned requests;
+	unsigned merges;
+	unsigned queueDepth;
+	unsigned maxQueueDepth;
 
 } diskStats;
 
@@ -87,6 +87,24 @@
 #define KERNELVAR_NET_HOSTNAME		KERNELVAR_NETWORK "." KERNELVAR_HOSTNAME
 #define KERNELVAR_NET_DOMAINNAME	KERNELVAR_NETWORK "." KERNELVAR_DOMAINNAME
 
+// Processors
+#define KERNELVAR_CPUS				"cpus"
+#define KERNELVAR_MAX				"max"
+#define KERNELVAR_CPUS_MAX			KERNELVAR_CPUS "." KERNELVAR_MAX
+
+// Swap
+#define KERNELVAR_SWAP				"swap"
+#define KERNELVAR_DISK				"disk"
+#define KERNELVAR_SWAP_DISK			KERNELVAR_SWAP "." KERNELVAR_DISK
+
+// Disk cache writeback
+#define KERNELVAR_WRITEBACK			"writeback"
+#define KERNELVAR_AGE				"age"
+#define KERNELVAR_RATIO				"ratio"
+#define KERNELVAR_DISK_WB			KERNELVAR_DISK "." KERNELVAR_WRITEBACK
+#define KERNELVAR_DISK_WB_AGE		KERNELVAR_DISK_WB "." KERNELVAR_AGE
+#define KERNELVAR_DISK_WB_RATIO		KERNELVAR_DISK_WB "." KERNELVAR_RATIO
+
 #define _KERNCONF_H
 #endif
 
@@ -24,9 +24,12 @@
 
 #if !defined(_LINUXSWAP_H)
 
+#include <sys/memory.h>
+
 #define LINUXSWAP_MAGIC1	"SWAP-SPACE"
 #define LINUXSWAP_MAGIC2	"SWAPSPACE2"
 #define LINUXSWAP_MAXPAGES	(~0UL << 8)
+#define LINUXSWAP_MAXBADPAGES	((MEMORY_PAGE_SIZE - 1024 - 512 - 10) / 4)
 
 typedef union  {
 	struct {
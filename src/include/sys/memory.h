@@ -32,10 +32,16 @@
 #define MEMORY_PAGE_SIZE				4096
 #define MEMORY_BLOCK_SIZE				MEMORY_PAGE_SIZE
 #define MEMORY_MAX_DESC_LENGTH			32
+#define MEMORY_MAX_CACHENAME_LENGTH		32
+#define MEMORY_MAX_CACHES				32
 
 #define USER_MEMORY_HEAP_MULTIPLE		(64 * 1024)    // 64 Kb
 #define KERNEL_MEMORY_HEAP_MULTIPLE		(1024 * 1024)  // 1 meg
 
+// Flags for memoryMapFile().  By default, mapped files are read-only.
+#define MEMORY_MAP_READONLY				0x00
+#define MEMORY_MAP_PRIVATE				0x01	// Writable, not written back
+
 typedef struct _mallocBlock {
 	int process;
 	unsigned start;
@@ -44,7 +50,11 @@ typedef struct _mallocBlock {
 	unsigned heapAllocSize;
 	struct _mallocBlock *prev;
 	struct _mallocBlock *next;
+	struct _mallocBlock *startNext;
+	struct _mallocBlock *endNext;
 	const char *function;
+	int used;
+	int dirty;
 
 } mallocBlock;
 
@@ -63,9 +73,26 @@ typedef struct {
 	unsigned usedBlocks;
 	unsigned totalMemory;
 	unsigned usedMemory;
+	unsigned reservedMemory;	// Demand-paged memory reserved by processes
+	unsigned residentMemory;	// How much of that is populated
+	unsigned swapTotal;			// Size of the swap space
+	unsigned swapUsed;			// How much of it holds paged-out memory
 
 } memoryStats;
 
+// Struct that describes one of the kernel's object caches
+typedef struct {
+	char name[MEMORY_MAX_CACHENAME_LENGTH];
+	unsigned objectSize;
+	unsigned numSlabs;
+	unsigned totalObjects;
+	unsigned usedObjects;
+	unsigned allocs;
+	unsigned frees;
+	unsigned memory;
+
+} memoryCacheStats;
+
 typedef struct {
 	int (*multitaskerGetCurrentProcessId)(void);
 	void *(*memoryGet)(unsigned, const char *);
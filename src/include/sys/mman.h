@@ -0,0 +1,49 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2018 J. Andrew McLaughlin
+//
+//  This library is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation; either version 2.1 of the License, or (at
+//  your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+//  General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this library; if not, write to the Free Software Foundation,
+//  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  mman.h
+//
+
+// This file is the Visopsys implementation of the standard <sys/mman.h>
+// file found in Unix.
+
+#if !defined(_MMAN_H)
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Memory protection
+#define PROT_NONE		0x00
+#define PROT_READ		0x01
+#define PROT_WRITE		0x02
+#define PROT_EXEC		0x04
+
+// Mapping types.  Shared mappings are read-only, since changes to mapped
+// files aren't written back.
+#define MAP_SHARED		0x01
+#define MAP_PRIVATE		0x02
+#define MAP_FIXED		0x10
+
+#define MAP_FAILED		((void *) -1)
+
+void *mmap(void *, size_t, int, int, int, off_t);
+int munmap(void *, size_t);
+
+#define _MMAN_H
+#endif
+
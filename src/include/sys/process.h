@@ -27,7 +27,7 @@
 #include <string.h>
 
 #define MAX_PROCNAME_LENGTH		64
-#define MAX_PROCESSES			((GDT_SIZE - RES_GLOBAL_DESCRIPTORS))
+#define MAX_PROCESSES			4096
 
 // An enumeration listing possible process states
 typedef enum {
@@ -70,6 +70,22 @@ typedef struct {
 
 } process;
 
+// Types of scheduler trace events
+#define SCHEDTRACE_SWITCHIN		1
+#define SCHEDTRACE_SWITCHOUT	2
+#define SCHEDTRACE_WAKEUP		3
+
+// An event recorded by the scheduler trace, when it's enabled.  The time is
+// in microseconds, and the state is the process' new state.
+typedef struct {
+	unsigned long long time;
+	int processId;
+	int cpu;
+	int type;
+	processState state;
+
+} schedTraceEvent;
+
 #define _PROCESS_H
 #endif
 
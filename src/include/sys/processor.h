@@ -34,6 +34,26 @@
 #define X86_MSR_APICBASE_APICENABLE		0x00000800
 #define X86_MSR_APICBASE_BSP			0x00000100
 
+// CPUID feature bits that we use
+#define X86_CPUID1_EDX_PSE				0x00000008
+#define X86_CPUID1_EDX_PGE				0x00002000
+#define X86_CPUID1_EDX_FXSR				0x01000000
+#define X86_CPUID1_EDX_SSE				0x02000000
+#define X86_CPUID1_ECX_XSAVE			0x04000000
+#define X86_CPUID1_ECX_AVX				0x10000000
+
+// Bitfields for CR4
+#define X86_CR4_PSE						0x00000010
+#define X86_CR4_PGE						0x00000080
+#define X86_CR4_OSFXSR					0x00000200
+#define X86_CR4_OSXMMEXCPT				0x00000400
+#define X86_CR4_OSXSAVE					0x00040000
+
+// Bitfields for XCR0, the extended state mask
+#define X86_XCR0_X87					0x00000001
+#define X86_XCR0_SSE					0x00000002
+#define X86_XCR0_AVX					0x00000004
+
 //
 // Processor registers
 //
@@ -42,6 +62,10 @@
 	__asm__ __volatile__ ("cpuid" : "=a" (rega), "=b" (regb), "=c" (regc), \
 		"=d" (regd) : "a" (arg))
 
+#define processorIdSub(arg, sub, rega, regb, regc, regd) \
+	__asm__ __volatile__ ("cpuid" : "=a" (rega), "=b" (regb), "=c" (regc), \
+		"=d" (regd) : "a" (arg), "c" (sub))
+
 #define processorReadMsr(msr, rega, regd) \
 	__asm__ __volatile__ ("rdmsr" : "=a" (rega), "=d" (regd) : "c" (msr));
 
@@ -54,12 +78,24 @@
 #define processorSetCR0(variable) \
 	__asm__ __volatile__ ("movl %0, %%cr0" : : "r" (variable))
 
+#define processorGetCR2(variable) \
+	__asm__ __volatile__ ("movl %%cr2, %0" : "=r" (variable))
+
 #define processorGetCR3(variable) \
 	__asm__ __volatile__ ("movl %%cr3, %0" : "=r" (variable))
 
 #define processorSetCR3(variable) \
 	__asm__ __volatile__ ("movl %0, %%cr3" : : "r" (variable))
 
+#define processorGetCR4(variable) \
+	__asm__ __volatile__ ("movl %%cr4, %0" : "=r" (variable))
+
+#define processorSetCR4(variable) \
+	__asm__ __volatile__ ("movl %0, %%cr4" : : "r" (variable))
+
+#define processorSetXCR(xcr, rega, regd) \
+	__asm__ __volatile__ ("xsetbv" : : "a" (rega), "d" (regd), "c" (xcr))
+
 #define processorClearAddressCache(addr) \
 	__asm__ __volatile__ ("invlpg %0" : : "m" (*((char *)(addr))))
 
@@ -258,6 +294,10 @@
 	processorPopFlags(); \
 } while (0)
 
+#define processorGetTaskReg(selector) \
+	__asm__ __volatile__ ("xorl %%eax, %%eax \n\t" \
+		"str %%ax" : "=a" (selector))
+
 #define processorClearTaskSwitched() __asm__ __volatile__ ("clts")
 
 #define processorGetInstructionPointer(addr) \
@@ -276,6 +316,33 @@
 	processorPopFlags(); \
 } while (0)
 
+// Save the current context on the stack, storing the stack pointer in
+// *saveEsp, and resume the context whose stack pointer is loadEsp
+#define processorSwitchContext(saveEsp, loadEsp) do { \
+	unsigned _save __attribute__((unused)); \
+	unsigned _load __attribute__((unused)); \
+	__asm__ __volatile__ ( \
+		"pushfl \n\t" \
+		"pushl %%ds \n\t" \
+		"pushl %%es \n\t" \
+		"pushl %%fs \n\t" \
+		"pushl %%gs \n\t" \
+		"pushl %%ebp \n\t" \
+		"pushl $1f \n\t" \
+		"movl %%esp, (%0) \n\t" \
+		"movl %1, %%esp \n\t" \
+		"ret \n\t" \
+		"1: \n\t" \
+		"popl %%ebp \n\t" \
+		"popl %%gs \n\t" \
+		"popl %%fs \n\t" \
+		"popl %%es \n\t" \
+		"popl %%ds \n\t" \
+		"popfl" \
+		: "=a" (_save), "=d" (_load) : "0" (saveEsp), "1" (loadEsp) \
+		: "%ebx", "%ecx", "%esi", "%edi", "memory", "cc"); \
+} while (0)
+
 #define processorIsrCall(addr) do { \
 	processorPush(PRIV_CODE); \
 	processorPush(addr); \
@@ -313,6 +380,23 @@
 	processorIntReturn(); \
 } while (0)
 
+// For exceptions (such as page faults) where the processor pushes an error
+// code after the return address
+#define processorErrorExceptionEnter(exAddr, errCode, ints) do { \
+	processorPushRegs(); \
+	processorSuspendInts(ints); \
+	__asm__ __volatile__ ("movl 4(%%ebp), %0" : "=r" (errCode)); \
+	__asm__ __volatile__ ("movl 8(%%ebp), %0" : "=r" (exAddr)); \
+} while (0)
+
+#define processorErrorExceptionExit(ints) do { \
+	processorRestoreInts(ints); \
+	processorPopRegs(); \
+	processorPopFrame(); \
+	__asm__ __volatile__ ("addl $4, %%esp" : : : "%esp"); \
+	processorIntReturn(); \
+} while (0)
+
 #define processorIsrEnter(stAddr) do { \
 	processorDisableInts(); \
 	processorPushRegs(); \
@@ -327,6 +411,11 @@
 	processorIntReturn(); \
 } while (0)
 
+// In an interrupt handler, get the code segment selector of the interrupted
+// code.  Its low 2 bits are the privilege level it was running at.
+#define processorIsrGetCodeSelector(cs) \
+	__asm__ __volatile__ ("movl 8(%%ebp), %0" : "=r" (cs))
+
 #define processorApiExit(stAddr, codeLo, codeHi) do { \
 	__asm__ __volatile__ ( \
 		"movl %0, %%eax \n\t" \
@@ -354,6 +443,22 @@
 
 #define processorFpuInit() __asm__ __volatile__ ("fninit")
 
+// The FXSAVE area must be 16-byte aligned, and the XSAVE area 64-byte aligned
+#define processorFxStateSave(addr) \
+	__asm__ __volatile__ ("fxsave %0" : : "m" (*((char *)(addr))) : "memory")
+
+#define processorFxStateRestore(addr) \
+	__asm__ __volatile__ ("fxrstor %0" : : "m" (*((char *)(addr))) \
+		: "memory")
+
+#define processorXStateSave(addr, maskLo, maskHi) \
+	__asm__ __volatile__ ("xsave %0" : : "m" (*((char *)(addr))), \
+		"a" (maskLo), "d" (maskHi) : "memory")
+
+#define processorXStateRestore(addr, maskLo, maskHi) \
+	__asm__ __volatile__ ("xrstor %0" : : "m" (*((char *)(addr))), \
+		"a" (maskLo), "d" (maskHi) : "memory")
+
 #define processorGetFpuControl(code) \
 	__asm__ __volatile__ ("fstcw %0" : "=m" (code))
 
@@ -371,6 +476,20 @@
 	__asm__ __volatile__ ("lock cmpxchgl %1, %2" \
 		: : "a" (0), "r" (proc), "m" (lck) : "memory")
 
+#define processorAtomicSwap(ptr, value) \
+	__asm__ __volatile__ ("xchgl %0, %1" \
+		: "+r" (value), "+m" (*(ptr)) : : "memory")
+
+#define processorAtomicSetBit(ptr, bit) \
+	__asm__ __volatile__ ("lock btsl %1, %0" \
+		: "+m" (*(ptr)) : "r" (bit) : "memory")
+
+#define processorAtomicClearBit(ptr, bit) \
+	__asm__ __volatile__ ("lock btrl %1, %0" \
+		: "+m" (*(ptr)) : "r" (bit) : "memory")
+
+#define processorPause() __asm__ __volatile__ ("pause" : : : "memory")
+
 static inline unsigned short processorSwap16(unsigned short variable)
 {
 	volatile unsigned short tmp = (variable);
@@ -47,6 +47,7 @@
 #include "kernelRandom.h"
 #include "kernelRtc.h"
 #include "kernelShutdown.h"
+#include "kernelSlab.h"
 #include "kernelText.h"
 #include "kernelUser.h"
 #include "kernelWindow.h"
@@ -626,6 +627,17 @@ static kernelArgInfo args_memoryGetBlocks[] =
 	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
 		{ 1, type_val, API_ARG_ANYVAL },
 		{ 1, type_val, API_ARG_ANYVAL } };
+static kernelArgInfo args_memoryReserve[] =
+	{ { 1, type_val, API_ARG_ANYVAL },
+		{ 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR } };
+static kernelArgInfo args_memoryMapFile[] =
+	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
+		{ 1, type_val, API_ARG_ANYVAL },
+		{ 1, type_val, API_ARG_ANYVAL },
+		{ 1, type_val, API_ARG_ANYVAL } };
+static kernelArgInfo args_memoryGetCacheStats[] =
+	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
+		{ 1, type_val, API_ARG_ANYVAL } };
 
 static kernelFunctionIndex memoryFunctionIndex[] = {
 	{ _fnum_memoryGet, kernelMemoryGet,
@@ -637,7 +649,13 @@ static kernelFunctionIndex memoryFunctionIndex[] = {
 	{ _fnum_memoryGetStats, kernelMemoryGetStats,
 		PRIVILEGE_USER, 2, args_memoryGetStats, type_val },
 	{ _fnum_memoryGetBlocks, kernelMemoryGetBlocks,
-		PRIVILEGE_USER, 3, args_memoryGetBlocks, type_val }
+		PRIVILEGE_USER, 3, args_memoryGetBlocks, type_val },
+	{ _fnum_memoryReserve, kernelMemoryReserve,
+		PRIVILEGE_USER, 2, args_memoryReserve, type_ptr },
+	{ _fnum_memoryMapFile, kernelMemoryMapFile,
+		PRIVILEGE_USER, 4, args_memoryMapFile, type_ptr },
+	{ _fnum_memoryGetCacheStats, kernelSlabGetStats,
+		PRIVILEGE_USER, 2, args_memoryGetCacheStats, type_val }
 };
 
 // Multitasker functions (0x6000-0x6FFF range)
@@ -717,6 +735,11 @@ static kernelArgInfo args_multitaskerSetIoPerm[] =
 		{ 1, type_val, API_ARG_ANYVAL } };
 static kernelArgInfo args_multitaskerStackTrace[] =
 	{ { 1, type_val, API_ARG_ANYVAL } };
+static kernelArgInfo args_multitaskerSchedTrace[] =
+	{ { 1, type_val, API_ARG_ANYVAL } };
+static kernelArgInfo args_multitaskerSchedTraceRead[] =
+	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
+		{ 1, type_val, API_ARG_ANYVAL } };
 
 static kernelFunctionIndex multitaskerFunctionIndex[] = {
 	{ _fnum_multitaskerCreateProcess, kernelMultitaskerCreateProcess,
@@ -780,7 +803,11 @@ static kernelFunctionIndex multitaskerFunctionIndex[] = {
 	{ _fnum_multitaskerSetIoPerm, kernelMultitaskerSetIoPerm,
 		PRIVILEGE_SUPERVISOR, 3, args_multitaskerSetIoPerm, type_val },
 	{ _fnum_multitaskerStackTrace, kernelMultitaskerStackTrace,
-		PRIVILEGE_USER, 1, args_multitaskerStackTrace, type_val }
+		PRIVILEGE_USER, 1, args_multitaskerStackTrace, type_val },
+	{ _fnum_multitaskerSchedTrace, kernelMultitaskerSchedTrace,
+		PRIVILEGE_SUPERVISOR, 1, args_multitaskerSchedTrace, type_val },
+	{ _fnum_multitaskerSchedTraceRead, kernelMultitaskerSchedTraceRead,
+		PRIVILEGE_SUPERVISOR, 2, args_multitaskerSchedTraceRead, type_val }
 };
 
 // Loader functions (0x7000-0x7FFF range)
@@ -1980,6 +2007,10 @@ void kernelApi(unsigned CS __attribute__((unused)), unsigned *args)
 	const char *symbolName = NULL;
 	#endif // defined(DEBUG)
 
+	// Kernel code only runs on the boot processor.  If we were called on one
+	// of the others, this returns once we've been moved.
+	kernelMultitaskerKernelEnter();
+
 	// Check args
 	if (!args)
 	{
@@ -23,16 +23,19 @@
 
 #include "kernelDriver.h" // Contains my prototypes
 #include "kernelApicDriver.h"
+#include "kernelCpu.h"
 #include "kernelDebug.h"
 #include "kernelDevice.h"
 #include "kernelError.h"
 #include "kernelInterrupt.h"
+#include "kernelLog.h"
 #include "kernelMalloc.h"
 #include "kernelPage.h"
 #include "kernelParameters.h"
 #include "kernelPic.h"
 #include "kernelSystemDriver.h"
 #include <string.h>
+#include <time.h>
 #include <sys/multiproc.h>
 #include <sys/processor.h>
 
@@ -44,6 +47,7 @@
 	writeIoReg((ioApic), (0x10 + (num * 2) + 1), value)
 
 static volatile void *localApicRegs = NULL;
+static unsigned timerFreq = 0;
 
 
 static unsigned readLocalReg(unsigned offset)
@@ -107,6 +111,43 @@ static inline void debugLocalRegs(void)
 #endif
 
 
+static int waitIcrIdle(void)
+{
+	// Wait for the delivery status bit of the interrupt command register to
+	// show that any previous IPI has been sent
+
+	int count;
+
+	for (count = 0; count < 100000; count ++)
+	{
+		if (!(readLocalReg(APIC_LOCALREG_INTCMDLO) & (1 << 12)))
+			return (0);
+
+		processorPause();
+	}
+
+	return (ERR_TIMEOUT);
+}
+
+
+static int sendIcr(int apicId, unsigned command)
+{
+	// Send an inter-processor interrupt command to the local APIC with the
+	// given ID
+
+	int status = 0;
+
+	status = waitIcrIdle();
+	if (status < 0)
+		return (status);
+
+	writeLocalReg(APIC_LOCALREG_INTCMDHI, ((apicId & 0xFF) << 24));
+	writeLocalReg(APIC_LOCALREG_INTCMDLO, command);
+
+	return (status = waitIcrIdle());
+}
+
+
 static int timerIrqMapped(kernelDevice *mpDevice)
 {
 	// Loop through the buses and I/O interrupt assignments to determine
@@ -1063,6 +1104,231 @@ void kernelApicDriverRegister(kernelDriver *driver)
 }
 
 
+int kernelApicGetId(void)
+{
+	// Returns the local APIC ID of the current processor
+
+	if (!localApicRegs)
+		return (ERR_NOTINITIALIZED);
+
+	return ((readLocalReg(APIC_LOCALREG_APICID) >> 24) & 0xFF);
+}
+
+
+int kernelApicGetProcessors(int *apicIds, int maxIds)
+{
+	// Fill the array with the local APIC IDs of the usable application
+	// processors (i.e. not the boot processor) listed in the multiprocessor
+	// table, and return the number found
+
+	kernelDevice *mpDevice = NULL;
+	kernelMultiProcOps *mpOps = NULL;
+	multiProcCpuEntry *cpuEntry = NULL;
+	int numIds = 0;
+	int count;
+
+	// Check params
+	if (!apicIds)
+		return (ERR_NULLPARAMETER);
+
+	if (!localApicRegs)
+		return (ERR_NOTINITIALIZED);
+
+	if (kernelDeviceFindType(
+		kernelDeviceGetClass(DEVICESUBCLASS_SYSTEM_MULTIPROC), NULL,
+			&mpDevice, 1) < 1)
+	{
+		return (ERR_NOTIMPLEMENTED);
+	}
+
+	mpOps = (kernelMultiProcOps *) mpDevice->driver->ops;
+
+	for (count = 0; numIds < maxIds; count ++)
+	{
+		cpuEntry = mpOps->driverGetEntry(mpDevice, MULTIPROC_ENTRY_CPU,
+			count);
+		if (!cpuEntry)
+			break;
+
+		// Enabled, and not the boot processor?
+		if ((cpuEntry->cpuFlags & 0x01) && !(cpuEntry->cpuFlags & 0x02))
+			apicIds[numIds++] = cpuEntry->localApicId;
+	}
+
+	return (numIds);
+}
+
+
+int kernelApicInitializeCpu(void)
+{
+	// Called by an application processor, once it's running in protected
+	// mode, to enable its own local APIC.  The registers are at the same
+	// address for every processor, and are already mapped by the boot
+	// processor.  The application processors don't receive any external
+	// interrupts, only IPIs.
+
+	unsigned rega = 0, regd = 0;
+
+	if (!localApicRegs)
+		return (ERR_NOTINITIALIZED);
+
+	processorReadMsr(X86_MSR_APICBASE, rega, regd);
+	rega |= X86_MSR_APICBASE_APICENABLE;
+	processorWriteMsr(X86_MSR_APICBASE, rega, regd);
+
+	// Accept all interrupts
+	writeLocalReg(APIC_LOCALREG_TASKPRI, 0);
+
+	// Mask off the local interrupt vectors
+	writeLocalReg(APIC_LOCALREG_LOCVECTBL, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_PERFCNT, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_LINT0, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_LINT1, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_ERROR, (1 << 16));
+
+	// Flat model, and enable with spurious interrupt vector 0xFF, as for
+	// the boot processor
+	writeLocalReg(APIC_LOCALREG_DESTFMT,
+		(readLocalReg(APIC_LOCALREG_DESTFMT) | (0xF << 28)));
+	writeLocalReg(APIC_LOCALREG_SPURINT,
+		(readLocalReg(APIC_LOCALREG_SPURINT) | 0x000001FF));
+
+	return (0);
+}
+
+
+int kernelApicStartCpu(int apicId, unsigned startPhysical)
+{
+	// Start an application processor using the INIT-SIPI-SIPI sequence.  The
+	// startup code must be in a page-aligned location below 1MB.
+
+	int status = 0;
+	int count;
+
+	if (!localApicRegs)
+		return (status = ERR_NOTINITIALIZED);
+
+	if ((startPhysical & (MEMORY_PAGE_SIZE - 1)) || (startPhysical >= 0x100000))
+		return (status = ERR_ALIGN);
+
+	kernelDebug(debug_io, "APIC starting processor %d at 0x%08x", apicId,
+		startPhysical);
+
+	// INIT, level-triggered, assert
+	status = sendIcr(apicId, ((1 << 15) | (1 << 14) | (0x05 << 8)));
+	if (status < 0)
+		return (status);
+
+	// INIT de-assert, for the benefit of older APICs
+	status = sendIcr(apicId, ((1 << 15) | (0x05 << 8)));
+	if (status < 0)
+		return (status);
+
+	kernelCpuSpinMs(10);
+
+	// Two STARTUP IPIs, with the vector being the page number of the code
+	for (count = 0; count < 2; count ++)
+	{
+		status = sendIcr(apicId, ((0x06 << 8) | (startPhysical >> 12)));
+		if (status < 0)
+			return (status);
+
+		kernelCpuSpinMs(1);
+	}
+
+	return (status = 0);
+}
+
+
+int kernelApicSendIpi(int apicId, int vector)
+{
+	// Send a fixed inter-processor interrupt to the processor with the given
+	// local APIC ID
+
+	if (!localApicRegs)
+		return (ERR_NOTINITIALIZED);
+
+	return (sendIcr(apicId, ((1 << 14) | (vector & 0xFF))));
+}
+
+
+void kernelApicEndOfInterrupt(void)
+{
+	// Acknowledge an IPI (or any interrupt) in the current processor's local
+	// APIC
+	writeLocalReg(APIC_LOCALREG_EOI, 0);
+}
+
+
+int kernelApicTimerInitialize(int vector)
+{
+	// Set up the current processor's local APIC timer to interrupt with the
+	// given vector, in one-shot mode.  The first time, we measure its
+	// frequency against the CPU timestamp counter.
+
+	uquad_t tsFreq = 0;
+	uquad_t timestamp = 0;
+	unsigned elapsed = 0;
+
+	if (!localApicRegs)
+		return (ERR_NOTINITIALIZED);
+
+	// Divide the bus clock by 16, and make sure the timer is stopped
+	writeLocalReg(APIC_LOCALREG_TIMERDIV, 0x03);
+	writeLocalReg(APIC_LOCALREG_LOCVECTBL, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_TIMERCNT, 0);
+
+	if (!timerFreq)
+	{
+		tsFreq = kernelCpuTimestampFreq();
+		if (!tsFreq)
+			return (ERR_NOTINITIALIZED);
+
+		// Count down (masked) for about 10ms
+		timestamp = kernelCpuTimestamp();
+		writeLocalReg(APIC_LOCALREG_TIMERCNT, 0xFFFFFFFF);
+		kernelCpuSpinMs(10);
+		elapsed = (0xFFFFFFFF - readLocalReg(APIC_LOCALREG_TIMERCURR));
+		timestamp = (kernelCpuTimestamp() - timestamp);
+		writeLocalReg(APIC_LOCALREG_TIMERCNT, 0);
+
+		if (!elapsed || !timestamp)
+			return (ERR_NOTIMPLEMENTED);
+
+		timerFreq = (unsigned)((elapsed * tsFreq) / timestamp);
+
+		kernelLog("Local APIC timer frequency is %u kHz", (timerFreq / 1000));
+	}
+
+	// One-shot mode, unmasked
+	writeLocalReg(APIC_LOCALREG_LOCVECTBL, (vector & 0xFF));
+
+	return (0);
+}
+
+
+void kernelApicTimerSet(unsigned microseconds)
+{
+	// Arm the current processor's local APIC timer to interrupt once after
+	// the given number of microseconds, or stop it if the number is zero
+
+	unsigned count = 0;
+
+	if (!localApicRegs || !timerFreq)
+		return;
+
+	if (microseconds)
+	{
+		count = (unsigned)(((uquad_t) microseconds * timerFreq) /
+			US_PER_SEC);
+		if (!count)
+			count = 1;
+	}
+
+	writeLocalReg(APIC_LOCALREG_TIMERCNT, count);
+}
+
+
 #ifdef DEBUG
 void kernelApicDebug(void)
 {
@@ -42,6 +42,14 @@
 #define APIC_LOCALREG_LINT1			0x360
 #define APIC_LOCALREG_ERROR			0x370
 #define APIC_LOCALREG_TIMERCNT		0x380
+#define APIC_LOCALREG_TIMERCURR		0x390
+#define APIC_LOCALREG_TIMERDIV		0x3E0
+
+// Vectors for inter-processor interrupts (and the local APIC timer), just
+// below the spurious vector
+#define APIC_VECTOR_TIMER			0xFC
+#define IPI_VECTOR_RESCHEDULE		0xFD
+#define IPI_VECTOR_TLBFLUSH			0xFE
 
 typedef struct {
 	unsigned char id;
@@ -49,6 +57,15 @@ typedef struct {
 
 } kernelIoApic;
 
+// Functions exported by kernelApicDriver.c
+int kernelApicGetId(void);
+int kernelApicGetProcessors(int *, int);
+int kernelApicInitializeCpu(void);
+int kernelApicStartCpu(int, unsigned);
+int kernelApicSendIpi(int, int);
+void kernelApicEndOfInterrupt(void);
+int kernelApicTimerInitialize(int);
+void kernelApicTimerSet(unsigned);
 void kernelApicDebug(void);
 
 #define _KERNELAPICDRIVER_H
@@ -35,6 +35,7 @@
 //#define ATA_READECC			0x22	// Obsolete
 #define ATA_READSECTS_EXT		0x24
 #define ATA_READDMA_EXT			0x25
+#define ATA_READLOG_EXT			0x2F
 #define ATA_READMULTI_EXT		0x29
 #define ATA_WRITESECTS			0x30
 //#define ATA_WRITEECC			0x32	// Obsolete
@@ -42,6 +43,8 @@
 #define ATA_WRITEDMA_EXT		0x35
 #define ATA_WRITEMULTI_EXT		0x39
 #define ATA_VERIFYMULTI			0x40
+#define ATA_READFPDMA			0x60
+#define ATA_WRITEFPDMA			0x61
 //#define ATA_FORMATTRACK		0x50	// Obsolete
 //#define ATA_SEEK				0x70	// Obsolete
 #define ATA_DIAG				0x90
@@ -108,6 +111,7 @@
 
 // ATA feature flags.  These don't represent all possible features; just the
 // ones we [plan to] support.
+#define ATA_FEATURE_NCQ			0x100
 #define ATA_FEATURE_48BIT		0x80
 #define ATA_FEATURE_MEDSTAT		0x40
 #define ATA_FEATURE_WCACHE		0x20
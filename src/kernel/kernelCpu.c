@@ -20,15 +20,23 @@
 //
 
 #include "kernelCpu.h"
+#include "kernelApicDriver.h"
 #include "kernelDebug.h"
+#include "kernelDescriptor.h"
 #include "kernelDevice.h"
 #include "kernelDriver.h"
+#include "kernelError.h"
 #include "kernelLog.h"
 #include "kernelMalloc.h"
+#include "kernelMemory.h"
+#include "kernelMultitasker.h"
+#include "kernelPage.h"
+#include "kernelParameters.h"
 #include "kernelSysTimer.h"
 #include "kernelVariableList.h"
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/processor.h>
@@ -56,6 +64,105 @@ static struct {
 
 static uquad_t timestampFreq = 0;
 
+// Handshaking with an application processor as it starts
+static volatile int apStarted = 0;
+static volatile int apGo = 0;
+static volatile int apCpuNum = 0;
+
+// The code that application processors start executing, in real mode.  It
+// gets copied to a page of low memory, and the data at the end is filled in
+// before each processor is started.  It switches to protected mode with a
+// flat GDT (with the same selectors as the kernel's), loads the kernel's
+// paging and control registers, and jumps to apEntry() on a temporary stack.
+extern char apStartCode[], apStart32[], apStartGdt[], apStartGdtr[],
+	apStartJump[], apStartCr0[], apStartCr3[], apStartCr4[], apStartStack[],
+	apStartEntry[], apStartEnd[];
+__asm__ (
+	".pushsection .text \n"
+	".code16 \n"
+	"apStartCode: \n\t"
+	"cli \n\t"
+	"movw %cs, %ax \n\t"
+	"movw %ax, %ds \n\t"
+	"xorl %ebx, %ebx \n\t"
+	"movw %ax, %bx \n\t"
+	"shll $4, %ebx \n\t"
+	"lgdtl (apStartGdtr - apStartCode) \n\t"
+	"movl %cr0, %eax \n\t"
+	"orl $1, %eax \n\t"
+	"movl %eax, %cr0 \n\t"
+	"ljmpl *(apStartJump - apStartCode) \n"
+	".code32 \n"
+	"apStart32: \n\t"
+	"movw $0x10, %ax \n\t"
+	"movw %ax, %ds \n\t"
+	"movw %ax, %es \n\t"
+	"movw %ax, %fs \n\t"
+	"movw %ax, %gs \n\t"
+	"movw $0x18, %ax \n\t"
+	"movw %ax, %ss \n\t"
+	"movl (apStartCr4 - apStartCode)(%ebx), %eax \n\t"
+	"movl %eax, %cr4 \n\t"
+	"movl (apStartCr3 - apStartCode)(%ebx), %eax \n\t"
+	"movl %eax, %cr3 \n\t"
+	"movl (apStartCr0 - apStartCode)(%ebx), %eax \n\t"
+	"movl %eax, %cr0 \n\t"
+	"movl (apStartStack - apStartCode)(%ebx), %esp \n\t"
+	"jmp *(apStartEntry - apStartCode)(%ebx) \n"
+	".align 8 \n"
+	"apStartGdt: \n\t"
+	".quad 0 \n\t"
+	".quad 0x00CF9A000000FFFF \n\t"	// 0x08 code
+	".quad 0x00CF92000000FFFF \n\t"	// 0x10 data
+	".quad 0x00CF92000000FFFF \n"		// 0x18 stack
+	"apStartGdtr: \n\t"
+	".word 31 \n\t"
+	".long 0 \n"
+	"apStartJump: \n\t"
+	".long 0 \n\t"
+	".word 0x08 \n"
+	"apStartCr0: \n\t"
+	".long 0 \n"
+	"apStartCr3: \n\t"
+	".long 0 \n"
+	"apStartCr4: \n\t"
+	".long 0 \n"
+	"apStartStack: \n\t"
+	".long 0 \n"
+	"apStartEntry: \n\t"
+	".long 0 \n"
+	"apStartEnd: \n"
+	".popsection \n"
+);
+
+#define AP_START_OFFSET(label) ((unsigned) (label) - (unsigned) apStartCode)
+#define AP_START_DATA(base, label) \
+	((unsigned *)((base) + AP_START_OFFSET(label)))
+
+
+__attribute__((noreturn))
+static void apEntry(void)
+{
+	// Application processors arrive here from the startup code, in
+	// protected mode with paging enabled
+
+	// Use the kernel's descriptor tables, and set up the local APIC
+	kernelDescriptorLoad();
+	kernelApicInitializeCpu();
+
+	// Tell the boot processor that we're alive, and wait for it to set up
+	// our scheduler
+	apStarted = 1;
+	while (!apGo)
+		processorPause();
+
+	// Doesn't return
+	kernelMultitaskerStartCpu(apCpuNum);
+
+	while (1)
+		processorStop();
+}
+
 
 static int driverDetectCpu(void *parent, kernelDriver *driver)
 {
@@ -312,6 +419,19 @@ uquad_t kernelCpuGetMs(void)
 }
 
 
+uquad_t kernelCpuGetUs(void)
+{
+	// Returns a value representing the current CPU timestamp in
+	// microseconds.
+
+	// Make sure the timestamp frequency has been determined
+	if (!timestampFreq)
+		kernelCpuTimestampFreq();
+
+	return (kernelCpuTimestamp() / (timestampFreq / US_PER_SEC));
+}
+
+
 void kernelCpuSpinMs(unsigned millisecs)
 {
 	// This will use the CPU timestamp counter to spin for (at least) the
@@ -322,3 +442,151 @@ void kernelCpuSpinMs(unsigned millisecs)
 	while (kernelCpuGetMs() < endtime);
 }
 
+
+int kernelCpuStartAps(int maxCpus)
+{
+	// Start up the application processors listed in the multiprocessor
+	// table, up to a total of 'maxCpus' processors including the boot one.
+	// Returns the number of processors started (not including the boot one)
+	// or negative on error.
+
+	int status = 0;
+	int apicIds[MAX_CPUS - 1];
+	int numAps = 0;
+	unsigned startPhysical = 0;
+	unsigned char *startCode = NULL;
+	int mapped = 0;
+	void *stack = NULL;
+	unsigned cr = 0;
+	uquad_t timeout = 0;
+	int numCpus = 0;
+	int started = 0;
+	int count;
+
+	maxCpus = min(maxCpus, MAX_CPUS);
+	if (maxCpus < 2)
+		return (status = 0);
+
+	numAps = kernelApicGetProcessors(apicIds, (maxCpus - 1));
+	if (numAps <= 0)
+		// No application processors (or no APIC)
+		return (status = 0);
+
+	// The startup code has to be in a page of low memory, since that's where
+	// the processors begin executing, in real mode
+	startPhysical = kernelMemoryGetPhysical(MEMORY_PAGE_SIZE,
+		MEMORY_PAGE_SIZE, 1 /* low memory */, "processor startup");
+	if (!startPhysical)
+		return (status = ERR_MEMORY);
+
+	if (startPhysical >= (1024 * 1024))
+	{
+		kernelError(kernel_error, "No low memory for processor startup");
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	// It needs to be identity-mapped, since it turns on paging
+	startCode = (unsigned char *) startPhysical;
+	if (kernelPageMapped(KERNELPROCID, startCode, MEMORY_PAGE_SIZE) != 1)
+	{
+		status = kernelPageMap(KERNELPROCID, startPhysical, startCode,
+			MEMORY_PAGE_SIZE);
+		if (status < 0)
+			goto out;
+
+		mapped = 1;
+	}
+
+	stack = kernelMalloc(AP_BOOT_STACK_SIZE);
+	if (!stack)
+	{
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	// Copy the startup code and fill in its data
+	memcpy(startCode, apStartCode, AP_START_OFFSET(apStartEnd));
+
+	*((unsigned *)(startCode + AP_START_OFFSET(apStartGdtr) + 2)) =
+		(startPhysical + AP_START_OFFSET(apStartGdt));
+	*AP_START_DATA(startCode, apStartJump) =
+		(startPhysical + AP_START_OFFSET(apStart32));
+	processorGetCR0(cr);
+	*AP_START_DATA(startCode, apStartCr0) = (cr & ~0x8);
+	processorGetCR3(cr);
+	*AP_START_DATA(startCode, apStartCr3) = cr;
+	processorGetCR4(cr);
+	*AP_START_DATA(startCode, apStartCr4) = cr;
+	*AP_START_DATA(startCode, apStartStack) =
+		((unsigned) stack + AP_BOOT_STACK_SIZE);
+	*AP_START_DATA(startCode, apStartEntry) = (unsigned) &apEntry;
+
+	// Start them one at a time, since they share the startup code and stack
+	for (count = 0; count < numAps; count ++)
+	{
+		apStarted = apGo = 0;
+
+		status = kernelApicStartCpu(apicIds[count], startPhysical);
+		if (status < 0)
+			continue;
+
+		timeout = (kernelCpuGetMs() + AP_START_TIMEOUT_MS);
+		while (!apStarted && (kernelCpuGetMs() < timeout))
+			processorPause();
+
+		if (!apStarted)
+		{
+			kernelError(kernel_warn, "Processor with APIC ID %d did not "
+				"start", apicIds[count]);
+			continue;
+		}
+
+		status = kernelMultitaskerAddCpu(apicIds[count]);
+		if (status < 0)
+		{
+			// It's stuck waiting for apGo, which is harmless enough
+			kernelError(kernel_warn, "Couldn't add processor with APIC ID "
+				"%d", apicIds[count]);
+			continue;
+		}
+
+		// Let it go, and wait until its scheduler is running before we
+		// reuse the stack
+		numCpus = kernelMultitaskerGetNumCpus();
+		apCpuNum = status;
+		apGo = 1;
+
+		timeout = (kernelCpuGetMs() + AP_START_TIMEOUT_MS);
+		while ((kernelMultitaskerGetNumCpus() == numCpus) &&
+			(kernelCpuGetMs() < timeout))
+		{
+			processorPause();
+		}
+
+		if (kernelMultitaskerGetNumCpus() == numCpus)
+		{
+			kernelError(kernel_warn, "Processor %d did not start its "
+				"scheduler", apCpuNum);
+
+			// We can't safely reuse the stack for any others
+			stack = NULL;
+			break;
+		}
+
+		started += 1;
+	}
+
+	kernelLog("%d processors running", kernelMultitaskerGetNumCpus());
+	status = started;
+
+out:
+	if (stack)
+		kernelFree(stack);
+	if (mapped)
+		kernelPageUnmap(KERNELPROCID, startCode, MEMORY_PAGE_SIZE);
+	if (startPhysical)
+		kernelMemoryReleasePhysical(startPhysical);
+
+	return (status);
+}
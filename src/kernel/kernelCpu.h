@@ -23,10 +23,16 @@
 
 #include <sys/types.h>
 
+#define MAX_CPUS				16
+#define AP_BOOT_STACK_SIZE		4096
+#define AP_START_TIMEOUT_MS		100
+
 uquad_t kernelCpuTimestampFreq(void);
 uquad_t kernelCpuTimestamp(void);
 uquad_t kernelCpuGetMs(void);
+uquad_t kernelCpuGetUs(void);
 void kernelCpuSpinMs(unsigned);
+int kernelCpuStartAps(int);
 
 #define _KERNELCPU_H
 #endif
@@ -211,6 +211,23 @@ int kernelDescriptorInitialize(void)
 }
 
 
+int kernelDescriptorLoad(void)
+{
+	// Used by application processors, to load the tables that were set up
+	// by the boot processor
+
+	int status = 0;
+
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	processorSetGDT((void *) globalDescriptorTable, (GDT_SIZE * 8));
+	processorSetIDT((void *) interruptDescriptorTable, (IDT_SIZE * 8));
+
+	return (status = 0);
+}
+
+
 int kernelDescriptorRequest(volatile kernelSelector *descNumPointer)
 {
 	// This function is used to allocate a free descriptor from the
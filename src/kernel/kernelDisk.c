@@ -27,6 +27,7 @@
 #include "kernelDebug.h"
 #include "kernelError.h"
 #include "kernelFilesystem.h"
+#include "kernelInterrupt.h"
 #include "kernelLock.h"
 #include "kernelLog.h"
 #include "kernelMain.h"
@@ -36,6 +37,7 @@
 #include "kernelMultitasker.h"
 #include "kernelParameters.h"
 #include "kernelRandom.h"
+#include "kernelSlab.h"
 #include "kernelSysTimer.h"
 #include "kernelVariableList.h"
 #include <stdio.h>
@@ -45,6 +47,7 @@
 #include <sys/gpt.h>
 #include <sys/iso.h>
 #include <sys/msdos.h>
+#include <sys/processor.h>
 
 // All the disks
 static kernelPhysicalDisk *physicalDisks[DISK_MAXDEVICES];
@@ -55,14 +58,24 @@ static volatile int logicalDiskCounter = 0;
 // The name of the disk we booted from
 static char bootDisk[DISK_MAX_NAMELENGTH];
 
-// Modes for the readWriteSectors function
-#define IOMODE_READ		0x01
-#define IOMODE_WRITE	0x02
-#define IOMODE_NOCACHE	0x04
+// Memory for disk cache buffer structures
+static kernelSlabCache cacheBufferCache;
+
+// Memory for I/O request structures
+static kernelSlabCache requestCache;
 
 // For the disk thread
 static int threadPid = 0;
 
+// When the disk thread writes back dirty cache data
+static unsigned writebackAge = DISK_WRITEBACK_AGE;
+static unsigned writebackRatio = DISK_WRITEBACK_RATIO;
+
+#if (DISK_CACHE)
+static void cacheMerge(kernelPhysicalDisk *, uquad_t, uquad_t);
+static int cacheWriteback(kernelPhysicalDisk *);
+#endif
+
 // This is a table for keeping known MS-DOS partition type codes and
 // descriptions
 static msdosPartType msdosPartTypes[] = {
@@ -229,7 +242,7 @@ static int initialized = 0;
 static void debugLockCheck(kernelPhysicalDisk *physicalDisk,
 	const char *function)
 {
-	if (physicalDisk->lock.processId != kernelMultitaskerGetCurrentProcessId())
+	if (!kernelRwLockHeld(&physicalDisk->lock))
 	{
 		kernelError(kernel_error, "%s is not locked by process %d in function "
 			"%s", physicalDisk->name, kernelMultitaskerGetCurrentProcessId(),
@@ -259,6 +272,12 @@ static int motorOff(kernelPhysicalDisk *physicalDisk)
 	if (!(physicalDisk->flags & DISKFLAG_MOTORON))
 		return (status = 0);
 
+	#if (DISK_CACHE)
+	// Or still in use by cache I/O that has the disk unlocked
+	if (physicalDisk->cache.inFlight)
+		return (status = 0);
+	#endif // DISK_CACHE
+
 	// Make sure the device driver function is available.
 	if (!ops->driverSetMotorState)
 		// Don't make this an error.  It's just not available in some drivers.
@@ -281,7 +300,7 @@ static void diskThread(void)
 {
 	// This thread will be spawned at inititialization time to do any required
 	// ongoing operations on disks, such as shutting off floppy and CD/DVD
-	// motors
+	// motors, and writing back dirty cache data
 
 	kernelPhysicalDisk *physicalDisk = NULL;
 	int count;
@@ -303,14 +322,29 @@ static void diskThread(void)
 				(kernelSysTimerRead() > (physicalDisk->lastAccess + 40)))
 			{
 				// Lock the disk
-				if (kernelLockGet(&physicalDisk->lock) < 0)
+				if (kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE) < 0)
 					continue;
 
 				motorOff(physicalDisk);
 
 				// Unlock the disk
-				kernelLockRelease(&physicalDisk->lock);
+				kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 			}
+
+			#if (DISK_CACHE)
+			// Write back dirty cache data that's old, or if there's too much
+			// of it, so that writers don't have to wait for it
+			if (physicalDisk->cache.dirty &&
+				!(physicalDisk->flags & DISKFLAG_READONLY))
+			{
+				if (kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE) < 0)
+					continue;
+
+				cacheWriteback(physicalDisk);
+
+				kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
+			}
+			#endif // DISK_CACHE
 		}
 
 		// Yield the rest of the timeslice and wait for 1 second
@@ -336,35 +370,14 @@ static int spawnDiskThread(void)
 }
 
 
-static int realReadWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
-	uquad_t numSectors, void *data, unsigned mode)
+static int driverReadWrite(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, void *data, unsigned mode)
 {
-	// This function does all real, physical disk reads or writes.
+	// This function does all real, physical disk reads or writes, on behalf
+	// of the disk's dispatcher thread.
 
 	int status = 0;
 	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
-	processState tmpState;
-
-	debugLockCheck(physicalDisk, __FUNCTION__);
-
-	// Update the 'last access' value
-	physicalDisk->lastAccess = kernelSysTimerRead();
-
-	// Make sure the disk thread is running
-	if (kernelMultitaskerGetProcessState(threadPid, &tmpState) < 0)
-		// Re-spawn the disk thread
-		spawnDiskThread();
-
-	// Make sure the device driver function is available.
-	if (((mode & IOMODE_READ) && !ops->driverReadSectors) ||
-		((mode & IOMODE_WRITE) && !ops->driverWriteSectors))
-	{
-		kernelError(kernel_error, "Disk %s cannot %s", physicalDisk->name,
-			((mode & IOMODE_READ)? "read" : "write"));
-		return (status = ERR_NOSUCHFUNCTION);
-	}
-
-	// Do the actual read/write operation
 
 	kernelDebug(debug_io, "Disk %s %s %llu sectors at %llu",
 		physicalDisk->name, ((mode & IOMODE_READ)? "read" : "write"),
@@ -381,9 +394,6 @@ static int realReadWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 		physicalDisk->name, ((mode & IOMODE_READ)? "read" : "writ"),
 		numSectors, startSector);
 
-	// Update the 'last access' value again
-	physicalDisk->lastAccess = kernelSysTimerRead();
-
 	if (status < 0)
 	{
 		// If it is a write-protect error, mark the disk as read only
@@ -405,235 +415,1164 @@ static int realReadWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 }
 
 
-#if (DISK_CACHE)
+static kernelDiskRequest *queueSelect(kernelDiskQueue *queue)
+{
+	// Choose the next request to service.  Normally this is C-LOOK order:
+	// the first one at or beyond the current head position, or else the
+	// first one on the disk.  A request that has been waiting longer than
+	// the deadline goes first, though, so that none are starved.
 
-#define bufferEnd(buffer) (buffer->startSector + buffer->numSectors - 1)
-#define bufferBytes(physicalDisk, buffer) \
-	(buffer->numSectors * physicalDisk->sectorSize)
+	kernelDiskRequest *request = NULL;
+	kernelDiskRequest *oldest = NULL;
+	kernelDiskRequest *next = NULL;
 
-static inline void cacheMarkDirty(kernelPhysicalDisk *physicalDisk,
-	kernelDiskCacheBuffer *buffer)
-{
-	if (!buffer->dirty)
+	for (request = queue->requests; request; request = request->next)
 	{
-		buffer->dirty = 1;
-		physicalDisk->cache.dirty += 1;
+		if (!oldest || (request->queueTime < oldest->queueTime))
+			oldest = request;
+
+		if (!next && (request->startSector >= queue->headSector))
+			next = request;
+	}
+
+	if (oldest && ((kernelCpuGetMs() - oldest->queueTime) >=
+		DISK_QUEUE_DEADLINE))
+	{
+		return (oldest);
 	}
+
+	if (!next)
+		next = queue->requests;
+
+	return (next);
 }
 
 
-static inline void cacheMarkClean(kernelPhysicalDisk *physicalDisk,
-	kernelDiskCacheBuffer *buffer)
+static void *queueRunData(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *first, uquad_t numSectors, int numRequests)
 {
-	if (buffer->dirty)
+	// Get the buffer for a run of adjacent requests.  A single request uses
+	// its own, but for several we allocate one, and for writes fill it with
+	// their data.
+
+	kernelDiskRequest *request = NULL;
+	void *data = NULL;
+	void *ptr = NULL;
+
+	if (numRequests <= 1)
+		return (first->data);
+
+	data = kernelMalloc(numSectors * physicalDisk->sectorSize);
+	if (data && (first->mode & IOMODE_WRITE))
 	{
-		buffer->dirty = 0;
-		physicalDisk->cache.dirty -= 1;
+		for (request = first, ptr = data; request; request = request->next)
+		{
+			memcpy(ptr, request->data, (request->numSectors *
+				physicalDisk->sectorSize));
+			ptr += (request->numSectors * physicalDisk->sectorSize);
+		}
 	}
+
+	return (data);
 }
 
 
-static int cacheSync(kernelPhysicalDisk *physicalDisk)
+static void queueComplete(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *first, int numRequests, void *data, int status)
 {
-	// Write all dirty cached buffers to the disk
+	// Complete a run of adjacent requests that used the buffer from
+	// queueRunData(), and wake up their waiters.
 
-	int status = 0;
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
-	int errors = 0;
+	kernelDiskRequest *request = NULL;
+	kernelDiskRequest *next = NULL;
+	void *ptr = NULL;
+	int waitProcess = 0;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	if ((numRequests > 1) && data)
+	{
+		if ((first->mode & IOMODE_READ) && (status >= 0))
+		{
+			for (request = first, ptr = data; request; request = request->next)
+			{
+				memcpy(request->data, ptr, (request->numSectors *
+					physicalDisk->sectorSize));
+				ptr += (request->numSectors * physicalDisk->sectorSize);
+			}
+		}
 
-	if (!physicalDisk->cache.dirty || (physicalDisk->flags & DISKFLAG_READONLY))
-		return (status = 0);
+		kernelFree(data);
+		physicalDisk->stats.merges += (numRequests - 1);
+	}
 
-	while (buffer)
+	for (request = first; request; request = next)
 	{
-		if (buffer->dirty)
+		// Once it's marked done, the waiter can free it
+		next = request->next;
+		waitProcess = request->waitProcess;
+
+		if (data)
 		{
-			status = realReadWrite(physicalDisk, buffer->startSector,
-				buffer->numSectors, buffer->data, IOMODE_WRITE);
-			if (status < 0)
-				errors = status;
-			else
-				cacheMarkClean(physicalDisk, buffer);
+			request->status = status;
+		}
+		else
+		{
+			// Couldn't get memory to merge them.  Do them one at a time.
+			request->status = driverReadWrite(physicalDisk,
+				request->startSector, request->numSectors, request->data,
+				request->mode);
 		}
 
-		buffer = buffer->next;
-	}
+		request->done = 1;
 
-	return (status = errors);
+		if (waitProcess != KERNELPROCID)
+			kernelMultitaskerSetProcessState(waitProcess, proc_ioready);
+	}
 }
 
 
-static kernelDiskCacheBuffer *cacheGetBuffer(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors)
+static void queueDispatch(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *first, uquad_t numSectors, int numRequests)
 {
-	// Get a new cache buffer for the specified number of sectors.
+	// Service a run of adjacent requests, going in the same direction, as a
+	// single operation if we can, and complete them.
 
-	kernelDiskCacheBuffer *buffer = NULL;
+	int status = 0;
+	void *data = NULL;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	data = queueRunData(physicalDisk, first, numSectors, numRequests);
 
-	// Get memory for the structure
-	buffer = kernelMalloc(sizeof(kernelDiskCacheBuffer));
-	if (!buffer)
-		return (buffer);
+	if (data)
+		status = driverReadWrite(physicalDisk, first->startSector,
+			numSectors, data, first->mode);
 
-	buffer->startSector = startSector;
-	buffer->numSectors = numSectors;
+	physicalDisk->queue.headSector = (first->startSector + numSectors);
 
-	// Get memory for the data
-	buffer->data = kernelMalloc(numSectors * physicalDisk->sectorSize);
-	if (!buffer->data)
+	queueComplete(physicalDisk, first, numRequests, data, status);
+}
+
+
+static void queueSubmit(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *first, uquad_t numSectors, int numRequests)
+{
+	// Start a run of adjacent requests in the driver without waiting for it,
+	// so that the device can work on several at once.  If the driver won't
+	// take it, service it the ordinary way.
+
+	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest *run = NULL;
+	void *data = NULL;
+
+	run = kernelSlabAlloc(&requestCache);
+	if (!run)
 	{
-		kernelFree((void *) buffer);
-		return (buffer = NULL);
+		queueDispatch(physicalDisk, first, numSectors, numRequests);
+		return;
 	}
 
-	return (buffer);
-}
+	data = queueRunData(physicalDisk, first, numSectors, numRequests);
+	if (!data)
+	{
+		kernelSlabFree(&requestCache, (void *) run);
+		queueDispatch(physicalDisk, first, numSectors, numRequests);
+		return;
+	}
 
+	run->startSector = first->startSector;
+	run->numSectors = numSectors;
+	run->data = data;
+	run->mode = first->mode;
+	run->queueTime = kernelCpuGetMs();
+	run->waitProcess = kernelMultitaskerGetCurrentProcessId();
+	run->requests = first;
+	run->numRequests = numRequests;
 
-static inline void cachePutBuffer(kernelDiskCacheBuffer *buffer)
-{
-	// Deallocate a cache buffer.
+	kernelDebug(debug_io, "Disk %s submit %s %llu sectors at %llu",
+		physicalDisk->name, ((run->mode & IOMODE_READ)? "read" : "write"),
+		numSectors, run->startSector);
 
-	if (buffer->data)
-		kernelFree(buffer->data);
+	if (ops->driverSubmit(physicalDisk->deviceNumber, run) < 0)
+	{
+		if (numRequests > 1)
+			kernelFree(data);
+		kernelSlabFree(&requestCache, (void *) run);
+		queueDispatch(physicalDisk, first, numSectors, numRequests);
+		return;
+	}
 
-	kernelFree((void *) buffer);
+	queue->headSector = (first->startSector + numSectors);
 
-	return;
+	// Only this thread uses the in-flight list, so it needs no lock
+	run->next = queue->inFlight;
+	queue->inFlight = run;
+	queue->numInFlight += 1;
 }
 
 
-static int cacheInvalidate(kernelPhysicalDisk *physicalDisk)
+static void queueReap(kernelPhysicalDisk *physicalDisk)
 {
-	// Invalidate the disk cache, syncing dirty sectors first.
+	// Complete any submitted runs that the driver has finished
 
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest *run = NULL;
+	kernelDiskRequest *prev = NULL;
+	kernelDiskRequest *next = NULL;
 	int status = 0;
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
-	kernelDiskCacheBuffer *next = NULL;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	for (run = queue->inFlight; run; run = next)
+	{
+		next = run->next;
 
-	// Try to sync dirty sectors first.
-	cacheSync(physicalDisk);
+		if (!run->done)
+		{
+			prev = run;
+			continue;
+		}
 
-	if (physicalDisk->cache.dirty)
-		kernelError(kernel_warn, "Invalidating dirty disk cache!");
+		if (prev)
+			prev->next = next;
+		else
+			queue->inFlight = next;
 
-	while (buffer)
-	{
-		next = buffer->next;
-		cachePutBuffer(buffer);
-		buffer = next;
-	}
+		queue->numInFlight -= 1;
 
-	physicalDisk->cache.buffer = NULL;
-	physicalDisk->cache.size = 0;
-	physicalDisk->cache.dirty = 0;
+		status = run->status;
 
-	return (status);
+		// If it failed, try it again the ordinary way, which also takes care
+		// of reporting the error
+		if (status < 0)
+			status = driverReadWrite(physicalDisk, run->startSector,
+				run->numSectors, run->data, run->mode);
+
+		queueComplete(physicalDisk, run->requests, run->numRequests,
+			run->data, status);
+
+		kernelSlabFree(&requestCache, (void *) run);
+	}
 }
 
 
-static kernelDiskCacheBuffer *cacheFind(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors)
+static int queueReapable(kernelDiskQueue *queue)
 {
-	// Finds the first buffer that intersects the supplied range of sectors.
-	// If not found, return NULL.
+	// Returns 1 if any of the runs submitted to the driver has finished
 
-	uquad_t endSector = (startSector + numSectors - 1);
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	kernelDiskRequest *run = NULL;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	for (run = queue->inFlight; run; run = run->next)
+	{
+		if (run->done)
+			return (1);
+	}
 
-	while (buffer)
+	return (0);
+}
+
+
+__attribute__((noreturn))
+static void queueThread(int argc __attribute__((unused)), void *argv[])
+{
+	// Each physical disk has one of these threads, which services the
+	// requests in its queue.
+
+	kernelPhysicalDisk *physicalDisk = argv[0];
+	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest *first = NULL;
+	kernelDiskRequest *last = NULL;
+	kernelDiskRequest *prev = NULL;
+	uquad_t numSectors = 0;
+	int numRequests = 0;
+	int async = 0;
+	int interrupts = 0;
+
+	while (1)
 	{
-		// Start sector inside buffer?
-		if ((startSector >= buffer->startSector) &&
-			(startSector <= bufferEnd(buffer)))
+		// Can the driver work on more than one request at a time?
+		async = (ops->driverSubmit && (physicalDisk->queueDepth > 1));
+
+		if (queue->inFlight)
 		{
-			return (buffer);
+			// Let the driver fail any that have timed out, and then we can
+			// try them again the ordinary way
+			if (ops->driverPoll)
+				ops->driverPoll(physicalDisk->deviceNumber);
+
+			queueReap(physicalDisk);
 		}
 
-		// End sector inside buffer?
-		if ((endSector >= buffer->startSector) &&
-			(endSector <= bufferEnd(buffer)))
+		if (kernelLockGet(&queue->lock) < 0)
 		{
-			return (buffer);
+			kernelMultitaskerWait(DISK_QUEUE_WAIT_MS);
+			continue;
 		}
 
-		// Range overlaps buffer?
-		if ((startSector < buffer->startSector) &&
-			(endSector > bufferEnd(buffer)))
+		if (!queue->requests ||
+			(async && (queue->numInFlight >= physicalDisk->queueDepth)))
 		{
-			return (buffer);
+			// Nothing we can start now.  Submitters will wake us up if we're
+			// idle, and the driver will when a submitted run completes.  With
+			// interrupts suspended, nobody can do that between our checks
+			// and our going to sleep, where the wakeup would be lost.
+			processorSuspendInts(interrupts);
+			queue->idle = !queue->requests;
+			kernelLockRelease(&queue->lock);
+			if (!queueReapable(queue))
+				kernelMultitaskerWait(queue->inFlight? DISK_QUEUE_WAIT_MS :
+					DISK_QUEUE_IDLE_MS);
+			queue->idle = 0;
+			processorRestoreInts(interrupts);
+			continue;
 		}
 
-		buffer = buffer->next;
-	}
+		first = queueSelect(queue);
 
-	// Not found
-	return (buffer = NULL);
+		// Merge any following requests that are adjacent, and in the same
+		// direction
+		last = first;
+		numSectors = first->numSectors;
+		numRequests = 1;
+
+		while (last->next && (last->next->mode == first->mode) &&
+			(last->next->startSector == (last->startSector +
+				last->numSectors)) &&
+			(((numSectors + last->next->numSectors) *
+				physicalDisk->sectorSize) <= DISK_QUEUE_MERGE_MAX))
+		{
+			last = last->next;
+			numSectors += last->numSectors;
+			numRequests += 1;
+		}
+
+		// Take them out of the queue
+		if (first == queue->requests)
+		{
+			queue->requests = last->next;
+		}
+		else
+		{
+			for (prev = queue->requests; prev->next != first; )
+				prev = prev->next;
+			prev->next = last->next;
+		}
+
+		last->next = NULL;
+		queue->numRequests -= numRequests;
+
+		for (prev = first; prev; prev = prev->next)
+			prev->dispatched = 1;
+
+		kernelLockRelease(&queue->lock);
+
+		if (async)
+			queueSubmit(physicalDisk, first, numSectors, numRequests);
+		else
+			queueDispatch(physicalDisk, first, numSectors, numRequests);
+	}
 }
 
 
-static unsigned cacheQueryRange(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors, uquad_t *firstCached)
+static int queueCheckThread(kernelPhysicalDisk *physicalDisk)
 {
-	// Search the cache for a range of sectors.  If any of the range is cached,
-	// return the *first* portion that is cached.
+	// Make sure the disk's dispatcher thread is running.  The queue must be
+	// locked.
 
-	kernelDiskCacheBuffer *buffer = NULL;
-	uquad_t numCached = 0;
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	void *args[] = { (void *) physicalDisk };
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	if (queue->threadPid &&
+		kernelMultitaskerProcessIsAlive(queue->threadPid))
+	{
+		return (0);
+	}
 
-	buffer = cacheFind(physicalDisk, startSector, numSectors);
-	if (buffer)
+	queue->threadPid = kernelMultitaskerSpawnKernelThread(queueThread,
+		"disk queue thread", 1, args);
+
+	return (queue->threadPid);
+}
+
+
+static void queueInsert(kernelDiskQueue *queue, kernelDiskRequest *request)
+{
+	// Insert the request in order of start sector.  The queue must be locked.
+
+	kernelDiskRequest *prev = NULL;
+
+	if (!queue->requests ||
+		(request->startSector < queue->requests->startSector))
 	{
-		*firstCached = max(startSector, buffer->startSector);
-		numCached = min((numSectors - (*firstCached - startSector)),
-			(buffer->numSectors - (*firstCached - buffer->startSector)));
-		kernelDebug(debug_io, "Disk %s found %llu->%llu in %llu->%llu, "
-			"first=%llu num=%llu", physicalDisk->name, startSector,
-			(startSector + numSectors - 1), buffer->startSector,
-			bufferEnd(buffer), *firstCached, numCached);
+		request->next = queue->requests;
+		queue->requests = request;
 	}
 	else
 	{
-		kernelDebug(debug_io, "Disk %s %llu->%llu not found",
-			physicalDisk->name, startSector, (startSector + numSectors - 1));
+		for (prev = queue->requests; prev->next &&
+			(prev->next->startSector <= request->startSector); )
+		{
+			prev = prev->next;
+		}
+
+		request->next = prev->next;
+		prev->next = request;
 	}
 
-	return (numCached);
+	queue->numRequests += 1;
 }
 
 
-#if defined(DEBUG)
-static void cachePrint(kernelPhysicalDisk *physicalDisk)
+static int queueRequest(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors, void *data, unsigned mode)
 {
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	// Put an I/O request in the disk's queue, and wait for the dispatcher
+	// thread to complete it.
 
-	while (buffer)
+	int status = 0;
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest *request = NULL;
+	unsigned bytes = (numSectors * physicalDisk->sectorSize);
+	void *bounce = NULL;
+	int wake = 0;
+	int interrupts = 0;
+
+	// If we can't queue it (for example, multitasking isn't running yet),
+	// just do it directly
+	if (kernelProcessingInterrupt() || (kernelLockGet(&queue->lock) < 0))
+		return (status = driverReadWrite(physicalDisk, startSector,
+			numSectors, data, mode));
+
+	if (queueCheckThread(physicalDisk) < 0)
 	{
-		kernelTextPrintLine("%s cache: %llu->%llu (%llu sectors) %s",
-			physicalDisk->name, buffer->startSector, bufferEnd(buffer),
-			buffer->numSectors, (buffer->dirty? "(dirty)" : ""));
-		buffer = buffer->next;
+		kernelLockRelease(&queue->lock);
+		return (status = driverReadWrite(physicalDisk, startSector,
+			numSectors, data, mode));
 	}
-}
-
 
-static void cacheCheck(kernelPhysicalDisk *physicalDisk)
-{
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
-	uquad_t cacheSize = 0;
-	uquad_t numDirty = 0;
+	kernelLockRelease(&queue->lock);
 
-	while (buffer)
+	// The dispatcher thread can't get at memory in the address space of the
+	// current process, so use a bounce buffer for that
+	if (data < (void *) KERNEL_VIRTUAL_ADDRESS)
+	{
+		bounce = kernelMalloc(bytes);
+		if (!bounce)
+			return (status = ERR_MEMORY);
+
+		if (mode & IOMODE_WRITE)
+			memcpy(bounce, data, bytes);
+	}
+
+	request = kernelSlabAlloc(&requestCache);
+	if (!request)
+	{
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	request->startSector = startSector;
+	request->numSectors = numSectors;
+	request->data = (bounce? bounce : data);
+	request->mode = mode;
+	request->waitProcess = kernelMultitaskerGetCurrentProcessId();
+
+requeue:
+	request->queueTime = kernelCpuGetMs();
+
+	status = kernelLockGet(&queue->lock);
+	if (status < 0)
+		goto out;
+
+	queueInsert(queue, request);
+
+	physicalDisk->stats.requests += 1;
+	if ((unsigned) queue->numRequests > physicalDisk->stats.maxQueueDepth)
+		physicalDisk->stats.maxQueueDepth = queue->numRequests;
+
+	wake = queue->idle;
+
+	kernelLockRelease(&queue->lock);
+
+	if (wake)
+		kernelMultitaskerSetProcessState(queue->threadPid, proc_ioready);
+
+	while (!request->done)
+	{
+		// If the dispatcher thread has died (it gets killed at shutdown,
+		// for example) start another one, and if it had taken our request,
+		// queue it again
+		if (!kernelMultitaskerProcessIsAlive(queue->threadPid))
+		{
+			if (kernelLockGet(&queue->lock) >= 0)
+			{
+				queueCheckThread(physicalDisk);
+				kernelLockRelease(&queue->lock);
+			}
+
+			if (request->dispatched && !request->done)
+			{
+				request->dispatched = 0;
+				goto requeue;
+			}
+		}
+
+		if (request->waitProcess == KERNELPROCID)
+		{
+			kernelMultitaskerYield();
+			continue;
+		}
+
+		// Check again with interrupts suspended, so that the dispatcher
+		// can't complete it and wake us before we're asleep
+		processorSuspendInts(interrupts);
+		if (!request->done)
+			kernelMultitaskerWait(DISK_QUEUE_WAIT_MS);
+		processorRestoreInts(interrupts);
+	}
+
+	status = request->status;
+
+	if (bounce && (mode & IOMODE_READ) && (status >= 0))
+		memcpy(data, bounce, bytes);
+
+out:
+	if (request)
+		kernelSlabFree(&requestCache, (void *) request);
+	if (bounce)
+		kernelFree(bounce);
+
+	return (status);
+}
+
+
+static int realReadWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors, void *data, unsigned mode)
+{
+	// This function does all real, physical disk reads or writes, by queueing
+	// them for the disk's dispatcher thread.  The disk doesn't need to be
+	// locked, since nothing here touches the cache.
+
+	int status = 0;
+	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
+	processState tmpState;
+
+	// Update the 'last access' value
+	physicalDisk->lastAccess = kernelSysTimerRead();
+
+	// Make sure the disk thread is running
+	if (kernelMultitaskerGetProcessState(threadPid, &tmpState) < 0)
+		// Re-spawn the disk thread
+		spawnDiskThread();
+
+	// Make sure the device driver function is available.
+	if (((mode & IOMODE_READ) && !ops->driverReadSectors) ||
+		((mode & IOMODE_WRITE) && !ops->driverWriteSectors))
+	{
+		kernelError(kernel_error, "Disk %s cannot %s", physicalDisk->name,
+			((mode & IOMODE_READ)? "read" : "write"));
+		return (status = ERR_NOSUCHFUNCTION);
+	}
+
+	// Do the actual read/write operation
+	status = queueRequest(physicalDisk, startSector, numSectors, data, mode);
+
+	// Update the 'last access' value again
+	physicalDisk->lastAccess = kernelSysTimerRead();
+
+	return (status);
+}
+
+
+#if (DISK_CACHE)
+
+#define bufferEnd(buffer) (buffer->startSector + buffer->numSectors - 1)
+#define bufferBytes(physicalDisk, buffer) \
+	(buffer->numSectors * physicalDisk->sectorSize)
+
+static inline void cacheMarkDirty(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBuffer *buffer)
+{
+	if (!buffer->dirty)
+	{
+		buffer->dirty = 1;
+		buffer->dirtyTime = kernelCpuGetMs();
+		physicalDisk->cache.dirty += 1;
+		physicalDisk->cache.dirtyBytes += bufferBytes(physicalDisk, buffer);
+	}
+}
+
+
+static inline void cacheMarkClean(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBuffer *buffer)
+{
+	if (buffer->dirty)
+	{
+		buffer->dirty = 0;
+		physicalDisk->cache.dirty -= 1;
+		physicalDisk->cache.dirtyBytes -= bufferBytes(physicalDisk, buffer);
+	}
+}
+
+
+static inline int treeHeight(kernelDiskCacheBuffer *node)
+{
+	return (node? node->height : 0);
+}
+
+
+static inline void treeUpdate(kernelDiskCacheBuffer *node)
+{
+	node->height = (max(treeHeight(node->left), treeHeight(node->right)) + 1);
+}
+
+
+static kernelDiskCacheBuffer *treeRotateRight(kernelDiskCacheBuffer *node)
+{
+	kernelDiskCacheBuffer *left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+	treeUpdate(node);
+	treeUpdate(left);
+
+	return (left);
+}
+
+
+static kernelDiskCacheBuffer *treeRotateLeft(kernelDiskCacheBuffer *node)
+{
+	kernelDiskCacheBuffer *right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+	treeUpdate(node);
+	treeUpdate(right);
+
+	return (right);
+}
+
+
+static kernelDiskCacheBuffer *treeBalance(kernelDiskCacheBuffer *node)
+{
+	// Restore the AVL property of the subtree at 'node', whose children are
+	// already balanced, and return its (possibly new) root.
+
+	int balance = 0;
+
+	treeUpdate(node);
+	balance = (treeHeight(node->left) - treeHeight(node->right));
+
+	if (balance > 1)
+	{
+		if (treeHeight(node->left->left) < treeHeight(node->left->right))
+			node->left = treeRotateLeft(node->left);
+
+		return (treeRotateRight(node));
+	}
+	else if (balance < -1)
+	{
+		if (treeHeight(node->right->right) < treeHeight(node->right->left))
+			node->right = treeRotateRight(node->right);
+
+		return (treeRotateLeft(node));
+	}
+
+	return (node);
+}
+
+
+static kernelDiskCacheBuffer *treeInsert(kernelDiskCacheBuffer *node,
+	kernelDiskCacheBuffer *buffer)
+{
+	if (!node)
+	{
+		buffer->left = buffer->right = NULL;
+		buffer->height = 1;
+		return (buffer);
+	}
+
+	if (buffer->startSector < node->startSector)
+		node->left = treeInsert(node->left, buffer);
+	else
+		node->right = treeInsert(node->right, buffer);
+
+	return (treeBalance(node));
+}
+
+
+static kernelDiskCacheBuffer *treeRemoveFirst(kernelDiskCacheBuffer *node)
+{
+	if (!node->left)
+		return (node->right);
+
+	node->left = treeRemoveFirst(node->left);
+
+	return (treeBalance(node));
+}
+
+
+static kernelDiskCacheBuffer *treeRemove(kernelDiskCacheBuffer *node,
+	kernelDiskCacheBuffer *buffer)
+{
+	kernelDiskCacheBuffer *successor = NULL;
+
+	if (!node)
+		return (node);
+
+	if (buffer->startSector < node->startSector)
+	{
+		node->left = treeRemove(node->left, buffer);
+	}
+	else if (buffer->startSector > node->startSector)
+	{
+		node->right = treeRemove(node->right, buffer);
+	}
+	else
+	{
+		// Found it.  Replace it with its in-order successor, if it has two
+		// children.
+
+		if (!node->left)
+			return (node->right);
+		if (!node->right)
+			return (node->left);
+
+		for (successor = node->right; successor->left; )
+			successor = successor->left;
+
+		successor->right = treeRemoveFirst(node->right);
+		successor->left = node->left;
+		node = successor;
+	}
+
+	return (treeBalance(node));
+}
+
+
+static kernelDiskCacheBuffer *treeFloor(kernelPhysicalDisk *physicalDisk,
+	uquad_t sector)
+{
+	// Return the buffer with the greatest start sector that is <= the one
+	// supplied, if any.  Buffers never overlap, so this is the only one that
+	// can contain the sector.
+
+	kernelDiskCacheBuffer *node = physicalDisk->cache.root;
+	kernelDiskCacheBuffer *floor = NULL;
+
+	while (node)
+	{
+		if (node->startSector <= sector)
+		{
+			floor = node;
+			node = node->right;
+		}
+		else
+		{
+			node = node->left;
+		}
+	}
+
+	return (floor);
+}
+
+
+static void lruRemove(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBuffer *buffer)
+{
+	if (buffer->lruPrev)
+		buffer->lruPrev->lruNext = buffer->lruNext;
+	else
+		physicalDisk->cache.lruFirst = buffer->lruNext;
+
+	if (buffer->lruNext)
+		buffer->lruNext->lruPrev = buffer->lruPrev;
+	else
+		physicalDisk->cache.lruLast = buffer->lruPrev;
+
+	buffer->lruPrev = buffer->lruNext = NULL;
+}
+
+
+static void lruInsert(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBuffer *buffer, kernelDiskCacheBuffer *prev)
+{
+	// Insert the buffer into the LRU list after 'prev', or at the head (least
+	// recently used) if 'prev' is NULL.
+
+	buffer->lruPrev = prev;
+
+	if (prev)
+	{
+		buffer->lruNext = prev->lruNext;
+		prev->lruNext = buffer;
+	}
+	else
+	{
+		buffer->lruNext = physicalDisk->cache.lruFirst;
+		physicalDisk->cache.lruFirst = buffer;
+	}
+
+	if (buffer->lruNext)
+		buffer->lruNext->lruPrev = buffer;
+	else
+		physicalDisk->cache.lruLast = buffer;
+}
+
+
+static inline void cacheTouch(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBuffer *buffer)
+{
+	// Make the buffer the most recently used one.  The disk must be locked
+	// in write mode.
+
+	buffer->lastAccess = kernelSysTimerRead();
+	buffer->referenced = 0;
+
+	if (buffer != physicalDisk->cache.lruLast)
+	{
+		lruRemove(physicalDisk, buffer);
+		lruInsert(physicalDisk, buffer, physicalDisk->cache.lruLast);
+	}
+}
+
+
+static void cacheMarkStale(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors)
+{
+	// Sectors are being written, so any cache I/O of them that's in progress
+	// with the disk unlocked is out of date.  Reads of them mustn't be
+	// cached, and writebacks of them mustn't mark the newer data clean.
+
+	kernelDiskCacheIo *io = NULL;
+
+	for (io = physicalDisk->cache.inFlight; io; io = io->next)
+	{
+		if ((io->startSector < (startSector + numSectors)) &&
+			(startSector < (io->startSector + io->numSectors)))
+		{
+			io->stale = 1;
+		}
+	}
+}
+
+
+static void cacheWaitIo(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, unsigned mode)
+{
+	// Wait for any cache I/O of the range of sectors, in the specified
+	// mode(s), that's in progress with the disk unlocked.  For example, a
+	// write mustn't overtake a writeback of the same sectors in the queue.
+	// They don't need the lock to finish the I/O, and they can't leave the
+	// list until we release it.
+
+	kernelDiskCacheIo *io = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	for (io = physicalDisk->cache.inFlight; io; io = io->next)
+	{
+		if ((io->mode & mode) &&
+			(io->startSector < (startSector + numSectors)) &&
+			(startSector < (io->startSector + io->numSectors)))
+		{
+			while (!io->done)
+				kernelMultitaskerYield();
+		}
+	}
+}
+
+
+static int cacheIo(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors, void *data, unsigned mode)
+{
+	// Do a real read or write on behalf of the cache.  With IOMODE_UNLOCK,
+	// the disk (which must be locked in write mode) is unlocked while we
+	// wait for the I/O, so that other processes' requests can be queued
+	// alongside ours, and then locked again.  Returns 1 if the sectors were
+	// written to in the meantime, so that the result is stale, 0 if not, or
+	// negative on error.
+
+	int status = 0;
+	kernelDiskCacheIo *io = NULL;
+	kernelDiskCacheIo *prev = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (!(mode & IOMODE_UNLOCK) || kernelProcessingInterrupt())
+	{
+		status = realReadWrite(physicalDisk, startSector, numSectors, data,
+			(mode & ~IOMODE_UNLOCK));
+		if (status < 0)
+			return (status);
+
+		return (status = 0);
+	}
+
+	io = kernelMalloc(sizeof(kernelDiskCacheIo));
+	if (!io)
+		return (status = ERR_MEMORY);
+
+	io->startSector = startSector;
+	io->numSectors = numSectors;
+	io->mode = (mode & ~IOMODE_UNLOCK);
+	io->next = physicalDisk->cache.inFlight;
+	physicalDisk->cache.inFlight = io;
+
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
+
+	status = realReadWrite(physicalDisk, startSector, numSectors, data,
+		io->mode);
+
+	io->done = 1;
+
+	if (kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE) < 0)
+	{
+		// Shouldn't happen.  Leave it in the list, since we can't safely
+		// change it.
+		return (status = ERR_NOLOCK);
+	}
+
+	if (physicalDisk->cache.inFlight == io)
+	{
+		physicalDisk->cache.inFlight = io->next;
+	}
+	else
+	{
+		for (prev = physicalDisk->cache.inFlight; prev->next != io; )
+			prev = prev->next;
+		prev->next = io->next;
+	}
+
+	if (status >= 0)
+		status = io->stale;
+
+	kernelFree((void *) io);
+
+	return (status);
+}
+
+
+static int cacheSync(kernelPhysicalDisk *physicalDisk)
+{
+	// Write all dirty cached buffers to the disk
+
+	int status = 0;
+	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	int written = 0;
+	int errors = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (!physicalDisk->cache.dirty || (physicalDisk->flags & DISKFLAG_READONLY))
+		return (status = 0);
+
+	cacheWaitIo(physicalDisk, 0, physicalDisk->numSectors, IOMODE_WRITE);
+
+	while (buffer)
+	{
+		if (buffer->dirty)
+		{
+			status = realReadWrite(physicalDisk, buffer->startSector,
+				buffer->numSectors, buffer->data, IOMODE_WRITE);
+			if (status < 0)
+			{
+				errors = status;
+			}
+			else
+			{
+				cacheMarkClean(physicalDisk, buffer);
+				written = 1;
+			}
+		}
+
+		buffer = buffer->next;
+	}
+
+	// Buffers that are now clean might be mergeable with their neighbours
+	if (written)
+		cacheMerge(physicalDisk, 0, physicalDisk->numSectors);
+
+	// Background writeback can start over, if it had given up
+	if (!errors)
+	{
+		physicalDisk->cache.writebackFailures = 0;
+		physicalDisk->cache.writebackRetry = 0;
+	}
+
+	return (status = errors);
+}
+
+
+static kernelDiskCacheBuffer *cacheGetBuffer(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors)
+{
+	// Get a new cache buffer for the specified number of sectors.
+
+	kernelDiskCacheBuffer *buffer = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	// Get memory for the structure
+	buffer = kernelSlabAlloc(&cacheBufferCache);
+	if (!buffer)
+		return (buffer);
+
+	buffer->startSector = startSector;
+	buffer->numSectors = numSectors;
+
+	// Get memory for the data
+	buffer->data = kernelMalloc(numSectors * physicalDisk->sectorSize);
+	if (!buffer->data)
+	{
+		kernelSlabFree(&cacheBufferCache, (void *) buffer);
+		return (buffer = NULL);
+	}
+
+	return (buffer);
+}
+
+
+static inline void cachePutBuffer(kernelDiskCacheBuffer *buffer)
+{
+	// Deallocate a cache buffer.
+
+	if (buffer->data)
+		kernelFree(buffer->data);
+
+	kernelSlabFree(&cacheBufferCache, (void *) buffer);
+
+	return;
+}
+
+
+static int cacheInvalidate(kernelPhysicalDisk *physicalDisk)
+{
+	// Invalidate the disk cache, syncing dirty sectors first.
+
+	int status = 0;
+	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	kernelDiskCacheBuffer *next = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	// Try to sync dirty sectors first.
+	cacheSync(physicalDisk);
+
+	// Don't let reads that are in progress add what they get to the cache,
+	// and let them finish before the media can be changed, for example
+	cacheMarkStale(physicalDisk, 0, physicalDisk->numSectors);
+	cacheWaitIo(physicalDisk, 0, physicalDisk->numSectors,
+		(IOMODE_READ | IOMODE_WRITE));
+
+	if (physicalDisk->cache.dirty)
+		kernelError(kernel_warn, "Invalidating dirty disk cache!");
+
+	while (buffer)
+	{
+		next = buffer->next;
+		cachePutBuffer(buffer);
+		buffer = next;
+	}
+
+	physicalDisk->cache.buffer = NULL;
+	physicalDisk->cache.root = NULL;
+	physicalDisk->cache.lruFirst = NULL;
+	physicalDisk->cache.lruLast = NULL;
+	physicalDisk->cache.size = 0;
+	physicalDisk->cache.dirty = 0;
+	physicalDisk->cache.dirtyBytes = 0;
+	memset((void *) physicalDisk->cache.streams, 0,
+		sizeof(physicalDisk->cache.streams));
+	physicalDisk->cache.writebackFailures = 0;
+	physicalDisk->cache.writebackRetry = 0;
+
+	return (status);
+}
+
+
+static kernelDiskCacheBuffer *cacheFind(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors)
+{
+	// Finds the first buffer that intersects the supplied range of sectors.
+	// If not found, return NULL.
+
+	uquad_t endSector = (startSector + numSectors - 1);
+	kernelDiskCacheBuffer *buffer = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	// Start sector inside a buffer?
+	buffer = treeFloor(physicalDisk, startSector);
+	if (buffer && (startSector <= bufferEnd(buffer)))
+		return (buffer);
+
+	// Otherwise, the only candidate is the following one
+	if (buffer)
+		buffer = buffer->next;
+	else
+		buffer = physicalDisk->cache.buffer;
+
+	if (buffer && (buffer->startSector <= endSector))
+		return (buffer);
+
+	// Not found
+	return (buffer = NULL);
+}
+
+
+static unsigned cacheQueryRange(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, uquad_t *firstCached)
+{
+	// Search the cache for a range of sectors.  If any of the range is cached,
+	// return the *first* portion that is cached.
+
+	kernelDiskCacheBuffer *buffer = NULL;
+	uquad_t numCached = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	buffer = cacheFind(physicalDisk, startSector, numSectors);
+	if (buffer)
+	{
+		*firstCached = max(startSector, buffer->startSector);
+		numCached = min((numSectors - (*firstCached - startSector)),
+			(buffer->numSectors - (*firstCached - buffer->startSector)));
+		kernelDebug(debug_io, "Disk %s found %llu->%llu in %llu->%llu, "
+			"first=%llu num=%llu", physicalDisk->name, startSector,
+			(startSector + numSectors - 1), buffer->startSector,
+			bufferEnd(buffer), *firstCached, numCached);
+	}
+	else
+	{
+		kernelDebug(debug_io, "Disk %s %llu->%llu not found",
+			physicalDisk->name, startSector, (startSector + numSectors - 1));
+	}
+
+	return (numCached);
+}
+
+
+#if defined(DEBUG)
+static void cachePrint(kernelPhysicalDisk *physicalDisk)
+{
+	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+
+	while (buffer)
+	{
+		kernelTextPrintLine("%s cache: %llu->%llu (%llu sectors) %s",
+			physicalDisk->name, buffer->startSector, bufferEnd(buffer),
+			buffer->numSectors, (buffer->dirty? "(dirty)" : ""));
+		buffer = buffer->next;
+	}
+}
+
+
+static void cacheCheck(kernelPhysicalDisk *physicalDisk)
+{
+	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	uquad_t cacheSize = 0;
+	uquad_t numDirty = 0;
+	int numBuffers = 0;
+
+	while (buffer)
 	{
 		if (buffer->next)
 		{
@@ -684,13 +1623,34 @@ static void cacheCheck(kernelPhysicalDisk *physicalDisk)
 			}
 		}
 
+		if (treeFloor(physicalDisk, buffer->startSector) != buffer)
+		{
+			kernelError(kernel_warn, "%s buffer %llu->%llu not in the tree",
+				physicalDisk->name, buffer->startSector, bufferEnd(buffer));
+			cachePrint(physicalDisk); while (1);
+		}
+
 		cacheSize += bufferBytes(physicalDisk, buffer);
 		if (buffer->dirty)
 			numDirty += 1;
+		numBuffers += 1;
 
 		buffer = buffer->next;
 	}
 
+	for (buffer = physicalDisk->cache.lruFirst; buffer;
+		buffer = buffer->lruNext)
+	{
+		numBuffers -= 1;
+	}
+
+	if (numBuffers)
+	{
+		kernelError(kernel_warn, "%s LRU list doesn't match the cache",
+			physicalDisk->name);
+		cachePrint(physicalDisk); while (1);
+	}
+
 	if (cacheSize != physicalDisk->cache.size)
 	{
 		kernelError(kernel_warn, "%s cacheSize(%llu) != "
@@ -717,6 +1677,9 @@ static void cacheRemove(kernelPhysicalDisk *physicalDisk,
 {
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
+	physicalDisk->cache.root = treeRemove(physicalDisk->cache.root, buffer);
+	lruRemove(physicalDisk, buffer);
+
 	if (buffer == physicalDisk->cache.buffer)
 		physicalDisk->cache.buffer = buffer->next;
 
@@ -736,39 +1699,24 @@ static void cachePrune(kernelPhysicalDisk *physicalDisk)
 	// value, uncache some data.  Uncache the least-recently-used buffers
 	// until we're under the limit.
 
-	kernelDiskCacheBuffer *currBuffer = NULL;
-	unsigned oldestTime = 0;
 	kernelDiskCacheBuffer *oldestBuffer = NULL;
 
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
 	while (physicalDisk->cache.size > DISK_MAX_CACHE)
 	{
-		currBuffer = physicalDisk->cache.buffer;
+		oldestBuffer = physicalDisk->cache.lruFirst;
 
 		// Don't bother uncaching the only buffer
-		if (!currBuffer->next)
+		if (!oldestBuffer || !oldestBuffer->lruNext)
 			break;
 
-		oldestTime = ~0UL;
-		oldestBuffer = NULL;
-
-		while (currBuffer)
+		if (oldestBuffer->referenced)
 		{
-			if (currBuffer->lastAccess < oldestTime)
-			{
-				oldestTime = currBuffer->lastAccess;
-				oldestBuffer = currBuffer;
-			}
-
-			currBuffer = currBuffer->next;
-		}
-
-		if (!oldestBuffer)
-		{
-			kernelDebug(debug_io, "Disk %s, no oldest buffer!",
-				physicalDisk->name);
-			break;
+			// It's had a cache hit (under the read lock, so it couldn't be
+			// moved) since it was last queued.  Give it another chance.
+			cacheTouch(physicalDisk, oldestBuffer);
+			continue;
 		}
 
 		kernelDebug(debug_io, "Disk %s uncache buffer %llu->%llu, mem=%p, "
@@ -777,6 +1725,9 @@ static void cachePrune(kernelPhysicalDisk *physicalDisk)
 
 		if (oldestBuffer->dirty)
 		{
+			cacheWaitIo(physicalDisk, oldestBuffer->startSector,
+				oldestBuffer->numSectors, IOMODE_WRITE);
+
 			if (realReadWrite(physicalDisk, oldestBuffer->startSector,
 				oldestBuffer->numSectors, oldestBuffer->data, IOMODE_WRITE) < 0)
 			{
@@ -810,17 +1761,11 @@ static kernelDiskCacheBuffer *cacheAdd(kernelPhysicalDisk *physicalDisk,
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
 	// Find out where in the order the new buffer would go.
-	nextBuffer = physicalDisk->cache.buffer;
-	while (nextBuffer)
-	{
-		if (startSector > nextBuffer->startSector)
-		{
-			prevBuffer = nextBuffer;
-			nextBuffer = nextBuffer->next;
-		}
-		else
-			break;
-	}
+	prevBuffer = treeFloor(physicalDisk, startSector);
+	if (prevBuffer)
+		nextBuffer = prevBuffer->next;
+	else
+		nextBuffer = physicalDisk->cache.buffer;
 
 	// Get a new cache buffer.
 	newBuffer = cacheGetBuffer(physicalDisk, startSector, numSectors);
@@ -831,120 +1776,448 @@ static kernelDiskCacheBuffer *cacheAdd(kernelPhysicalDisk *physicalDisk,
 		return (newBuffer);
 	}
 
-	// Copy the data into the cache buffer.
-	memcpy(newBuffer->data, data, bufferBytes(physicalDisk, newBuffer));
+	// Copy the data into the cache buffer.
+	memcpy(newBuffer->data, data, bufferBytes(physicalDisk, newBuffer));
+
+	newBuffer->prev = prevBuffer;
+	newBuffer->next = nextBuffer;
+
+	if (newBuffer->prev)
+		newBuffer->prev->next = newBuffer;
+	else
+		// This will be the first cache buffer in the cache.
+		physicalDisk->cache.buffer = newBuffer;
+
+	if (newBuffer->next)
+		newBuffer->next->prev = newBuffer;
+
+	physicalDisk->cache.root = treeInsert(physicalDisk->cache.root,
+		newBuffer);
+
+	// It's the most recently used
+	lruInsert(physicalDisk, newBuffer, physicalDisk->cache.lruLast);
+	newBuffer->lastAccess = kernelSysTimerRead();
+
+	physicalDisk->cache.size += bufferBytes(physicalDisk, newBuffer);
+
+	return (newBuffer);
+}
+
+
+static void cacheMerge(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors)
+{
+	// Check whether we should merge cache entries.  We do this if they are
+	// a) adjacent; and b) their clean/dirty state matches.  Only the supplied
+	// range of sectors has changed, so only the entries within it, or on
+	// either side of it, need to be checked.
+
+	uquad_t firstSector = (startSector? (startSector - 1) : 0);
+	uquad_t lastSector = (startSector + numSectors);
+	kernelDiskCacheBuffer *currBuffer = NULL;
+	kernelDiskCacheBuffer *nextBuffer = NULL;
+	void *newData = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	currBuffer = cacheFind(physicalDisk, firstSector,
+		(lastSector - firstSector + 1));
+
+	while (currBuffer && (currBuffer->startSector <= lastSector))
+	{
+		nextBuffer = currBuffer->next;
+
+		if (nextBuffer)
+		{
+			if ((bufferEnd(currBuffer) == (nextBuffer->startSector - 1)) &&
+				(currBuffer->dirty == nextBuffer->dirty))
+			{
+				// Merge the 2 entries by expanding the memory of the first
+				// entry, copying both entries' data into it, and removing the
+				// second entry.
+
+				kernelDebug(debug_io, "Disk %s merge %llu->%llu and %llu->%llu",
+					physicalDisk->name, currBuffer->startSector,
+					bufferEnd(currBuffer), nextBuffer->startSector,
+					bufferEnd(nextBuffer));
+
+				// Get a new cache buffer
+				newData = kernelMalloc(bufferBytes(physicalDisk, currBuffer) +
+					bufferBytes(physicalDisk, nextBuffer));
+				if (!newData)
+				{
+					kernelError(kernel_error, "Couldn't get a new buffer for "
+						"%s's disk cache", physicalDisk->name);
+					return;
+				}
+
+				// Copy the data from each existing entry
+				memcpy(newData, currBuffer->data,
+					bufferBytes(physicalDisk, currBuffer));
+				memcpy((newData + bufferBytes(physicalDisk, currBuffer)),
+					nextBuffer->data, bufferBytes(physicalDisk, nextBuffer));
+
+				// Replace the buffer pointer
+				kernelFree(currBuffer->data);
+				currBuffer->data = newData;
+
+				// Update the first entry's size
+				currBuffer->numSectors += nextBuffer->numSectors;
+
+				// Briefly grow the cache size; removing the 'next' entry will
+				// shrink it back again
+				physicalDisk->cache.size +=
+					bufferBytes(physicalDisk, nextBuffer);
+
+				// The merged entry takes the more recent of the two places in
+				// the LRU list
+				if (nextBuffer->lastAccess > currBuffer->lastAccess)
+				{
+					lruRemove(physicalDisk, currBuffer);
+					lruInsert(physicalDisk, currBuffer, nextBuffer);
+					currBuffer->lastAccess = nextBuffer->lastAccess;
+				}
+				currBuffer->referenced |= nextBuffer->referenced;
+
+				// If they're dirty, it's been since the earlier of the two
+				currBuffer->dirtyTime = min(currBuffer->dirtyTime,
+					nextBuffer->dirtyTime);
+
+				// Remove the second entry
+				cacheRemove(physicalDisk, nextBuffer);
+
+				if (currBuffer->dirty)
+					physicalDisk->cache.dirty -= 1;
+
+				// Process this one again, since we might want to merge it
+				// with the next one as well.
+				continue;
+			}
+		}
+
+		// Move to the next one
+		currBuffer = nextBuffer;
+	}
+}
+
+
+static int cacheWriteback(kernelPhysicalDisk *physicalDisk)
+{
+	// Write back the dirty buffers that have been dirty for longer than the
+	// writeback age.  If there are more dirty bytes than the writeback ratio
+	// allows, write back others as well, in sector order, until there are
+	// half as many.  Adjacent dirty ranges are always merged into a single
+	// buffer, so each one goes out as a single large write.
+	//
+	// When a write fails, wait twice as long each time before trying again,
+	// and after DISK_WRITEBACK_RETRIES failures, give up.  The data stays
+	// dirty, and an explicit sync still tries to write it.
+	//
+	// Each buffer is written from a copy of its data, with the disk unlocked,
+	// so that other processes can use the cache, and queue their own I/O,
+	// in the meantime.
+
+	int status = 0;
+	uquad_t currentTime = kernelCpuGetMs();
+	uquad_t maxDirty = ((DISK_MAX_CACHE / 100) * writebackRatio);
+	int flush = 0;
+	kernelDiskCacheBuffer *buffer = NULL;
+	uquad_t startSector = 0;
+	uquad_t numSectors = 0;
+	void *data = NULL;
+	uquad_t nextSector = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (!physicalDisk->cache.dirty || (physicalDisk->flags & DISKFLAG_READONLY))
+		return (status = 0);
+
+	if (physicalDisk->cache.writebackFailures >= DISK_WRITEBACK_RETRIES)
+		return (status = ERR_IO);
+
+	if (currentTime < physicalDisk->cache.writebackRetry)
+		return (status = 0);
+
+	flush = (physicalDisk->cache.dirtyBytes > maxDirty);
+
+	buffer = physicalDisk->cache.buffer;
+	while (buffer)
+	{
+		if (!buffer->dirty || (!flush && ((currentTime - buffer->dirtyTime) <
+			(writebackAge * MS_PER_SEC))))
+		{
+			buffer = buffer->next;
+			continue;
+		}
+
+		kernelDebug(debug_io, "Disk %s write back %llu->%llu",
+			physicalDisk->name, buffer->startSector, bufferEnd(buffer));
+
+		startSector = buffer->startSector;
+		numSectors = buffer->numSectors;
+
+		data = kernelMalloc(bufferBytes(physicalDisk, buffer));
+		if (data)
+		{
+			memcpy(data, buffer->data, bufferBytes(physicalDisk, buffer));
+			status = cacheIo(physicalDisk, startSector, numSectors, data,
+				(IOMODE_WRITE | IOMODE_UNLOCK));
+			kernelFree(data);
+
+			// The buffer might have been changed, merged, or uncached while
+			// the disk was unlocked
+			buffer = cacheFind(physicalDisk, startSector, numSectors);
+			if (buffer && ((buffer->startSector != startSector) ||
+				(buffer->numSectors != numSectors)))
+			{
+				buffer = NULL;
+			}
+		}
+		else
+		{
+			status = cacheIo(physicalDisk, startSector, numSectors,
+				buffer->data, IOMODE_WRITE);
+		}
+
+		if (status < 0)
+		{
+			physicalDisk->cache.writebackFailures += 1;
+
+			if (physicalDisk->cache.writebackFailures >=
+				DISK_WRITEBACK_RETRIES)
+			{
+				kernelError(kernel_error, "Disk %s: giving up writing back "
+					"dirty cache data after %d failures", physicalDisk->name,
+					physicalDisk->cache.writebackFailures);
+			}
+			else
+			{
+				physicalDisk->cache.writebackRetry = (currentTime +
+					(MS_PER_SEC << physicalDisk->cache.writebackFailures));
+			}
+
+			return (status);
+		}
+
+		physicalDisk->cache.writebackFailures = 0;
+		physicalDisk->cache.writebackRetry = 0;
+
+		// If it was written to in the meantime, it's still dirty
+		if (!status && buffer && buffer->dirty)
+			cacheMarkClean(physicalDisk, buffer);
+
+		if (flush && (physicalDisk->cache.dirtyBytes <= (maxDirty / 2)))
+			flush = 0;
+
+		// Now that it's clean, it might be mergeable with its neighbours.
+		// That can free it, so carry on from whichever buffer follows it.
+		nextSector = (startSector + numSectors);
+		cacheMerge(physicalDisk, startSector, numSectors);
+
+		buffer = treeFloor(physicalDisk, nextSector);
+		if (!buffer)
+			buffer = physicalDisk->cache.buffer;
+		else if (bufferEnd(buffer) < nextSector)
+			buffer = buffer->next;
+	}
+
+	cacheCheck(physicalDisk);
+
+	return (status = 0);
+}
+
+
+static int cacheReadHit(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, void *data)
+{
+	// If the whole range of sectors is in the cache, copy it into the target
+	// data buffer and return 1.  Otherwise, return 0 without copying
+	// anything.  This doesn't change the cache (except for the access
+	// times), so the disk only needs to be locked in read mode.  For the
+	// same reason we can't move the buffers in the LRU list; just flag them
+	// as referenced, and cachePrune() will requeue them.
+
+	uquad_t sector = startSector;
+	uquad_t remaining = numSectors;
+	uquad_t numCached = 0;
+	kernelDiskCacheBuffer *buffer = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	// Make sure there are no gaps first
+	while (remaining)
+	{
+		buffer = cacheFind(physicalDisk, sector, 1);
+		if (!buffer)
+			return (0);
+
+		numCached = min(remaining, (bufferEnd(buffer) - sector + 1));
+		sector += numCached;
+		remaining -= numCached;
+	}
+
+	while (numSectors)
+	{
+		buffer = cacheFind(physicalDisk, startSector, 1);
+		numCached = min(numSectors, (bufferEnd(buffer) - startSector + 1));
+
+		memcpy(data, (buffer->data + ((startSector - buffer->startSector) *
+			physicalDisk->sectorSize)),
+			(numCached * physicalDisk->sectorSize));
+		buffer->lastAccess = kernelSysTimerRead();
+		buffer->referenced = 1;
+
+		startSector += numCached;
+		numSectors -= numCached;
+		data += (numCached * physicalDisk->sectorSize);
+	}
+
+	return (1);
+}
+
+
+static kernelDiskReadAheadStream *cacheReadAheadStream(
+	kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors)
+{
+	// Cache misses are matched against the streams of reads we're tracking.
+	// If this one continues a stream, the stream's previous read-ahead got
+	// used, and its read-ahead window grows.  Otherwise it starts a new
+	// stream in place of the least recently used one, with no read-ahead
+	// until it proves to be sequential.
+
+	kernelDiskReadAheadStream *readStream = NULL;
+	kernelDiskReadAheadStream *oldest = NULL;
+	unsigned maxWindow = (DISK_READAHEAD_MAX / physicalDisk->sectorSize);
+	int count;
+
+	for (count = 0; count < DISK_READAHEAD_STREAMS; count ++)
+	{
+		readStream = &physicalDisk->cache.streams[count];
+
+		if (readStream->lastAccess &&
+			(startSector <= readStream->nextSector) &&
+			(readStream->nextSector <= (startSector + numSectors)))
+		{
+			break;
+		}
+
+		if (!oldest || (readStream->lastAccess < oldest->lastAccess))
+			oldest = readStream;
 
-	newBuffer->prev = prevBuffer;
-	newBuffer->next = nextBuffer;
+		readStream = NULL;
+	}
 
-	if (newBuffer->prev)
-		newBuffer->prev->next = newBuffer;
+	if (readStream)
+	{
+		physicalDisk->stats.readAheadHitKbytes +=
+			((readStream->aheadSectors * physicalDisk->sectorSize) / 1024);
+
+		if (readStream->window)
+			readStream->window = min((readStream->window * 2), maxWindow);
+		else
+			readStream->window = min(DISK_READAHEAD_SECTORS, maxWindow);
+	}
 	else
-		// This will be the first cache buffer in the cache.
-		physicalDisk->cache.buffer = newBuffer;
+	{
+		readStream = oldest;
 
-	if (newBuffer->next)
-		newBuffer->next->prev = newBuffer;
+		physicalDisk->stats.readAheadWasteKbytes +=
+			((readStream->aheadSectors * physicalDisk->sectorSize) / 1024);
 
-	physicalDisk->cache.size += bufferBytes(physicalDisk, newBuffer);
+		readStream->window = 0;
+	}
 
-	return (newBuffer);
+	readStream->aheadSectors = 0;
+	readStream->lastAccess = kernelSysTimerRead();
+
+	return (readStream);
 }
 
 
-static void cacheMerge(kernelPhysicalDisk *physicalDisk)
+static uquad_t cacheReadAheadSectors(kernelPhysicalDisk *physicalDisk,
+	kernelDiskReadAheadStream *readStream, uquad_t sector)
 {
-	// Check whether we should merge cache entries.  We do this if they are
-	// a) adjacent; and b) their clean/dirty state matches.
-
-	kernelDiskCacheBuffer *currBuffer = NULL;
-	kernelDiskCacheBuffer *nextBuffer = NULL;
-	void *newData = NULL;
-
-	debugLockCheck(physicalDisk, __FUNCTION__);
-
-	currBuffer = physicalDisk->cache.buffer;
+	// How many sectors, starting at 'sector', to read ahead for the stream.
+	// Don't go past the end of the disk, or into data that's already cached.
 
-	while (currBuffer)
-	{
-		nextBuffer = currBuffer->next;
+	uquad_t aheadSectors = readStream->window;
+	kernelDiskCacheBuffer *buffer = NULL;
 
-		if (nextBuffer)
-		{
-			if ((bufferEnd(currBuffer) == (nextBuffer->startSector - 1)) &&
-				(currBuffer->dirty == nextBuffer->dirty))
-			{
-				// Merge the 2 entries by expanding the memory of the first
-				// entry, copying both entries' data into it, and removing the
-				// second entry.
+	if (!aheadSectors || (sector >= physicalDisk->numSectors))
+		return (aheadSectors = 0);
 
-				kernelDebug(debug_io, "Disk %s merge %llu->%llu and %llu->%llu",
-					physicalDisk->name, currBuffer->startSector,
-					bufferEnd(currBuffer), nextBuffer->startSector,
-					bufferEnd(nextBuffer));
+	aheadSectors = min(aheadSectors, (physicalDisk->numSectors - sector));
 
-				// Get a new cache buffer
-				newData = kernelMalloc(bufferBytes(physicalDisk, currBuffer) +
-					bufferBytes(physicalDisk, nextBuffer));
-				if (!newData)
-				{
-					kernelError(kernel_error, "Couldn't get a new buffer for "
-						"%s's disk cache", physicalDisk->name);
-					return;
-				}
+	buffer = cacheFind(physicalDisk, sector, aheadSectors);
+	if (buffer)
+		aheadSectors = (buffer->startSector - sector);
 
-				// Copy the data from each existing entry
-				memcpy(newData, currBuffer->data,
-					bufferBytes(physicalDisk, currBuffer));
-				memcpy((newData + bufferBytes(physicalDisk, currBuffer)),
-					nextBuffer->data, bufferBytes(physicalDisk, nextBuffer));
+	return (aheadSectors);
+}
 
-				// Replace the buffer pointer
-				kernelFree(currBuffer->data);
-				currBuffer->data = newData;
 
-				// Update the first entry's size
-				currBuffer->numSectors += nextBuffer->numSectors;
+static int cacheAddGaps(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, void *data)
+{
+	// Add the parts of the supplied range of sectors that aren't cached
+	// already.  If the disk was unlocked while the data was read, other
+	// processes might have cached some of it in the meantime.  Returns 1 if
+	// anything was added.
 
-				// Briefly grow the cache size; removing the 'next' entry will
-				// shrink it back again
-				physicalDisk->cache.size +=
-					bufferBytes(physicalDisk, nextBuffer);
+	uquad_t numCached = 0;
+	uquad_t firstCached = 0;
+	uquad_t notCached = 0;
+	int added = 0;
 
-				// Remove the second entry
-				cacheRemove(physicalDisk, nextBuffer);
+	while (numSectors)
+	{
+		numCached = cacheQueryRange(physicalDisk, startSector, numSectors,
+			&firstCached);
 
-				if (currBuffer->dirty)
-					physicalDisk->cache.dirty -= 1;
+		if (numCached)
+			notCached = (firstCached - startSector);
+		else
+			notCached = numSectors;
 
-				// Process this one again, since we might want to merge it
-				// with the next one as well.
-				continue;
-			}
-		}
+		if (notCached && cacheAdd(physicalDisk, startSector, notCached, data))
+			added = 1;
 
-		// Move to the next one
-		currBuffer = nextBuffer;
+		notCached += numCached;
+		startSector += notCached;
+		numSectors -= notCached;
+		data += (notCached * physicalDisk->sectorSize);
 	}
+
+	return (added);
 }
 
 
 static int cacheRead(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
-	uquad_t numSectors, void *data)
+	uquad_t numSectors, void *data, unsigned mode)
 {
 	// For ranges of sectors that are in the cache, copy them into the target
 	// data buffer.  For ranges that are not in the cache, read the sectors
-	// from disk and put a copy in a new cache buffer.
+	// from disk and put a copy in a new cache buffer.  If the read ends with
+	// a miss, and it's part of a sequential stream, read ahead as well.
+	// With IOMODE_UNLOCK in the mode, the disk is unlocked during the reads.
 
 	int status = 0;
+	uquad_t mergeStart = startSector;
+	uquad_t mergeSectors = numSectors;
 	uquad_t numCached = 0;
 	uquad_t firstCached = 0;
 	uquad_t notCached = 0;
 	int added = 0;
 	kernelDiskCacheBuffer *buffer = NULL;
+	kernelDiskReadAheadStream *readStream = NULL;
+	uquad_t aheadSectors = 0;
+	void *readData = NULL;
 
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
+	readStream = cacheReadAheadStream(physicalDisk, startSector, numSectors);
+
 	while (numSectors)
 	{
 		numCached = cacheQueryRange(physicalDisk, startSector, numSectors,
@@ -961,22 +2234,26 @@ static int cacheRead(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 			// Read the uncached portion from disk.
 			if (notCached)
 			{
-				status = realReadWrite(physicalDisk, startSector, notCached,
-					data, IOMODE_READ);
+				status = cacheIo(physicalDisk, startSector, notCached, data,
+					(IOMODE_READ | mode));
 				if (status < 0)
 					return (status);
 
-				// Add the data to the cache.
-				buffer = cacheAdd(physicalDisk, startSector, notCached, data);
-				if (buffer)
+				// Add the data to the cache, unless it's stale.
+				if (!status && cacheAddGaps(physicalDisk, startSector,
+					notCached, data))
 				{
-					buffer->lastAccess = kernelSysTimerRead();
 					added = 1;
 				}
 
 				startSector += notCached;
 				numSectors -= notCached;
 				data += (notCached * physicalDisk->sectorSize);
+
+				// If the disk was unlocked, the cached portion might have
+				// changed, so look again
+				if (mode & IOMODE_UNLOCK)
+					continue;
 			}
 
 			// Get the cached portion
@@ -987,7 +2264,7 @@ static int cacheRead(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 					((startSector - buffer->startSector) *
 						physicalDisk->sectorSize)),
 					(numCached * physicalDisk->sectorSize));
-				buffer->lastAccess = kernelSysTimerRead();
+				cacheTouch(physicalDisk, buffer);
 			}
 
 			startSector += numCached;
@@ -996,24 +2273,75 @@ static int cacheRead(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 		}
 		else
 		{
-			// Nothing is cached.  Read everything from disk.
-			status = realReadWrite(physicalDisk, startSector, numSectors, data,
-				IOMODE_READ);
-			if (status < 0)
-				return (status);
+			// Nothing is cached.  Read everything from disk, along with any
+			// read-ahead, in a single operation.
+			readData = data;
 
-			// Add the data to the cache.
-			buffer = cacheAdd(physicalDisk, startSector, numSectors, data);
-			if (buffer)
+			aheadSectors = cacheReadAheadSectors(physicalDisk, readStream,
+				(startSector + numSectors));
+			if (aheadSectors)
 			{
-				buffer->lastAccess = kernelSysTimerRead();
-				added = 1;
+				readData = kernelMalloc((numSectors + aheadSectors) *
+					physicalDisk->sectorSize);
+				if (!readData)
+				{
+					readData = data;
+					aheadSectors = 0;
+				}
+			}
+
+			status = cacheIo(physicalDisk, startSector,
+				(numSectors + aheadSectors), readData, (IOMODE_READ | mode));
+
+			if ((status < 0) && aheadSectors)
+			{
+				// The read-ahead might be what failed (for example, it ran
+				// into a bad sector).  Try again with just the sectors that
+				// were asked for.
+				kernelFree(readData);
+				readData = data;
+				aheadSectors = 0;
+
+				status = cacheIo(physicalDisk, startSector, numSectors,
+					readData, (IOMODE_READ | mode));
+			}
+
+			if (readData != data)
+			{
+				if (status >= 0)
+					memcpy(data, readData,
+						(numSectors * physicalDisk->sectorSize));
+
+				// Add the data to the cache, unless it's stale.
+				if (!status && cacheAddGaps(physicalDisk, startSector,
+					(numSectors + aheadSectors), readData))
+				{
+					added = 1;
+				}
+
+				kernelFree(readData);
+			}
+			else if (!status)
+			{
+				// Add the data to the cache, unless it's stale.
+				if (cacheAddGaps(physicalDisk, startSector, numSectors, data))
+					added = 1;
 			}
 
+			if (status < 0)
+				return (status);
+
 			break;
 		}
 	}
 
+	// Where the stream continues, and how much of that was read ahead
+	readStream->nextSector = (mergeStart + mergeSectors + aheadSectors);
+	readStream->aheadSectors = aheadSectors;
+	physicalDisk->stats.readAheadKbytes += ((aheadSectors *
+		physicalDisk->sectorSize) / 1024);
+	mergeSectors += aheadSectors;
+
 	if (added)
 	{
 		// Since we added something to the cache above, check whether we should
@@ -1023,7 +2351,7 @@ static int cacheRead(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	}
 
 	// Check whether we should merge any entries
-	cacheMerge(physicalDisk);
+	cacheMerge(physicalDisk, mergeStart, mergeSectors);
 
 	cacheCheck(physicalDisk);
 
@@ -1074,6 +2402,18 @@ static kernelDiskCacheBuffer *cacheSplit(kernelPhysicalDisk *physicalDisk,
 		return (newBuffer = NULL);
 	}
 
+	// Take the old buffer out of the tree, and put the new ones in its place
+	// in the LRU list
+	physicalDisk->cache.root = treeRemove(physicalDisk->cache.root, buffer);
+
+	if (nextBuffer)
+		lruInsert(physicalDisk, nextBuffer, buffer);
+	lruInsert(physicalDisk, newBuffer, buffer);
+	if (prevBuffer)
+		lruInsert(physicalDisk, prevBuffer, buffer);
+
+	lruRemove(physicalDisk, buffer);
+
 	// Copy data
 	if (prevBuffer)
 	{
@@ -1081,7 +2421,9 @@ static kernelDiskCacheBuffer *cacheSplit(kernelPhysicalDisk *physicalDisk,
 			(prevSectors * physicalDisk->sectorSize));
 		if (buffer->dirty)
 			cacheMarkDirty(physicalDisk, prevBuffer);
+		prevBuffer->dirtyTime = buffer->dirtyTime;
 		prevBuffer->lastAccess = buffer->lastAccess;
+		prevBuffer->referenced = buffer->referenced;
 
 		prevBuffer->prev = buffer->prev;
 		prevBuffer->next = newBuffer;
@@ -1108,6 +2450,7 @@ static kernelDiskCacheBuffer *cacheSplit(kernelPhysicalDisk *physicalDisk,
 		(numSectors * physicalDisk->sectorSize));
 	if (buffer->dirty)
 		cacheMarkDirty(physicalDisk, newBuffer);
+	newBuffer->dirtyTime = buffer->dirtyTime;
 	newBuffer->lastAccess = buffer->lastAccess;
 
 	if (nextBuffer)
@@ -1118,7 +2461,9 @@ static kernelDiskCacheBuffer *cacheSplit(kernelPhysicalDisk *physicalDisk,
 			(nextSectors * physicalDisk->sectorSize));
 		if (buffer->dirty)
 			cacheMarkDirty(physicalDisk, nextBuffer);
+		nextBuffer->dirtyTime = buffer->dirtyTime;
 		nextBuffer->lastAccess = buffer->lastAccess;
+		nextBuffer->referenced = buffer->referenced;
 
 		nextBuffer->prev = newBuffer;
 		nextBuffer->next = buffer->next;
@@ -1136,6 +2481,21 @@ static kernelDiskCacheBuffer *cacheSplit(kernelPhysicalDisk *physicalDisk,
 			newBuffer->next->prev = newBuffer;
 	}
 
+	if (prevBuffer)
+	{
+		physicalDisk->cache.root = treeInsert(physicalDisk->cache.root,
+			prevBuffer);
+	}
+
+	physicalDisk->cache.root = treeInsert(physicalDisk->cache.root,
+		newBuffer);
+
+	if (nextBuffer)
+	{
+		physicalDisk->cache.root = treeInsert(physicalDisk->cache.root,
+			nextBuffer);
+	}
+
 	if (buffer->dirty)
 		cacheMarkClean(physicalDisk, buffer);
 
@@ -1153,6 +2513,8 @@ static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	// new cache buffer for the new data.
 
 	int status = 0;
+	uquad_t mergeStart = startSector;
+	uquad_t mergeSectors = numSectors;
 	uquad_t numCached = 0;
 	uquad_t firstCached = 0;
 	uquad_t notCached = 0;
@@ -1181,7 +2543,6 @@ static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 				if (buffer)
 				{
 					cacheMarkDirty(physicalDisk, buffer);
-					buffer->lastAccess = kernelSysTimerRead();
 					added = 1;
 				}
 
@@ -1210,7 +2571,7 @@ static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 			if (buffer)
 			{
 				cacheMarkDirty(physicalDisk, buffer);
-				buffer->lastAccess = kernelSysTimerRead();
+				cacheTouch(physicalDisk, buffer);
 			}
 
 			startSector += numCached;
@@ -1224,7 +2585,6 @@ static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 			if (buffer)
 			{
 				cacheMarkDirty(physicalDisk, buffer);
-				buffer->lastAccess = kernelSysTimerRead();
 				added = 1;
 			}
 			break;
@@ -1240,7 +2600,7 @@ static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	}
 
 	// Check whether we should merge any entries
-	cacheMerge(physicalDisk);
+	cacheMerge(physicalDisk, mergeStart, mergeSectors);
 
 	cacheCheck(physicalDisk);
 
@@ -1249,6 +2609,21 @@ static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 #endif // DISK_CACHE
 
 
+static inline int ioLockMode(kernelPhysicalDisk *physicalDisk, int mode)
+{
+	// I/O that doesn't go through the cache only needs the disk locked in
+	// read mode, so that requests from several processes can be queued at
+	// once
+
+	#if (DISK_CACHE)
+	if (!(physicalDisk->flags & DISKFLAG_NOCACHE) && !(mode & IOMODE_NOCACHE))
+		return (RWLOCK_WRITE);
+	#endif // DISK_CACHE
+
+	return (RWLOCK_READ);
+}
+
+
 static int readWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	uquad_t numSectors, void *data, int mode)
 {
@@ -1268,10 +2643,16 @@ static int readWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	}
 
 	#if (DISK_CACHE)
+	// Reads that are in progress with the disk unlocked mustn't cache the
+	// old data
+	if (mode & IOMODE_WRITE)
+		cacheMarkStale(physicalDisk, startSector, numSectors);
+
 	if (!(physicalDisk->flags & DISKFLAG_NOCACHE) && !(mode & IOMODE_NOCACHE))
 	{
 		if (mode & IOMODE_READ)
-			status = cacheRead(physicalDisk, startSector, numSectors, data);
+			status = cacheRead(physicalDisk, startSector, numSectors, data,
+				(mode & IOMODE_UNLOCK));
 		else
 			status = cacheWrite(physicalDisk, startSector, numSectors, data);
 	}
@@ -1279,7 +2660,7 @@ static int readWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	#endif // DISK_CACHE
 	{
 		status = realReadWrite(physicalDisk, startSector, numSectors, data,
-			mode);
+			(mode & ~IOMODE_UNLOCK));
 	}
 
 	// Throughput stats collection
@@ -1302,6 +2683,34 @@ static int readWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 }
 
 
+static int getBounce(kernelPhysicalDisk *physicalDisk, const void *data,
+	uquad_t numSectors, void **bounce)
+{
+	// Memory that a process has reserved is demand-paged, so it isn't
+	// physically contiguous for the drivers, and touching it might mean
+	// paging it in from swap, which needs the disk lock.  If the caller's
+	// buffer is like that, get a bounce buffer to use while we're holding
+	// the lock.
+
+	unsigned bytes = (numSectors * physicalDisk->sectorSize);
+
+	*bounce = NULL;
+
+	if ((data >= (void *) KERNEL_VIRTUAL_ADDRESS) ||
+		!kernelMemoryIsReserved(kernelMultitaskerGetCurrentProcessId(),
+			(void *) data, bytes))
+	{
+		return (0);
+	}
+
+	*bounce = kernelMemoryGetSystem(bytes, "disk bounce buffer");
+	if (!*bounce)
+		return (ERR_MEMORY);
+
+	return (0);
+}
+
+
 static kernelPhysicalDisk *getPhysicalByName(const char *name)
 {
 	// This function takes the name of a physical disk and finds it in the
@@ -1915,7 +3324,7 @@ static int identifyBootCd(void)
 			return (status = ERR_MEMORY);
 
 		// Lock the disk
-		status = kernelLockGet(&physicalDisk->lock);
+		status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 		if (status < 0)
 		{
 			kernelFree(buffer);
@@ -1927,7 +3336,7 @@ static int identifyBootCd(void)
 			IOMODE_READ);
 		if (status < 0)
 		{
-			kernelLockRelease(&physicalDisk->lock);
+			kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 			kernelFree(buffer);
 			continue;
 		}
@@ -1938,7 +3347,7 @@ static int identifyBootCd(void)
 				IOMODE_READ);
 		if (status < 0)
 		{
-			kernelLockRelease(&physicalDisk->lock);
+			kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 			kernelFree(buffer);
 			continue;
 		}
@@ -1948,7 +3357,7 @@ static int identifyBootCd(void)
 		{
 			kernelDebug(debug_io, "Disk %s is not bootable",
 				physicalDisk->name);
-			kernelLockRelease(&physicalDisk->lock);
+			kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 			kernelFree(buffer);
 			continue;
 		}
@@ -1961,7 +3370,7 @@ static int identifyBootCd(void)
 		status = readWrite(physicalDisk, imageSector, 1, buffer, IOMODE_READ);
 
 		// Unlock the disk
-		kernelLockRelease(&physicalDisk->lock);
+		kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 		if (status < 0)
 		{
@@ -2037,7 +3446,7 @@ static int identifyBootDisk(void)
 			return (status = ERR_MEMORY);
 
 		// Lock the disk
-		status = kernelLockGet(&physicalDisk->lock);
+		status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 		if (status < 0)
 		{
 			kernelFree(buffer);
@@ -2049,7 +3458,7 @@ static int identifyBootDisk(void)
 			IOMODE_READ);
 
 		// Unlock the disk
-		kernelLockRelease(&physicalDisk->lock);
+		kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 		if (status < 0)
 		{
@@ -2158,7 +3567,7 @@ int kernelDiskRegisterDevice(kernelDevice *dev)
 	// never be used.
 
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status = ERR_NOLOCK);
 
@@ -2178,7 +3587,7 @@ int kernelDiskRegisterDevice(kernelDevice *dev)
 	physicalDisk->lastAccess = kernelSysTimerRead();
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	// Success
 	return (status = 0);
@@ -2214,6 +3623,13 @@ int kernelDiskRemoveDevice(kernelDevice *dev)
 
 	kernelDebug(debug_io, "Disk %s remove device",  physicalDisk->name);
 
+	// Stop its dispatcher thread
+	if (physicalDisk->queue.threadPid &&
+		kernelMultitaskerProcessIsAlive(physicalDisk->queue.threadPid))
+	{
+		kernelMultitaskerKillProcess(physicalDisk->queue.threadPid, 0);
+	}
+
 	// Add all the logical disks that don't belong to this physical disk
 	for (count = 0; count < logicalDiskCounter; count ++)
 		if (logicalDisks[count]->physical != physicalDisk)
@@ -2270,6 +3686,17 @@ int kernelDiskInitialize(void)
 		return (status = ERR_NOTINITIALIZED);
 	}
 
+	// Create the caches for disk cache buffers and I/O requests
+	status = kernelSlabCacheCreate(&cacheBufferCache, "disk cache buffers",
+		sizeof(kernelDiskCacheBuffer));
+	if (status < 0)
+		return (status);
+
+	status = kernelSlabCacheCreate(&requestCache, "disk requests",
+		sizeof(kernelDiskRequest));
+	if (status < 0)
+		return (status);
+
 	// Spawn the disk thread
 	status = spawnDiskThread();
 	if (status < 0)
@@ -2397,7 +3824,7 @@ int kernelDiskInvalidateCache(const char *diskName)
 	}
 
 	// Lock the physical disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 	{
 		kernelError(kernel_error, "Unable to lock disk \"%s\" for cache "
@@ -2407,7 +3834,7 @@ int kernelDiskInvalidateCache(const char *diskName)
 
 	status = cacheInvalidate(physicalDisk);
 
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	if (status < 0)
 		kernelError(kernel_warn, "Error invalidating disk \"%s\" cache",
@@ -2418,6 +3845,24 @@ int kernelDiskInvalidateCache(const char *diskName)
 }
 
 
+int kernelDiskSetWriteback(unsigned age, unsigned ratio)
+{
+	// Set the thresholds at which the disk thread writes back dirty cache
+	// data: the age of the data in seconds, and the percentage of the
+	// maximum cache size
+
+	int status = 0;
+
+	if (ratio > 100)
+		return (status = ERR_INVALID);
+
+	writebackAge = age;
+	writebackRatio = ratio;
+
+	return (status = 0);
+}
+
+
 int kernelDiskShutdown(void)
 {
 	// Shut down.
@@ -2440,7 +3885,7 @@ int kernelDiskShutdown(void)
 		physicalDisk = physicalDisks[count];
 
 		// Lock the disk
-		status = kernelLockGet(&physicalDisk->lock);
+		status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 		if (status < 0)
 			return (status = ERR_NOLOCK);
 
@@ -2451,7 +3896,7 @@ int kernelDiskShutdown(void)
 		}
 
 		// Unlock the disk
-		kernelLockRelease(&physicalDisk->lock);
+		kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 	}
 
 	return (status);
@@ -2782,7 +4227,7 @@ int kernelDiskSync(const char *diskName)
 	}
 
 	// Lock the physical disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 	{
 		kernelError(kernel_error, "Unable to lock disk \"%s\" for sync",
@@ -2815,7 +4260,7 @@ int kernelDiskSync(const char *diskName)
 		}
 	}
 
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (status = errors);
 }
@@ -3122,7 +4567,7 @@ int kernelDiskSetFlags(const char *diskName, unsigned flags, int set)
 	}
 
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 		goto out;
 
@@ -3150,7 +4595,7 @@ int kernelDiskSetFlags(const char *diskName, unsigned flags, int set)
 
 out:
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (status);
 }
@@ -3194,7 +4639,7 @@ int kernelDiskSetLockState(const char *diskName, int state)
 	}
 
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status = ERR_NOLOCK);
 
@@ -3202,7 +4647,7 @@ int kernelDiskSetLockState(const char *diskName, int state)
 	status = ops->driverSetLockState(physicalDisk->deviceNumber, state);
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (status);
 }
@@ -3253,7 +4698,7 @@ int kernelDiskSetDoorState(const char *diskName, int state)
 	}
 
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status = ERR_NOLOCK);
 
@@ -3266,7 +4711,7 @@ int kernelDiskSetDoorState(const char *diskName, int state)
 	status = ops->driverSetDoorState(physicalDisk->deviceNumber, state);
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (status);
 }
@@ -3308,7 +4753,7 @@ int kernelDiskMediaPresent(const char *diskName)
 	ops = (kernelDiskOps *) physicalDisk->driver->ops;
 
 	// Lock the disk
-	if (kernelLockGet(&physicalDisk->lock) < 0)
+	if (kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE) < 0)
 		return (present = 0);
 
 	// Does the driver implement the 'media present' function?
@@ -3335,7 +4780,7 @@ int kernelDiskMediaPresent(const char *diskName)
 	}
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (present);
 }
@@ -3380,7 +4825,7 @@ int kernelDiskMediaChanged(const char *diskName)
 		return (changed = 0);
 
 	// Lock the disk
-	if (kernelLockGet(&physicalDisk->lock) < 0)
+	if (kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE) < 0)
 		return (changed = 0);
 
 	changed = ops->driverMediaChanged(physicalDisk->deviceNumber);
@@ -3394,7 +4839,7 @@ int kernelDiskMediaChanged(const char *diskName)
 	}
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (changed);
 }
@@ -3410,6 +4855,10 @@ int kernelDiskReadSectors(const char *diskName, uquad_t logicalSector,
 	int status = 0;
 	kernelPhysicalDisk *physicalDisk = NULL;
 	kernelDisk *theDisk = NULL;
+	void *bounce = NULL;
+	void *buffer = dataPointer;
+	int lockMode = 0;
+	int unlock = 0;
 
 	if (!initialized)
 		return (status = ERR_NOTINITIALIZED);
@@ -3454,17 +4903,67 @@ int kernelDiskReadSectors(const char *diskName, uquad_t logicalSector,
 		}
 	}
 
+	status = getBounce(physicalDisk, dataPointer, numSectors, &bounce);
+	if (status < 0)
+		return (status);
+
+	if (bounce)
+		buffer = bounce;
+
+	#if (DISK_CACHE)
+	// Cache hits don't change the cache, so any number of them can proceed at
+	// once, with the disk locked in read mode
+	if (!(physicalDisk->flags & DISKFLAG_NOCACHE) &&
+		(kernelRwLockGet(&physicalDisk->lock, RWLOCK_READ) >= 0))
+	{
+		status = cacheReadHit(physicalDisk, logicalSector, numSectors,
+			buffer);
+
+		if (status > 0)
+			physicalDisk->stats.readKbytes += ((numSectors *
+				physicalDisk->sectorSize) / 1024);
+
+		kernelRwLockRelease(&physicalDisk->lock, RWLOCK_READ);
+
+		if (status > 0)
+		{
+			status = 0;
+			goto out;
+		}
+	}
+	#endif // DISK_CACHE
+
+	// Unless we had it locked already, the cache can unlock the disk while
+	// it waits for cache misses to be read, so that other processes' I/O can
+	// be queued at the same time
+	if (!kernelRwLockHeld(&physicalDisk->lock))
+		unlock = IOMODE_UNLOCK;
+
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	lockMode = ioLockMode(physicalDisk, IOMODE_READ);
+	status = kernelRwLockGet(&physicalDisk->lock, lockMode);
 	if (status < 0)
-		return (status = ERR_NOLOCK);
+	{
+		status = ERR_NOLOCK;
+		goto out;
+	}
 
 	// Call the read-write function for a read operation
-	status = readWrite(physicalDisk, logicalSector, numSectors, dataPointer,
-		IOMODE_READ);
+	status = readWrite(physicalDisk, logicalSector, numSectors, buffer,
+		(IOMODE_READ | unlock));
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, lockMode);
+
+out:
+	if (bounce)
+	{
+		if (status >= 0)
+			memcpy(dataPointer, bounce, (numSectors *
+				physicalDisk->sectorSize));
+
+		kernelMemoryReleaseSystem(bounce);
+	}
 
 	return (status);
 }
@@ -3480,6 +4979,9 @@ int kernelDiskWriteSectors(const char *diskName, uquad_t logicalSector,
 	int status = 0;
 	kernelPhysicalDisk *physicalDisk = NULL;
 	kernelDisk *theDisk = NULL;
+	void *bounce = NULL;
+	void *buffer = (void *) data;
+	int lockMode = 0;
 
 	if (!initialized)
 		return (status = ERR_NOTINITIALIZED);
@@ -3521,17 +5023,88 @@ int kernelDiskWriteSectors(const char *diskName, uquad_t logicalSector,
 		}
 	}
 
+	status = getBounce(physicalDisk, data, numSectors, &bounce);
+	if (status < 0)
+		return (status);
+
+	if (bounce)
+	{
+		memcpy(bounce, data, (numSectors * physicalDisk->sectorSize));
+		buffer = bounce;
+	}
+
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	lockMode = ioLockMode(physicalDisk, IOMODE_WRITE);
+	status = kernelRwLockGet(&physicalDisk->lock, lockMode);
+	if (status >= 0)
+	{
+		// Call the read-write function for a write operation
+		status = readWrite(physicalDisk, logicalSector, numSectors, buffer,
+			IOMODE_WRITE);
+
+		// Unlock the disk
+		kernelRwLockRelease(&physicalDisk->lock, lockMode);
+	}
+	else
+	{
+		status = ERR_NOLOCK;
+	}
+
+	if (bounce)
+		kernelMemoryReleaseSystem(bounce);
+
+	return (status);
+}
+
+
+int kernelDiskReadWriteUncached(const char *diskName, uquad_t logicalSector,
+	uquad_t numSectors, void *data, int write)
+{
+	// Read or write sectors of a logical disk without going through the
+	// cache.  This is for paging to and from swap, where caching the pages
+	// would only use up the memory we're trying to free.
+
+	int status = 0;
+	kernelDisk *theDisk = NULL;
+	kernelPhysicalDisk *physicalDisk = NULL;
+
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!diskName || !data)
+		return (status = ERR_NULLPARAMETER);
+
+	theDisk = kernelDiskGetByName(diskName);
+	if (!theDisk)
+		return (status = ERR_NOSUCHENTRY);
+
+	// Make sure the sectors are within the volume
+	if ((logicalSector >= theDisk->numSectors) ||
+		((logicalSector + numSectors) > theDisk->numSectors))
+	{
+		kernelError(kernel_error, "Exceeding volume boundary");
+		return (status = ERR_BOUNDS);
+	}
+
+	physicalDisk = theDisk->physical;
+	if (!physicalDisk)
+	{
+		kernelError(kernel_error, "Logical disk's physical disk is NULL");
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	// Lock the disk.  This doesn't touch the cache, so read mode will do.
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_READ);
 	if (status < 0)
 		return (status = ERR_NOLOCK);
 
-	// Call the read-write function for a write operation
-	status = readWrite(physicalDisk, logicalSector, numSectors, (void *) data,
-		IOMODE_WRITE);
+	status = readWrite(physicalDisk, (theDisk->startSector + logicalSector),
+		numSectors, data, ((write? IOMODE_WRITE : IOMODE_READ) |
+			IOMODE_NOCACHE));
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_READ);
 
 	return (status);
 }
@@ -3593,7 +5166,7 @@ int kernelDiskEraseSectors(const char *diskName, uquad_t logicalSector,
 		return (status = ERR_MEMORY);
 
 	// Lock the disk
-	status = kernelLockGet(&physicalDisk->lock);
+	status = kernelRwLockGet(&physicalDisk->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status = ERR_NOLOCK);
 
@@ -3632,7 +5205,7 @@ int kernelDiskEraseSectors(const char *diskName, uquad_t logicalSector,
 	kernelFree(buffer);
 
 	// Unlock the disk
-	kernelLockRelease(&physicalDisk->lock);
+	kernelRwLockRelease(&physicalDisk->lock, RWLOCK_WRITE);
 
 	return (status);
 }
@@ -3671,6 +5244,7 @@ int kernelDiskGetStats(const char *diskName, diskStats *stats)
 		}
 
 		memcpy(stats, (void *) &physicalDisk->stats, sizeof(diskStats));
+		stats->queueDepth = physicalDisk->queue.numRequests;
 	}
 	else
 	{
@@ -3679,6 +5253,16 @@ int kernelDiskGetStats(const char *diskName, diskStats *stats)
 			physicalDisk = physicalDisks[count];
 			stats->readTimeMs += physicalDisk->stats.readTimeMs;
 			stats->readKbytes += physicalDisk->stats.readKbytes;
+			stats->readAheadKbytes += physicalDisk->stats.readAheadKbytes;
+			stats->readAheadHitKbytes +=
+				physicalDisk->stats.readAheadHitKbytes;
+			stats->readAheadWasteKbytes +=
+				physicalDisk->stats.readAheadWasteKbytes;
+			stats->requests += physicalDisk->stats.requests;
+			stats->merges += physicalDisk->stats.merges;
+			stats->queueDepth += physicalDisk->queue.numRequests;
+			stats->maxQueueDepth = max(stats->maxQueueDepth,
+				physicalDisk->stats.maxQueueDepth);
 			stats->writeTimeMs += physicalDisk->stats.writeTimeMs;
 			stats->writeKbytes += physicalDisk->stats.writeKbytes;
 		}
@@ -31,7 +31,22 @@
 
 #define DISK_CACHE				1
 #define DISK_CACHE_ALIGN		(64 * 1024)	// Convenient for floppies
-#define DISK_READAHEAD_SECTORS	32
+#define DISK_READAHEAD_SECTORS	32			// Initial window
+#define DISK_READAHEAD_MAX		(128 * 1024)	// Maximum window, in bytes
+#define DISK_READAHEAD_STREAMS	4
+#define DISK_QUEUE_MERGE_MAX	(128 * 1024)	// Bytes in a merged request
+#define DISK_QUEUE_DEADLINE		500		// Milliseconds
+#define DISK_QUEUE_WAIT_MS		10
+#define DISK_QUEUE_IDLE_MS		100
+#define DISK_WRITEBACK_AGE		5	// Seconds
+#define DISK_WRITEBACK_RATIO	25	// Percent of DISK_MAX_CACHE
+#define DISK_WRITEBACK_RETRIES	6	// Failures before giving up
+
+// Modes for reading and writing sectors, as in disk requests
+#define IOMODE_READ				0x01
+#define IOMODE_WRITE			0x02
+#define IOMODE_NOCACHE			0x04
+#define IOMODE_UNLOCK			0x08	// Can unlock the disk during I/O
 
 typedef enum { addr_pchs, addr_lba } kernelAddrMethod;
 
@@ -76,6 +91,24 @@ typedef volatile struct _kernelDisk {
 
 } kernelDisk;
 
+// This is an I/O request waiting in a physical disk's queue
+typedef volatile struct _kernelDiskRequest {
+	uquad_t startSector;
+	uquad_t numSectors;
+	void *data;
+	unsigned mode;
+	uquad_t queueTime;
+	int waitProcess;
+	int dispatched;
+	int done;
+	int status;
+	volatile struct _kernelDiskRequest *next;
+	// For a run submitted to the driver, the queued requests it covers
+	volatile struct _kernelDiskRequest *requests;
+	int numRequests;
+
+} kernelDiskRequest;
+
 typedef struct {
 	int (*driverSetMotorState)(int, int);
 	int (*driverSetLockState)(int, int);
@@ -85,9 +118,31 @@ typedef struct {
 	int (*driverReadSectors)(int, uquad_t, uquad_t, void *);
 	int (*driverWriteSectors)(int, uquad_t, uquad_t, const void *);
 	int (*driverFlush)(int);
+	// Optional.  Start a request and return without waiting; the driver
+	// sets its status and done fields, and wakes its waitProcess, when it
+	// completes.
+	int (*driverSubmit)(int, kernelDiskRequest *);
+	// Optional.  Called periodically while submitted requests are
+	// outstanding, so that the driver can time out any that the device
+	// hasn't finished, and complete them with an error.
+	int (*driverPoll)(int);
 
 } kernelDiskOps;
 
+// This is the queue of I/O requests for a physical disk, which its
+// dispatcher thread services in elevator order
+typedef volatile struct {
+	lock lock;
+	kernelDiskRequest *requests;	// In order of start sector
+	int numRequests;
+	uquad_t headSector;
+	int threadPid;
+	int idle;
+	kernelDiskRequest *inFlight;	// Runs submitted to the driver
+	int numInFlight;
+
+} kernelDiskQueue;
+
 #if (DISK_CACHE)
 // This is for metadata about a range of data in a disk cache
 typedef volatile struct _kernelDiskCacheSector {
@@ -95,17 +150,56 @@ typedef volatile struct _kernelDiskCacheSector {
 	uquad_t numSectors;
 	void *data;
 	int dirty;
+	uquad_t dirtyTime;
 	unsigned lastAccess;
+	int referenced;
+	// In order of start sector
 	volatile struct _kernelDiskCacheSector *prev;
 	volatile struct _kernelDiskCacheSector *next;
+	// Balanced search tree, keyed by start sector
+	volatile struct _kernelDiskCacheSector *left;
+	volatile struct _kernelDiskCacheSector *right;
+	int height;
+	// In order of use, least recent first
+	volatile struct _kernelDiskCacheSector *lruPrev;
+	volatile struct _kernelDiskCacheSector *lruNext;
 
 } kernelDiskCacheBuffer;
 
+// This is for cache I/O that's in progress with the disk unlocked
+typedef volatile struct _kernelDiskCacheIo {
+	uquad_t startSector;
+	uquad_t numSectors;
+	unsigned mode;
+	int done;
+	int stale;
+	volatile struct _kernelDiskCacheIo *next;
+
+} kernelDiskCacheIo;
+
+// This is for detecting a sequential stream of reads from a disk
+typedef volatile struct {
+	uquad_t nextSector;
+	uquad_t aheadSectors;
+	unsigned window;
+	unsigned lastAccess;
+
+} kernelDiskReadAheadStream;
+
 // This is for managing the data cache of a physical disk
 typedef volatile struct {
 	kernelDiskCacheBuffer *buffer;
+	kernelDiskCacheBuffer *root;
+	kernelDiskCacheBuffer *lruFirst;
+	kernelDiskCacheBuffer *lruLast;
 	uquad_t size;
 	uquad_t dirty;
+	uquad_t dirtyBytes;
+	kernelDiskCacheIo *inFlight;
+	kernelDiskReadAheadStream streams[DISK_READAHEAD_STREAMS];
+	// Failed background writebacks, and when to try again
+	int writebackFailures;
+	uquad_t writebackRetry;
 
 } kernelDiskCache;
 #endif // DISK_CACHE
@@ -134,9 +228,10 @@ typedef volatile struct _kernelPhysicalDisk {
 
 	// Misc
 	unsigned lastSession;  // Needed for multisession CD-ROM
-	lock lock;
+	rwLock lock;
 	unsigned lastAccess;
 	int multiSectors;
+	int queueDepth;  // Requests the driver can have outstanding at once
 
 	// Physical disk driver
 	kernelDriver *driver;
@@ -144,6 +239,9 @@ typedef volatile struct _kernelPhysicalDisk {
 
 	diskStats stats;
 
+	// The I/O request queue
+	kernelDiskQueue queue;
+
 #if (DISK_CACHE)
 	// The cache
 	kernelDiskCache cache;
@@ -158,6 +256,7 @@ int kernelDiskInitialize(void);
 void kernelDiskAutoMount(kernelDisk *);
 void kernelDiskAutoMountAll(void);
 int kernelDiskInvalidateCache(const char *);
+int kernelDiskSetWriteback(unsigned, unsigned);
 int kernelDiskShutdown(void);
 int kernelDiskFromLogical(kernelDisk *, disk *);
 kernelDisk *kernelDiskGetByName(const char *);
@@ -184,6 +283,7 @@ int kernelDiskMediaPresent(const char *);
 int kernelDiskMediaChanged(const char *);
 int kernelDiskReadSectors(const char *, uquad_t, uquad_t, void *);
 int kernelDiskWriteSectors(const char *, uquad_t, uquad_t, const void *);
+int kernelDiskReadWriteUncached(const char *, uquad_t, uquad_t, void *, int);
 int kernelDiskEraseSectors(const char *, uquad_t, uquad_t, int);
 int kernelDiskGetStats(const char *, diskStats *);
 int kernelDiskRamDiskCreate(unsigned, char *);
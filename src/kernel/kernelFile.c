@@ -34,6 +34,7 @@
 #include "kernelMultitasker.h"
 #include "kernelRandom.h"
 #include "kernelRtc.h"
+#include "kernelSlab.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,42 +45,12 @@
 // The root directory
 static kernelFileEntry *rootEntry = NULL;
 
-// Memory for free file entries
-static kernelFileEntry *freeEntries = NULL;
-static unsigned numFreeEntries = 0;
+// Memory for file entries
+static kernelSlabCache entryCache;
 
 static int initialized = 0;
 
 
-static int allocateFileEntries(void)
-{
-	// This function is used to allocate more memory for the freeEntries
-	// list.
-
-	int status = 0;
-	kernelFileEntry *entries = NULL;
-	int count;
-
-	// Allocate memory for file entries
-	entries = kernelMalloc(sizeof(kernelFileEntry) * MAX_BUFFERED_FILES);
-	if (!entries)
-		return (status = ERR_MEMORY);
-
-	// Initialize the new kernelFileEntry structures.
-
-	for (count = 0; count < (MAX_BUFFERED_FILES - 1); count ++)
-		entries[count].nextEntry = &entries[count + 1];
-
-	// The free file entries are the new memory
-	freeEntries = entries;
-
-	// Add the number of new file entries
-	numFreeEntries = MAX_BUFFERED_FILES;
-
-	return (status = 0);
-}
-
-
 static int isLeafDir(kernelFileEntry *entry)
 {
 	// This function will determine whether the supplied directory entry
@@ -1337,9 +1308,10 @@ static int fileMove(kernelFileEntry *sourceEntry, kernelFileEntry *destDir)
 
 int kernelFileInitialize(void)
 {
-	// Nothing to do, but we're not initialized until the root directory
-	// has been set, below
-	return (0);
+	// Create the cache for file entries, but we're not initialized until the
+	// root directory has been set, below
+	return (kernelSlabCacheCreate(&entryCache, "file entries",
+		sizeof(kernelFileEntry)));
 }
 
 
@@ -1382,21 +1354,10 @@ kernelFileEntry *kernelFileNewEntry(kernelDisk *fsDisk)
 		return (entry = NULL);
 	}
 
-	// Make sure there is a free file entry available
-	if (!numFreeEntries)
-	{
-		status = allocateFileEntries();
-		if (status < 0)
-			return (entry = NULL);
-	}
-
-	// Get a free file entry.  Grab it from the first spot
-	entry = freeEntries;
-	freeEntries = entry->nextEntry;
-	numFreeEntries -= 1;
-
-	// Clear it
-	memset((void *) entry, 0, sizeof(kernelFileEntry));
+	// Get a free file entry.  It comes cleared.
+	entry = kernelSlabAlloc(&entryCache);
+	if (!entry)
+		return (entry);
 
 	// Set some default time/date values
 	updateAllTimes(entry);
@@ -1458,9 +1419,7 @@ void kernelFileReleaseEntry(kernelFileEntry *entry)
 	memset((void *) entry, 0, sizeof(kernelFileEntry));
 
 	// Put the entry back into the pool of free entries.
-	entry->nextEntry = freeEntries;
-	freeEntries = entry;
-	numFreeEntries += 1;
+	kernelSlabFree(&entryCache, (void *) entry);
 }
 
 
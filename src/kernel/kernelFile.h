@@ -25,7 +25,6 @@
 #include <sys/disk.h>
 
 // Definitions
-#define MAX_BUFFERED_FILES		1024
 // MicrosoftTM's filesystems can't handle too many directory entries
 #define MAX_DIRECTORY_ENTRIES	0xFFFE
 
@@ -23,6 +23,7 @@
 
 #include "kernelDisk.h"
 #include <sys/file.h>
+#include <sys/linuxswap.h>
 #include <sys/progress.h>
 
 // Definitions
@@ -86,6 +87,9 @@ int kernelFilesystemLinuxSwapInitialize(void);
 int kernelFilesystemNtfsInitialize(void);
 int kernelFilesystemUdfInitialize(void);
 
+// Functions exported by kernelFilesystemLinuxSwap.c
+int kernelFilesystemLinuxSwapGetHeader(kernelDisk *, linuxSwapHeader *);
+
 // Functions exported by kernelFilesystem.c
 int kernelFilesystemScan(const char *);
 int kernelFilesystemFormat(const char *, const char *, const char *, int,
@@ -27,7 +27,6 @@
 #include "kernelError.h"
 #include "kernelMalloc.h"
 #include <string.h>
-#include <sys/linuxswap.h>
 
 static int initialized = 0;
 
@@ -349,10 +348,10 @@ static int readDir(kernelFileEntry *directory)
 
 static int mount(kernelDisk *theDisk)
 {
-	// For the moment, this is a dummy mount function.  Basically it allows
-	// a 'mount' operation to succeed without actually doing anything --
-	// because for the moment we don't implement swapping, and of course there
-	// are no files in a linux swap partition.  In other words, a placeholder.
+	// This is a dummy mount function.  Basically it allows a 'mount'
+	// operation to succeed without actually doing anything -- there are no
+	// files in a linux swap partition, and paging to it is started by
+	// kernelMemorySwapOn().  In other words, a placeholder.
 
 	int status = 0;
 	kernelPhysicalDisk *physicalDisk = NULL;
@@ -485,3 +484,45 @@ int kernelFilesystemLinuxSwapInitialize(void)
 	return (status);
 }
 
+
+int kernelFilesystemLinuxSwapGetHeader(kernelDisk *theDisk,
+	linuxSwapHeader *header)
+{
+	// Read the swap header of a disk that's going to be used for paging, and
+	// make sure it's one we can use: the new-style (version 1) format, with
+	// at least one usable page
+
+	int status = 0;
+
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!theDisk || !header)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	status = readSwapHeader(theDisk, header);
+	if (status < 0)
+		return (status);
+
+	if (strncmp(header->magic.magic, LINUXSWAP_MAGIC2, 10) ||
+		(header->info.version != 1) || !header->info.lastPage)
+	{
+		kernelError(kernel_error, "Disk %s is not a usable linux-swap "
+			"partition", theDisk->name);
+		return (status = ERR_INVALID);
+	}
+
+	// The last page can't be past the end of the partition
+	if (header->info.lastPage >= ((theDisk->numSectors *
+		theDisk->physical->sectorSize) / MEMORY_PAGE_SIZE))
+	{
+		header->info.lastPage = (((theDisk->numSectors *
+			theDisk->physical->sectorSize) / MEMORY_PAGE_SIZE) - 1);
+	}
+
+	return (status = 0);
+}
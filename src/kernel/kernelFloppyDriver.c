@@ -1052,7 +1052,9 @@ static kernelDiskOps floppyOps = {
 	driverMediaChanged,
 	driverReadSectors,
 	driverWriteSectors,
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL,	// driverSubmit
+	NULL	// driverPoll
 };
 
 
@@ -3518,7 +3518,9 @@ static kernelDiskOps ideOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	driverFlush
+	driverFlush,
+	NULL,	// driverSubmit
+	NULL	// driverPoll
 };
 
 
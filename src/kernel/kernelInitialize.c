@@ -20,6 +20,7 @@
 //
 
 #include "kernelInitialize.h"
+#include "kernelCpu.h"
 #include "kernelDebug.h"
 #include "kernelDescriptor.h"
 #include "kernelDisk.h"
@@ -29,6 +30,7 @@
 #include "kernelImage.h"
 #include "kernelInterrupt.h"
 #include "kernelKeyboard.h"
+#include "kernelLinkedList.h"
 #include "kernelLocale.h"
 #include "kernelLog.h"
 #include "kernelMain.h"
@@ -199,6 +201,9 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 	kernelDisk *rootDisk = NULL;
 	const char *value = NULL;
 	int networking = 0;
+	int maxCpus = MAX_CPUS;
+	unsigned writebackAge = DISK_WRITEBACK_AGE;
+	unsigned writebackRatio = DISK_WRITEBACK_RATIO;
 	int count;
 
 	extern char *kernelVersion[];
@@ -221,6 +226,11 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 	if (status < 0)
 		return (status);
 
+	// Initialize linked lists, which are used by lots of things from here on
+	status = kernelLinkedListInitialize();
+	if (status < 0)
+		return (status);
+
 	// Initialize the descriptor tables (GDT and IDT)
 	status = kernelDescriptorInitialize();
 	if (status < 0)
@@ -495,6 +505,38 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 		value = kernelVariableListGet(kernelVariables, KERNELVAR_NETWORK);
 		if (value && !strcmp(value, "yes"))
 			networking = 1;
+
+		// The maximum number of processors to use
+		value = kernelVariableListGet(kernelVariables, KERNELVAR_CPUS_MAX);
+		if (value)
+			maxCpus = atoi(value);
+
+		// A linux-swap partition to page out to
+		value = kernelVariableListGet(kernelVariables, KERNELVAR_SWAP_DISK);
+		if (value && value[0])
+		{
+			kernelDebug(debug_misc, "Enabling swap");
+
+			status = kernelMemorySwapOn(value);
+			if (status < 0)
+				// Make a warning, but don't return error.  This is not fatal.
+				kernelError(kernel_warn, "Unable to use swap disk %s", value);
+		}
+
+		// When to write back dirty disk cache data
+		value = kernelVariableListGet(kernelVariables, KERNELVAR_DISK_WB_AGE);
+		if (value && value[0])
+			writebackAge = atoi(value);
+
+		value = kernelVariableListGet(kernelVariables,
+			KERNELVAR_DISK_WB_RATIO);
+		if (value && value[0])
+			writebackRatio = atoi(value);
+
+		status = kernelDiskSetWriteback(writebackAge, writebackRatio);
+		if (status < 0)
+			kernelError(kernel_warn, "Invalid disk writeback ratio %u",
+				writebackRatio);
 	}
 
 	if (graphics)
@@ -538,6 +580,13 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 	kernelDebug(debug_misc, "Reading kernel symbols");
 	kernelReadSymbols();
 
+	// Start any additional processors
+	kernelDebug(debug_misc, "Starting processors");
+	status = kernelCpuStartAps(maxCpus);
+	if (status < 0)
+		// Make a warning, but don't return error.  This is not fatal.
+		kernelError(kernel_warn, "Starting processors failed");
+
 	// Initialize the network system
 	kernelDebug(debug_misc, "Initializing networking");
 	status = kernelNetworkInitialize();
@@ -57,11 +57,29 @@ static void exHandler10(void) EXHANDLERX(EXCEPTION_INVALIDTSS)
 static void exHandler11(void) EXHANDLERX(EXCEPTION_SEGNOTPRES)
 static void exHandler12(void) EXHANDLERX(EXCEPTION_STACK)
 static void exHandler13(void) EXHANDLERX(EXCEPTION_GENPROTECT)
-static void exHandler14(void) EXHANDLERX(EXCEPTION_PAGE)
 static void exHandler15(void) EXHANDLERX(EXCEPTION_RESERVED)
 static void exHandler16(void) EXHANDLERX(EXCEPTION_FLOAT)
 static void exHandler17(void) EXHANDLERX(EXCEPTION_ALIGNCHECK)
 static void exHandler18(void) EXHANDLERX(EXCEPTION_MACHCHECK)
+static void exHandler19(void) EXHANDLERX(EXCEPTION_SIMD)
+
+static void exHandler14(void)
+{
+	// The page fault handler.  The processor pushes an error code, and puts
+	// the faulting address in CR2.  We have to read CR2 before anything else
+	// can fault, and before we can be moved to another processor.
+
+	unsigned exAddress = 0;
+	unsigned errorCode = 0;
+	unsigned faultAddress = 0;
+	int exInterrupts = 0;
+
+	processorErrorExceptionEnter(exAddress, errorCode, exInterrupts);
+	processorGetCR2(faultAddress);
+	kernelExceptionPageFault(exAddress, (void *) faultAddress, errorCode);
+	processorErrorExceptionExit(exInterrupts);
+}
+
 
 static void intHandlerUnimp(void)
 {
@@ -111,10 +129,11 @@ int kernelInterruptInitialize(void)
 	kernelDescriptorSetIDTInterruptGate(EXCEPTION_FLOAT, &exHandler16);
 	kernelDescriptorSetIDTInterruptGate(EXCEPTION_ALIGNCHECK, &exHandler17);
 	kernelDescriptorSetIDTInterruptGate(EXCEPTION_MACHCHECK, &exHandler18);
+	kernelDescriptorSetIDTInterruptGate(EXCEPTION_SIMD, &exHandler19);
 
 	// Initialize the rest of the table with the vector for the standard
 	// "unimplemented" interrupt vector
-	for (count = 19; count < IDT_SIZE; count ++)
+	for (count = EXCEPTIONS; count < IDT_SIZE; count ++)
 		kernelDescriptorSetIDTInterruptGate(count, intHandlerUnimp);
 
 	// Note that we've been called
@@ -25,9 +25,11 @@
 #include "kernelLinkedList.h"
 #include "kernelDebug.h"
 #include "kernelError.h"
-#include "kernelMalloc.h"
+#include "kernelSlab.h"
 #include <string.h>
 
+static kernelSlabCache itemCache;
+
 
 static inline int inList(kernelLinkedList *list, kernelLinkedListItem *item)
 {
@@ -55,6 +57,16 @@ static inline int inList(kernelLinkedList *list, kernelLinkedListItem *item)
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+int kernelLinkedListInitialize(void)
+{
+	// Create the slab cache for list items.  This has to happen before any
+	// list is used.
+
+	return (kernelSlabCacheCreate(&itemCache, "linked list items",
+		sizeof(kernelLinkedListItem)));
+}
+
+
 int kernelLinkedListAdd(kernelLinkedList *list, void *data)
 {
 	// Add the specified data value to the linked list.
@@ -65,16 +77,16 @@ int kernelLinkedListAdd(kernelLinkedList *list, void *data)
 	if (!list || !data)
 		return (status = ERR_NULLPARAMETER);
 
-	new = kernelMalloc(sizeof(kernelLinkedListItem));
+	new = kernelSlabAlloc(&itemCache);
 	if (!new)
 		return (status = ERR_MEMORY);
 
 	new->data = data;
 
-	status = kernelLockGet(&list->lock);
+	status = kernelRwLockGet(&list->lock, RWLOCK_WRITE);
 	if (status < 0)
 	{
-		kernelFree(new);
+		kernelSlabFree(&itemCache, new);
 		return (status);
 	}
 
@@ -86,7 +98,7 @@ int kernelLinkedListAdd(kernelLinkedList *list, void *data)
 
 	list->numItems += 1;
 
-	kernelLockRelease(&list->lock);
+	kernelRwLockRelease(&list->lock, RWLOCK_WRITE);
 	return (status = 0);
 }
 
@@ -101,7 +113,7 @@ int kernelLinkedListRemove(kernelLinkedList *list, void *data)
 	if (!list || !data)
 		return (status = ERR_NULLPARAMETER);
 
-	status = kernelLockGet(&list->lock);
+	status = kernelRwLockGet(&list->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status);
 
@@ -122,15 +134,15 @@ int kernelLinkedListRemove(kernelLinkedList *list, void *data)
 
 			list->numItems -= 1;
 
-			kernelFree(iter);
-			kernelLockRelease(&list->lock);
+			kernelSlabFree(&itemCache, iter);
+			kernelRwLockRelease(&list->lock, RWLOCK_WRITE);
 			return (status = 0);
 		}
 
 		iter = iter->next;
 	}
 
-	kernelLockRelease(&list->lock);
+	kernelRwLockRelease(&list->lock, RWLOCK_WRITE);
 	return (status = ERR_NOSUCHENTRY);
 }
 
@@ -146,7 +158,7 @@ int kernelLinkedListClear(kernelLinkedList *list)
 	if (!list)
 		return (status = ERR_NULLPARAMETER);
 
-	status = kernelLockGet(&list->lock);
+	status = kernelRwLockGet(&list->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status);
 
@@ -155,13 +167,13 @@ int kernelLinkedListClear(kernelLinkedList *list)
 	while (iter)
 	{
 		next = iter->next;
-		kernelFree(iter);
+		kernelSlabFree(&itemCache, iter);
 		iter = next;
 	}
 
 	list->numItems = 0;
 
-	kernelLockRelease(&list->lock);
+	kernelRwLockRelease(&list->lock, RWLOCK_WRITE);
 	memset(list, 0, sizeof(kernelLinkedList));
 	return (status = 0);
 }
@@ -173,6 +185,9 @@ void *kernelLinkedListIterStart(kernelLinkedList *list,
 	// Starts an iteration through the linked list.  Returns the data value
 	// from the first item, if applicable.
 
+	void *data = NULL;
+	int locked = 0;
+
 	// Check params
 	if (!list || !iter)
 	{
@@ -180,12 +195,20 @@ void *kernelLinkedListIterStart(kernelLinkedList *list,
 		return (NULL);
 	}
 
+	// Iterating only needs the list in read mode, so any number of
+	// iterations can proceed at once.  If we can't get it (for example in an
+	// interrupt handler) carry on anyway, as before.
+	locked = (kernelRwLockGet(&list->lock, RWLOCK_READ) >= 0);
+
 	*iter = list->first;
 
-	if (!(*iter))
-		return (NULL);
-	else
-		return ((*iter)->data);
+	if (*iter)
+		data = (*iter)->data;
+
+	if (locked)
+		kernelRwLockRelease(&list->lock, RWLOCK_READ);
+
+	return (data);
 }
 
 
@@ -194,6 +217,9 @@ void *kernelLinkedListIterNext(kernelLinkedList *list,
 {
 	// Returns the data value from the next item in the list, if applicable.
 
+	void *data = NULL;
+	int locked = 0;
+
 	// Check params
 	if (!list || !iter)
 	{
@@ -204,16 +230,21 @@ void *kernelLinkedListIterNext(kernelLinkedList *list,
 	if (!(*iter))
 		return (NULL);
 
+	locked = (kernelRwLockGet(&list->lock, RWLOCK_READ) >= 0);
+
 	// Ensure that the current item hasn't been removed from the list
 	if (inList(list, *iter))
 		*iter = (*iter)->next;
 	else
 		*iter = list->first; // restart
 
-	if (!(*iter))
-		return (NULL);
-	else
-		return ((*iter)->data);
+	if (*iter)
+		data = (*iter)->data;
+
+	if (locked)
+		kernelRwLockRelease(&list->lock, RWLOCK_READ);
+
+	return (data);
 }
 
 
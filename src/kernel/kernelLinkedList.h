@@ -33,10 +33,11 @@ typedef struct _kernelLinkedListItem {
 typedef struct {
 	kernelLinkedListItem *first;
 	int numItems;
-	lock lock;
+	rwLock lock;
 
 } kernelLinkedList;
 
+int kernelLinkedListInitialize(void);
 int kernelLinkedListAdd(kernelLinkedList *, void *);
 int kernelLinkedListRemove(kernelLinkedList *, void *);
 int kernelLinkedListClear(kernelLinkedList *);
@@ -130,6 +130,7 @@ typedef struct _kernelDynamicLibrary {
 	void *data;
 	void *dataVirtual;
 	unsigned dataSize;
+	void *privateData;	// The private (relocated) pages, while linking
 	unsigned imageSize;
 	loaderSymbolTable *symbolTable;
 	kernelRelocationTable *relocationTable;
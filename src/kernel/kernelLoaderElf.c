@@ -951,35 +951,183 @@ static int layoutExecutable(void *loadAddress, processImage *execImage)
 }
 
 
+static int findRelocatedPages(kernelDynamicLibrary *library,
+	unsigned dataOffset, unsigned char *pages, int numPages)
+{
+	// Mark the library's data pages that relocations are done in.  They're
+	// different for every process, so they can't be shared.  Returns the
+	// number of pages marked.
+
+	unsigned relocOffset = (library->dataVirtual - library->codeVirtual);
+	unsigned offset = 0;
+	int numRelocated = 0;
+	int page, count;
+
+	memset(pages, 0, numPages);
+
+	for (count = 0; count < library->relocationTable->numRelocs; count ++)
+	{
+		offset = (dataOffset + ((unsigned)
+			library->relocationTable->relocations[count].offset -
+				relocOffset));
+
+		// A relocated value can straddle 2 pages
+		for (page = (offset / MEMORY_PAGE_SIZE);
+			page <= (int)((offset + (sizeof(int) - 1)) / MEMORY_PAGE_SIZE);
+			page ++)
+		{
+			if ((page < numPages) && !pages[page])
+			{
+				pages[page] = 1;
+				numRelocated += 1;
+			}
+		}
+	}
+
+	return (numRelocated);
+}
+
+
+static int mapLibraryData(int processId, void *virtual, void *sharedData,
+	unsigned privatePhysical, unsigned char *privatePages, int numPages)
+{
+	// Map the library's data pages at the virtual address.  The private ones
+	// are mapped in order from the private physical memory, and the others
+	// are the kernel's copy of the data, shared copy-on-write.  If it fails,
+	// nothing is left mapped.
+
+	int status = 0;
+	unsigned sharedPhysical = 0;
+	int mapped = 0;
+	int start, count;
+
+	sharedPhysical = kernelPageGetPhysical(KERNELPROCID, sharedData);
+	if (!sharedPhysical)
+		return (status = ERR_NOSUCHENTRY);
+
+	// Map runs of pages of the same kind
+	for (start = 0; start < numPages; start = count)
+	{
+		for (count = (start + 1); (count < numPages) &&
+			(privatePages[count] == privatePages[start]); count ++);
+
+		if (privatePages[start])
+		{
+			status = kernelPageMap(processId, privatePhysical,
+				(virtual + (start * MEMORY_PAGE_SIZE)),
+				((count - start) * MEMORY_PAGE_SIZE));
+			if (status >= 0)
+				mapped = count;
+
+			privatePhysical += ((count - start) * MEMORY_PAGE_SIZE);
+		}
+		else
+		{
+			status = kernelPageMap(processId, (sharedPhysical +
+				(start * MEMORY_PAGE_SIZE)),
+				(virtual + (start * MEMORY_PAGE_SIZE)),
+				((count - start) * MEMORY_PAGE_SIZE));
+			if (status >= 0)
+				mapped = count;
+
+			if (status >= 0)
+				status = kernelPageSetAttrs(processId, 0 /* clear */,
+					PAGEFLAG_WRITABLE, (virtual + (start * MEMORY_PAGE_SIZE)),
+					((count - start) * MEMORY_PAGE_SIZE));
+
+			if (status >= 0)
+				status = kernelPageSetAttrs(processId, 1 /* set */,
+					PAGEFLAG_COPYONWRITE,
+					(virtual + (start * MEMORY_PAGE_SIZE)),
+					((count - start) * MEMORY_PAGE_SIZE));
+		}
+
+		if (status < 0)
+		{
+			if (mapped)
+				kernelPageUnmap(processId, virtual,
+					(mapped * MEMORY_PAGE_SIZE));
+			return (status);
+		}
+	}
+
+	return (status = 0);
+}
+
+
 static int pullInLibrary(int processId, kernelDynamicLibrary *library,
 	loaderSymbolTable **symbols)
 {
 	// Load the named dynamic library, augment the supplied symbol table with
-	// the symbols from the library, and return a pointer to the library
+	// the symbols from the library, and return a pointer to the library.
+	//
+	// The process shares the kernel's copy of the library's data pages,
+	// copy-on-write, except for the ones that relocations are done in, which
+	// are copied now.
 
 	int status = 0;
+	int currentPid = kernelCurrentProcess->processId;
 	unsigned dataOffset = 0;
+	void *sharedData = NULL;
+	int dataPages = 0;
+	unsigned char *privatePages = NULL;
+	int numPrivate = 0;
+	void *privateMem = NULL;
+	unsigned privatePhysical = 0;
+	int codeMapped = 0;
+	int dataMapped = 0;
 	void *dataMem = NULL;
-	unsigned libraryDataPhysical = 0;
+	int count1, count2;
 
 	kernelDebug(debug_loader, "ELF pull in library %s", library->name);
 
 	// Calculate the offset of the data start within its memory page
 	dataOffset = ((unsigned) library->dataVirtual % MEMORY_PAGE_SIZE);
+	sharedData = (library->data - dataOffset);
+	dataPages = (kernelPageRoundUp(dataOffset + library->dataSize) /
+		MEMORY_PAGE_SIZE);
 
-	// Get memory for a copy of the library's data
-	dataMem = kernelMemoryGet(kernelPageRoundUp(dataOffset + library->dataSize),
-		"dynamic library data");
-	if (!dataMem)
+	// Find out which data pages get relocated
+	privatePages = kernelMalloc(dataPages);
+	if (!privatePages)
 		return (status = ERR_MEMORY);
 
-	// Get the physical address of the data memory
-	libraryDataPhysical =
-		kernelPageGetPhysical(kernelCurrentProcess->processId, dataMem);
-	if (!libraryDataPhysical)
+	numPrivate = findRelocatedPages(library, dataOffset, privatePages,
+		dataPages);
+
+	kernelDebug(debug_loader, "ELF library %s %d data pages, %d private",
+		library->name, dataPages, numPrivate);
+
+	if (numPrivate)
 	{
-		kernelMemoryRelease(dataMem);
-		return (status = ERR_MEMORY);
+		// Get memory for a copy of the private pages
+		privateMem = kernelMemoryGet((numPrivate * MEMORY_PAGE_SIZE),
+			"dynamic library data");
+		if (!privateMem)
+		{
+			status = ERR_MEMORY;
+			goto out;
+		}
+
+		privatePhysical = kernelPageGetPhysical(currentPid, privateMem);
+		if (!privatePhysical)
+		{
+			status = ERR_MEMORY;
+			goto out;
+		}
+
+		// Make a copy of the data
+		for (count1 = 0, count2 = 0; count1 < dataPages; count1 ++)
+		{
+			if (privatePages[count1])
+			{
+				memcpy((privateMem + (count2++ * MEMORY_PAGE_SIZE)),
+					(sharedData + (count1 * MEMORY_PAGE_SIZE)),
+					MEMORY_PAGE_SIZE);
+			}
+		}
+
+		kernelDebug(debug_loader, "ELF copied library data");
 	}
 
 	kernelDebug(debug_loader, "ELF library->codeVirtual=%p "
@@ -989,24 +1137,12 @@ static int pullInLibrary(int processId, kernelDynamicLibrary *library,
 		"library->dataSize=%u (0x%x)", library->dataVirtual,
 		library->dataSize, library->dataSize);
 
-	kernelDebug(debug_loader, "ELF got libraryDataPhysical=0x%08x "
-		"dataOffset=%u", libraryDataPhysical, dataOffset);
-
-	kernelDebug(debug_loader, "ELF copy data from %p to %p (%p + %u) size %u",
-		library->data, (dataMem + dataOffset), dataMem, dataOffset,
-		library->dataSize);
-
-	// Make a copy of the data
-	memcpy((dataMem + dataOffset), library->data, library->dataSize);
-
-	kernelDebug(debug_loader, "ELF copied library data");
-
 	// Find enough free pages for the whole library image
 	library->codeVirtual = kernelPageFindFree(processId, library->imageSize);
 	if (!library->codeVirtual)
 	{
-		kernelMemoryRelease(dataMem);
-		return (status = ERR_MEMORY);
+		status = ERR_MEMORY;
+		goto out;
 	}
 
 	library->dataVirtual += (unsigned) library->codeVirtual;
@@ -1018,54 +1154,112 @@ static int pullInLibrary(int processId, kernelDynamicLibrary *library,
 	status = kernelPageMap(processId, library->codePhysical,
 		library->codeVirtual, kernelPageRoundUp(library->codeSize));
 	if (status < 0)
-	{
-		kernelMemoryRelease(dataMem);
-		return (status);
-	}
+		goto out;
+
+	codeMapped = 1;
 
 	kernelDebug(debug_loader, "ELF mapped library code");
 
-	// Map the data memory into the process' address space, right after the
-	// end of the code.
-	status = kernelPageMap(processId, libraryDataPhysical,
-		(library->dataVirtual - dataOffset),
-		kernelPageRoundUp(library->dataSize));
+	// Map the data into the process' address space, right after the end of
+	// the code.
+	status = mapLibraryData(processId, (library->dataVirtual - dataOffset),
+		sharedData, privatePhysical, privatePages, dataPages);
 	if (status < 0)
+		goto out;
+
+	dataMapped = 1;
+	library->privateData = NULL;
+
+	if (processId == currentPid)
 	{
-		kernelMemoryRelease(dataMem);
-		return (status);
+		// We can do the relocations where it is
+		dataMem = (library->dataVirtual - dataOffset);
+	}
+	else
+	{
+		// Map the data the same way in this process, so that we can do the
+		// relocations
+		dataMem = kernelPageFindFree(currentPid,
+			(dataPages * MEMORY_PAGE_SIZE));
+		if (!dataMem)
+		{
+			status = ERR_MEMORY;
+			goto out;
+		}
+
+		status = mapLibraryData(currentPid, dataMem, sharedData,
+			privatePhysical, privatePages, dataPages);
+		if (status < 0)
+		{
+			dataMem = NULL;
+			goto out;
+		}
+
+		// Remember where the first private page is, so that the process
+		// can be made to own the private memory afterwards
+		for (count1 = 0; count1 < dataPages; count1 ++)
+		{
+			if (privatePages[count1])
+			{
+				library->privateData = (dataMem +
+					(count1 * MEMORY_PAGE_SIZE));
+				break;
+			}
+		}
 	}
 
-	// Adjust the library's data pointer, so that it points to our copy (plus
-	// the offset to the actual data start)
+	// Adjust the library's data pointer, so that it points to our mapping
+	// (plus the offset to the actual data start)
 	library->data = (dataMem + dataOffset);
 
-	kernelDebug(debug_loader, "ELF mapped library data copy to %p, "
+	kernelDebug(debug_loader, "ELF mapped library data to %p, "
 		"library->data=%p", (library->dataVirtual - dataOffset),
 		library->data);
 
 	// Code should be read-only
-	kernelPageSetAttrs(processId, 0, PAGEFLAG_WRITABLE, library->codeVirtual,
-			 kernelPageRoundUp(library->codeSize));
+	status = kernelPageSetAttrs(processId, 0, PAGEFLAG_WRITABLE,
+		library->codeVirtual, kernelPageRoundUp(library->codeSize));
 	if (status < 0)
-	{
-		kernelMemoryRelease(dataMem);
-		return (status);
-	}
+		goto out;
 
 	kernelDebug(debug_loader, "ELF set code page attrs");
 
 	// Resolve symbols
 	status = resolveLibrarySymbols(symbols, library);
+	if (status < 0)
+		goto out;
+
+	kernelDebug(debug_loader, "ELF resolved library symbols");
+
+	// The private pages are mapped where they're needed now
+	if (privateMem)
+		kernelPageUnmap(currentPid, privateMem,
+			(numPrivate * MEMORY_PAGE_SIZE));
+
+	status = 0;
+
+out:
 	if (status < 0)
 	{
-		kernelMemoryRelease(dataMem);
-		return (status);
+		// Take down the mappings before the private memory is released, so
+		// that none of them are left pointing at it
+		if (dataMem && (processId != currentPid))
+			kernelPageUnmap(currentPid, dataMem,
+				(dataPages * MEMORY_PAGE_SIZE));
+		if (dataMapped)
+			kernelPageUnmap(processId, (library->dataVirtual - dataOffset),
+				(dataPages * MEMORY_PAGE_SIZE));
+		if (codeMapped)
+			kernelPageUnmap(processId, library->codeVirtual,
+				kernelPageRoundUp(library->codeSize));
+		if (privateMem)
+			kernelMemoryRelease(privateMem);
+		library->privateData = NULL;
 	}
 
-	kernelDebug(debug_loader, "ELF resolved library symbols");
+	kernelFree(privatePages);
 
-	return (status = 0);
+	return (status);
 }
 
 
@@ -1112,6 +1306,7 @@ static int link(int processId, void *loadAddress, processImage *execImage,
 
 	int status = 0;
 	elfLibraryArray libArray;
+	kernelDynamicLibrary *library = NULL;
 	kernelRelocationTable *relocations = NULL;
 	int count;
 
@@ -1166,17 +1361,20 @@ static int link(int processId, void *loadAddress, processImage *execImage,
 		return (status);
 	}
 
-	// Make the process own the memory for each library's data, and unmap it
-	// from the memory of this process.
+	// Make the process own the memory for each library's private data, and
+	// unmap the data from the memory of this process.
 	for (count = 0; count < libArray.numLibraries; count ++)
 	{
-		kernelMemoryChangeOwner(kernelCurrentProcess->processId, processId, 0,
-			(void *) kernelPageRoundDown(libArray.libraries[count].data),
-			NULL);
+		library = &libArray.libraries[count];
+
+		if (library->privateData)
+			kernelMemoryChangeOwner(kernelCurrentProcess->processId,
+				processId, 0, library->privateData, NULL);
 
-		kernelPageUnmap(kernelCurrentProcess->processId, (void *)
-			kernelPageRoundDown(libArray.libraries[count].data),
-			kernelPageRoundUp(libArray.libraries[count].dataSize));
+		kernelPageUnmap(kernelCurrentProcess->processId,
+			(void *) kernelPageRoundDown(library->data),
+			kernelPageRoundUp(((unsigned) library->data % MEMORY_PAGE_SIZE) +
+				library->dataSize));
 	}
 
 	kernelFree(libArray.libraries);
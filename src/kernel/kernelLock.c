@@ -34,6 +34,79 @@
 #include <sys/processor.h>
 
 
+static int readerAlive(int processId)
+{
+	// Returns 1 unless the process holding a reader-writer lock in read mode
+	// no longer exists, or has finished
+
+	processState tmpState;
+
+	if (kernelMultitaskerGetProcessState(processId, &tmpState) < 0)
+		return (0);
+
+	if ((tmpState == proc_finished) || (tmpState == proc_zombie))
+		return (0);
+
+	return (1);
+}
+
+
+static void waitReaders(rwLock *waitLock, int maxReaders)
+{
+	// Wait until no more than the given number of processes hold the lock in
+	// read mode.  Readers that have died are dropped along the way.  Called
+	// with the write lock held, and interrupts disabled.
+
+	int count;
+
+	if (waitLock->readers <= maxReaders)
+		return;
+
+	while (1)
+	{
+		for (count = 0; count < RWLOCK_MAX_READERS; count ++)
+		{
+			if (waitLock->readerIds[count] &&
+				!readerAlive(waitLock->readerIds[count]))
+			{
+				waitLock->readerIds[count] = 0;
+				waitLock->readers -= 1;
+			}
+		}
+
+		if (waitLock->readers <= maxReaders)
+			break;
+
+		// Readers wake us as they finish
+		kernelMultitaskerLockWait((lock *) &waitLock->readersDone,
+			LOCK_VERIFY_MS);
+	}
+
+	kernelMultitaskerLockCancel((lock *) &waitLock->readersDone);
+}
+
+
+static int readerAdd(rwLock *addLock, int processId)
+{
+	// Record a process as holding the lock in read mode.  Called with
+	// interrupts disabled.
+
+	int count;
+
+	for (count = 0; count < RWLOCK_MAX_READERS; count ++)
+	{
+		if (!addLock->readerIds[count])
+		{
+			addLock->readerIds[count] = processId;
+			addLock->readers += 1;
+			return (0);
+		}
+	}
+
+	return (ERR_NOFREE);
+}
+
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 //
@@ -48,24 +121,16 @@ int kernelLockGet(lock *getLock)
 	// particular process.  Usually the lock will be part of a data structure
 	// of some sort.
 
-	// The function scans the list of lock structures looking for an existing
-	// lock on the same resource.  If there is no such lock, a lock structure
-	// is filled and the lock is granted.
+	// If the lock is free, it's granted with a single atomic operation.
 
 	// If a lock is already held by another process at the time of the
-	// request, this function will add the requesting process' id to the list
-	// of 'waiters' in the lock structure, and go into a multitasker yield()
-	// loop until the lock can be obtained -- on a first come, first served
-	// basis for the time being.  Waiters wait in a queue.
-
-	// As a safeguard, this loop will make sure that the holding process is
-	// still viable (i.e. it still exists, and is not stopped or anything
-	// like that).
+	// request, the requesting process goes to sleep until the lock is
+	// released.  Waiters are woken -- and the lock is handed directly to
+	// them -- on a first come, first served basis.
 
-	// This yielding loop serves the dual purpose of maintaining exclusivity
-	// and also allows the first process to terminate more quickly, since it
-	// will not be contending with other resource-bound processes for processor
-	// time.
+	// As a safeguard, waiters wake up periodically to make sure that the
+	// holding process is still viable (i.e. it still exists, and is not
+	// stopped or anything like that).
 
 	// The void* argument passed to the function must be a pointer to some
 	// identifiable part of the resource (shared by all requesting
@@ -89,61 +154,98 @@ int kernelLockGet(lock *getLock)
 	if (getLock->processId == currentProcId)
 		return (status = 0);
 
-	while (1)
-	{
-		// This is the loop of death, where the requesting process will live
-		// until it is allowed to use the resource
-
-		// Disable interrupts from here, so that we don't get the lock granted
-		// or released out from under us.
-		processorSuspendInts(interrupts);
+	// The fast path, if nobody holds it
+	processorLock(getLock->processId, currentProcId);
+	if (getLock->processId == currentProcId)
+		return (status = 0);
 
-		processorLock(getLock->processId, currentProcId);
+	if (kernelProcessingInterrupt())
+		// We can't make the interrupt service function wait
+		return (status = ERR_BUSY);
 
-		processorRestoreInts(interrupts);
+	// Disable interrupts from here, so that we don't get the lock granted or
+	// released out from under us.
+	processorSuspendInts(interrupts);
 
+	while (1)
+	{
+		processorLock(getLock->processId, currentProcId);
 		if (getLock->processId == currentProcId)
 			break;
 
 		// Some other process has locked the resource.  Make sure the process
 		// is still alive, and that it is not sleeping, and that it has not
-		// become stopped or zombie.  If it has, we will remove the lock given
-		// to that process.
+		// become stopped or zombie.  If it has, we will take the lock away,
+		// and give it to whoever has been waiting longest.
 		if (!kernelLockVerify(getLock))
 		{
-			// We might give the lock to the requesting process at the the
-			// start of the next loop.  Clear the current lock and restart the
-			// loop.
-			getLock->processId = 0;
+			getLock->processId = kernelMultitaskerLockWake(getLock);
 			continue;
 		}
 
-		// We didn't get the lock.
+		// Sleep until the lock is handed to us, or it's time to check on the
+		// holder again
+		kernelMultitaskerLockWait(getLock, LOCK_VERIFY_MS);
 
-		if (kernelProcessingInterrupt())
-			// We can't grant this lock to the interrupt service function
-			return (status = ERR_BUSY);
-
-		// This process will now have to continue waiting until the lock has
-		// been released or becomes invalid
-
-		// Yield this time slice back to the scheduler while the process
-		// waits for the lock
-		kernelMultitaskerYield();
+		if (getLock->processId == currentProcId)
+			break;
 
 		// Loop again
 	}
 
+	// If we took the lock ourselves, rather than having it handed to us, we
+	// still have a place in its queue
+	kernelMultitaskerLockCancel(getLock);
+
+	processorRestoreInts(interrupts);
+
 	return (status = 0);
 }
 
 
+int kernelLockTryGet(lock *getLock)
+{
+	// Like kernelLockGet(), but if the lock is held by another process,
+	// return ERR_BUSY instead of waiting for it.  For code (such as the idle
+	// thread) that must never sleep.
+
+	int status = 0;
+	int currentProcId = 0;
+
+	// Make sure the pointer we were given is not NULL
+	if (!getLock)
+		return (status = ERR_NULLPARAMETER);
+
+	// Get the process Id of the current process
+	currentProcId = kernelMultitaskerGetCurrentProcessId();
+	if (currentProcId < 0)
+		return (currentProcId);
+
+	if (getLock->processId == currentProcId)
+		return (status = 0);
+
+	// If others are waiting for it, it's theirs first, even if it's free
+	// right now (it might be on its way to one of them)
+	if (kernelMultitaskerLockWaiting(getLock))
+		return (status = ERR_BUSY);
+
+	processorLock(getLock->processId, currentProcId);
+	if (getLock->processId == currentProcId)
+		return (status = 0);
+
+	return (status = ERR_BUSY);
+}
+
+
 int kernelLockRelease(lock *relLock)
 {
 	// This function corresponds to the lock function.  It enables a
-	// process to release a resource that it had previously locked.
+	// process to release a resource that it had previously locked.  If any
+	// other processes are waiting for it, the lock is handed to the one that
+	// has been waiting longest.
 
 	int status = 0;
+	int interrupts = 0;
 	int currentProcId = 0;
 
 	// Make sure the pointer we were given is not NULL
@@ -158,15 +260,22 @@ int kernelLockRelease(lock *relLock)
 		return (currentProcId);
 
 	// Make sure that the current lock, if any, really belongs to this process.
-
-	if (relLock->processId == currentProcId)
-	{
-		relLock->processId = 0;
-		return (status = 0);
-	}
-	else
+	if (relLock->processId != currentProcId)
 		// It is not locked by this process
 		return (status = ERR_NOLOCK);
+
+	processorSuspendInts(interrupts);
+
+	// Hand it to whoever has been waiting longest.  If there's nobody, the
+	// lock simply becomes free.
+	relLock->processId = kernelMultitaskerLockWake(relLock);
+
+	// If we were running at a priority inherited from waiters, give it up
+	kernelMultitaskerLockRestorePriority();
+
+	processorRestoreInts(interrupts);
+
+	return (status = 0);
 }
 
 
@@ -206,3 +315,197 @@ int kernelLockVerify(lock *verLock)
 		return (status = 1);
 }
 
+
+int kernelRwLockGet(rwLock *getLock, int mode)
+{
+	// Obtain a reader-writer lock in read (shared) or write (exclusive) mode.
+	// Readers only need the write lock long enough to register themselves,
+	// so they don't wait for each other, only for writers.  A writer takes
+	// the write lock, which keeps out any new readers, and then waits for
+	// the existing ones to finish.  A process that holds the lock in write
+	// mode can also get it in read mode, but not the other way around.
+
+	int status = 0;
+	int interrupts = 0;
+	int currentProcId = 0;
+
+	// Make sure the pointer we were given is not NULL
+	if (!getLock)
+		return (status = ERR_NULLPARAMETER);
+
+	currentProcId = kernelMultitaskerGetCurrentProcessId();
+	if (currentProcId < 0)
+		return (currentProcId);
+
+	if (mode == RWLOCK_READ)
+	{
+		if (getLock->writeLock.processId == currentProcId)
+		{
+			// We're the writer
+			processorSuspendInts(interrupts);
+			status = readerAdd(getLock, currentProcId);
+			processorRestoreInts(interrupts);
+			return (status);
+		}
+
+		status = kernelLockGet((lock *) &getLock->writeLock);
+		if (status < 0)
+			return (status);
+
+		processorSuspendInts(interrupts);
+
+		status = readerAdd(getLock, currentProcId);
+		if ((status < 0) && !kernelProcessingInterrupt())
+		{
+			// There are as many readers as we can record.  Wait for one to
+			// finish.
+			waitReaders(getLock, (RWLOCK_MAX_READERS - 1));
+			status = readerAdd(getLock, currentProcId);
+		}
+
+		processorRestoreInts(interrupts);
+
+		kernelLockRelease((lock *) &getLock->writeLock);
+		return (status);
+	}
+
+	status = kernelLockGet((lock *) &getLock->writeLock);
+	if (status < 0)
+		return (status);
+
+	processorSuspendInts(interrupts);
+
+	if (getLock->readers)
+	{
+		if (kernelProcessingInterrupt())
+		{
+			processorRestoreInts(interrupts);
+			kernelLockRelease((lock *) &getLock->writeLock);
+			return (status = ERR_BUSY);
+		}
+
+		// Wait for the readers to finish
+		waitReaders(getLock, 0);
+	}
+
+	processorRestoreInts(interrupts);
+
+	return (status = 0);
+}
+
+
+int kernelRwLockRelease(rwLock *relLock, int mode)
+{
+	// Release a reader-writer lock obtained with kernelRwLockGet(), in the
+	// same mode
+
+	int status = ERR_NOLOCK;
+	int interrupts = 0;
+	int currentProcId = 0;
+	int count;
+
+	// Make sure the pointer we were given is not NULL
+	if (!relLock)
+		return (status = ERR_NULLPARAMETER);
+
+	if (mode != RWLOCK_READ)
+		return (status = kernelLockRelease((lock *) &relLock->writeLock));
+
+	currentProcId = kernelMultitaskerGetCurrentProcessId();
+	if (currentProcId < 0)
+		return (currentProcId);
+
+	processorSuspendInts(interrupts);
+
+	for (count = 0; count < RWLOCK_MAX_READERS; count ++)
+	{
+		if (relLock->readerIds[count] == currentProcId)
+		{
+			relLock->readerIds[count] = 0;
+			relLock->readers -= 1;
+
+			// Wake anyone waiting for readers to finish, so that they can
+			// check again
+			kernelMultitaskerLockWake((lock *) &relLock->readersDone);
+
+			status = 0;
+			break;
+		}
+	}
+
+	processorRestoreInts(interrupts);
+
+	return (status);
+}
+
+
+int kernelRwLockHeld(rwLock *testLock)
+{
+	// Returns 1 if the current process holds the reader-writer lock, in
+	// either mode, or 0 otherwise
+
+	int currentProcId = 0;
+	int count;
+
+	// Make sure the pointer we were given is not NULL
+	if (!testLock)
+		return (0);
+
+	currentProcId = kernelMultitaskerGetCurrentProcessId();
+
+	if (testLock->writeLock.processId == currentProcId)
+		return (1);
+
+	for (count = 0; count < RWLOCK_MAX_READERS; count ++)
+	{
+		if (testLock->readerIds[count] == currentProcId)
+			return (1);
+	}
+
+	return (0);
+}
+
+
+void kernelSpinLockGet(spinLock *getLock)
+{
+	// Obtain a spin lock.  Unlike the locks above, this doesn't belong to a
+	// process, and a waiter doesn't yield -- it busy-waits, so it's only for
+	// short critical sections that might be entered on several processors
+	// at once.  Interrupts are disabled on this processor until the lock is
+	// released, and spin locks must be released in the reverse order in
+	// which they were obtained.
+
+	int interrupts = 0;
+	int locked = 0;
+
+	processorSuspendInts(interrupts);
+
+	while (1)
+	{
+		locked = 1;
+		processorAtomicSwap(&getLock->locked, locked);
+		if (!locked)
+			break;
+
+		// Wait until it looks free before trying again, so that we're not
+		// hammering the bus with locked operations
+		while (getLock->locked)
+			processorPause();
+	}
+
+	getLock->interrupts = interrupts;
+}
+
+
+void kernelSpinLockRelease(spinLock *relLock)
+{
+	// Release a spin lock, and restore the interrupt state from the time it
+	// was obtained
+
+	int interrupts = relLock->interrupts;
+	int locked = 0;
+
+	processorAtomicSwap(&relLock->locked, locked);
+
+	processorRestoreInts(interrupts);
+}
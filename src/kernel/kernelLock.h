@@ -26,10 +26,48 @@
 
 #if !defined(_KERNELLOCK_H)
 
+// How often a process waiting for a lock checks that the holder is still
+// viable
+#define LOCK_VERIFY_MS		100
+
+// How many processes can hold a reader-writer lock in read mode at once
+#define RWLOCK_MAX_READERS	16
+
+// A reader-writer lock.  Several processes can hold it in read mode at once,
+// or one process in write mode.  Writers queue on the 'writeLock' (as do
+// readers while there's a writer), and the writer that holds it waits for
+// any remaining readers to finish.  The readers are recorded, so that one
+// that dies can't hold up the writers forever.
+typedef volatile struct {
+	lock writeLock;
+	int readers;
+	int readerIds[RWLOCK_MAX_READERS];
+	lock readersDone;
+
+} rwLock;
+
+#define RWLOCK_READ			0
+#define RWLOCK_WRITE		1
+
+// A spin lock, for short critical sections that must be protected from other
+// processors as well as from interrupts on the local one (such as the
+// scheduler's run queues).  Interrupts are disabled while it's held.
+typedef volatile struct {
+	int locked;
+	int interrupts;
+
+} spinLock;
+
 // Functions exported by kernelLock.c
 int kernelLockGet(lock *);
+int kernelLockTryGet(lock *);
 int kernelLockRelease(lock *);
 int kernelLockVerify(lock *);
+int kernelRwLockGet(rwLock *, int);
+int kernelRwLockRelease(rwLock *, int);
+int kernelRwLockHeld(rwLock *);
+void kernelSpinLockGet(spinLock *);
+void kernelSpinLockRelease(spinLock *);
 
 #define _KERNELLOCK_H
 #endif
@@ -73,12 +73,9 @@ void *_kernelMalloc(unsigned size, const char *function)
 	if (kernelProcessingInterrupt())
 		return (address = NULL);
 
+	// The memory is cleared for us
 	address = _doMalloc(size, function);
 
-	// If we got the memory, clear it.
-	if (address)
-		memset(address, 0, size);
-
 	return (address);
 }
 
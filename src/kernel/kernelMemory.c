@@ -24,28 +24,78 @@
 // it's a speedy algorithm, and because supposedly "best-fit" and
 // "worst-fit" don't really provide a significant memory utilization
 // advantage but do imply significant overhead.
+//
+// Free physical memory is tracked in a bitmap with one bit per block.  On
+// top of that there's a summary tree, in which each node records the free
+// runs at the start and end of its range, and the longest free run within
+// it.  That lets us find the first free range of a given size by descending
+// the tree, rather than testing the bitmap one bit at a time.
+//
+// When the system is idle, the idle thread clears free memory into a pool,
+// so that allocations which can be satisfied from the pool don't have to be
+// cleared while the caller waits.
+//
+// Processes can also reserve ranges of virtual memory that only get physical
+// memory when they're touched.  The page fault handler calls us to populate
+// them, one page at a time.  Files can be mapped the same way, with pages
+// read from the file as they're touched.
+//
+// If a linux-swap partition is configured, the populated pages of those
+// reservations can be paged out when memory runs short.  A clock sweeps the
+// pages, giving each one that's been accessed another chance, and takes the
+// first that hasn't.  Unwritten pages are just dropped; the rest go to swap,
+// and are read back by the page fault handler.
 
 #include "kernelMemory.h"
+#include "kernelDisk.h"
 #include "kernelError.h"
+#include "kernelFile.h"
+#include "kernelFilesystem.h"
 #include "kernelInterrupt.h"
 #include "kernelLock.h"
+#include "kernelLog.h"
 #include "kernelMain.h"
 #include "kernelMalloc.h"
 #include "kernelMultitasker.h"
 #include "kernelPage.h"
 #include "kernelParameters.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/processor.h>
 
 static volatile int initialized = 0;
 static lock memoryLock;
 static volatile unsigned totalMemory = 0;
-static memoryBlock * volatile usedBlockList[MAXMEMORYBLOCKS];
+static kernelMemoryBlock *blockHash[MEMORY_BLOCK_BUCKETS];
+static kernelMemoryBlock *procBlocks[MEMORY_PROC_BUCKETS];
+static kernelMemoryBlock * volatile freeRecords = NULL;
+static volatile int numFreeRecords = 0;
+static volatile int growingRecords = 0;
 static volatile int usedBlocks = 0;
 static unsigned char * volatile freeBlockBitmap = NULL;
 static volatile int totalBlocks = 0;
+static kernelFreeSummary * volatile freeBlockSummary = NULL;
+static volatile int summaryLeaves = 0;
 static volatile unsigned totalFree = 0;
 static volatile unsigned totalUsed = 0;
+static kernelMemoryBlock *zeroPool[MEMORY_ZERO_POOL_CHUNKS];
+static volatile int zeroPoolChunks = 0;
+static volatile unsigned zeroPoolSize = 0;
+static volatile unsigned fillPhysical = 0;
+static volatile unsigned fillCleared = 0;
+static kernelMemoryReservation *reservations = NULL;
+static volatile unsigned reservedMemory = 0;
+static volatile unsigned residentMemory = 0;
+static kernelMemoryReservation *clockRes = NULL;
+static volatile unsigned clockOffset = 0;
+static kernelDisk *swapDisk = NULL;
+static lock swapLock;
+static unsigned char *swapBitmap = NULL;
+static volatile unsigned swapSlots = 0;
+static volatile unsigned swapUsable = 0;
+static volatile unsigned swapFree = 0;
+static volatile unsigned swapNext = 0;
 
 // This structure can be used to "reserve" memory blocks so that they
 // will be marked as "used" by the memory manager and then left alone.
@@ -76,20 +126,326 @@ static memoryBlock reservedBlocks[] =
 	// dependent upon the previous three
 	{ KERNELPROCID, MEMORYDESC_FREEBITMAP, 0, 0 },
 
+	// The summary tree of the free memory bitmap, which follows it
+	{ KERNELPROCID, MEMORYDESC_FREESUMMARY, 0, 0 },
+
 	{ 0, "", 0, 0 }
 };
 
 
+static inline int blockIsFree(unsigned block)
+{
+	return ((block < (unsigned) totalBlocks) &&
+		!(freeBlockBitmap[block / 8] & (0x80 >> (block % 8))));
+}
+
+
+static void summaryLeaf(int leaf)
+{
+	// Recalculate one leaf of the free-block summary from the bitmap
+
+	kernelFreeSummary *node = &freeBlockSummary[summaryLeaves + leaf];
+	unsigned block = (leaf * MEMORY_SUMMARY_BLOCKS);
+	unsigned run = 0;
+	unsigned count;
+
+	node->prefix = 0;
+	node->largest = 0;
+
+	for (count = 0; count < MEMORY_SUMMARY_BLOCKS; count ++, block ++)
+	{
+		if (!blockIsFree(block))
+		{
+			run = 0;
+			continue;
+		}
+
+		run += 1;
+
+		if (run == (count + 1))
+			node->prefix = run;
+		if (run > node->largest)
+			node->largest = run;
+	}
+
+	node->suffix = run;
+}
+
+
+static void summaryCombine(int index, unsigned childBlocks)
+{
+	// Recalculate a non-leaf node of the free-block summary from its two
+	// children, each of which covers childBlocks blocks
+
+	kernelFreeSummary *node = &freeBlockSummary[index];
+	kernelFreeSummary *left = &freeBlockSummary[index * 2];
+	kernelFreeSummary *right = &freeBlockSummary[(index * 2) + 1];
+
+	node->prefix = left->prefix;
+	if (left->prefix == childBlocks)
+		node->prefix += right->prefix;
+
+	node->suffix = right->suffix;
+	if (right->suffix == childBlocks)
+		node->suffix += left->suffix;
+
+	node->largest = max(left->largest, right->largest);
+	node->largest = max(node->largest, (left->suffix + right->prefix));
+}
+
+
+static void summaryUpdate(unsigned firstBlock, unsigned lastBlock)
+{
+	// The bitmap has changed for the range of blocks.  Recalculate the
+	// summary leaves that cover it, and then their parents, one level at a
+	// time up to the root.
+
+	int first = (summaryLeaves + (firstBlock / MEMORY_SUMMARY_BLOCKS));
+	int last = (summaryLeaves + (lastBlock / MEMORY_SUMMARY_BLOCKS));
+	unsigned childBlocks = MEMORY_SUMMARY_BLOCKS;
+	int count;
+
+	for (count = first; count <= last; count ++)
+		summaryLeaf(count - summaryLeaves);
+
+	while (first > 1)
+	{
+		first /= 2;
+		last /= 2;
+
+		for (count = first; count <= last; count ++)
+			summaryCombine(count, childBlocks);
+
+		childBlocks *= 2;
+	}
+}
+
+
+static int summaryFind(int index, unsigned start, unsigned blocks,
+	unsigned from, unsigned wanted, unsigned *run)
+{
+	// Descend the free-block summary from the node, which covers the blocks
+	// from 'start' to 'start + blocks', looking for the first run of
+	// 'wanted' free blocks that begins at or after block 'from'.  'run' is
+	// the number of free blocks immediately preceding this node.  Returns
+	// the first block of the run, or negative if it's not in this node.
+
+	kernelFreeSummary *node = &freeBlockSummary[index];
+	unsigned block = 0;
+	int found = 0;
+
+	// Skip nodes entirely before the starting point
+	if ((start + blocks) <= from)
+		return (found = -1);
+
+	if (start >= from)
+	{
+		// Does the run carried over from the previous node(s) reach far
+		// enough into this one?
+		if ((*run + node->prefix) >= wanted)
+			return (found = (start - *run));
+
+		// If there's no large enough run inside this node, we can skip it,
+		// but carry any free blocks at the end over to the next one
+		if (node->largest < wanted)
+		{
+			if (node->prefix == blocks)
+				*run += blocks;
+			else
+				*run = node->suffix;
+
+			return (found = -1);
+		}
+	}
+
+	if (index >= summaryLeaves)
+	{
+		// This is a leaf, so look through its bits
+		for (block = max(start, from); block < (start + blocks); block ++)
+		{
+			if (!blockIsFree(block))
+			{
+				*run = 0;
+				continue;
+			}
+
+			*run += 1;
+			if (*run >= wanted)
+				return (found = ((block - *run) + 1));
+		}
+
+		return (found = -1);
+	}
+
+	found = summaryFind((index * 2), start, (blocks / 2), from, wanted, run);
+	if (found >= 0)
+		return (found);
+
+	return (found = summaryFind(((index * 2) + 1), (start + (blocks / 2)),
+		(blocks / 2), from, wanted, run));
+}
+
+
+static unsigned markBlocks(unsigned firstBlock, unsigned lastBlock, int used)
+{
+	// Mark the range of blocks in the free-block bitmap as used or free, and
+	// update the summary to match.  Returns the number of blocks that
+	// actually changed state.
+
+	unsigned char *byte = NULL;
+	unsigned char mask = 0;
+	unsigned changed = 0;
+	unsigned block = firstBlock;
+	unsigned char bits = 0;
+	unsigned setBits = 0;
+
+	while (block <= lastBlock)
+	{
+		byte = &freeBlockBitmap[block / 8];
+
+		if (!(block % 8) && ((block + 7) <= lastBlock))
+		{
+			// Do a whole byte at a time.  Count the bits that were already
+			// set.
+			for (bits = *byte, setBits = 0; bits; setBits ++)
+				bits &= (bits - 1);
+
+			if (used)
+			{
+				changed += (8 - setBits);
+				*byte = 0xFF;
+			}
+			else
+			{
+				changed += setBits;
+				*byte = 0;
+			}
+
+			block += 8;
+			continue;
+		}
+
+		mask = (0x80 >> (block % 8));
+
+		if (used && !(*byte & mask))
+		{
+			*byte |= mask;
+			changed += 1;
+		}
+		else if (!used && (*byte & mask))
+		{
+			*byte &= ~mask;
+			changed += 1;
+		}
+
+		block += 1;
+	}
+
+	summaryUpdate(firstBlock, lastBlock);
+
+	return (changed);
+}
+
+
+static inline int blockBucket(unsigned start)
+{
+	return ((start / MEMORY_BLOCK_SIZE) % MEMORY_BLOCK_BUCKETS);
+}
+
+
+static void procChainAdd(kernelMemoryBlock *block)
+{
+	// Add a used block to the hash chain for its owning process
+
+	int bucket = (block->block.processId % MEMORY_PROC_BUCKETS);
+
+	block->procPrev = NULL;
+	block->procNext = procBlocks[bucket];
+	if (block->procNext)
+		block->procNext->procPrev = block;
+	procBlocks[bucket] = block;
+}
+
+
+static void procChainRemove(kernelMemoryBlock *block)
+{
+	// Remove a used block from the hash chain for its owning process
+
+	int bucket = (block->block.processId % MEMORY_PROC_BUCKETS);
+
+	if (block->procPrev)
+		block->procPrev->procNext = block->procNext;
+	else
+		procBlocks[bucket] = block->procNext;
+
+	if (block->procNext)
+		block->procNext->procPrev = block->procPrev;
+}
+
+
+static void addRecords(kernelMemoryBlock *records, int number)
+{
+	// Add an array of block records to the free list
+
+	int count;
+
+	for (count = 0; count < number; count ++)
+	{
+		records[count].next = freeRecords;
+		freeRecords = &records[count];
+	}
+
+	numFreeRecords += number;
+}
+
+
+static void growRecords(void)
+{
+	// If we're running low on free used block records, allocate another
+	// page of them.  This must be called without the memory lock held,
+	// since getting the page needs the lock (and some of the remaining
+	// records).
+
+	kernelMemoryBlock *records = NULL;
+
+	if (growingRecords || (numFreeRecords >= MEMORY_MIN_FREE_RECORDS))
+		return;
+
+	growingRecords = 1;
+
+	records = kernelMemoryGetSystem(MEMORY_BLOCK_SIZE, MEMORYDESC_USEDBLOCKS);
+	if (records)
+	{
+		if (kernelLockGet(&memoryLock) >= 0)
+		{
+			addRecords(records, (MEMORY_BLOCK_SIZE /
+				sizeof(kernelMemoryBlock)));
+			kernelLockRelease(&memoryLock);
+		}
+		else
+		{
+			kernelMemoryReleaseSystem(records);
+		}
+	}
+
+	growingRecords = 0;
+}
+
+
+static void releaseZeroPool(void);
+
+
 static int allocateBlock(int processId, unsigned start, unsigned end,
 	const char *description)
 {
-	// This function will allocate a block in the used block list, mark the
+	// This function will allocate a used block record, mark the
 	// corresponding blocks as allocated in the free-block bitmap, and adjust
 	// the totalUsed and totalFree values accordingly.
 
 	int status = 0;
-	unsigned lastBit = 0;
-	unsigned count;
+	kernelMemoryBlock *block = NULL;
+	int bucket = 0;
+	unsigned changed = 0;
 
 	// The description pointer is allowed to be NULL
 
@@ -104,40 +460,51 @@ static int allocateBlock(int processId, unsigned start, unsigned end,
 	if ((start >= totalMemory) || (end >= totalMemory))
 		return (status = ERR_INVALID);
 
-	// Clear the memory occupied by the first unused memory block structure
-	memset((void *) usedBlockList[usedBlocks], 0, sizeof(memoryBlock));
+	// Take the first free block record
+	block = freeRecords;
+	if (!block)
+		return (status = ERR_MEMORY);
+
+	freeRecords = block->next;
+	numFreeRecords -= 1;
+
+	// Clear it
+	memset(block, 0, sizeof(kernelMemoryBlock));
 
 	// Assign the appropriate values to the block structure
-	usedBlockList[usedBlocks]->processId = processId;
-	usedBlockList[usedBlocks]->startLocation = start;
-	usedBlockList[usedBlocks]->endLocation = end;
+	block->block.processId = processId;
+	block->block.startLocation = start;
+	block->block.endLocation = end;
 
 	if (description)
 	{
-		strncpy((char *) usedBlockList[usedBlocks]->description,
-			description, MEMORY_MAX_DESC_LENGTH);
-		usedBlockList[usedBlocks]
-			->description[MEMORY_MAX_DESC_LENGTH - 1] = '\0';
+		strncpy(block->block.description, description,
+			MEMORY_MAX_DESC_LENGTH);
+		block->block.description[MEMORY_MAX_DESC_LENGTH - 1] = '\0';
 	}
-	else
-		usedBlockList[usedBlocks]->description[0] = '\0';
+
+	// Add it to the hash chain for its start address
+	bucket = blockBucket(start);
+	block->next = blockHash[bucket];
+	if (block->next)
+		block->next->prev = block;
+	blockHash[bucket] = block;
+
+	// Add it to the chain for its process
+	procChainAdd(block);
 
 	// Increment the count of used memory blocks.
 	usedBlocks += 1;
 
 	// Take the whole range of memory covered by this new block, and mark
 	// each of its physical memory blocks as "used" in the free-block bitmap,
-	// adjusting the totalUsed and totalFree values as we go.
-	lastBit = ((end + (MEMORY_BLOCK_SIZE - 1)) / MEMORY_BLOCK_SIZE);
-	for (count = (start / MEMORY_BLOCK_SIZE); count <= lastBit; count ++)
-	{
-		if (!(freeBlockBitmap[count / 8] & (0x80 >> (count % 8))))
-		{
-			freeBlockBitmap[count / 8] |= (0x80 >> (count % 8));
-			totalUsed += MEMORY_BLOCK_SIZE;
-			totalFree -= MEMORY_BLOCK_SIZE;
-		}
-	}
+	// adjusting the totalUsed and totalFree values by the number that
+	// weren't already used.
+	changed = markBlocks((start / MEMORY_BLOCK_SIZE),
+		(end / MEMORY_BLOCK_SIZE), 1 /* used */);
+
+	totalUsed += (changed * MEMORY_BLOCK_SIZE);
+	totalFree -= (changed * MEMORY_BLOCK_SIZE);
 
 	// Return success
 	return (status = 0);
@@ -155,205 +522,923 @@ static int requestBlock(int processId, unsigned size, unsigned alignment,
 	// this.
 
 	int status = 0;
-	int startBlock = 0;
-	unsigned blockPointer = 0;
-	unsigned consecutiveBlocks = 0;
-	int foundBlock = 0;
-	int count;
+	unsigned startBlock = 0;
+	unsigned blockPointer = 0;
+	unsigned run = 0;
+	int foundBlock = -1;
+
+	// If the requested block size is zero, forget it.  We can probably
+	// assume something has gone wrong in the calling program
+	if (!size)
+	{
+		kernelError(kernel_error, "Can't allocate 0 bytes");
+		return (status = ERR_INVALID);
+	}
+
+	// Make sure that we have a record for a new block.  If we don't, return
+	// NULL.
+	if (!freeRecords)
+	{
+		// Not enough memory blocks left over
+		kernelError(kernel_error, "The number of memory blocks has been "
+			"exhausted");
+		return (status = ERR_MEMORY);
+	}
+
+	// Make sure the requested alignment is a multiple of MEMORY_BLOCK_SIZE.
+	// Obviously, if MEMORY_BLOCK_SIZE is the size of each block, we can't
+	// really start allocating memory which uses only bits and pieces
+	// of blocks
+	if (alignment && (alignment % MEMORY_BLOCK_SIZE))
+	{
+		kernelError(kernel_error, "Physical memory can only be aligned on "
+			"%u-byte boundary (not %u)", MEMORY_BLOCK_SIZE, alignment);
+		return (status = ERR_ALIGN);
+	}
+
+	// Make the requested size be a multiple of MEMORY_BLOCK_SIZE.  Our memory
+	// blocks are all going to be multiples of this size
+	if (size % MEMORY_BLOCK_SIZE)
+		size = (((size / MEMORY_BLOCK_SIZE) + 1) * MEMORY_BLOCK_SIZE);
+
+	// If we're short of free memory, take back the pool of cleared memory
+	if ((size > totalFree) && zeroPoolChunks)
+		releaseZeroPool();
+
+	// Now, make sure that there's enough total free memory to satisfy
+	// this request (whether or not there is a large enough contiguous
+	// block is another matter.)
+	if (size > totalFree)
+	{
+		// There is not enough free memory
+		kernelError(kernel_error, "The computer is out of physical memory");
+		return (status = ERR_MEMORY);
+	}
+
+	// Adjust "alignment" so that it is expressed in blocks
+	alignment /= MEMORY_BLOCK_SIZE;
+
+	// If the caller didn't request low memory, we will start our search after
+	// 1MB
+	if (!lowMem)
+		startBlock = ((1024 * 1024) / MEMORY_BLOCK_SIZE);
+
+retry:
+	// Use the free-block summary to find the first run of free blocks large
+	// enough to fit the requested size.  If alignment is desired and the run
+	// doesn't start on a multiple of the alignment size, search again from
+	// the next aligned block.
+	while (1)
+	{
+		run = 0;
+		foundBlock = summaryFind(1 /* root */, 0, (summaryLeaves *
+			MEMORY_SUMMARY_BLOCKS), startBlock, (size / MEMORY_BLOCK_SIZE),
+			&run);
+
+		if ((foundBlock < 0) || !alignment || !(foundBlock % alignment))
+			break;
+
+		startBlock = (foundBlock + (alignment - (foundBlock % alignment)));
+	}
+
+	// Did we find an appropriate block?
+	if (foundBlock < 0)
+	{
+		if (!lowMem)
+		{
+			// Retry, including low memory
+			lowMem = 1;
+			startBlock = 0;
+			goto retry;
+		}
+
+		if (zeroPoolChunks)
+		{
+			// Retry, after taking back the pool of cleared memory
+			releaseZeroPool();
+			startBlock = 0;
+			goto retry;
+		}
+
+		return (status = ERR_MEMORY);
+	}
+
+	// It looks like we will be able to satisfy this request.  We found a
+	// block in the loop above.  We now have to allocate the new "used" block.
+
+	// blockPointer should point to the start of the memory area.
+	blockPointer = (foundBlock * MEMORY_BLOCK_SIZE);
+	status = allocateBlock(processId, blockPointer, (blockPointer + size - 1),
+		description);
+
+	// Make sure we were successful with the allocation, above
+	if (status < 0)
+		return (status);
+
+	// Assign the start location of the new memory
+	*memory = blockPointer;
+
+	// Success
+	return (status = 0);
+}
+
+
+
+static kernelMemoryBlock *findBlock(unsigned memory)
+{
+	// Search the hash chain for the supplied physical starting address.  If
+	// found, return the used block, else NULL.
+
+	kernelMemoryBlock *block = NULL;
+
+	for (block = blockHash[blockBucket(memory)]; block; block = block->next)
+	{
+		if (block->block.startLocation == memory)
+			// This is the one
+			return (block);
+	}
+
+	// Not found
+	return (block = NULL);
+}
+
+
+static void releaseBlock(kernelMemoryBlock *block)
+{
+	// This function will remove a used block, mark the corresponding blocks
+	// as free in the free-block bitmap, and adjust the totalUsed and
+	// totalFree values accordingly.
+
+	unsigned changed = 0;
+
+	// Mark all of the applicable blocks in the free block bitmap as unused
+	changed = markBlocks((block->block.startLocation / MEMORY_BLOCK_SIZE),
+		(block->block.endLocation / MEMORY_BLOCK_SIZE), 0 /* free */);
+
+	// Adjust the total used and free memory quantities
+	totalUsed -= (changed * MEMORY_BLOCK_SIZE);
+	totalFree += (changed * MEMORY_BLOCK_SIZE);
+
+	// Remove it from the hash chains
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		blockHash[blockBucket(block->block.startLocation)] = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+
+	procChainRemove(block);
+
+	// Put the record back on the free list
+	block->next = freeRecords;
+	freeRecords = block;
+	numFreeRecords += 1;
+
+	// Now reduce the total count.
+	usedBlocks -= 1;
+}
+
+
+static void releaseZeroPool(void)
+{
+	// Free all of the memory in the pool of cleared memory, because someone
+	// needs it more than we need it to be clear
+
+	while (zeroPoolChunks)
+	{
+		zeroPoolChunks -= 1;
+		releaseBlock(zeroPool[zeroPoolChunks]);
+	}
+
+	zeroPoolSize = 0;
+}
+
+
+static int takeZeroed(int processId, unsigned size, const char *description,
+	unsigned *memory)
+{
+	// If there's a chunk in the pool of cleared memory that's big enough for
+	// the request, give the process the first part of it, and leave the rest
+	// of it in the pool.
+
+	int status = 0;
+	kernelMemoryBlock *block = NULL;
+	unsigned chunkSize = 0;
+	unsigned bestSize = 0;
+	unsigned start = 0;
+	unsigned changed = 0;
+	int chunk = -1;
+	int count;
+
+	if (size % MEMORY_BLOCK_SIZE)
+		size = (((size / MEMORY_BLOCK_SIZE) + 1) * MEMORY_BLOCK_SIZE);
+
+	// Find the smallest chunk that's big enough
+	for (count = 0; count < zeroPoolChunks; count ++)
+	{
+		chunkSize = ((zeroPool[count]->block.endLocation -
+			zeroPool[count]->block.startLocation) + 1);
+
+		if ((chunkSize >= size) && ((chunk < 0) || (chunkSize < bestSize)))
+		{
+			chunk = count;
+			bestSize = chunkSize;
+		}
+	}
+
+	if (chunk < 0)
+		return (status = ERR_NOFREE);
+
+	block = zeroPool[chunk];
+	start = block->block.startLocation;
+
+	// Take it out of the pool
+	zeroPoolChunks -= 1;
+	zeroPool[chunk] = zeroPool[zeroPoolChunks];
+	zeroPoolSize -= bestSize;
+
+	if (bestSize > size)
+	{
+		// The rest goes back in the pool as a chunk of its own.  Its memory
+		// is already marked as used, so this just gets a record for it.
+		if (allocateBlock(KERNELPROCID, (start + size),
+			block->block.endLocation, MEMORYDESC_ZEROPOOL) >= 0)
+		{
+			zeroPool[zeroPoolChunks] = findBlock(start + size);
+			zeroPoolChunks += 1;
+			zeroPoolSize += (bestSize - size);
+		}
+		else
+		{
+			// No record for it, so free it
+			changed = markBlocks(((start + size) / MEMORY_BLOCK_SIZE),
+				(block->block.endLocation / MEMORY_BLOCK_SIZE), 0 /* free */);
+			totalUsed -= (changed * MEMORY_BLOCK_SIZE);
+			totalFree += (changed * MEMORY_BLOCK_SIZE);
+		}
+
+		block->block.endLocation = (start + size - 1);
+	}
+
+	// Give it to the process
+	procChainRemove(block);
+	block->block.processId = processId;
+	procChainAdd(block);
+
+	block->block.description[0] = '\0';
+	if (description)
+	{
+		strncpy(block->block.description, description,
+			MEMORY_MAX_DESC_LENGTH);
+		block->block.description[MEMORY_MAX_DESC_LENGTH - 1] = '\0';
+	}
+
+	*memory = start;
+	return (status = 0);
+}
+
+
+static kernelMemoryReservation *findReservation(void *pageDir,
+	void *virtual, unsigned size)
+{
+	// Find a reservation, in the supplied address space, that overlaps the
+	// range of virtual memory
+
+	kernelMemoryReservation *res = NULL;
+
+	for (res = reservations; res; res = res->next)
+	{
+		if ((res->pageDir == pageDir) && ((virtual + size) > res->virtual) &&
+			(virtual < (res->virtual + res->size)))
+		{
+			return (res);
+		}
+	}
+
+	return (res = NULL);
+}
+
+
+static void removeReservation(kernelMemoryReservation *res)
+{
+	// Take a reservation off the list, and out of the totals
+
+	kernelMemoryReservation *prev = NULL;
+
+	if (reservations == res)
+	{
+		reservations = res->next;
+	}
+	else
+	{
+		for (prev = reservations; prev; prev = prev->next)
+		{
+			if (prev->next == res)
+			{
+				prev->next = res->next;
+				break;
+			}
+		}
+	}
+
+	// Don't leave the page-out clock pointing at it
+	if (clockRes == res)
+	{
+		clockRes = res->next;
+		clockOffset = 0;
+	}
+
+	reservedMemory -= res->size;
+	residentMemory -= res->resident;
+}
+
+
+static unsigned swapGetSlot(void)
+{
+	// Allocate a free swap slot.  Returns 0 (which is the swap header, and
+	// never free) if there aren't any.
+
+	unsigned slot = 0;
+	unsigned count;
+
+	if (!swapFree)
+		return (slot = 0);
+
+	for (count = 0; count < swapSlots; count ++)
+	{
+		slot = swapNext;
+		swapNext = ((swapNext + 1) % swapSlots);
+
+		if (!(swapBitmap[slot / 8] & (1 << (slot % 8))))
+		{
+			swapBitmap[slot / 8] |= (1 << (slot % 8));
+			swapFree -= 1;
+			return (slot);
+		}
+	}
+
+	return (slot = 0);
+}
+
+
+static void swapReleaseSlot(unsigned slot)
+{
+	// Free a swap slot
+
+	swapBitmap[slot / 8] &= ~(1 << (slot % 8));
+	swapFree += 1;
+}
+
+
+static int swapReadWrite(unsigned slot, unsigned physical, int write)
+{
+	// Read or write a page of physical memory from or to a swap slot
+
+	int status = 0;
+	unsigned sectors = (MEMORY_PAGE_SIZE / swapDisk->physical->sectorSize);
+	void *buffer = NULL;
+
+	status = kernelPageMapToFree(KERNELPROCID, physical, &buffer,
+		MEMORY_PAGE_SIZE);
+	if (status < 0)
+		return (status);
+
+	status = kernelDiskReadWriteUncached((char *) swapDisk->name,
+		((uquad_t) slot * sectors), sectors, buffer, write);
+
+	kernelPageUnmap(KERNELPROCID, buffer, MEMORY_PAGE_SIZE);
+
+	if (status < 0)
+		kernelError(kernel_error, "Error %s swap slot %u", (write?
+			"writing" : "reading"), slot);
+
+	return (status);
+}
+
+
+static void releaseSwapped(kernelMemoryReservation *res)
+{
+	// Free the swap slots of a reservation's pages that are paged out
+
+	void *page = NULL;
+	unsigned slot = 0;
+
+	for (page = res->virtual; (res->swapped && (page < (res->virtual +
+		res->size))); page += MEMORY_PAGE_SIZE)
+	{
+		if (kernelPageGetSwapped(res->processId, page, &slot))
+		{
+			swapReleaseSlot(slot);
+			res->swapped -= MEMORY_PAGE_SIZE;
+		}
+	}
+}
+
+
+static void releaseReservation(kernelMemoryReservation *res)
+{
+	// Unmap a reservation from its address space, and release the physical
+	// pages that were populated in it, and any swap slots
+
+	void *end = (res->virtual + res->size);
+	void *run = res->virtual;
+	void *page = NULL;
+	unsigned physical = 0;
+	kernelMemoryBlock *block = NULL;
+
+	if (res->swapped)
+		releaseSwapped(res);
+
+	for (page = res->virtual; page < end; page += MEMORY_PAGE_SIZE)
+	{
+		physical = kernelPageGetPhysical(res->processId, page);
+		if (!physical)
+			continue;
+
+		// Unmap the run of unpopulated pages before this one, and this one,
+		// before the physical page can be reused
+		kernelPageUnmap(res->processId, run, ((page - run) +
+			MEMORY_PAGE_SIZE));
+		run = (page + MEMORY_PAGE_SIZE);
+
+		block = findBlock(physical);
+		if (block)
+			releaseBlock(block);
+	}
+
+	if (run < end)
+		kernelPageUnmap(res->processId, run, (end - run));
+}
+
+
+static void *addReservation(kernelMemoryReservation *res, unsigned size,
+	const char *description)
+{
+	// Reserve a range of virtual memory in the address space of the current
+	// process, and add the reservation to the list
+
+	int status = 0;
+	int processId = 0;
+	void *virtual = NULL;
+
+	// Get the current process Id
+	processId = kernelMultitaskerGetCurrentProcessId();
+	if (processId < 0)
+	{
+		kernelError(kernel_error, "Unable to determine the current process");
+		return (virtual = NULL);
+	}
+
+	res->processId = processId;
+	res->pageDir = (void *) kernelMultitaskerGetPageDir(processId);
+	res->size = kernelPageRoundUp(size);
+
+	if (description)
+	{
+		strncpy(res->description, description, MEMORY_MAX_DESC_LENGTH);
+		res->description[MEMORY_MAX_DESC_LENGTH - 1] = '\0';
+	}
+
+	if (!res->pageDir)
+		return (virtual = NULL);
+
+	// Reserve the virtual address range
+	status = kernelPageReserve(processId, &virtual, res->size);
+	if (status < 0)
+		return (virtual = NULL);
+
+	res->virtual = virtual;
+
+	// Obtain a lock on the memory data
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+	{
+		kernelPageUnmap(processId, virtual, res->size);
+		return (virtual = NULL);
+	}
+
+	res->next = reservations;
+	reservations = res;
+	reservedMemory += res->size;
+
+	// Release the lock on the memory data
+	kernelLockRelease(&memoryLock);
+
+	return (virtual);
+}
+
+
+static void freeReservation(kernelMemoryReservation *res)
+{
+	// Free a reservation that's been removed from the list
+
+	if (res->mapFile)
+	{
+		kernelFileClose(res->mapFile);
+		kernelFree(res->mapFile);
+	}
+
+	kernelFree(res);
+}
+
+
+static int readFilePage(file *theFile, unsigned position, void *buffer)
+{
+	// Read a page of a mapped file into the buffer.  Anything past the end
+	// of the file is cleared.
+
+	int status = 0;
+	unsigned bytes = 0;
+	unsigned firstBlock = 0;
+	unsigned skip = 0;
+	unsigned numBlocks = 0;
+	void *blocksBuffer = NULL;
+
+	if (position < theFile->size)
+	{
+		bytes = min(MEMORY_PAGE_SIZE, (theFile->size - position));
+		firstBlock = (position / theFile->blockSize);
+		skip = (position % theFile->blockSize);
+		numBlocks = (((skip + bytes) + (theFile->blockSize - 1)) /
+			theFile->blockSize);
+
+		if (!skip && ((numBlocks * theFile->blockSize) <= MEMORY_PAGE_SIZE))
+		{
+			// Read straight into the page
+			status = kernelFileRead(theFile, firstBlock, numBlocks, buffer);
+		}
+		else
+		{
+			// The blocks are bigger than pages
+			blocksBuffer = kernelMalloc(numBlocks * theFile->blockSize);
+			if (!blocksBuffer)
+				return (status = ERR_MEMORY);
+
+			status = kernelFileRead(theFile, firstBlock, numBlocks,
+				blocksBuffer);
+			if (status >= 0)
+				memcpy(buffer, (blocksBuffer + skip), bytes);
+
+			kernelFree(blocksBuffer);
+		}
+
+		if (status < 0)
+			return (status);
+	}
+
+	if (bytes < MEMORY_PAGE_SIZE)
+		memset((buffer + bytes), 0, (MEMORY_PAGE_SIZE - bytes));
+
+	return (status = 0);
+}
+
+
+static int copyOnWrite(int processId, void *page)
+{
+	// The process wrote to a page that it shares copy-on-write.  Give it its
+	// own copy.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	unsigned oldPhysical = 0;
+	unsigned physical = 0;
+	int haveLock = 0;
+	void *copy = NULL;
+	kernelMemoryBlock *block = NULL;
+
+	oldPhysical = kernelPageGetCopyOnWrite(processId, page);
+	if (!oldPhysical)
+		// A real protection fault
+		return (status = ERR_PERMISSION);
+
+	// The copy belongs to the owner of the address space, since threads
+	// share it
+	directory = kernelPageGetDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	// See kernelMemoryPageFault() about the lock
+	haveLock = (memoryLock.processId == processId);
+
+	if (!haveLock)
+	{
+		growRecords();
+
+		status = kernelLockGet(&memoryLock);
+		if (status < 0)
+			return (status);
+	}
+
+	status = requestBlock(directory->processId, MEMORY_PAGE_SIZE,
+		0 /* no alignment */, 0 /* not low memory */, "copy-on-write data",
+		&physical);
+
+	if (!haveLock)
+		kernelLockRelease(&memoryLock);
+
+	if (status < 0)
+		return (status);
+
+	// Copy the page, which the process can still read
+	status = kernelPageMapToFree(KERNELPROCID, physical, &copy,
+		MEMORY_PAGE_SIZE);
+	if (status >= 0)
+	{
+		memcpy(copy, page, MEMORY_PAGE_SIZE);
+		kernelPageUnmap(KERNELPROCID, copy, MEMORY_PAGE_SIZE);
+
+		status = kernelPageMapCopy(processId, oldPhysical, physical, page);
+	}
+
+	if (status < 0)
+	{
+		if (haveLock || (kernelLockGet(&memoryLock) >= 0))
+		{
+			block = findBlock(physical);
+			if (block)
+				releaseBlock(block);
+
+			if (!haveLock)
+				kernelLockRelease(&memoryLock);
+		}
+
+		// If another thread already copied it, the process can carry on (and
+		// if that's not the case, it will fault again)
+		if (!kernelPageGetCopyOnWrite(processId, page))
+			status = 0;
+	}
+
+	return (status);
+}
+
+
+static int swapOut(void)
+{
+	// Page out one cold page of user memory, using the clock algorithm: we
+	// go around the populated pages of the reservations, clearing their
+	// 'accessed' bits, and take the first one that hasn't been accessed
+	// since we last passed it.  Pages that were never written are simply
+	// dropped (they'll be populated afresh if they're touched again), and
+	// the rest are written to swap.  Returns 1 if we freed a page, or 0 if
+	// there wasn't one we could page out.
+
+	int status = 0;
+	unsigned pages = 0;
+	kernelMemoryReservation *res = NULL;
+	int processId = 0;
+	void *pageDir = NULL;
+	void *page = NULL;
+	unsigned physical = 0;
+	unsigned slot = 0;
+	int evicted = 0;
+	kernelMemoryBlock *block = NULL;
 
-	// If the requested block size is zero, forget it.  We can probably
-	// assume something has gone wrong in the calling program
-	if (!size)
-	{
-		kernelError(kernel_error, "Can't allocate 0 bytes");
-		return (status = ERR_INVALID);
-	}
+	// Only one thread pages in or out at a time, so nobody reads a slot
+	// before it's written
+	status = kernelLockGet(&swapLock);
+	if (status < 0)
+		return (status);
 
-	// Make sure that we have room for a new block.  If we don't, return
-	// NULL.
-	if (usedBlocks >= MAXMEMORYBLOCKS)
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
 	{
-		// Not enough memory blocks left over
-		kernelError(kernel_error, "The number of memory blocks has been "
-			"exhausted");
-		return (status = ERR_MEMORY);
+		kernelLockRelease(&swapLock);
+		return (status);
 	}
 
-	// Make sure the requested alignment is a multiple of MEMORY_BLOCK_SIZE.
-	// Obviously, if MEMORY_BLOCK_SIZE is the size of each block, we can't
-	// really start allocating memory which uses only bits and pieces
-	// of blocks
-	if (alignment && (alignment % MEMORY_BLOCK_SIZE))
+	// Going around twice is enough to find a page, unless they're all in
+	// constant use
+	for (pages = (2 * (reservedMemory / MEMORY_PAGE_SIZE)); pages > 0;
+		pages --)
 	{
-		kernelError(kernel_error, "Physical memory can only be aligned on "
-			"%u-byte boundary (not %u)", MEMORY_BLOCK_SIZE, alignment);
-		return (status = ERR_ALIGN);
-	}
+		if (!clockRes || (clockOffset >= clockRes->size))
+		{
+			// On to the next reservation
+			clockRes = (clockRes? clockRes->next : reservations);
+			clockOffset = 0;
+			continue;
+		}
 
-	// Make the requested size be a multiple of MEMORY_BLOCK_SIZE.  Our memory
-	// blocks are all going to be multiples of this size
-	if (size % MEMORY_BLOCK_SIZE)
-		size = (((size / MEMORY_BLOCK_SIZE) + 1) * MEMORY_BLOCK_SIZE);
+		res = clockRes;
+		page = (res->virtual + clockOffset);
+		clockOffset += MEMORY_PAGE_SIZE;
 
-	// Now, make sure that there's enough total free memory to satisfy
-	// this request (whether or not there is a large enough contiguous
-	// block is another matter.)
-	if (size > totalFree)
-	{
-		// There is not enough free memory
-		kernelError(kernel_error, "The computer is out of physical memory");
-		return (status = ERR_MEMORY);
-	}
+		// Kernel memory never gets paged out, since the kernel can't wait
+		// for it whenever it touches it
+		if ((res->processId == KERNELPROCID) || !res->resident)
+		{
+			pages -= min(pages - 1, ((res->size - clockOffset) /
+				MEMORY_PAGE_SIZE));
+			clockOffset = res->size;
+			continue;
+		}
 
-	// Adjust "alignment" so that it is expressed in blocks
-	alignment /= MEMORY_BLOCK_SIZE;
+		physical = kernelPageGetPhysical(res->processId, page);
+		if (!physical || kernelPageTestAccessed(res->processId, page))
+			continue;
 
-	// If the caller didn't request low memory, we will start our search after
-	// 1MB
-	if (!lowMem)
-		startBlock = ((1024 * 1024) / MEMORY_BLOCK_SIZE);
+		// Found one.  It needs a swap slot if it's been written.  If there
+		// aren't any left, only unwritten pages can go.
+		slot = swapGetSlot();
 
-retry:
-	// Skip through the free-block bitmap and find the first block large
-	// enough to fit the requested size, plus the alignment value if
-	// applicable.
-	for (count = startBlock; count < totalBlocks; count ++)
-	{
-		// Is the current block used or free?
-		if (freeBlockBitmap[count / 8] & (0x80 >> (count % 8)))
-		{
-			// This block is allocated.  We're not there yet.
-			consecutiveBlocks = 0;
+		evicted = kernelPageEvict(res->processId, physical, page, slot);
 
-			// If alignment is desired, we need to advance "count" to the
-			// next multiple of the alignment size
-			if (alignment)
-				// Subract one from the expected number because count will get
-				// incremented by the loop
-				count += ((alignment - (count % alignment)) - 1);
+		if (slot && (evicted <= 0))
+			swapReleaseSlot(slot);
 
+		if (evicted < 0)
 			continue;
-		}
 
-		// This block is free.
-		consecutiveBlocks += 1;
+		res->resident -= MEMORY_PAGE_SIZE;
+		residentMemory -= MEMORY_PAGE_SIZE;
+
+		block = findBlock(physical);
 
-		// Do we have enough yet?
-		if ((consecutiveBlocks * MEMORY_BLOCK_SIZE) >= size)
+		if (!evicted)
 		{
-			blockPointer = ((count - (consecutiveBlocks - 1)) *
-				MEMORY_BLOCK_SIZE);
-			foundBlock = 1;
-			break;
+			if (block)
+				releaseBlock(block);
 		}
-	}
-
-	// Did we find an appropriate block?
-	if (!foundBlock)
-	{
-		if (!lowMem)
+		else
 		{
-			// Retry, including low memory
-			lowMem = 1;
-			startBlock = 0;
-			goto retry;
+			res->swapped += MEMORY_PAGE_SIZE;
+			processId = res->processId;
+			pageDir = res->pageDir;
+
+			// The kernel owns the page while it's being written, in case
+			// the process goes away in the meantime
+			if (block)
+			{
+				procChainRemove(block);
+				block->block.processId = KERNELPROCID;
+				procChainAdd(block);
+			}
 		}
 
-		return (status = ERR_MEMORY);
+		break;
 	}
 
-	// It looks like we will be able to satisfy this request.  We found a
-	// block in the loop above.  We now have to allocate the new "used" block.
-
-	// blockPointer should point to the start of the memory area.
-	status = allocateBlock(processId, blockPointer, (blockPointer + size - 1),
-		description);
+	kernelLockRelease(&memoryLock);
 
-	// Make sure we were successful with the allocation, above
-	if (status < 0)
-		return (status);
+	if (!pages)
+	{
+		// Nothing to page out
+		kernelLockRelease(&swapLock);
+		return (status = 0);
+	}
 
-	// Assign the start location of the new memory
-	*memory = blockPointer;
+	if (evicted > 0)
+	{
+		status = swapReadWrite(slot, physical, 1 /* write */);
 
-	// Success
-	return (status = 0);
-}
+		if (kernelLockGet(&memoryLock) >= 0)
+		{
+			block = findBlock(physical);
 
+			// If we couldn't write it, try to put it back
+			if ((status < 0) && block &&
+				(kernelPageMapSwapped(processId, physical, page, slot) >= 0))
+			{
+				procChainRemove(block);
+				block->block.processId = processId;
+				procChainAdd(block);
+				block = NULL;
+
+				swapReleaseSlot(slot);
+
+				res = findReservation(pageDir, page, MEMORY_PAGE_SIZE);
+				if (res)
+				{
+					res->swapped -= MEMORY_PAGE_SIZE;
+					res->resident += MEMORY_PAGE_SIZE;
+					residentMemory += MEMORY_PAGE_SIZE;
+				}
+			}
 
+			if (block)
+				releaseBlock(block);
 
-static int findBlock(unsigned memory)
-{
-	// Search the used block list for one with the supplied physical starting
-	// address.  If found, return the index of the block (else negative error
-	// code)
+			kernelLockRelease(&memoryLock);
+		}
+	}
 
-	int index = 0;
+	kernelLockRelease(&swapLock);
 
-	// Now we can go through the "used" block list watching for a start
-	// value that matches this pointer
-	for (index = 0; ((index < usedBlocks) && (index < MAXMEMORYBLOCKS));
-		index ++)
-	{
-		if (usedBlockList[index]->startLocation == memory)
-			// This is the one
-			return (index);
-	}
+	if (status < 0)
+		return (status);
 
-	// Not found
-	return (ERR_NOSUCHENTRY);
+	return (status = 1);
 }
 
 
-static int releaseBlock(int index)
+static int swapIn(int processId, void *pageDir, void *page, unsigned slot)
 {
-	// This function will remove a block from the used block list, mark the
-	// corresponding blocks as free in the free-block bitmap, and adjust
-	// the totalUsed and totalFree values accordingly.  Returns 0 on success,
-	// negative otherwise.
+	// The process touched a page that was paged out.  Read it back from its
+	// swap slot.
 
 	int status = 0;
-	memoryBlock *unused;
-	unsigned temp = 0;
-	unsigned lastBit = 0;
+	kernelMemoryReservation *res = NULL;
+	int ownerId = 0;
+	unsigned physical = 0;
+	unsigned swapped = 0;
+	kernelMemoryBlock *block = NULL;
 
-	// Make sure the block location is reasonable
-	if (index > (usedBlocks - 1))
-		return (status = ERR_NOSUCHENTRY);
+	growRecords();
 
-	// Mark all of the applicable blocks in the free block bitmap as unused
-	lastBit = (usedBlockList[index]->endLocation / MEMORY_BLOCK_SIZE);
-	for (temp = (usedBlockList[index]->startLocation /
-		MEMORY_BLOCK_SIZE); temp <= lastBit; temp ++)
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+		return (status);
+
+	res = findReservation(pageDir, page, MEMORY_PAGE_SIZE);
+	if (res)
+	{
+		ownerId = res->processId;
+		status = requestBlock(ownerId, MEMORY_PAGE_SIZE, 0 /* no alignment */,
+			0 /* not low memory */, res->description, &physical);
+	}
+	else
 	{
-		freeBlockBitmap[temp / 8] &= (0xFF7F >> (temp % 8));
+		status = ERR_NOSUCHENTRY;
 	}
 
-	// Adjust the total used and free memory quantities
-	temp = ((usedBlockList[index]->endLocation -
-		usedBlockList[index]->startLocation) + 1);
-	totalUsed -= temp;
-	totalFree += temp;
+	kernelLockRelease(&memoryLock);
 
-	// Remove this element from the "used" part of the list.  What we have to
-	// do is this: Since this is an unordered list, the way we accomplish this
-	// is by copying the last entry into the place of the current entry and
-	// reducing the total block count, unless the entry we're removing happens
-	// to be the only item, or the last item in the list.  In those cases we
-	// simply reduce the total number
+	if (status < 0)
+		return (status);
 
-	if ((usedBlocks > 1) && (index < (usedBlocks - 1)))
+	// Wait for any write of the slot to finish
+	status = kernelLockGet(&swapLock);
+	if (status >= 0)
 	{
-		unused = usedBlockList[index];
-		usedBlockList[index] = usedBlockList[usedBlocks - 1];
-		usedBlockList[usedBlocks - 1] = unused;
+		// It might have been paged in by another thread in the meantime
+		if (kernelPageGetSwapped(processId, page, &swapped) &&
+			(swapped == slot))
+		{
+			status = swapReadWrite(slot, physical, 0 /* read */);
+		}
+		else
+		{
+			status = ERR_NOSUCHENTRY;
+		}
+
+		if (kernelLockGet(&memoryLock) >= 0)
+		{
+			if (status >= 0)
+				status = kernelPageMapSwapped(ownerId, physical, page, slot);
+
+			if (status >= 0)
+			{
+				swapReleaseSlot(slot);
+
+				res = findReservation(pageDir, page, MEMORY_PAGE_SIZE);
+				if (res)
+				{
+					res->swapped -= MEMORY_PAGE_SIZE;
+					res->resident += MEMORY_PAGE_SIZE;
+					residentMemory += MEMORY_PAGE_SIZE;
+				}
+			}
+			else
+			{
+				block = findBlock(physical);
+				if (block)
+					releaseBlock(block);
+
+				// If another thread paged it in, the process can carry on
+				if (kernelPageGetPhysical(processId, page))
+					status = 0;
+			}
+
+			kernelLockRelease(&memoryLock);
+		}
+
+		kernelLockRelease(&swapLock);
 	}
 
-	// Now reduce the total count.
-	usedBlocks -= 1;
+	return (status);
+}
 
-	// Return success
-	return (status = 0);
+
+__attribute__((noreturn))
+static void swapThread(void)
+{
+	// This thread pages out cold user memory when free memory gets low, so
+	// that processes don't usually have to wait for it themselves
+
+	while (1)
+	{
+		if (totalFree < MEMORY_SWAP_LOW)
+		{
+			while (totalFree < MEMORY_SWAP_HIGH)
+			{
+				if (swapOut() <= 0)
+					break;
+			}
+		}
+
+		kernelMultitaskerWait(MS_PER_SEC / 4);
+	}
 }
 
 
@@ -378,6 +1463,8 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 	void *blockListVirtual = NULL;
 	unsigned bitmapPhysical = 0;
 	unsigned bitmapSize = 0;
+	unsigned summaryPhysical = 0;
+	unsigned summarySize = 0;
 	const char *desc = NULL;
 	unsigned start = 0, end = 0;
 	int count;
@@ -412,7 +1499,7 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 		KERNEL_PAGING_DATA_SIZE);
 
 	// Calculate the size of the list
-	blockListSize = (MAXMEMORYBLOCKS * sizeof(memoryBlock));
+	blockListSize = (MEMORY_INIT_RECORDS * sizeof(kernelMemoryBlock));
 
 	// Make sure the list is allocated to block boundaries
 	blockListSize += (MEMORY_BLOCK_SIZE - (blockListSize %
@@ -424,12 +1511,8 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 	if (status < 0)
 		return (status);
 
-	// Fill up the list of pointers to those memory structures
-	for (count = 0; count < MAXMEMORYBLOCKS; count ++)
-	{
-		usedBlockList[count] = (memoryBlock *)(blockListVirtual + (count *
-			sizeof(memoryBlock)));
-	}
+	// Put those memory structures on the free list
+	addRecords(blockListVirtual, MEMORY_INIT_RECORDS);
 
 	totalBlocks = (totalMemory / MEMORY_BLOCK_SIZE);
 	usedBlocks = 0;
@@ -455,6 +1538,29 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 	// Clear the memory we use for the bitmap
 	memset((void *) freeBlockBitmap, 0, bitmapSize);
 
+	// The free-block summary tree goes after the bitmap.  The number of
+	// leaves is a power of 2, so that the whole tree fits in an array with
+	// the root at index 1.
+	summaryPhysical = (bitmapPhysical + bitmapSize);
+
+	summaryLeaves = 1;
+	while ((unsigned)(summaryLeaves * MEMORY_SUMMARY_BLOCKS) <
+		(unsigned) totalBlocks)
+	{
+		summaryLeaves *= 2;
+	}
+
+	summarySize = ((summaryLeaves * 2) * sizeof(kernelFreeSummary));
+	summarySize += (MEMORY_BLOCK_SIZE - (summarySize % MEMORY_BLOCK_SIZE));
+
+	status = kernelPageMapToFree(KERNELPROCID, summaryPhysical,
+		(void **) &freeBlockSummary, summarySize);
+	if (status < 0)
+		return (status);
+
+	// Build the summary from the (empty) bitmap
+	summaryUpdate(0, ((summaryLeaves * MEMORY_SUMMARY_BLOCKS) - 1));
+
 	// The list of reserved memory blocks needs to be completed here, before
 	// we attempt to use it to calculate the location of the free-block
 	// bitmap.
@@ -498,6 +1604,16 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 			reservedBlocks[count].endLocation =
 				(reservedBlocks[count].startLocation + bitmapSize - 1);
 		}
+
+		// Set the start and end values for the "free memory summary"
+		// reserved block
+		if (!strcmp((char *) reservedBlocks[count].description,
+			MEMORYDESC_FREESUMMARY))
+		{
+			reservedBlocks[count].startLocation = summaryPhysical;
+			reservedBlocks[count].endLocation =
+				(reservedBlocks[count].startLocation + summarySize - 1);
+		}
 	}
 
 	// Allocate blocks for all our static reserved memory ranges
@@ -574,6 +1690,8 @@ unsigned kernelMemoryGetPhysical(unsigned size, unsigned alignment,
 	if (kernelProcessingInterrupt())
 		return (physical = NULL);
 
+	growRecords();
+
 	// Obtain a lock on the memory data
 	status = kernelLockGet(&memoryLock);
 	if (status < 0)
@@ -601,7 +1719,7 @@ int kernelMemoryReleasePhysical(unsigned physical)
 	// the the supplied physical address, and releases it.
 
 	int status = 0;
-	int index = 0;
+	kernelMemoryBlock *block = NULL;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -620,19 +1738,17 @@ int kernelMemoryReleasePhysical(unsigned physical)
 		return (status);
 
 	// Try to find the block
-	index = findBlock(physical);
+	block = findBlock(physical);
 
-	if (index >= 0)
-		// Call the releaseBlock function with this block's index.
-		status = releaseBlock(index);
+	if (block)
+		releaseBlock(block);
+	else
+		status = ERR_NOSUCHENTRY;
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
 
-	if (index < 0)
-		return (status = index);
-	else
-		return (status);
+	return (status);
 }
 
 
@@ -644,13 +1760,26 @@ void *kernelMemoryGetSystem(unsigned size, const char *description)
 
 	int status = 0;
 	unsigned physical = 0;
+	int zeroed = 0;
 	void *virtual = NULL;
 
-	// This function will check initialization, etc
-	physical = kernelMemoryGetPhysical(size, 0 /* no alignment */,
-		0 /* not low memory */, description);
-	if (!physical)
-		return (virtual = NULL);
+	// Use memory from the pool of cleared memory, if there's some that fits
+	if (initialized && zeroPoolChunks && !kernelProcessingInterrupt() &&
+		(kernelLockGet(&memoryLock) >= 0))
+	{
+		zeroed = (takeZeroed(KERNELPROCID, size, description,
+			&physical) >= 0);
+		kernelLockRelease(&memoryLock);
+	}
+
+	if (!zeroed)
+	{
+		// This function will check initialization, etc
+		physical = kernelMemoryGetPhysical(size, 0 /* no alignment */,
+			0 /* not low memory */, description);
+		if (!physical)
+			return (virtual = NULL);
+	}
 
 	// Now we will ask the page manager to map this physical memory to
 	// virtual memory pages in the address space of the kernel.
@@ -663,8 +1792,9 @@ void *kernelMemoryGetSystem(unsigned size, const char *description)
 		return (virtual = NULL);
 	}
 
-	// Clear the memory area we allocated
-	memset(virtual, 0, size);
+	// Clear the memory area we allocated, unless it's already clear
+	if (!zeroed)
+		memset(virtual, 0, size);
 
 	return (virtual);
 }
@@ -678,7 +1808,7 @@ int kernelMemoryReleaseSystem(void *virtual)
 
 	int status = 0;
 	unsigned physical = 0;
-	int index = 0;
+	kernelMemoryBlock *block = NULL;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -706,27 +1836,26 @@ int kernelMemoryReleaseSystem(void *virtual)
 		return (status);
 
 	// Try to find the block
-	index = findBlock(physical);
+	block = findBlock(physical);
 
-	if (index >= 0)
+	if (block)
 	{
-		// Now that we know the index of the memory block, we can get the
-		// size, and unmap it from the virtual address space.
+		// Now that we know the memory block, we can get the size, and unmap
+		// it from the virtual address space.
 		status = kernelPageUnmap(KERNELPROCID, virtual,
-			(usedBlockList[index]->endLocation -
-				usedBlockList[index]->startLocation + 1));
+			(block->block.endLocation - block->block.startLocation + 1));
 		if (status < 0)
 		{
 			kernelError(kernel_error, "Unable to unmap memory from the "
 				"virtual address space");
 		}
 
-		// Call the releaseBlock function with this block's index.
-		status = releaseBlock(index);
+		releaseBlock(block);
+		status = 0;
 	}
 	else
 	{
-		status = index;
+		status = ERR_NOSUCHENTRY;
 	}
 
 	// Release the lock on the memory data
@@ -841,6 +1970,7 @@ void *kernelMemoryGet(unsigned size, const char *description)
 	int status = 0;
 	int processId = 0;
 	unsigned physical = 0;
+	int zeroed = 0;
 	void *virtual = NULL;
 
 	// Make sure the memory manager has been initialized
@@ -858,33 +1988,157 @@ void *kernelMemoryGet(unsigned size, const char *description)
 		return (virtual = NULL);
 	}
 
+	growRecords();
+
 	// Obtain a lock on the memory data
 	status = kernelLockGet(&memoryLock);
 	if (status < 0)
 		return (virtual = NULL);
 
-	// Call requestBlock to find a free memory region.
-	status = requestBlock(processId, size, 0 /* no alignment */,
-		0 /* not low memory */, description, &physical);
+	// Use memory from the pool of cleared memory if there's some that fits,
+	// or else call requestBlock to find a free memory region.
+	zeroed = (takeZeroed(processId, size, description, &physical) >= 0);
+	if (!zeroed)
+		status = requestBlock(processId, size, 0 /* no alignment */,
+			0 /* not low memory */, description, &physical);
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
 
 	if (status < 0)
-		return (virtual = NULL);
+		return (virtual = NULL);
+
+	// Now we will ask the page manager to map this physical memory to
+	// virtual memory pages in the address space of the current process.
+	status = kernelPageMapToFree(processId, physical, &virtual, size);
+	if (status < 0)
+	{
+		// Attempt to deallocate the physical memory block.
+		kernelMemoryReleasePhysical(physical);
+		return (virtual = NULL);
+	}
+
+	// Clear the memory area we allocated, unless it's already clear
+	if (!zeroed)
+		memset(virtual, 0, size);
+
+	return (virtual);
+}
+
+
+void *kernelMemoryReserve(unsigned size, const char *description)
+{
+	// Reserve a range of virtual memory in the address space of the current
+	// process, without allocating any physical memory for it.  Pages are
+	// allocated, cleared, and mapped one at a time by the page fault handler
+	// when the process first touches them.  Release it using
+	// kernelMemoryRelease().
+
+	kernelMemoryReservation *res = NULL;
+	void *virtual = NULL;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (virtual = NULL);
+
+	if (kernelProcessingInterrupt())
+		return (virtual = NULL);
+
+	if (!size)
+	{
+		kernelError(kernel_error, "Can't reserve 0 bytes");
+		return (virtual = NULL);
+	}
+
+	res = kernelMalloc(sizeof(kernelMemoryReservation));
+	if (!res)
+		return (virtual = NULL);
+
+	virtual = addReservation(res, size, description);
+	if (!virtual)
+		kernelFree(res);
+
+	return (virtual);
+}
+
+
+void *kernelMemoryMapFile(file *theFile, unsigned offset, unsigned size,
+	int flags)
+{
+	// Map part of an open file into the address space of the current
+	// process.  Like kernelMemoryReserve(), no physical memory is allocated
+	// until the process touches the pages, and then they're read from the
+	// file.  If the MEMORY_MAP_PRIVATE flag is set, the memory is writable,
+	// but changes are never written back to the file.  Otherwise it's
+	// read-only.  Release it using kernelMemoryRelease().
+
+	int status = 0;
+	char *fileName = NULL;
+	kernelMemoryReservation *res = NULL;
+	void *virtual = NULL;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (virtual = NULL);
+
+	if (kernelProcessingInterrupt())
+		return (virtual = NULL);
+
+	// Check params
+	if (!theFile)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (virtual = NULL);
+	}
+
+	if (offset % MEMORY_PAGE_SIZE)
+	{
+		kernelError(kernel_error, "File offset %u is not page-aligned",
+			offset);
+		return (virtual = NULL);
+	}
+
+	if (!size || !theFile->blockSize)
+	{
+		kernelError(kernel_error, "Can't map 0 bytes");
+		return (virtual = NULL);
+	}
+
+	fileName = kernelMalloc(MAX_PATH_NAME_LENGTH);
+	res = kernelMalloc(sizeof(kernelMemoryReservation));
+	if (res)
+		res->mapFile = kernelMalloc(sizeof(file));
+
+	if (!fileName || !res || !res->mapFile)
+		goto out;
+
+	// Open the file ourselves, so that the mapping doesn't depend on the
+	// caller keeping it open
+	status = kernelFileGetFullPath(theFile, fileName, MAX_PATH_NAME_LENGTH);
+	if (status < 0)
+		goto out;
 
-	// Now we will ask the page manager to map this physical memory to
-	// virtual memory pages in the address space of the current process.
-	status = kernelPageMapToFree(processId, physical, &virtual, size);
+	status = kernelFileOpen(fileName, OPENMODE_READ, res->mapFile);
 	if (status < 0)
+		goto out;
+
+	res->mapOffset = offset;
+	res->mapFlags = flags;
+
+	virtual = addReservation(res, size, "mapped file");
+	if (!virtual)
+		kernelFileClose(res->mapFile);
+
+out:
+	if (!virtual && res)
 	{
-		// Attempt to deallocate the physical memory block.
-		kernelMemoryReleasePhysical(physical);
-		return (virtual = NULL);
+		if (res->mapFile)
+			kernelFree(res->mapFile);
+		kernelFree(res);
 	}
 
-	// Clear the memory area we allocated
-	memset(virtual, 0, size);
+	if (fileName)
+		kernelFree(fileName);
 
 	return (virtual);
 }
@@ -894,12 +2148,15 @@ int kernelMemoryRelease(void *virtual)
 {
 	// This function will determine the blockId of the block that contains
 	// the memory location pointed to by the parameter, unmap it from the
-	// relevant page table, and deallocate it.
+	// relevant page table, and deallocate it.  It also releases memory
+	// reserved with kernelMemoryReserve().
 
 	int status = 0;
 	int pid = 0;
+	void *pageDir = NULL;
+	kernelMemoryReservation *res = NULL;
 	unsigned physical = 0;
-	int index = 0;
+	kernelMemoryBlock *block = NULL;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -929,6 +2186,36 @@ int kernelMemoryRelease(void *virtual)
 	if (virtual >= (void *) KERNEL_VIRTUAL_ADDRESS)
 		pid = KERNELPROCID;
 
+	// Is it reserved memory, rather than a block?
+	if (reservations)
+		pageDir = (void *) kernelMultitaskerGetPageDir(pid);
+
+	if (pageDir)
+	{
+		status = kernelLockGet(&memoryLock);
+		if (status < 0)
+			return (status);
+
+		res = findReservation(pageDir, virtual, 1);
+		if (res && (res->virtual == virtual))
+		{
+			removeReservation(res);
+			releaseReservation(res);
+		}
+		else
+		{
+			res = NULL;
+		}
+
+		kernelLockRelease(&memoryLock);
+
+		if (res)
+		{
+			freeReservation(res);
+			return (status = 0);
+		}
+	}
+
 	// Get the memory's physical address.  We could simply unmap it here,
 	// except that we don't yet know the size of the block.
 	physical = kernelPageGetPhysical(pid, virtual);
@@ -944,27 +2231,26 @@ int kernelMemoryRelease(void *virtual)
 		return (status);
 
 	// Try to find the block
-	index = findBlock(physical);
+	block = findBlock(physical);
 
-	if (index >= 0)
+	if (block)
 	{
-		// Now that we know the index of the memory block, we can get the
-		// size, and unmap it from the virtual address space.
+		// Now that we know the memory block, we can get the size, and unmap
+		// it from the virtual address space.
 		status = kernelPageUnmap(pid, virtual,
-			(usedBlockList[index]->endLocation -
-				usedBlockList[index]->startLocation + 1));
+			(block->block.endLocation - block->block.startLocation + 1));
 		if (status < 0)
 		{
 			kernelError(kernel_error, "Unable to unmap memory from the "
 				"virtual address space");
 		}
 
-		// Call the releaseBlock function with this block's index.
-		status = releaseBlock(index);
+		releaseBlock(block);
+		status = 0;
 	}
 	else
 	{
-		status = index;
+		status = ERR_NOSUCHENTRY;
 	}
 
 	// Release the lock on the memory data
@@ -981,7 +2267,11 @@ int kernelMemoryReleaseAllByProcId(int processId)
 	// on success, negative otherwise.
 
 	int status = 0;
-	int count;
+	kernelMemoryBlock *block = NULL;
+	kernelMemoryBlock *nextBlock = NULL;
+	kernelMemoryReservation *res = NULL;
+	kernelMemoryReservation *nextRes = NULL;
+	kernelMemoryReservation *freeRes = NULL;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -995,28 +2285,45 @@ int kernelMemoryReleaseAllByProcId(int processId)
 	if (status < 0)
 		return (status);
 
-	for (count = 0; ((count < usedBlocks) && (count < MAXMEMORYBLOCKS));
-		count ++)
+	// Forget about the process' reservations.  Any pages populated in them
+	// are blocks owned by the process, which are released below, but the
+	// swap slots of pages that are paged out need to be freed.
+	for (res = reservations; res; res = nextRes)
 	{
-		if (usedBlockList[count]->processId == processId)
+		nextRes = res->next;
+
+		if (res->processId == processId)
 		{
+			removeReservation(res);
+			releaseSwapped(res);
+			res->next = freeRes;
+			freeRes = res;
+		}
+	}
+
+	// Walk the hash chain for the process, which can also contain blocks
+	// belonging to other processes
+	block = procBlocks[processId % MEMORY_PROC_BUCKETS];
+	while (block)
+	{
+		nextBlock = block->procNext;
+
+		if (block->block.processId == processId)
 			// This is one.
-			status = releaseBlock(count);
-			if (status < 0)
-			{
-				kernelLockRelease(&memoryLock);
-				return (status);
-			}
+			releaseBlock(block);
 
-			// Reduce "count" by one, since the block it points at now
-			// will be one forward of where we want to be
-			count -= 1;
-		}
+		block = nextBlock;
 	}
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
 
+	for (res = freeRes; res; res = nextRes)
+	{
+		nextRes = res->next;
+		freeReservation(res);
+	}
+
 	// Return success
 	return (status = 0);
 }
@@ -1030,7 +2337,7 @@ int kernelMemoryChangeOwner(int oldPid, int newPid, int remap,
 
 	int status = 0;
 	unsigned physical = 0;
-	int index = 0;
+	kernelMemoryBlock *block = NULL;
 	unsigned blockSize = 0;
 
 	// Make sure the memory manager has been initialized
@@ -1067,33 +2374,39 @@ int kernelMemoryChangeOwner(int oldPid, int newPid, int remap,
 		return (status);
 
 	// Try to find the block
-	index = findBlock(physical);
-
-	// Release the lock on the memory data
-	kernelLockRelease(&memoryLock);
-
-	if (index < 0)
-		return (status = index);
+	block = findBlock(physical);
+	if (!block)
+	{
+		kernelLockRelease(&memoryLock);
+		return (status = ERR_NOSUCHENTRY);
+	}
 
-	if (usedBlockList[index]->processId != oldPid)
+	if (block->block.processId != oldPid)
 	{
 		kernelError(kernel_error, "Attempt to change memory ownership from "
 			"incorrect owner (%d should be %d)", oldPid,
-			usedBlockList[index]->processId);
+			block->block.processId);
+		kernelLockRelease(&memoryLock);
 		return (status = ERR_PERMISSION);
 	}
 
-	// Change the pid number on this block
-	usedBlockList[index]->processId = newPid;
+	// Change the pid number on this block, which moves it to a different
+	// process chain
+	procChainRemove(block);
+	block->block.processId = newPid;
+	procChainAdd(block);
+
+	blockSize = ((block->block.endLocation - block->block.startLocation) +
+		1);
+
+	// Release the lock on the memory data
+	kernelLockRelease(&memoryLock);
 
 	if (remap)
 	{
 		if (kernelMultitaskerGetPageDir(newPid) !=
 			kernelMultitaskerGetPageDir(oldPid))
 		{
-			blockSize = ((usedBlockList[index]->endLocation -
-				usedBlockList[index]->startLocation) + 1);
-
 			// Map the memory into the new owner's address space
 			status = kernelPageMapToFree(newPid, physical, newVirtual,
 				blockSize);
@@ -1127,7 +2440,7 @@ int kernelMemoryShare(int sharerPid, int shareePid, void *oldVirtual,
 
 	int status = 0;
 	unsigned physical = 0;
-	int index = 0;
+	kernelMemoryBlock *block = NULL;
 	unsigned blockSize = 0;
 
 	// Make sure the memory manager has been initialized
@@ -1162,24 +2475,26 @@ int kernelMemoryShare(int sharerPid, int shareePid, void *oldVirtual,
 		return (status);
 
 	// Try to find the block
-	index = findBlock(physical);
-
-	// Release the lock on the memory data
-	kernelLockRelease(&memoryLock);
-
-	if (index < 0)
-		return (status = index);
+	block = findBlock(physical);
+	if (!block)
+	{
+		kernelLockRelease(&memoryLock);
+		return (status = ERR_NOSUCHENTRY);
+	}
 
-	if (usedBlockList[index]->processId != sharerPid)
+	if (block->block.processId != sharerPid)
 	{
 		kernelError(kernel_error, "Attempt to share memory from incorrect "
-			"owner (%d should be %d)", sharerPid,
-			usedBlockList[index]->processId);
+			"owner (%d should be %d)", sharerPid, block->block.processId);
+		kernelLockRelease(&memoryLock);
 		return (status = ERR_PERMISSION);
 	}
 
-	blockSize = ((usedBlockList[index]->endLocation -
-		usedBlockList[index]->startLocation) + 1);
+	blockSize = ((block->block.endLocation - block->block.startLocation) +
+		1);
+
+	// Release the lock on the memory data
+	kernelLockRelease(&memoryLock);
 
 	// Map the memory into the sharee's address space
 	status = kernelPageMapToFree(shareePid, physical, newVirtual, blockSize);
@@ -1189,6 +2504,396 @@ int kernelMemoryShare(int sharerPid, int shareePid, void *oldVirtual,
 }
 
 
+int kernelMemoryFillZeroPool(void)
+{
+	// This is called by the boot processor's idle thread, to do a little bit
+	// of work on filling the pool of cleared memory: get a chunk of free
+	// memory, clear one page of it, or add it to the pool once it's all
+	// clear.  The idle thread can't sleep, so we don't wait for the memory
+	// lock, and we don't let anyone else run while we hold it.  Returns 1 if
+	// we did some work, or 0 if there was nothing we could do.
+
+	int status = 0;
+	int interrupts = 0;
+	unsigned physical = 0;
+
+	if (!initialized)
+		return (status = 0);
+
+	if (fillPhysical && (fillCleared < MEMORY_ZERO_CHUNK))
+	{
+		// Clear the next page
+		if (kernelPageClearPhysical(fillPhysical + fillCleared) < 0)
+			return (status = 0);
+
+		fillCleared += MEMORY_PAGE_SIZE;
+		return (status = 1);
+	}
+
+	// Don't take more memory if the pool is full, or if we'd be using up a
+	// sizeable part of what's free
+	if (!fillPhysical && ((zeroPoolChunks >= MEMORY_ZERO_POOL_CHUNKS) ||
+		(zeroPoolSize >= MEMORY_ZERO_POOL_SIZE) ||
+		(numFreeRecords < MEMORY_MIN_FREE_RECORDS) ||
+		((totalFree / 4) < MEMORY_ZERO_POOL_SIZE)))
+	{
+		return (status = 0);
+	}
+
+	processorSuspendInts(interrupts);
+
+	if (kernelLockTryGet(&memoryLock) >= 0)
+	{
+		if (fillPhysical)
+		{
+			// It's all clear.  Add it to the pool.
+			zeroPool[zeroPoolChunks] = findBlock(fillPhysical);
+			if (zeroPool[zeroPoolChunks])
+			{
+				zeroPoolChunks += 1;
+				zeroPoolSize += MEMORY_ZERO_CHUNK;
+			}
+
+			fillPhysical = 0;
+			status = 1;
+		}
+		else if (requestBlock(KERNELPROCID, MEMORY_ZERO_CHUNK,
+			0 /* no alignment */, 0 /* not low memory */,
+			MEMORYDESC_ZEROPOOL, &physical) >= 0)
+		{
+			// Start clearing a new chunk
+			fillPhysical = physical;
+			fillCleared = 0;
+			status = 1;
+		}
+
+		kernelLockRelease(&memoryLock);
+	}
+
+	processorRestoreInts(interrupts);
+
+	return (status);
+}
+
+
+int kernelMemoryPageFault(int processId, void *address, unsigned errorCode)
+{
+	// Called by the page fault handler.  If the address is in memory that
+	// the process has reserved, and the page hasn't been populated yet, give
+	// it a cleared physical page (or one read from the mapped file).  If
+	// it's a write to a page that's shared copy-on-write, give it its own
+	// copy.  If the page was paged out, read it back from swap.  Returns 0
+	// if the process can carry on.
+
+	int status = 0;
+	int haveLock = 0;
+	void *pageDir = NULL;
+	unsigned slot = 0;
+	kernelMemoryReservation *res = NULL;
+	int ownerId = 0;
+	char description[MEMORY_MAX_DESC_LENGTH];
+	file mapFile;
+	int fileMapped = 0;
+	unsigned position = 0;
+	int writable = 1;
+	void *page = (void *) kernelPageRoundDown(address);
+	unsigned physical = 0;
+	int zeroed = 0;
+	void *clear = NULL;
+	kernelMemoryBlock *block = NULL;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (errorCode & PAGEFAULT_PRESENT)
+	{
+		// The only faults on present pages that we can fix are writes to
+		// pages shared copy-on-write
+		if (errorCode & PAGEFAULT_WRITE)
+			return (status = copyOnWrite(processId, page));
+		else
+			return (status = ERR_INVALID);
+	}
+
+	pageDir = (void *) kernelMultitaskerGetPageDir(processId);
+	if (!pageDir)
+		return (status = ERR_NOSUCHENTRY);
+
+	// The kernel can fault on a process' memory while it's holding the
+	// memory lock (when it's copying data out to the process), in which case
+	// we mustn't take or release the lock again
+	haveLock = (memoryLock.processId == processId);
+
+	if (swapDisk)
+	{
+		if (kernelPageGetSwapped(processId, page, &slot))
+		{
+			if (haveLock)
+				// Reading swap needs the lock
+				return (status = ERR_BUSY);
+
+			return (status = swapIn(processId, pageDir, page, slot));
+		}
+
+		// If we've run out of memory, page something else out to make room
+		while (!haveLock && (totalFree < MEMORY_SWAP_MIN) && !zeroPoolChunks)
+		{
+			if (swapOut() <= 0)
+				break;
+		}
+	}
+
+	if (!haveLock)
+	{
+		growRecords();
+
+		status = kernelLockGet(&memoryLock);
+		if (status < 0)
+			return (status);
+	}
+
+	res = findReservation(pageDir, page, MEMORY_PAGE_SIZE);
+	if (res)
+	{
+		// The pages belong to the process that made the reservation
+		ownerId = res->processId;
+		strcpy(description, res->description);
+
+		if (res->mapFile)
+		{
+			memcpy(&mapFile, res->mapFile, sizeof(file));
+			fileMapped = 1;
+			position = (res->mapOffset + (page - res->virtual));
+			writable = (res->mapFlags & MEMORY_MAP_PRIVATE);
+		}
+
+		if (fileMapped && haveLock)
+			// Reading the file needs the lock
+			status = ERR_BUSY;
+		else if (!fileMapped)
+			zeroed = (takeZeroed(ownerId, MEMORY_PAGE_SIZE, description,
+				&physical) >= 0);
+
+		if ((status >= 0) && !zeroed)
+			status = requestBlock(ownerId, MEMORY_PAGE_SIZE,
+				0 /* no alignment */, 0 /* not low memory */, description,
+				&physical);
+	}
+	else
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+
+	if (!haveLock)
+		kernelLockRelease(&memoryLock);
+
+	if (status < 0)
+		return (status);
+
+	if (!zeroed)
+	{
+		// Fill it from the file, or clear it, before the process can see it
+		status = kernelPageMapToFree(KERNELPROCID, physical, &clear,
+			MEMORY_PAGE_SIZE);
+		if (status >= 0)
+		{
+			if (fileMapped)
+				status = readFilePage(&mapFile, position, clear);
+			else
+				memset(clear, 0, MEMORY_PAGE_SIZE);
+
+			kernelPageUnmap(KERNELPROCID, clear, MEMORY_PAGE_SIZE);
+		}
+	}
+
+	if (status >= 0)
+		status = kernelPageMapReserved(ownerId, physical, page, writable);
+
+	if (!haveLock && (kernelLockGet(&memoryLock) < 0))
+		// We can't do the bookkeeping.  The page stays with the process.
+		return (status);
+
+	if (status >= 0)
+	{
+		// The reservation might have been released while we didn't hold the
+		// lock, in which case the page was released along with it
+		res = findReservation(pageDir, page, MEMORY_PAGE_SIZE);
+		if (res)
+		{
+			res->resident += MEMORY_PAGE_SIZE;
+			residentMemory += MEMORY_PAGE_SIZE;
+		}
+	}
+	else
+	{
+		// Give the page back.  If another thread populated it while we
+		// were waiting (and maybe it was paged out again), the process can
+		// carry on anyway.
+		block = findBlock(physical);
+		if (block)
+			releaseBlock(block);
+
+		if (kernelPageGetPhysical(ownerId, page) ||
+			kernelPageGetSwapped(ownerId, page, &slot))
+		{
+			status = 0;
+		}
+	}
+
+	if (!haveLock)
+		kernelLockRelease(&memoryLock);
+
+	return (status);
+}
+
+
+int kernelMemoryIsReserved(int processId, void *virtual, unsigned size)
+{
+	// Returns 1 if any of the range of virtual memory is in memory that the
+	// process has reserved (which is populated a page at a time, so it isn't
+	// physically contiguous)
+
+	int isReserved = 0;
+	void *pageDir = NULL;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (isReserved = 0);
+
+	pageDir = (void *) kernelMultitaskerGetPageDir(processId);
+	if (!pageDir)
+		return (isReserved = 0);
+
+	if (kernelLockGet(&memoryLock) < 0)
+		return (isReserved = 0);
+
+	isReserved = (findReservation(pageDir, virtual, size) != NULL);
+
+	kernelLockRelease(&memoryLock);
+
+	return (isReserved);
+}
+
+
+int kernelMemorySwapOn(const char *diskName)
+{
+	// Start paging cold user memory out to the named linux-swap partition,
+	// when we run short of physical memory
+
+	int status = 0;
+	kernelDisk *theDisk = NULL;
+	linuxSwapHeader *header = NULL;
+	unsigned char *bitmap = NULL;
+	unsigned slots = 0;
+	unsigned usable = 0;
+	unsigned slot = 0;
+	unsigned count;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!diskName)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	if (swapDisk)
+	{
+		kernelError(kernel_error, "Already paging to %s", swapDisk->name);
+		return (status = ERR_ALREADY);
+	}
+
+	theDisk = kernelDiskGetByName(diskName);
+	if (!theDisk)
+	{
+		kernelError(kernel_error, "No such disk %s", diskName);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	// Each swap slot is a page, which has to be a whole number of sectors
+	if (!theDisk->physical->sectorSize ||
+		(MEMORY_PAGE_SIZE % theDisk->physical->sectorSize))
+	{
+		kernelError(kernel_error, "Can't page to disk %s with %u-byte "
+			"sectors", diskName, theDisk->physical->sectorSize);
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	header = kernelMalloc(sizeof(linuxSwapHeader));
+	if (!header)
+		return (status = ERR_MEMORY);
+
+	status = kernelFilesystemLinuxSwapGetHeader(theDisk, header);
+	if (status < 0)
+		goto out;
+
+	// Slot numbers have to fit in a page table entry, and the size of the
+	// swap space has to fit in the memory stats
+	slots = min((header->info.lastPage + 1), (0xFFFFF000 >> 12));
+
+	bitmap = kernelMalloc((slots + 7) / 8);
+	if (!bitmap)
+	{
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	// The first page is the header, and bad pages are never free
+	bitmap[0] = 0x01;
+	usable = (slots - 1);
+
+	for (count = 0; ((count < header->info.numBadPages) &&
+		(count < LINUXSWAP_MAXBADPAGES)); count ++)
+	{
+		slot = header->info.badPages[count];
+
+		if ((slot < slots) && !(bitmap[slot / 8] & (1 << (slot % 8))))
+		{
+			bitmap[slot / 8] |= (1 << (slot % 8));
+			usable -= 1;
+		}
+	}
+
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+		goto out;
+
+	swapBitmap = bitmap;
+	swapSlots = slots;
+	swapUsable = usable;
+	swapFree = usable;
+	swapNext = 1;
+	swapDisk = theDisk;
+
+	kernelLockRelease(&memoryLock);
+
+	// The faulting processes can page out for themselves, so it's not fatal
+	// if the thread doesn't start
+	if (kernelMultitaskerSpawnKernelThread(swapThread, "swap thread", 0,
+		NULL) < 0)
+	{
+		kernelError(kernel_warn, "Unable to start the swap thread");
+	}
+
+	kernelLog("Paging to %s, %u Kb", diskName,
+		(usable * (MEMORY_PAGE_SIZE / 1024)));
+
+	status = 0;
+
+out:
+	if ((status < 0) && bitmap)
+		kernelFree(bitmap);
+
+	kernelFree(header);
+
+	return (status);
+}
+
+
 int kernelMemoryGetStats(memoryStats *stats, int kernel)
 {
 	// Return overall memory usage statistics
@@ -1214,6 +2919,10 @@ int kernelMemoryGetStats(memoryStats *stats, int kernel)
 	stats->usedBlocks = usedBlocks;
 	stats->totalMemory = totalMemory;
 	stats->usedMemory = totalUsed;
+	stats->reservedMemory = reservedMemory;
+	stats->residentMemory = residentMemory;
+	stats->swapTotal = (swapUsable * MEMORY_PAGE_SIZE);
+	stats->swapUsed = ((swapUsable - swapFree) * MEMORY_PAGE_SIZE);
 
 	return (status = 0);
 }
@@ -1227,7 +2936,9 @@ int kernelMemoryGetBlocks(memoryBlock *blocksArray, unsigned buffSize,
 
 	int status = 0;
 	int doBlocks = 0;
-	memoryBlock *temp = NULL;
+	memoryBlock *sorted = NULL;
+	kernelMemoryBlock *block = NULL;
+	int numBlocks = 0;
 	int count1, count2;
 
 	// Make sure the memory manager has been initialized
@@ -1251,43 +2962,67 @@ int kernelMemoryGetBlocks(memoryBlock *blocksArray, unsigned buffSize,
 		return (status = ERR_NULLPARAMETER);
 	}
 
+	memset(blocksArray, 0, (doBlocks * sizeof(memoryBlock)));
+
+	// There's no point in a bigger list than there are blocks
+	if (doBlocks > usedBlocks)
+		doBlocks = usedBlocks;
+	if (!doBlocks)
+		return (status = 0);
+
+	// Build the list in kernel memory.  The caller's buffer could be paged
+	// out to swap at any time, and we can't wait for it to be paged in while
+	// we're holding the lock.
+	sorted = kernelMalloc(doBlocks * sizeof(memoryBlock));
+	if (!sorted)
+		return (status = ERR_MEMORY);
+
 	// Obtain a lock on the memory data
 	status = kernelLockGet(&memoryLock);
 	if (status < 0)
+	{
+		kernelFree(sorted);
 		return (status);
+	}
 
-	// Before we return the list of used memory blocks, we should sort it so
-	// that it's a little easier to see the distribution of memory.  This will
-	// not help the memory manager to function more efficiently or anything,
-	// it's purely cosmetic.  Just a bubble sort.
-	for (count1 = 0; count1 < usedBlocks; count1 ++)
+	// Here's the loop through the hash chains.  The hash order doesn't mean
+	// anything, so insert each block in order of start address, which makes
+	// it easier to see the distribution of memory.  If there are more than
+	// will fit, keep the lowest ones.
+	for (count1 = 0; count1 < MEMORY_BLOCK_BUCKETS; count1 ++)
 	{
-		for (count2 = 0;  count2 < (usedBlocks - 1); count2 ++)
+		for (block = blockHash[count1]; block; block = block->next)
 		{
-			if (usedBlockList[count2]->startLocation >
-				usedBlockList[count2 + 1]->startLocation)
+			if (numBlocks >= doBlocks)
+			{
+				if (block->block.startLocation >=
+					sorted[doBlocks - 1].startLocation)
+				{
+					continue;
+				}
+
+				// Drop the highest one to make room
+				numBlocks -= 1;
+			}
+
+			for (count2 = numBlocks; ((count2 > 0) &&
+				(sorted[count2 - 1].startLocation >
+					block->block.startLocation)); count2 --)
 			{
-				temp = usedBlockList[count2 + 1];
-				usedBlockList[count2 + 1] = usedBlockList[count2];
-				usedBlockList[count2] = temp;
+				memcpy(&sorted[count2], &sorted[count2 - 1],
+					sizeof(memoryBlock));
 			}
+
+			memcpy(&sorted[count2], &block->block, sizeof(memoryBlock));
+			numBlocks += 1;
 		}
 	}
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
 
-	// Here's the loop through the used list
-	for (count1 = 0; count1 < doBlocks; count1 ++)
-	{
-		blocksArray[count1].processId = usedBlockList[count1]->processId;
-		strncpy(blocksArray[count1].description,
-			usedBlockList[count1]->description, MEMORY_MAX_DESC_LENGTH);
-		blocksArray[count1].startLocation =
-			usedBlockList[count1]->startLocation;
-		blocksArray[count1].endLocation = usedBlockList[count1]->endLocation;
-	}
+	memcpy(blocksArray, sorted, (numBlocks * sizeof(memoryBlock)));
+	kernelFree(sorted);
 
 	return (status = 0);
 }
-
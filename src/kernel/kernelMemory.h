@@ -21,10 +21,18 @@
 
 #if !defined(_KERNELMEMORY_H)
 
+#include <sys/file.h>
 #include <sys/memory.h>
 
-// Maximum number of raw memory allocations
-#define MAXMEMORYBLOCKS			2048
+// Initial number of raw memory allocation records.  More are allocated, a
+// page at a time, when fewer than MEMORY_MIN_FREE_RECORDS are left.
+#define MEMORY_INIT_RECORDS		2048
+#define MEMORY_MIN_FREE_RECORDS	16
+
+// Sizes of the hash tables for looking up allocations by start address and
+// by process
+#define MEMORY_BLOCK_BUCKETS	1024
+#define MEMORY_PROC_BUCKETS		64
 
 // Descriptions for standard reserved memory areas
 #define MEMORYDESC_IVT_BDA		"real mode ivt and bda"
@@ -34,6 +42,63 @@
 #define MEMORYDESC_PAGING		"kernel paging data"
 #define MEMORYDESC_USEDBLOCKS	"used memory block list"
 #define MEMORYDESC_FREEBITMAP	"free memory bitmap"
+#define MEMORYDESC_FREESUMMARY	"free memory summary"
+#define MEMORYDESC_ZEROPOOL		"cleared memory pool"
+
+// The idle thread keeps a pool of memory that it has already cleared, in
+// chunks of MEMORY_ZERO_CHUNK bytes
+#define MEMORY_ZERO_CHUNK		USER_MEMORY_HEAP_MULTIPLE
+#define MEMORY_ZERO_POOL_CHUNKS	16
+#define MEMORY_ZERO_POOL_SIZE	(MEMORY_ZERO_POOL_CHUNKS * MEMORY_ZERO_CHUNK)
+
+// When there's less than MEMORY_SWAP_LOW bytes of free memory, the swap
+// thread pages out cold user pages until there's MEMORY_SWAP_HIGH.  Below
+// MEMORY_SWAP_MIN, processes that need pages page out others themselves.
+#define MEMORY_SWAP_MIN			(256 * 1024)
+#define MEMORY_SWAP_LOW			(2 * 1024 * 1024)
+#define MEMORY_SWAP_HIGH		(4 * 1024 * 1024)
+
+// Number of memory blocks covered by each leaf of the free-block summary
+#define MEMORY_SUMMARY_BLOCKS	256
+
+// A node in the free-block summary tree.  It describes the free blocks in
+// its range of the free-block bitmap, so that we can find a run of free
+// blocks without scanning the whole bitmap.
+typedef struct {
+	unsigned prefix;	// Free blocks at the start of the range
+	unsigned suffix;	// Free blocks at the end of the range
+	unsigned largest;	// Longest run of free blocks in the range
+
+} kernelFreeSummary;
+
+// A record of a raw memory allocation.  It's in a hash chain for its start
+// address, and another for its owning process.
+typedef struct _kernelMemoryBlock {
+	memoryBlock block;
+	struct _kernelMemoryBlock *prev;
+	struct _kernelMemoryBlock *next;
+	struct _kernelMemoryBlock *procPrev;
+	struct _kernelMemoryBlock *procNext;
+
+} kernelMemoryBlock;
+
+// A range of a process' virtual memory that's reserved, and only gets
+// physical memory a page at a time, when it's touched.  If it's a mapped
+// file, the pages are read from the file.  Pages can be paged out to swap.
+typedef struct _kernelMemoryReservation {
+	int processId;
+	void *pageDir;
+	void *virtual;
+	unsigned size;
+	unsigned resident;
+	unsigned swapped;
+	char description[MEMORY_MAX_DESC_LENGTH];
+	file *mapFile;
+	unsigned mapOffset;
+	int mapFlags;
+	struct _kernelMemoryReservation *next;
+
+} kernelMemoryReservation;
 
 typedef struct {
 	unsigned size;
@@ -53,9 +118,15 @@ int kernelMemoryGetIo(unsigned, unsigned, int, const char *,
 int kernelMemoryReleaseIo(kernelIoMemory *);
 int kernelMemoryChangeOwner(int, int, int, void *, void **);
 int kernelMemoryShare(int, int, void *, void **);
+int kernelMemoryFillZeroPool(void);
+int kernelMemoryPageFault(int, void *, unsigned);
+int kernelMemoryIsReserved(int, void *, unsigned);
+int kernelMemorySwapOn(const char *);
 
 // Functions exported to userspace
 void *kernelMemoryGet(unsigned, const char *);
+void *kernelMemoryReserve(unsigned, const char *);
+void *kernelMemoryMapFile(file *, unsigned, unsigned, int);
 int kernelMemoryRelease(void *);
 int kernelMemoryReleaseAllByProcId(int);
 int kernelMemoryGetStats(memoryStats *, int);
@@ -233,6 +233,7 @@ int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 	unsigned stackPhysical = 0;
 	void *stackVirtual = NULL;
 	long memoryOffset = 0;
+	unsigned *savedFrame = NULL;
 	const char *symbolName = NULL;
 
 	// Check params
@@ -278,8 +279,8 @@ int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 	}
 	else
 	{
-		instPointer = (void *) traceProcess->taskStateSegment.EIP;
-		framePointer = (void *) traceProcess->taskStateSegment.EBP;
+		// If the process has never run, all we have is its entry point
+		instPointer = (void *) traceProcess->context.EIP;
 
 		// If we're tracing some other process, we need to map its stack into
 		// our address space.
@@ -303,6 +304,17 @@ int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 			else
 				memoryOffset = -(traceProcess->userStack - stackVirtual);
 		}
+
+		// Otherwise, the saved context on the process' stack begins with
+		// the instruction pointer and frame pointer where it was switched
+		// out.
+		if (traceProcess->context.savedESP)
+		{
+			savedFrame = (unsigned *)(traceProcess->context.savedESP +
+				memoryOffset);
+			instPointer = (void *) savedFrame[0];
+			framePointer = (void *) savedFrame[1];
+		}
 	}
 
 	// First try and figure out the current function
@@ -23,12 +23,14 @@
 // multitasker
 
 #include "kernelMultitasker.h"
+#include "kernelApicDriver.h"
 #include "kernelCpu.h"
 #include "kernelDebug.h"
 #include "kernelEnvironment.h"
 #include "kernelError.h"
 #include "kernelFile.h"
 #include "kernelInterrupt.h"
+#include "kernelLock.h"
 #include "kernelLog.h"
 #include "kernelMain.h"
 #include "kernelMalloc.h"
@@ -49,7 +51,7 @@
 
 #define PROC_KILLABLE(proc) ((proc != kernelProc) && \
 	(proc != exceptionProc) && \
-	(proc != idleProc) && \
+	(proc != cpus[proc->cpu].idleProc) && \
 	(proc != kernelCurrentProcess))
 
 #define SET_PORT_BIT(bitmap, port) \
@@ -58,34 +60,170 @@
 	do { bitmap[port / 8] &= ~(1 << (port % 8)); } while (0)
 #define GET_PORT_BIT(bitmap, port) ((bitmap[port / 8] >> (port % 8)) & 0x01)
 
+// Above this many pages, a TLB shootdown flushes the whole TLB
+#define TLB_SHOOTDOWN_MAX_PAGES		32
+
+// How far a priority boost is passed along a chain of lock holders
+#define MAX_INHERIT_DEPTH			8
+
+// Hash buckets for the wait queues of locks
+#define LOCK_WAIT_BUCKETS			64
+
+// A process' FPU state is saved in the aligned part of its fpuState buffer
+#define FPU_STATE_AREA(proc) \
+	((void *)(((unsigned)(proc)->fpuState + (FPU_STATE_ALIGN - 1)) & \
+		~(FPU_STATE_ALIGN - 1)))
+
 // Global multitasker stuff
 static int multitaskingEnabled = 0;
 static volatile int processIdCounter = KERNELPROCID;
 static kernelProcess *kernelProc = NULL;
-static kernelProcess *idleProc = NULL;
 static kernelProcess *exceptionProc = NULL;
 static volatile int processingException = 0;
 static volatile unsigned exceptionAddress = 0;
-static volatile int schedulerSwitchedByCall = 0;
-static kernelProcess *fpuProcess = NULL;
 
 // We allow the pointer to the current process to be exported, so that when a
 // process uses system calls, there is an easy way for the process to get
-// information about itself.
+// information about itself.  This is the current process of the boot
+// processor, which is the only one that runs kernel code.
 kernelProcess *kernelCurrentProcess = NULL;
 
 // Process queue for CPU execution
 static kernelProcess *processQueue[MAX_PROCESSES];
 static volatile int numQueued = 0;
-
-// Things specific to the scheduler.  The scheduler process is just a
-// convenient place to keep things, we don't use all of it and it doesn't go
-// in the queue
-static kernelProcess *schedulerProc = NULL;
+static volatile int numFinished = 0;
+
+// Pending kernel timers (including those of waiting processes), in a binary
+// min-heap ordered by expiry time, so that the scheduler only needs to look
+// at the ones that have actually expired.
+static kernelTimer *timerHeap[MAX_TIMERS];
+static volatile int numTimers = 0;
+
+// Processes waiting for a lock are queued on it in the order in which they
+// arrived.  The queues are kept here rather than in the locks themselves,
+// since a lock can be in user memory.  There can't be more of them than
+// there are processes to wait.
+typedef volatile struct _lockWaitQueue {
+	lock *lock;
+	kernelPageDirectory *pageDirectory;	// Only for locks in user memory
+	kernelProcess *first;
+	kernelProcess *last;
+	volatile struct _lockWaitQueue *next;	// Hash chain, or free list
+
+} lockWaitQueue;
+
+static lockWaitQueue lockWaitQueues[MAX_PROCESSES];
+static lockWaitQueue *lockWaitHash[LOCK_WAIT_BUCKETS];
+static lockWaitQueue *lockWaitFree = NULL;
+static int lockWaitUsed = 0;
+
+// The scheduler trace is a ring buffer of process state change events, with
+// raw CPU timestamps.  It's protected by the scheduler lock, and only
+// allocated the first time that it's enabled.
+static struct {
+	volatile int enabled;
+	schedTraceEvent *events;
+	unsigned first;
+	unsigned count;
+
+} schedTrace;
+
+// How FPU state gets saved and restored, depending on what the processors
+// support.  FXSAVE and XSAVE also cover the SSE (and, with XSAVE, AVX)
+// registers.  New processes get their state from fpuInitState.
+static enum { fpu_fsave, fpu_fxsave, fpu_xsave } fpuSaveType = fpu_fsave;
+static unsigned fpuXsaveMask = 0;
+static unsigned fpuCr4Bits = 0;
+static unsigned char fpuInitState[FPU_STATE_LEN]
+	__attribute__((aligned(FPU_STATE_ALIGN)));
+
+// Per-processor state.  All kernel code runs on the boot processor (CPU 0).
+// The application processors only run user processes in user mode; a process
+// that enters the kernel migrates to the boot processor first, and a user
+// process that's preempted outside the kernel can be moved to the least
+// loaded processor.  Each processor has its own scheduler, idle thread, TSS,
+// and ready queues -- one per priority level, with a bitmap of the non-empty
+// ones, so that the scheduler doesn't need to examine every process in order
+// to choose the next one.  The scheduler processes are just a convenient
+// place to keep things, we don't use all of them and they don't go in the
+// process queue.
+typedef volatile struct {
+	int cpuNum;
+	int apicId;
+	int online;
+	kernelTSS *tss;
+	kernelSelector tssSelector;
+	kernelProcess *schedulerProc;
+	kernelProcess *idleProc;
+	kernelProcess *currentProcess;
+	kernelProcess *fpuProcess;
+	kernelProcess *ioMapProcess;
+	unsigned loadedCR3;
+	int switchedByCall;
+	int preemptedRing;
+	uquad_t sliceStart;
+	uquad_t sliceEnd;
+	struct {
+		kernelProcess *first;
+		kernelProcess *last;
+		unsigned waitTime;
+
+	} readyQueue[PRIORITY_LEVELS];
+	unsigned readyBitmap;
+	int numReady;
+	int numIoReady;
+
+} cpuState;
+
+static cpuState cpus[MAX_CPUS];
+static volatile int numCpus = 1;
+
+// Protects the ready queues of all the processors, and the processor
+// assignments of the processes
+static spinLock schedulerLock;
+
+// Things specific to the boot processor's scheduler
 static volatile int schedulerStop = 0;
 static void (*oldSysTimerHandler)(void) = NULL;
 static volatile unsigned schedulerTimeslices = 0;
 
+// If we have local APICs, each processor uses its own APIC timer in one-shot
+// mode for the end of its time slice (or the next kernel timer), and an idle
+// processor isn't interrupted at all until there's something for it to do.
+// Otherwise the boot processor uses the system timer, and gives the others
+// a reschedule interrupt once per time slice.
+static int apicTimer = 0;
+
+// The boot processor's TSS.  TSSs are only used for privilege level changes
+// (i.e. to supply the supervisor stack of the current process) and user I/O
+// permissions.  Context switches are done in software.
+static kernelTSS bootCpuTSS;
+
+// The current TLB shootdown request to the application processors
+static struct {
+	unsigned pageDir;
+	void *virtual;
+	unsigned pages;
+	volatile unsigned pending;
+
+} tlbShootdown;
+static spinLock tlbShootdownLock;
+
+// New processes start here, the first time they're switched to.  The
+// initial stack frame is built by createStartFrame().
+extern void processStart(void);
+__asm__ (
+	".text \n"
+	"processStart: \n\t"
+	"popl %ebp \n\t"
+	"popl %gs \n\t"
+	"popl %fs \n\t"
+	"popl %es \n\t"
+	"popl %ds \n\t"
+	"popfl \n\t"
+	"iret"
+);
+
 // An array of exception types.  The selectors are initialized later.
 static struct {
 	int index;
@@ -94,7 +232,7 @@ static struct {
 	const char *name;
 	int (*handler)(void);
 
-} exceptionVector[19] = {
+} exceptionVector[EXCEPTIONS] = {
 	{ EXCEPTION_DIVBYZERO, 0, "a", "divide-by-zero", NULL },
 	{ EXCEPTION_DEBUG, 0, "a", "debug", NULL },
 	{ EXCEPTION_NMI, 0, "a", "non-maskable interrupt (NMI)", NULL },
@@ -113,55 +251,51 @@ static struct {
 	{ EXCEPTION_RESERVED, 0, "a", "\"reserved\"", NULL },
 	{ EXCEPTION_FLOAT, 0, "a", "floating point", NULL },
 	{ EXCEPTION_ALIGNCHECK, 0, "an", "alignment check", NULL },
-	{ EXCEPTION_MACHCHECK, 0, "a", "machine check", NULL }
+	{ EXCEPTION_MACHCHECK, 0, "a", "machine check", NULL },
+	{ EXCEPTION_SIMD, 0, "a", "SIMD floating point", NULL }
 };
 
 
-static void debugTSS(kernelProcess *proc, char *buffer, int len)
+static void debugContext(kernelProcess *proc, char *buffer, int len)
 {
 	if (!buffer)
 		return;
 
-	snprintf(buffer, len, "Multitasker debug TSS selector:\n");
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  oldTSS=%08x", proc->taskStateSegment.oldTSS);
+	snprintf(buffer, len, "Multitasker debug context:\n");
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP0=%08x SS0=%08x\n", proc->taskStateSegment.ESP0,
-		proc->taskStateSegment.SS0);
+		"  savedESP=%08x ESP0=%08x CR3=%08x\n", proc->context.savedESP,
+		proc->context.ESP0, proc->context.CR3);
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP1=%08x SS1=%08x\n", proc->taskStateSegment.ESP1,
-		proc->taskStateSegment.SS1);
+		"  start EIP=%08x EFLAGS=%08x ESP=%08x\n", proc->context.EIP,
+		proc->context.EFLAGS, proc->context.ESP);
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP2=%08x SS2=%08x\n", proc->taskStateSegment.ESP2,
-		proc->taskStateSegment.SS2);
+		"  CS=%08x DS=%08x SS=%08x ioMap=%p\n", proc->context.CS,
+		proc->context.DS, proc->context.SS, proc->ioMap);
+}
 
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  CR3=%08x EIP=%08x EFLAGS=%08x\n", proc->taskStateSegment.CR3,
-		proc->taskStateSegment.EIP, proc->taskStateSegment.EFLAGS);
 
-	// Skip general-purpose registers for now -- not terribly interesting
+static inline cpuState *thisCpu(void)
+{
+	// Returns the state of the processor we're running on, which we can
+	// identify by its TSS selector.  Until the task register is loaded (or
+	// if it's not one of the application processors' TSSs), it's the boot
+	// processor.
 
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP=%08x EBP=%08x ESI=%08x EDI=%08x\n",
-		proc->taskStateSegment.ESP, proc->taskStateSegment.EBP,
-		proc->taskStateSegment.ESI, proc->taskStateSegment.EDI);
+	kernelSelector selector = 0;
+	int count;
 
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  CS=%08x SS=%08x\n", proc->taskStateSegment.CS,
-		proc->taskStateSegment.SS);
+	processorGetTaskReg(selector);
 
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ES=%08x DS=%08x FS=%08x GS=%08x\n", proc->taskStateSegment.ES,
-		proc->taskStateSegment.DS, proc->taskStateSegment.FS,
-		proc->taskStateSegment.GS);
+	for (count = 1; count < numCpus; count ++)
+	{
+		if (cpus[count].tssSelector == selector)
+			return (&cpus[count]);
+	}
 
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  LDTSelector=%08x IOMapBase=%04x\n",
-		proc->taskStateSegment.LDTSelector,
-		proc->taskStateSegment.IOMapBase);
+	return (&cpus[0]);
 }
 
 
@@ -248,6 +382,666 @@ static inline int releaseProcess(kernelProcess *killProcess)
 }
 
 
+static inline void timerHeapSwap(int first, int second)
+{
+	kernelTimer *tmpTimer = timerHeap[first];
+
+	timerHeap[first] = timerHeap[second];
+	timerHeap[first]->heapPosition = (first + 1);
+	timerHeap[second] = tmpTimer;
+	timerHeap[second]->heapPosition = (second + 1);
+}
+
+
+static void timerHeapUp(int position)
+{
+	// Move the timer at the given heap position up toward the root until
+	// its parent expires no later than it does
+
+	int parent = 0;
+
+	while (position > 0)
+	{
+		parent = ((position - 1) / 2);
+
+		if (timerHeap[parent]->expiry <= timerHeap[position]->expiry)
+			break;
+
+		timerHeapSwap(parent, position);
+		position = parent;
+	}
+}
+
+
+static void timerHeapDown(int position)
+{
+	// Move the timer at the given heap position down toward the leaves
+	// until neither of its children expires before it does
+
+	int child = 0;
+
+	while (1)
+	{
+		child = ((position * 2) + 1);
+		if (child >= numTimers)
+			break;
+
+		if (((child + 1) < numTimers) &&
+			(timerHeap[child + 1]->expiry < timerHeap[child]->expiry))
+		{
+			child += 1;
+		}
+
+		if (timerHeap[position]->expiry <= timerHeap[child]->expiry)
+			break;
+
+		timerHeapSwap(position, child);
+		position = child;
+	}
+}
+
+
+static void timerRemove(kernelTimer *timer)
+{
+	// Remove a timer from the heap, if it's pending.  Interrupts must be
+	// disabled.
+
+	int position = 0;
+
+	if (!timer->heapPosition)
+		// Not pending
+		return;
+
+	position = (timer->heapPosition - 1);
+	timer->heapPosition = 0;
+
+	numTimers -= 1;
+	if (position == numTimers)
+		return;
+
+	// Move the last timer into the vacated spot, and restore the heap order
+	timerHeap[position] = timerHeap[numTimers];
+	timerHeap[position]->heapPosition = (position + 1);
+	timerHeapUp(position);
+	timerHeapDown(position);
+}
+
+
+static int timerInsert(kernelTimer *timer, unsigned milliseconds,
+	void (*function)(void *), void *data)
+{
+	// Add a timer to the heap, replacing any previous setting, to expire
+	// after the given number of milliseconds.  Interrupts must be disabled.
+
+	timerRemove(timer);
+
+	if (numTimers >= MAX_TIMERS)
+		return (ERR_NOFREE);
+
+	timer->expiry = (kernelCpuGetUs() + (milliseconds * (uquad_t) US_PER_MS));
+	timer->function = function;
+	timer->data = data;
+
+	timerHeap[numTimers] = timer;
+	timer->heapPosition = (numTimers + 1);
+	numTimers += 1;
+	timerHeapUp(numTimers - 1);
+
+	return (0);
+}
+
+
+static void runExpiredTimers(void)
+{
+	// Called by the scheduler to fire any timers whose time has come
+
+	unsigned long long theTime = 0;
+	kernelTimer *timer = NULL;
+
+	if (!numTimers)
+		return;
+
+	// Get the CPU time
+	theTime = kernelCpuGetUs();
+
+	while (numTimers && (timerHeap[0]->expiry <= theTime))
+	{
+		timer = timerHeap[0];
+		timerRemove(timer);
+
+		if (timer->function)
+			timer->function(timer->data);
+	}
+}
+
+
+static inline int readyQueueLevel(kernelProcess *proc)
+{
+	// Returns the ready queue level for the process.  A process that was
+	// waiting for I/O which has now arrived is given a high (1) temporary
+	// priority level, except for real-time and background processes.
+
+	if ((proc->state == proc_ioready) && proc->priority &&
+		(proc->priority < (PRIORITY_LEVELS - 1)))
+	{
+		return (1);
+	}
+
+	return (proc->priority);
+}
+
+
+static void readyEnqueue(kernelProcess *proc)
+{
+	// Add a ready process to the ready queue for its priority level, on its
+	// processor.  Normal ready processes go to the back of the queue, while
+	// I/O ready processes go to the front.  The scheduler lock must be held.
+
+	cpuState *cpu = &cpus[proc->cpu];
+	int level = 0;
+
+	if (proc->readyLevel >= 0)
+		// Already queued
+		return;
+
+	level = readyQueueLevel(proc);
+
+	if (!cpu->readyQueue[level].first)
+	{
+		proc->prevReady = proc->nextReady = NULL;
+		cpu->readyQueue[level].first = cpu->readyQueue[level].last = proc;
+		cpu->readyQueue[level].waitTime = 0;
+		cpu->readyBitmap |= (1 << level);
+	}
+	else if (proc->state == proc_ioready)
+	{
+		proc->prevReady = NULL;
+		proc->nextReady = cpu->readyQueue[level].first;
+		cpu->readyQueue[level].first->prevReady = proc;
+		cpu->readyQueue[level].first = proc;
+	}
+	else
+	{
+		proc->prevReady = cpu->readyQueue[level].last;
+		proc->nextReady = NULL;
+		cpu->readyQueue[level].last->nextReady = proc;
+		cpu->readyQueue[level].last = proc;
+	}
+
+	proc->readyLevel = level;
+	cpu->numReady += 1;
+
+	if (proc->state == proc_ioready)
+		cpu->numIoReady += 1;
+}
+
+
+static void readyDequeue(kernelProcess *proc)
+{
+	// Remove a process from whichever ready queue it's in, if any.  The
+	// scheduler lock must be held.
+
+	cpuState *cpu = &cpus[proc->cpu];
+	int level = proc->readyLevel;
+
+	if (level < 0)
+		// Not queued
+		return;
+
+	if (proc->prevReady)
+		proc->prevReady->nextReady = proc->nextReady;
+	else
+		cpu->readyQueue[level].first = proc->nextReady;
+
+	if (proc->nextReady)
+		proc->nextReady->prevReady = proc->prevReady;
+	else
+		cpu->readyQueue[level].last = proc->prevReady;
+
+	if (!cpu->readyQueue[level].first)
+	{
+		cpu->readyBitmap &= ~(1 << level);
+		cpu->readyQueue[level].waitTime = 0;
+	}
+
+	proc->prevReady = proc->nextReady = NULL;
+	proc->readyLevel = -1;
+	cpu->numReady -= 1;
+
+	if (proc->state == proc_ioready)
+		cpu->numIoReady -= 1;
+}
+
+
+static void schedTraceRecord(kernelProcess *proc, processState newState)
+{
+	// Record a scheduler trace event for a process state change, if it's
+	// interesting.  If the buffer is full, the oldest event is overwritten.
+	// The scheduler lock must be held.
+
+	schedTraceEvent *event = NULL;
+	int type = 0;
+
+	if (newState == proc_running)
+		type = SCHEDTRACE_SWITCHIN;
+	else if (proc->state == proc_running)
+		type = SCHEDTRACE_SWITCHOUT;
+	else if ((newState == proc_ready) || (newState == proc_ioready))
+		type = SCHEDTRACE_WAKEUP;
+	else
+		return;
+
+	event = &schedTrace.events[(schedTrace.first + schedTrace.count) %
+		SCHEDTRACE_EVENTS];
+
+	if (schedTrace.count < SCHEDTRACE_EVENTS)
+		schedTrace.count += 1;
+	else
+		schedTrace.first = ((schedTrace.first + 1) % SCHEDTRACE_EVENTS);
+
+	event->time = kernelCpuTimestamp();
+	event->processId = proc->processId;
+	event->cpu = proc->cpu;
+	event->type = type;
+	event->state = newState;
+}
+
+
+static void changeProcessState(kernelProcess *proc, processState newState)
+{
+	// All changes to process states go through here, so that the ready
+	// queues are kept up to date.  The scheduler lock must be held.
+
+	if (schedTrace.enabled)
+		schedTraceRecord(proc, newState);
+
+	readyDequeue(proc);
+
+	if (proc->state == proc_finished)
+		numFinished -= 1;
+
+	// If the process is leaving the waiting state for any reason, it no
+	// longer needs its wakeup timer
+	if ((proc->state == proc_waiting) && (newState != proc_waiting))
+		timerRemove(&proc->waitTimer);
+
+	proc->state = newState;
+
+	if ((newState == proc_ready) || (newState == proc_ioready))
+		readyEnqueue(proc);
+	else if (newState == proc_finished)
+		numFinished += 1;
+}
+
+
+static void setProcessState(kernelProcess *proc, processState newState)
+{
+	kernelSpinLockGet(&schedulerLock);
+	changeProcessState(proc, newState);
+	kernelSpinLockRelease(&schedulerLock);
+}
+
+
+static void setPriority(kernelProcess *proc, int newPriority)
+{
+	// Set the priority value of the process.  If it's in a ready queue, move
+	// it to the one for the new priority.
+
+	kernelSpinLockGet(&schedulerLock);
+	if (proc->readyLevel >= 0)
+	{
+		readyDequeue(proc);
+		proc->priority = newPriority;
+		readyEnqueue(proc);
+	}
+	else
+	{
+		proc->priority = newPriority;
+	}
+	kernelSpinLockRelease(&schedulerLock);
+}
+
+
+static kernelProcess *getLockHolder(kernelProcess *waiter)
+{
+	// Returns the process holding the lock that the waiter is waiting for,
+	// if any.  A lock in user memory can only be looked at from within the
+	// same address space.
+
+	lock *waitLock = waiter->waitLock;
+
+	if (!waitLock)
+		return (NULL);
+
+	if (((unsigned) waitLock < KERNEL_VIRTUAL_ADDRESS) &&
+		(waiter->pageDirectory != kernelCurrentProcess->pageDirectory))
+	{
+		return (NULL);
+	}
+
+	return (getProcessById(waitLock->processId));
+}
+
+
+static lockWaitQueue *lockQueueFind(lock *waitLock,
+	kernelPageDirectory *pageDirectory, int create)
+{
+	// Find the wait queue of a lock, or optionally start a new one.  A lock
+	// in user memory is only the same lock within the same address space.
+	// Called with interrupts disabled.
+
+	lockWaitQueue *queue = NULL;
+	unsigned bucket = (((unsigned) waitLock >> 2) % LOCK_WAIT_BUCKETS);
+
+	if ((unsigned) waitLock >= KERNEL_VIRTUAL_ADDRESS)
+		pageDirectory = NULL;
+
+	for (queue = lockWaitHash[bucket]; queue; queue = queue->next)
+	{
+		if ((queue->lock == waitLock) &&
+			(queue->pageDirectory == pageDirectory))
+		{
+			return (queue);
+		}
+	}
+
+	if (!create)
+		return (queue = NULL);
+
+	if (lockWaitFree)
+	{
+		queue = lockWaitFree;
+		lockWaitFree = queue->next;
+	}
+	else if (lockWaitUsed < MAX_PROCESSES)
+	{
+		queue = &lockWaitQueues[lockWaitUsed++];
+	}
+	else
+	{
+		return (queue = NULL);
+	}
+
+	queue->lock = waitLock;
+	queue->pageDirectory = pageDirectory;
+	queue->first = queue->last = NULL;
+	queue->next = lockWaitHash[bucket];
+	lockWaitHash[bucket] = queue;
+
+	return (queue);
+}
+
+
+static void lockQueueRemove(lockWaitQueue *queue, kernelProcess *proc)
+{
+	// Take a process out of a lock's wait queue, and free the queue if that
+	// leaves it empty.  Called with interrupts disabled.
+
+	kernelProcess *prev = NULL;
+	lockWaitQueue **link = NULL;
+
+	if (queue->first == proc)
+	{
+		queue->first = proc->nextLockWaiter;
+	}
+	else
+	{
+		for (prev = queue->first; prev && (prev->nextLockWaiter != proc); )
+			prev = prev->nextLockWaiter;
+
+		if (prev)
+			prev->nextLockWaiter = proc->nextLockWaiter;
+	}
+
+	if (queue->last == proc)
+		queue->last = prev;
+
+	proc->nextLockWaiter = NULL;
+	proc->waitLock = NULL;
+
+	if (queue->first)
+		return;
+
+	link = &lockWaitHash[((unsigned) queue->lock >> 2) % LOCK_WAIT_BUCKETS];
+	while (*link && (*link != queue))
+		link = (lockWaitQueue **) &(*link)->next;
+
+	if (*link)
+		*link = queue->next;
+
+	queue->next = lockWaitFree;
+	lockWaitFree = queue;
+}
+
+
+static void lockWaitAbandon(kernelProcess *proc)
+{
+	// A process that's being killed stops waiting for its lock, if any
+
+	lock *waitLock = proc->waitLock;
+	lockWaitQueue *queue = NULL;
+	int interrupts = 0;
+
+	if (!waitLock)
+		return;
+
+	processorSuspendInts(interrupts);
+
+	queue = lockQueueFind(waitLock, proc->pageDirectory, 0);
+	if (queue)
+		lockQueueRemove(queue, proc);
+	proc->waitLock = NULL;
+
+	processorRestoreInts(interrupts);
+}
+
+
+static void inheritPriority(kernelProcess *waiter)
+{
+	// The waiter is going to sleep waiting for a lock.  Boost the holder of
+	// the lock to the waiter's priority if that's higher, so that a
+	// low-priority holder can't be starved by medium-priority processes
+	// while the high-priority waiter waits for it.  If the holder is itself
+	// waiting for another lock, the boost is passed along the chain.
+
+	kernelProcess *holder = NULL;
+	int count;
+
+	for (count = 0; count < MAX_INHERIT_DEPTH; count ++)
+	{
+		holder = getLockHolder(waiter);
+		if (!holder || (holder == waiter) ||
+			(holder->priority <= waiter->priority))
+		{
+			break;
+		}
+
+		setPriority(holder, waiter->priority);
+		waiter = holder;
+	}
+}
+
+
+static void moveProcessCpu(kernelProcess *proc, int cpuNum)
+{
+	// Assign a process to another processor, moving it to that processor's
+	// ready queues if it's ready.  The process must not be running, and the
+	// scheduler lock must be held.
+
+	int queued = (proc->readyLevel >= 0);
+
+	if (queued)
+		readyDequeue(proc);
+
+	proc->cpu = cpuNum;
+
+	if (queued)
+		readyEnqueue(proc);
+}
+
+
+static void fpuStateSave(kernelProcess *proc)
+{
+	// Save the contents of this processor's FPU to the process
+
+	unsigned char *area = FPU_STATE_AREA(proc);
+
+	switch (fpuSaveType)
+	{
+		case fpu_xsave:
+			processorXStateSave(area, fpuXsaveMask, 0);
+			break;
+
+		case fpu_fxsave:
+			processorFxStateSave(area);
+			break;
+
+		default:
+			processorFpuStateSave(area[0]);
+			break;
+	}
+
+	proc->fpuStateSaved = 1;
+}
+
+
+static void fpuStateRestore(kernelProcess *proc)
+{
+	// Load this processor's FPU with the process' saved state, or with the
+	// initial state if it has none
+
+	unsigned char *area = FPU_STATE_AREA(proc);
+	unsigned short fpuReg = 0;
+
+	if (!proc->fpuStateSaved)
+	{
+		if (fpuSaveType == fpu_fsave)
+		{
+			processorFpuInit();
+			processorGetFpuControl(fpuReg);
+			// Mask FPU exceptions.
+			fpuReg |= 0x3F;
+			processorSetFpuControl(fpuReg);
+			return;
+		}
+
+		area = fpuInitState;
+	}
+
+	switch (fpuSaveType)
+	{
+		case fpu_xsave:
+			processorXStateRestore(area, fpuXsaveMask, 0);
+			break;
+
+		case fpu_fxsave:
+			processorFxStateRestore(area);
+			break;
+
+		default:
+			processorFpuStateRestore(area[0]);
+			break;
+	}
+}
+
+
+static void fpuCpuInitialize(void)
+{
+	// Turn on the chosen method of FPU state saving for the current
+	// processor
+
+	unsigned cr4 = 0;
+
+	if (fpuSaveType == fpu_fsave)
+		return;
+
+	processorGetCR4(cr4);
+	processorSetCR4(cr4 | fpuCr4Bits);
+
+	if (fpuSaveType == fpu_xsave)
+		processorSetXCR(0, fpuXsaveMask, 0);
+}
+
+
+static void fpuDetect(void)
+{
+	// Use CPUID to decide how to save FPU state, and set up the boot
+	// processor.  We assume that all of the processors are the same.
+
+	unsigned cpuIdLimit = 0, features = 0;
+	unsigned rega = 0, regb = 0, regc = 0, regd = 0;
+
+	processorId(0, cpuIdLimit, regb, regc, regd);
+	if (cpuIdLimit < 1)
+		return;
+
+	processorId(1, rega, regb, features, regd);
+	if (!(regd & X86_CPUID1_EDX_FXSR))
+		return;
+
+	fpuSaveType = fpu_fxsave;
+	fpuCr4Bits = X86_CR4_OSFXSR;
+
+	// Let SIMD floating point errors cause exceptions, rather than invalid
+	// opcode faults
+	if (regd & X86_CPUID1_EDX_SSE)
+		fpuCr4Bits |= X86_CR4_OSXMMEXCPT;
+
+	if ((features & X86_CPUID1_ECX_XSAVE) && (cpuIdLimit >= 0xD))
+	{
+		// Which state components does XSAVE support?
+		processorIdSub(0xD, 0, rega, regb, regc, regd);
+
+		fpuXsaveMask = (rega & (X86_XCR0_X87 | X86_XCR0_SSE));
+		if (features & X86_CPUID1_ECX_AVX)
+			fpuXsaveMask |= (rega & X86_XCR0_AVX);
+
+		fpuSaveType = fpu_xsave;
+		fpuCr4Bits |= X86_CR4_OSXSAVE;
+	}
+
+	fpuCpuInitialize();
+
+	if (fpuSaveType == fpu_xsave)
+	{
+		// Now that the components are enabled, make sure the save area is
+		// big enough for them
+		processorIdSub(0xD, 0, rega, regb, regc, regd);
+		if (regb > FPU_STATE_LEN)
+		{
+			fpuXsaveMask &= ~X86_XCR0_AVX;
+			processorSetXCR(0, fpuXsaveMask, 0);
+		}
+	}
+
+	// The initial state has all FPU and SIMD exceptions masked, and
+	// everything else clear (for XSAVE, an all-zero header means that the
+	// components are in their initial state)
+	memset(fpuInitState, 0, FPU_STATE_LEN);
+	*((unsigned short *) fpuInitState) = 0x037F;	// FPU control word
+	*((unsigned *)(fpuInitState + 24)) = 0x1F80;	// MXCSR
+
+	kernelDebug(debug_multitasker, "Multitasker FPU state saved with %s "
+		"(mask %x)", ((fpuSaveType == fpu_xsave)? "XSAVE" : "FXSAVE"),
+		fpuXsaveMask);
+}
+
+
+static void releaseFpu(cpuState *cpu, kernelProcess *proc)
+{
+	// If the process' FPU state is still in this processor's FPU, save it,
+	// since the process is leaving (or going away).  Interrupts must be
+	// disabled.
+
+	if (cpu->fpuProcess != proc)
+		return;
+
+	processorClearTaskSwitched();
+	fpuStateSave(proc);
+	cpu->fpuProcess = NULL;
+}
+
+
 static int addProcessToQueue(kernelProcess *targetProcess)
 {
 	// This function will add a process to the task queue.  It returns zero on
@@ -312,6 +1106,9 @@ static int removeProcessFromQueue(kernelProcess *targetProcess)
 		// The process is not in the task queue
 		return (status = ERR_NOSUCHPROCESS);
 
+	// Make sure it's not in a ready queue either
+	setProcessState(targetProcess, proc_stopped);
+
 	// Subtract one from the number of queued processes
 	numQueued -= 1;
 
@@ -326,89 +1123,40 @@ static int removeProcessFromQueue(kernelProcess *targetProcess)
 }
 
 
-static int createTaskStateSegment(kernelProcess *theProcess)
+static void createContext(kernelProcess *theProcess)
 {
-	// This function will create a TSS (Task State Segment) for a new process
-	// based on the attributes of the process.  This function relies on the
-	// privilege, userStackSize, and superStackSize attributes having been
-	// previously set.  Returns 0 on success, negative on error.
-
-	int status = 0;
-
-	// Get a free descriptor for the process' TSS
-	status = kernelDescriptorRequest(&theProcess->tssSelector);
-	if ((status < 0) || !theProcess->tssSelector)
-		// Crap.  An error getting a free descriptor.
-		return (status);
-
-	// Fill in the process' Task State Segment descriptor
-	status = kernelDescriptorSet(
-		theProcess->tssSelector,	// TSS selector number
-		&theProcess->taskStateSegment, // Starts at...
-		sizeof(kernelTSS),			// Limit of a TSS segment
-		1,							// Present in memory
-		PRIVILEGE_SUPERVISOR,		// TSSs are supervisor privilege level
-		0,							// TSSs are system segs
-		0xB,						// TSS, 32-bit, busy
-		0,							// 0 for SMALL size granularity
-		0);							// Must be 0 in TSS
-	if (status < 0)
-	{
-		// Crap.  An error getting a free descriptor.
-		kernelDescriptorRelease(theProcess->tssSelector);
-		return (status);
-	}
-
-	// Now, fill in the TSS (Task State Segment) for the new process.  Parts
-	// of this will be different depending on whether this is a user or
-	// supervisor mode process
-
-	memset((void *) &theProcess->taskStateSegment, 0, sizeof(kernelTSS));
+	// This function will set up the initial processor context for a new
+	// process based on the attributes of the process.  This function relies
+	// on the privilege, userStackSize, and superStackSize attributes having
+	// been previously set.
 
-	// Set the IO bitmap's offset
-	theProcess->taskStateSegment.IOMapBase = IOBITMAP_OFFSET;
+	memset((void *) &theProcess->context, 0, sizeof(kernelProcessContext));
 
 	if (theProcess->processorPrivilege == PRIVILEGE_SUPERVISOR)
 	{
-		theProcess->taskStateSegment.CS = PRIV_CODE;
-		theProcess->taskStateSegment.DS = PRIV_DATA;
-		theProcess->taskStateSegment.SS = PRIV_STACK;
+		theProcess->context.CS = PRIV_CODE;
+		theProcess->context.DS = PRIV_DATA;
+		theProcess->context.SS = PRIV_STACK;
 	}
 	else
 	{
-		theProcess->taskStateSegment.CS = USER_CODE;
-		theProcess->taskStateSegment.DS = USER_DATA;
-		theProcess->taskStateSegment.SS = USER_STACK;
+		theProcess->context.CS = USER_CODE;
+		theProcess->context.DS = USER_DATA;
+		theProcess->context.SS = USER_STACK;
 
-		// Turn off access to all I/O ports by default
-		memset((void *) theProcess->taskStateSegment.IOMap, 0xFF,
-			PORTS_BYTES);
+		theProcess->context.ESP0 = ((unsigned) theProcess->superStack +
+			(theProcess->superStackSize - sizeof(int)));
 	}
 
-	// All other data segments same as DS
-	theProcess->taskStateSegment.ES = theProcess->taskStateSegment.FS =
-		theProcess->taskStateSegment.GS = theProcess->taskStateSegment.DS;
-
-	theProcess->taskStateSegment.ESP = ((unsigned) theProcess->userStack +
+	theProcess->context.ESP = ((unsigned) theProcess->userStack +
 		(theProcess->userStackSize - sizeof(void *)));
 
-	if (theProcess->processorPrivilege != PRIVILEGE_SUPERVISOR)
-	{
-		theProcess->taskStateSegment.SS0 = PRIV_STACK;
-		theProcess->taskStateSegment.ESP0 = ((unsigned)
-			theProcess->superStack + (theProcess->superStackSize -
-				sizeof(int)));
-	}
-
-	theProcess->taskStateSegment.EFLAGS = 0x00000202; // Interrupts enabled
-	theProcess->taskStateSegment.CR3 = (unsigned)
+	theProcess->context.EFLAGS = 0x00000202; // Interrupts enabled
+	theProcess->context.CR3 = (unsigned)
 		theProcess->pageDirectory->physical;
 
-	// All remaining values will be NULL from initialization.  Note that this
-	// includes the EIP.
-
-	// Return success
-	return (status = 0);
+	// The saved stack pointer is NULL until the process first runs.  Note
+	// that this also includes the EIP.
 }
 
 
@@ -499,6 +1247,7 @@ static int createNewProcess(const char *name, int priority, int privilege,
 
 	// Fill in the process' priority level
 	newProcess->priority = priority;
+	newProcess->basePriority = priority;
 
 	// Fill in the process' privilege level
 	newProcess->privilege = privilege;
@@ -512,6 +1261,11 @@ static int createNewProcess(const char *name, int priority, int privilege,
 
 	// The thread's initial state will be "stopped"
 	newProcess->state = proc_stopped;
+	newProcess->readyLevel = -1;
+
+	// It starts out on the boot processor
+	newProcess->cpu = 0;
+	newProcess->runningCpu = -1;
 
 	// Add the process to the process queue so we can continue whilst doing
 	// things like changing memory ownerships
@@ -703,18 +1457,15 @@ static int createNewProcess(const char *name, int priority, int privilege,
 			newProcess->superStack, newProcess->superStackSize);
 	}
 
-	// Create the TSS (Task State Segment) for this process.
-	status = createTaskStateSegment(newProcess);
-	if (status < 0)
-		// Not able to create the TSS
-		goto out;
+	// Set up the processor context for this process.
+	createContext(newProcess);
 
 	// Adjust the stack pointer to account for the arguments that we copied to
 	// the process' stack
-	newProcess->taskStateSegment.ESP -= sizeof(int);
+	newProcess->context.ESP -= sizeof(int);
 
 	// Set the EIP to the entry point
-	newProcess->taskStateSegment.EIP = (unsigned) execImage->entryPoint;
+	newProcess->context.EIP = (unsigned) execImage->entryPoint;
 
 	// Get memory for the user process environment structure
 	newProcess->environment = kernelMalloc(sizeof(variableList));
@@ -744,6 +1495,28 @@ out:
 }
 
 
+static void waitOffCpu(kernelProcess *proc)
+{
+	// If the process is running on one of the application processors, make
+	// that processor reschedule, and wait until the process has been switched
+	// out.  The process' state must already be such that it won't be chosen
+	// to run again.
+
+	int cpuNum = 0;
+	uquad_t timeout = 0;
+
+	while ((cpuNum = proc->runningCpu) > 0)
+	{
+		kernelApicSendIpi(cpus[cpuNum].apicId, IPI_VECTOR_RESCHEDULE);
+
+		// Send it again if it's not done within 10ms
+		timeout = (kernelCpuGetMs() + 10);
+		while ((proc->runningCpu == cpuNum) && (kernelCpuGetMs() < timeout))
+			processorPause();
+	}
+}
+
+
 static int deleteProcess(kernelProcess *killProcess)
 {
 	// Does all the work of actually destroyng a process when there's really
@@ -751,6 +1524,7 @@ static int deleteProcess(kernelProcess *killProcess)
 	// terminated, for example.
 
 	int status = 0;
+	int count;
 
 	// Processes cannot delete themselves
 	if (killProcess == kernelCurrentProcess)
@@ -760,20 +1534,28 @@ static int deleteProcess(kernelProcess *killProcess)
 		return (status = ERR_INVALID);
 	}
 
-	// We need to deallocate the TSS descriptor allocated to the process, if
-	// it has one
-	if (killProcess->tssSelector)
+	// If it's still running on another processor, wait until it's not
+	waitOffCpu(killProcess);
+
+	kernelSpinLockGet(&schedulerLock);
+
+	for (count = 0; count < numCpus; count ++)
 	{
-		status = kernelDescriptorRelease(killProcess->tssSelector);
-		if (status < 0)
-		{
-			// If this was unsuccessful, we don't want to continue and "lose"
-			// the descriptor
-			kernelError(kernel_error, "Can't release TSS");
-			return (status);
-		}
+		// If this process was using the FPU, it's not any more.
+		if (cpus[count].fpuProcess == killProcess)
+			cpus[count].fpuProcess = NULL;
+
+		// Forget its I/O permission bitmap, if it's loaded in a TSS
+		if (cpus[count].ioMapProcess == killProcess)
+			cpus[count].ioMapProcess = NULL;
 	}
 
+	kernelSpinLockRelease(&schedulerLock);
+
+	// If the process has an I/O permission bitmap, free it
+	if (killProcess->ioMap)
+		kernelFree(killProcess->ioMap);
+
 	// If the process has a signal stream, destroy it
 	if (killProcess->signalStream.buffer)
 		kernelStreamDestroy(&killProcess->signalStream);
@@ -823,10 +1605,6 @@ static int deleteProcess(kernelProcess *killProcess)
 		}
 	}
 
-	// If this process was using the FPU, it's not any more.
-	if (fpuProcess == killProcess)
-		fpuProcess = NULL;
-
 	// Remove the process from the multitasker's process queue.
 	status = removeProcessFromQueue(killProcess);
 	if (status < 0)
@@ -890,7 +1668,7 @@ static void exceptionHandler(void)
 			}
 			else
 			{
-				targetProc->state = proc_stopped;
+				setProcessState(targetProc, proc_stopped);
 			}
 		}
 
@@ -944,7 +1722,7 @@ static void exceptionHandler(void)
 		if (multitaskingEnabled)
 		{
 			// Get process info
-			debugTSS(targetProc, details, MAXSTRINGLENGTH);
+			debugContext(targetProc, details, MAXSTRINGLENGTH);
 
 			// Try a stack trace
 			kernelStackTrace(targetProc, (details + strlen(details)),
@@ -968,7 +1746,7 @@ static void exceptionHandler(void)
 		}
 
 		// The scheduler may now dismantle the process
-		targetProc->state = proc_finished;
+		setProcessState(targetProc, proc_finished);
 
 		kernelInterruptClearCurrent();
 		processingException = 0;
@@ -1008,124 +1786,344 @@ static int spawnExceptionThread(void)
 		return (status = ERR_NOCREATE);
 
 	// Set the process state to sleep
-	exceptionProc->state = proc_sleeping;
+	setProcessState(exceptionProc, proc_sleeping);
 
-	status = kernelDescriptorSet(
-		exceptionProc->tssSelector,	// TSS selector
-		&exceptionProc->taskStateSegment, // Starts at...
-		sizeof(kernelTSS),			// Maximum size of a TSS selector
-		1,							// Present in memory
-		PRIVILEGE_SUPERVISOR,		// Highest privilege level
-		0,							// TSS's are system segs
-		0x9,						// TSS, 32-bit, non-busy
-		0,							// 0 for SMALL size granularity
-		0);							// Must be 0 in TSS
+	// Interrupts should always be disabled for this task
+	exceptionProc->context.EFLAGS = 0x00000002;
+
+	return (status = 0);
+}
+
+
+__attribute__((noreturn))
+static void idleThread(void)
+{
+	// This is the idle task.  It runs in this loop whenever no other
+	// processes need the CPU.  This should be run at the absolute lowest
+	// possible priority so that it will not be run unless there is absolutely
+	// nothing else in the other queues that is ready.  Each processor has
+	// one.
+
+	cpuState *cpu = thisCpu();
+
+	while (1)
+	{
+		// Idle the processor until something happens.  The boot processor
+		// first spends the time clearing memory for the memory manager's
+		// pool, if there's any to be done.
+		if (cpu->cpuNum || !kernelMemoryFillZeroPool())
+			processorIdle();
+
+		// Are there any processes that have changed state to "I/O ready", or
+		// have been moved to this processor?  On the boot processor, has a
+		// kernel timer been set to expire before our timer interrupt?
+		if (cpu->numIoReady ||
+			(cpu->readyBitmap & ((1 << (PRIORITY_LEVELS - 1)) - 1)) ||
+			(!cpu->cpuNum && numTimers &&
+				(timerHeap[0]->expiry < cpu->sliceEnd)))
+		{
+			kernelMultitaskerYield();
+		}
+	}
+}
+
+
+static int spawnIdleThread(cpuState *cpu)
+{
+	// This function will create the idle thread of a processor.  Returns 0
+	// on success, negative otherwise.
+
+	int status = 0;
+	int interrupts = 0;
+	char name[MAX_PROCNAME_LENGTH];
+	int idleProcId = 0;
+
+	if (cpu->cpuNum)
+		snprintf(name, MAX_PROCNAME_LENGTH, "idle thread %d", cpu->cpuNum);
+	else
+		strcpy(name, "idle thread");
+
+	// Don't let the boot processor's scheduler run it before it's been moved
+	// to the right processor
+	processorSuspendInts(interrupts);
+
+	// The idle thread needs to be a child of the kernel
+	idleProcId = kernelMultitaskerSpawnKernelThread(idleThread, name, 0,
+		NULL);
+	if (idleProcId < 0)
+	{
+		processorRestoreInts(interrupts);
+		return (status = idleProcId);
+	}
+
+	cpu->idleProc = getProcessById(idleProcId);
+	if (!cpu->idleProc)
+	{
+		processorRestoreInts(interrupts);
+		return (status = ERR_NOSUCHPROCESS);
+	}
+
+	// Set it to the lowest priority
+	status = kernelMultitaskerSetProcessPriority(idleProcId,
+		(PRIORITY_LEVELS - 1));
 	if (status < 0)
-		// Something went wrong
-		return (status);
+	{
+		// There's no reason we should have to fail here, but make a warning
+		kernelError(kernel_warn, "The multitasker was unable to lower the "
+			"priority of the idle thread");
+	}
 
-	// Interrupts should always be disabled for this task
-	exceptionProc->taskStateSegment.EFLAGS = 0x00000002;
+	kernelSpinLockGet(&schedulerLock);
+	moveProcessCpu(cpu->idleProc, cpu->cpuNum);
+	kernelSpinLockRelease(&schedulerLock);
+
+	processorRestoreInts(interrupts);
 
+	// Return success
 	return (status = 0);
 }
 
 
-__attribute__((noreturn))
-static void idleThread(void)
-{
-	// This is the idle task.  It runs in this loop whenever no other
-	// processes need the CPU.  This should be run at the absolute lowest
-	// possible priority so that it will not be run unless there is absolutely
-	// nothing else in the other queues that is ready.
+static void loadIoMap(cpuState *cpu, kernelProcess *proc)
+{
+	// Set up the I/O permission bitmap of the processor's TSS for the
+	// process.  Only processes that have been granted I/O permissions have
+	// their own map; for any others, we point the map base past the end of
+	// the TSS, which denies access to all ports.
+
+	if (proc->ioMap)
+	{
+		if (cpu->ioMapProcess != proc)
+		{
+			memcpy((void *) cpu->tss->IOMap, proc->ioMap, PORTS_BYTES);
+			cpu->ioMapProcess = proc;
+		}
+
+		cpu->tss->IOMapBase = IOBITMAP_OFFSET;
+	}
+	else
+	{
+		cpu->tss->IOMapBase = sizeof(kernelTSS);
+	}
+}
+
+
+static void createStartFrame(kernelProcess *proc)
+{
+	// Build the initial stack frame for a process that has never run, such
+	// that switching to it 'returns' into processStart(), which pops the
+	// segment registers and irets to the process' entry point.  For user
+	// processes the frame goes on the supervisor stack, and the iret drops
+	// the privilege level.
+
+	unsigned *frame = NULL;
+
+	if (proc->processorPrivilege == PRIVILEGE_SUPERVISOR)
+	{
+		frame = (unsigned *) proc->context.ESP;
+	}
+	else
+	{
+		frame = (unsigned *) proc->context.ESP0;
+		*(--frame) = proc->context.SS;
+		*(--frame) = proc->context.ESP;
+	}
+
+	*(--frame) = proc->context.EFLAGS;
+	*(--frame) = proc->context.CS;
+	*(--frame) = proc->context.EIP;
+
+	// Interrupts stay disabled until the iret
+	*(--frame) = 0x00000002;		// EFLAGS
+	*(--frame) = proc->context.DS;	// DS
+	*(--frame) = proc->context.DS;	// ES
+	*(--frame) = proc->context.DS;	// FS
+	*(--frame) = proc->context.DS;	// GS
+	*(--frame) = 0;					// EBP
+	*(--frame) = (unsigned) &processStart;
+
+	proc->context.savedESP = (unsigned) frame;
+}
+
+
+static void switchContext(kernelProcess *fromProc, kernelProcess *toProc)
+{
+	// Switch this processor from one process to another.  Interrupts must be
+	// disabled.  This returns when the 'from' process is next switched to,
+	// which might be on a different processor.
+
+	cpuState *cpu = thisCpu();
+	unsigned cr0 = 0;
+
+	if (fromProc == toProc)
+		return;
+
+	// The scheduler only touches kernel memory, so switching to it doesn't
+	// need to change the address space (or any of the rest of this).
+	if (toProc != cpu->schedulerProc)
+	{
+		// Only reload the page directory if it's different, since that
+		// flushes the TLB.  Threads share the address space of the parent.
+		if (cpu->loadedCR3 != toProc->context.CR3)
+		{
+			cpu->loadedCR3 = toProc->context.CR3;
+			processorSetCR3(toProc->context.CR3);
+		}
+
+		cpu->tss->ESP0 = toProc->context.ESP0;
+		loadIoMap(cpu, toProc);
+
+		// The hardware used to set CR0[TS] for us on a task switch.  Set it
+		// unless the new process already owns the FPU state, so that the
+		// first FPU instruction will fault into fpuExceptionHandler().
+		processorGetCR0(cr0);
+		if (toProc == cpu->fpuProcess)
+			cr0 &= ~0x8;
+		else
+			cr0 |= 0x8;
+		processorSetCR0(cr0);
+	}
+
+	// A new process' stack might be in its own address space, so do this
+	// after loading CR3
+	if (!toProc->context.savedESP)
+		createStartFrame(toProc);
+
+	cpu->currentProcess = toProc;
+
+	processorSwitchContext(&fromProc->context.savedESP,
+		toProc->context.savedESP);
+}
+
+
+static void schedulerTimerInterrupt(void)
+{
+	// This is the system timer interrupt handler while the scheduler is
+	// running.  It switches to the scheduler, which acknowledges the
+	// interrupt, and we resume here when the interrupted process is next
+	// chosen to run.
+
+	void *address = NULL;
+	unsigned cs = 0;
+
+	processorIsrEnter(address);
+
+	// Record whether we interrupted user code, for the scheduler
+	processorIsrGetCodeSelector(cs);
+	cpus[0].preemptedRing = (cs & 3);
+
+	switchContext(kernelCurrentProcess, cpus[0].schedulerProc);
+
+	processorIsrExit(address);
+}
+
+
+static void apicTimerInterrupt(void)
+{
+	// This is the local APIC timer interrupt handler.  It switches to this
+	// processor's scheduler, which acknowledges the interrupt.
+
+	void *address = NULL;
+	cpuState *cpu = NULL;
+	unsigned cs = 0;
+
+	processorIsrEnter(address);
 
-	int count;
+	cpu = thisCpu();
 
-	while (1)
-	{
-		// Idle the processor until something happens
-		processorIdle();
+	// Record whether we interrupted user code, for the scheduler
+	processorIsrGetCodeSelector(cs);
+	cpu->preemptedRing = (cs & 3);
 
-		// Loop through the process list looking for any that have changed
-		// state to "I/O ready".
-		for (count = 0; count < numQueued; count ++)
-		{
-			if (processQueue[count]->state == proc_ioready)
-			{
-				kernelMultitaskerYield();
-				break;
-			}
-		}
-	}
+	if (cpu->cpuNum)
+		switchContext(cpu->currentProcess, cpu->schedulerProc);
+	else
+		switchContext(kernelCurrentProcess, cpu->schedulerProc);
+
+	processorIsrExit(address);
 }
 
 
-static int spawnIdleThread(void)
+static void rescheduleInterrupt(void)
 {
-	// This function will create the idle thread at initialization time.
-	// Returns 0 on success, negative otherwise.
+	// This is the handler for reschedule IPIs.  On an application processor
+	// it switches to the scheduler (which acknowledges the interrupt), in
+	// the same way as the timer interrupt does on the boot processor.  On the
+	// boot processor it's only used to wake up the idle thread when a process
+	// migrates there.
 
-	int status = 0;
-	int idleProcId = 0;
+	void *address = NULL;
+	cpuState *cpu = NULL;
 
-	// The idle thread needs to be a child of the kernel
-	idleProcId = kernelMultitaskerSpawn(idleThread, "idle thread", 0, NULL);
-	if (idleProcId < 0)
-		return (idleProcId);
+	processorIsrEnter(address);
 
-	idleProc = getProcessById(idleProcId);
-	if (!idleProc)
-		return (status = ERR_NOSUCHPROCESS);
+	cpu = thisCpu();
 
-	// Set it to the lowest priority
-	status = kernelMultitaskerSetProcessPriority(idleProcId,
-		(PRIORITY_LEVELS - 1));
-	if (status < 0)
-	{
-		// There's no reason we should have to fail here, but make a warning
-		kernelError(kernel_warn, "The multitasker was unable to lower the "
-			"priority of the idle thread");
-	}
+	if (cpu->cpuNum)
+		switchContext(cpu->currentProcess, cpu->schedulerProc);
+	else
+		kernelApicEndOfInterrupt();
 
-	// Return success
-	return (status = 0);
+	processorIsrExit(address);
 }
 
 
-static int markTaskBusy(int tssSelector, int busy)
+static void tlbShootdownInterrupt(void)
 {
-	// This function gets the requested TSS selector from the GDT and marks it
-	// as busy/not busy.  Returns negative on error.
+	// This is the handler for TLB shootdown IPIs on the application
+	// processors.  See kernelMultitaskerTlbShootdown().
 
-	int status = 0;
-	kernelDescriptor descriptor;
+	void *address = NULL;
+	cpuState *cpu = NULL;
+	unsigned cr3 = 0, cr4 = 0;
+	unsigned count;
 
-	// Initialize our empty descriptor
-	memset(&descriptor, 0, sizeof(kernelDescriptor));
+	processorIsrEnter(address);
 
-	// Fill out our descriptor with data from the "official" one from the GDT
-	// that corresponds to the selector we were given
-	status = kernelDescriptorGet(tssSelector, &descriptor);
-	if (status < 0)
-		return (status);
+	cpu = thisCpu();
+
+	if (!tlbShootdown.pages)
+	{
+		// The page directory is being deleted.  If it's loaded (the
+		// scheduler and idle thread don't change it), switch to the kernel's.
+		if (cpu->loadedCR3 == tlbShootdown.pageDir)
+		{
+			cpu->loadedCR3 = kernelProc->context.CR3;
+			processorSetCR3(cpu->loadedCR3);
+		}
+	}
+	else if (tlbShootdown.pages > TLB_SHOOTDOWN_MAX_PAGES)
+	{
+		processorGetCR4(cr4);
 
-	// Ok, now we can change the selector in the table
-	if (busy)
-		descriptor.attributes1 |= 0x2;
+		if (((unsigned) tlbShootdown.virtual >= KERNEL_VIRTUAL_ADDRESS) &&
+			(cr4 & X86_CR4_PGE))
+		{
+			// Kernel pages are global, and reloading CR3 doesn't flush
+			// those.  Toggling global pages off and on flushes everything.
+			processorSetCR4(cr4 & ~X86_CR4_PGE);
+			processorSetCR4(cr4);
+		}
+		else
+		{
+			processorGetCR3(cr3);
+			processorSetCR3(cr3);
+		}
+	}
 	else
-		descriptor.attributes1 &= ~0x2;
-
-	// Re-set the descriptor in the GDT
-	status =  kernelDescriptorSetUnformatted(tssSelector,
-		descriptor.segSizeByte1, descriptor.segSizeByte2,
-		descriptor.baseAddress1, descriptor.baseAddress2,
-		descriptor.baseAddress3, descriptor.attributes1,
-		descriptor.attributes2, descriptor.baseAddress4);
-	if (status < 0)
-		return (status);
+	{
+		for (count = 0; count < tlbShootdown.pages; count ++)
+		{
+			processorClearAddressCache((unsigned) tlbShootdown.virtual +
+				(count * MEMORY_PAGE_SIZE));
+		}
+	}
 
-	// Return success
-	return (status = 0);
+	processorAtomicClearBit(&tlbShootdown.pending, cpu->cpuNum);
+
+	kernelApicEndOfInterrupt();
+
+	processorIsrExit(address);
 }
 
 
@@ -1150,34 +2148,164 @@ static int schedulerShutdown(void)
 	if (status < 0)
 		kernelError(kernel_warn, "Could not restore system timer");
 
-	// Remove the task gate that we were using to capture the timer interrupt.
-	// Replace it with the old default timer interrupt handler
-	kernelInterruptHook(INTERRUPT_NUM_SYSTIMER, oldSysTimerHandler, NULL);
+	if (apicTimer)
+	{
+		// Stop the APIC timer, and turn the system timer interrupt back on
+		kernelApicTimerSet(0);
+		kernelPicMask(INTERRUPT_NUM_SYSTIMER, 1);
+	}
+	else
+	{
+		// Remove the handler that we were using to capture the timer
+		// interrupt.  Replace it with the old default timer interrupt handler
+		kernelInterruptHook(INTERRUPT_NUM_SYSTIMER, oldSysTimerHandler, NULL);
+	}
 
 	// Give exclusive control to the current task
-	markTaskBusy(kernelCurrentProcess->tssSelector, 0);
-	processorFarJump(kernelCurrentProcess->tssSelector);
+	switchContext(cpus[0].schedulerProc, kernelCurrentProcess);
 
 	// We should never get here
 	return (status = 0);
 }
 
 
-static kernelProcess *chooseNextProcess(void)
+static void waitTimerExpired(void *data)
+{
+	// The wakeup timer of a waiting process has expired.  The process is
+	// ready to run.
+
+	kernelProcess *proc = data;
+
+	if (proc->state == proc_waiting)
+		setProcessState(proc, proc_ready);
+}
+
+
+static unsigned nextSliceLength(kernelProcess *nextProcess)
 {
-	// Loops through the process queue, and determines which process to run
-	// next
+	// Normally a time slice is TIME_SLICE_LENGTH timer counts, but if a
+	// kernel timer will expire before then, shorten the slice so that the
+	// timer fires on time.  With the APIC timer, the idle thread doesn't need
+	// to be interrupted until the next kernel timer is due.
 
 	unsigned long long theTime = 0;
-	kernelProcess *miscProcess = NULL;
-	kernelProcess *nextProcess = NULL;
-	unsigned processWeight = 0;
-	unsigned topProcessWeight = 0;
+	unsigned long long expiry = 0;
+	unsigned sliceLength = TIME_SLICE_LENGTH;
+	unsigned minLength = MIN_TIME_SLICE_LENGTH;
+
+	if (apicTimer)
+	{
+		minLength = MIN_APIC_SLICE_LENGTH;
+		if (nextProcess == cpus[0].idleProc)
+			sliceLength = MAX_IDLE_SLICE_LENGTH;
+	}
+
+	if (!numTimers)
+		return (sliceLength);
+
+	theTime = kernelCpuGetUs();
+	expiry = timerHeap[0]->expiry;
+
+	if (expiry <= theTime)
+		return (sliceLength = minLength);
+
+	if ((expiry - theTime) < ((sliceLength * (uquad_t) US_PER_SEC) /
+		SYSTIMER_FREQ_HZ))
+	{
+		sliceLength = (((expiry - theTime) * SYSTIMER_FREQ_HZ) / US_PER_SEC);
+		sliceLength = max(sliceLength, minLength);
+	}
+
+	return (sliceLength);
+}
+
+
+static void setSliceTimer(cpuState *cpu, unsigned sliceLength)
+{
+	// Start a time slice of the given number of system timer counts on this
+	// processor.  Zero means that it doesn't need to be interrupted.  Without
+	// the APIC timer, only the boot processor has a timer of its own.
+
+	unsigned microseconds = (((uquad_t) sliceLength * US_PER_SEC) /
+		SYSTIMER_FREQ_HZ);
+
+	cpu->sliceStart = kernelCpuTimestamp();
+
+	if (sliceLength)
+		cpu->sliceEnd = (kernelCpuGetUs() + microseconds);
+	else
+		cpu->sliceEnd = ~0ULL;
+
+	if (apicTimer)
+	{
+		kernelApicTimerSet(microseconds);
+	}
+	else if (!cpu->cpuNum)
+	{
+		// PIT single countdown
+		while (kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */,
+			sliceLength) < 0)
+		{
+			kernelError(kernel_warn, "The scheduler was unable to control "
+				"the system timer");
+		}
+	}
+}
+
+
+static unsigned sliceTimeUsed(cpuState *cpu)
+{
+	// Returns the time since the start of this processor's time slice, in
+	// system timer counts, which is what the processes' CPU time is measured
+	// in
+
+	return ((unsigned)(((kernelCpuTimestamp() - cpu->sliceStart) *
+		SYSTIMER_FREQ_HZ) / kernelCpuTimestampFreq()));
+}
+
+
+static void reapFinishedProcesses(void)
+{
+	// This will dismantle any processes that have identified themselves as
+	// finished
+
 	int count;
 
+	for (count = 0; numFinished && (count < numQueued); count ++)
+	{
+		if (processQueue[count]->state == proc_finished)
+		{
+			kernelMultitaskerKillProcess(processQueue[count]->processId, 0);
+
+			// This removed it from the queue and placed another process in
+			// its place.  Decrement the current loop counter
+			count--;
+		}
+	}
+}
+
+
+static kernelProcess *chooseNextProcess(cpuState *cpu)
+{
+	// Looks at the processor's ready queues, and determines which process to
+	// run next.  The scheduler lock must be held.
+
+	kernelProcess *nextProcess = NULL;
+	unsigned levelWeight = 0;
+	unsigned topLevelWeight = 0;
+	int topLevel = -1;
+	int level;
+
 	// Here is where we make decisions about which tasks to schedule, and when.
 	// Below is a brief description of the scheduling algorithm.
 
+	// Each priority level has its own queue of ready processes, and a bitmap
+	// records which of the queues are non-empty.  The cost of choosing the
+	// next process therefore depends only on the number of priority levels,
+	// and not on the number of processes in the system.  Within a level,
+	// processes are run round-robin: the chosen process is removed from the
+	// front of its queue, and when it's interrupted it goes to the back.
+
 	// Priority level 0 (highest-priority) processes will be "real time"
 	// scheduled.  When there are any processes running and ready at this
 	// priority level, they will be serviced to the exclusion of all processes
@@ -1195,172 +2323,141 @@ static kernelProcess *chooseNextProcess(void)
 	// mentioned above will exhibit the same behavior regardless of the number
 	// of "normal" priority levels in the system.
 
-	// Amongst all of the processes at other priority levels, there will be a
-	// more even-handed approach to scheduling.  We will attempt a fair
-	// algorithm with a weighting scheme.  Among the weighting variables will
-	// be the following: priority, waiting time, and "shortness".  Shortness
-	// will probably come later (shortest-job-first), so for now we will
-	// concentrate on priority and waiting time.  The formula will look like
-	// this:
+	// Amongst all of the other priority levels, there will be a more
+	// even-handed approach to scheduling.  We will attempt a fair algorithm
+	// with a weighting scheme.  Among the weighting variables will be the
+	// following: priority, waiting time, and "shortness".  Shortness will
+	// probably come later (shortest-job-first), so for now we will
+	// concentrate on priority and waiting time.  The waiting time is kept
+	// per level: it's the number of times the level has been passed over
+	// since one of its processes last ran.  The formula will look like this:
 	//
-	// weight = ((PRIORITY_LEVELS - task_priority) * PRIORITY_RATIO) +
-	//		wait_time
+	// weight = ((PRIORITY_LEVELS - level) * PRIORITY_RATIO) + wait_time
 	//
-	// This means that the inverse of the process priority will be multiplied
+	// This means that the inverse of the priority level will be multiplied
 	// by the "priority ratio", and to that will be added the current waiting
 	// time.  For example, if we have 4 priority levels, the priority ratio is
-	// 3, and we have two tasks as follows:
+	// 3, and we have ready processes at two levels as follows:
 	//
-	//	Task 1: priority=1, waiting time=4
-	//	Task 2: priority=2, waiting time=6
+	//	Level 1: waiting time=4
+	//	Level 2: waiting time=6
 	//
 	// then
 	//
-	//	task1Weight = ((4 - 1) * 3) + 4 = 13  <- winner
-	//	task2Weight = ((4 - 2) * 3) + 6 = 12
+	//	level1Weight = ((4 - 1) * 3) + 4 = 13  <- winner
+	//	level2Weight = ((4 - 2) * 3) + 6 = 12
 	//
-	// Thus, even though task 2 has been waiting longer, task 1's higher
+	// Thus, even though level 2 has been waiting longer, level 1's higher
 	// priority wins.  However in a slightly different scenario -- using the
 	// same constants -- if we had:
 	//
-	//	Task 1: priority=1, waiting time=3
-	//	Task 2: priority=2, waiting time=7
+	//	Level 1: waiting time=3
+	//	Level 2: waiting time=7
 	//
 	// then
 	//
-	//	task1Weight = ((4 - 1) * 3) + 3 = 12
-	//	task2Weight = ((4 - 2) * 3) + 7 = 13  <- winner
+	//	level1Weight = ((4 - 1) * 3) + 3 = 12
+	//	level2Weight = ((4 - 2) * 3) + 7 = 13  <- winner
 	//
-	// In this case, task 2 gets to run since it has been waiting long enough
-	// to overcome task 1's higher priority.  This possibility helps to ensure
-	// that no processes will starve.  The priority ratio determines the
-	// weighting of priority vs. waiting time.  A priority ratio of zero would
-	// give higher-priority processes no advantage over lower-priority, and
-	// waiting time would determine execution order.
+	// In this case, level 2 gets to run since it has been waiting long enough
+	// to overcome level 1's higher priority.  This possibility helps to
+	// ensure that no processes will starve.  The priority ratio determines
+	// the weighting of priority vs. waiting time.  A priority ratio of zero
+	// would give higher-priority processes no advantage over lower-priority,
+	// and waiting time would determine execution order.
 	//
-	// A tie beteen the highest-weighted tasks is broken based on queue order.
-	// The queue is neither FIFO nor LIFO, but closer to LIFO.
-
-	// Get the CPU time
-	theTime = kernelCpuGetMs();
+	// A tie between the highest-weighted levels goes to the lower-priority
+	// one, since it has been waiting longer.
 
-	for (count = 0; count < numQueued; count ++)
+	if (cpu->readyBitmap & 1)
 	{
-		// Get a pointer to the process' main process
-		miscProcess = processQueue[count];
-
-		if (miscProcess->state == proc_waiting)
+		// There are real-time processes ready.
+		topLevel = 0;
+	}
+	else
+	{
+		for (level = 1; level < (PRIORITY_LEVELS - 1); level ++)
 		{
-			// This will change the state of a waiting process to "ready"
-			// if the specified "waiting reason" has come to pass
+			if (!(cpu->readyBitmap & (1 << level)))
+				continue;
 
-			// If the process is waiting for a specified time.  Has the
-			// requested time come?
-			if (miscProcess->waitUntil && (miscProcess->waitUntil < theTime))
+			if (cpu->switchedByCall && (cpu->readyQueue[level].first->lastSlice
+				== schedulerTimeslices))
 			{
-				// The process is ready to run
-				miscProcess->state = proc_ready;
+				// If the next process at this level has yielded this
+				// timeslice already, we should give it no weight this time so
+				// that a bunch of yielding processes don't gobble up all the
+				// CPU time.
+				levelWeight = 0;
 			}
 			else
 			{
-				// The process must continue waiting
-				continue;
+				levelWeight = (((PRIORITY_LEVELS - level) * PRIORITY_RATIO) +
+					cpu->readyQueue[level].waitTime);
+			}
+
+			if ((topLevel < 0) || (levelWeight >= topLevelWeight))
+			{
+				topLevel = level;
+				topLevelWeight = levelWeight;
 			}
 		}
 
-		if (miscProcess->state == proc_finished)
+		// Background processes only run if there's nothing else that wants
+		// to
+		if ((cpu->readyBitmap & (1 << (PRIORITY_LEVELS - 1))) &&
+			((topLevel < 0) || !topLevelWeight))
 		{
-			// This will dismantle any process that has identified itself as
-			// finished
-			kernelMultitaskerKillProcess(miscProcess->processId, 0);
-
-			// This removed it from the queue and placed another process in
-			// its place.  Decrement the current loop counter
-			count--;
-
-			continue;
+			topLevel = (PRIORITY_LEVELS - 1);
 		}
 
-		if ((miscProcess->state != proc_ready) &&
-			(miscProcess->state != proc_ioready))
+		// Increase the waiting time of the levels that we're not selecting
+		for (level = 1; level < (PRIORITY_LEVELS - 1); level ++)
 		{
-			// This process is not ready (might be stopped, sleeping, or
-			// zombie)
-			continue;
+			if ((level != topLevel) && (cpu->readyBitmap & (1 << level)))
+				cpu->readyQueue[level].waitTime += 1;
 		}
+	}
 
-		// This process is ready to run.  Determine its weight.
+	if (topLevel < 0)
+		// Nothing is ready
+		return (nextProcess = NULL);
 
-		if (!miscProcess->priority)
-		{
-			// If the process is of the highest (real-time) priority, it
-			// should get an infinite weight
-			processWeight = 0xFFFFFFFF;
-		}
-		else if (miscProcess->priority == (PRIORITY_LEVELS - 1))
-		{
-			// Else if the process is of the lowest priority, it should get a
-			// weight of zero
-			processWeight = 0;
-		}
-		else if (miscProcess->state == proc_ioready)
-		{
-			// If this process was waiting for I/O which has now arrived, give
-			// it a high (1) temporary priority level
-			processWeight = (((PRIORITY_LEVELS - 1) * PRIORITY_RATIO) +
-				miscProcess->waitTime);
-		}
-		else if (schedulerSwitchedByCall && (miscProcess->lastSlice ==
-			schedulerTimeslices))
-		{
-			// If this process has yielded this timeslice already, we should
-			// give it no weight this time so that a bunch of yielding
-			// processes don't gobble up all the CPU time.
-			processWeight = 0;
-		}
-		else
-		{
-			// Otherwise, calculate the weight of this task, using the
-			// algorithm described above
-			processWeight = (((PRIORITY_LEVELS - miscProcess->priority) *
-				PRIORITY_RATIO) + miscProcess->waitTime);
-		}
+	cpu->readyQueue[topLevel].waitTime = 0;
+	nextProcess = cpu->readyQueue[topLevel].first;
 
-		// Did this process win?
+	return (nextProcess);
+}
 
-		if (processWeight < topProcessWeight)
-		{
-			// No.  Increase the waiting time of this process, since it's not
-			// the one we're selecting
-			miscProcess->waitTime += 1;
-		}
-		else
-		{
-			if (nextProcess)
-			{
-				if ((processWeight == topProcessWeight) &&
-					(nextProcess->waitTime >= miscProcess->waitTime))
-				{
-					// If the process' weight is tied with that of the
-					// previously winning process, it will NOT win if the
-					// other process has been waiting as long or longer
-					miscProcess->waitTime += 1;
-					continue;
-				}
-				else
-				{
-					// We have a new winning process.  Increase the waiting
-					// time of the previous winner this one is replacing
-					nextProcess->waitTime += 1;
-				}
-			}
 
-			topProcessWeight = processWeight;
-			nextProcess = miscProcess;
+static int chooseApCpu(void)
+{
+	// Returns the number of the least busy application processor, if it's
+	// less busy than the boot processor, otherwise -1.  The scheduler lock
+	// must be held.
+
+	int load = 0;
+	int bestCpu = -1;
+	int bestLoad = cpus[0].numReady;
+	int count;
+
+	for (count = 1; count < numCpus; count ++)
+	{
+		if (!cpus[count].online)
+			continue;
+
+		load = cpus[count].numReady;
+		if (cpus[count].currentProcess != cpus[count].idleProc)
+			load += 1;
+
+		if (load < bestLoad)
+		{
+			bestCpu = count;
+			bestLoad = load;
 		}
 	}
 
-	return (nextProcess);
+	return (bestCpu);
 }
 
 
@@ -1368,7 +2465,10 @@ static int scheduler(void)
 {
 	// This is the kernel multitasker's scheduler thread.  This little program
 	// will run continually in a loop, handing out time slices to all
-	// processes, including the kernel itself.
+	// processes, including the kernel itself.  This is the scheduler of the
+	// boot processor, which runs all of the kernel code.  It also passes
+	// preempted user processes on to the application processors, if there
+	// are any (see apScheduler()).
 
 	// By the time this scheduler is invoked, the kernel should already have
 	// created itself a process in the task queue.  Thus, the scheduler can
@@ -1380,11 +2480,15 @@ static int scheduler(void)
 	// that it examines will have the new process added.
 
 	int status = 0;
+	cpuState *cpu = &cpus[0];
+	unsigned sliceLength = TIME_SLICE_LENGTH;
 	unsigned timeUsed = 0;
 	unsigned systemTime = 0;
 	unsigned schedulerTime = 0;
 	unsigned sliceCount = 0;
 	unsigned oldSliceCount = 0;
+	unsigned lastApTick = 0;
+	int wakeCpu = 0;
 	int count;
 
 	// This is info about the processes we run
@@ -1399,27 +2503,29 @@ static int scheduler(void)
 		processorDisableInts();
 
 		// The scheduler is the current process.
-		kernelCurrentProcess = schedulerProc;
+		kernelCurrentProcess = cpu->schedulerProc;
 
 		// Calculate how many timer ticks were used in the previous time slice.
 		// This will be different depending on whether the previous timeslice
 		// actually expired, or whether we were called for some other reason
 		// (for example a yield()).
 
-		if (!schedulerSwitchedByCall)
-			timeUsed = TIME_SLICE_LENGTH;
+		if (apicTimer)
+			timeUsed = sliceTimeUsed(cpu);
+		else if (!cpu->switchedByCall)
+			timeUsed = sliceLength;
 		else
-			timeUsed = (TIME_SLICE_LENGTH - kernelSysTimerReadValue(0));
+			timeUsed = (sliceLength - kernelSysTimerReadValue(0));
 
 		// Count the time used for legacy system timer purposes
 		systemTime += timeUsed;
 
-		// Have we had the equivalent of a full timer revolution?  If so, we
-		// need to call the standard timer interrupt handler
-		if (systemTime >= SYSTIMER_FULLCOUNT)
+		// Have we had the equivalent of a full timer revolution (or several,
+		// if we've been idle)?  If so, we need to call the standard timer
+		// interrupt handler
+		while (systemTime >= SYSTIMER_FULLCOUNT)
 		{
-			// Reset to zero
-			systemTime = 0;
+			systemTime -= SYSTIMER_FULLCOUNT;
 
 			// Artifically register a system timer tick.
 			kernelSysTimerTick();
@@ -1432,21 +2538,40 @@ static int scheduler(void)
 		{
 			// Increment the count of time slices.  This can just keep going
 			// up until it wraps, which is no problem.
-			schedulerTimeslices += 1;
+			schedulerTimeslices += (sliceCount - oldSliceCount);
 
 			oldSliceCount = sliceCount;
 		}
 
+		// Without the APIC timer, the application processors don't have a
+		// timer of their own, so give them a reschedule interrupt once per
+		// time slice
+		if (!apicTimer && (numCpus > 1) &&
+			(schedulerTimeslices != lastApTick))
+		{
+			for (count = 1; count < numCpus; count ++)
+			{
+				if (cpus[count].online)
+					kernelApicSendIpi(cpus[count].apicId,
+						IPI_VECTOR_RESCHEDULE);
+			}
+
+			lastApTick = schedulerTimeslices;
+		}
+
 		// Remember the previous process we ran
 		previousProcess = nextProcess;
+		wakeCpu = 0;
 
 		if (previousProcess)
 		{
+			kernelSpinLockGet(&schedulerLock);
+
 			if (previousProcess->state == proc_running)
 			{
 				// Change the state of the previous process to ready, since it
 				// was interrupted while still on the CPU.
-				previousProcess->state = proc_ready;
+				changeProcessState(previousProcess, proc_ready);
 			}
 
 			// Add the last timeslice to the process' CPU time
@@ -1455,6 +2580,39 @@ static int scheduler(void)
 			// Record the current timeslice number, so we can remember when
 			// this process was last active (see chooseNextProcess())
 			previousProcess->lastSlice = schedulerTimeslices;
+
+			previousProcess->runningCpu = -1;
+
+			// If the timer interrupted it in user mode, it can continue on one
+			// of the application processors, if there's one less busy.  It's
+			// the interrupted code segment that tells us, since a process
+			// is still running kernel code until it's actually returned to
+			// user mode.
+			if ((numCpus > 1) && !processingException &&
+				(previousProcess->state == proc_ready) &&
+				!cpu->switchedByCall &&
+				(cpu->preemptedRing != PRIVILEGE_SUPERVISOR))
+			{
+				wakeCpu = chooseApCpu();
+				if (wakeCpu > 0)
+				{
+					releaseFpu(cpu, previousProcess);
+					moveProcessCpu(previousProcess, wakeCpu);
+
+					// Only an idle processor needs to be woken
+					if (cpus[wakeCpu].currentProcess !=
+						cpus[wakeCpu].idleProc)
+					{
+						wakeCpu = 0;
+					}
+				}
+			}
+
+			kernelSpinLockRelease(&schedulerLock);
+
+			if (wakeCpu > 0)
+				kernelApicSendIpi(cpus[wakeCpu].apicId,
+					IPI_VECTOR_RESCHEDULE);
 		}
 
 		// Every CPU_PERCENT_TIMESLICES timeslices we will update the %CPU
@@ -1489,77 +2647,214 @@ static int scheduler(void)
 			nextProcess = previousProcess;
 			kernelDebugError("Scheduler interrupt while processing "
 				"exception");
+
+			kernelSpinLockGet(&schedulerLock);
 		}
 		else
 		{
+			// Fire any expired timers (which wakes up any waiting processes
+			// whose time has come), and dismantle any finished processes
+			runExpiredTimers();
+			if (numFinished)
+				reapFinishedProcesses();
+
+			kernelSpinLockGet(&schedulerLock);
+
 			// Choose the next process to run
-			nextProcess = chooseNextProcess();
+			nextProcess = chooseNextProcess(cpu);
+		}
+
+		// We should now have selected a process to run.  If not, we should
+		// re-start the old one.  This should only be likely to happen if some
+		// goombah kills the idle thread.
+		if (!nextProcess)
+			nextProcess = kernelCurrentProcess;
+
+		// Update some info about the next process.  Setting the state
+		// removes it from its ready queue.
+		nextProcess->waitTime = 0;
+		changeProcessState(nextProcess, proc_running);
+		nextProcess->runningCpu = 0;
+
+		kernelSpinLockRelease(&schedulerLock);
+
+		// Export (to the rest of the multitasker) the pointer to the
+		// currently selected process.
+		kernelCurrentProcess = nextProcess;
+
+		if (!cpu->switchedByCall)
+		{
+			// Acknowledge the timer interrupt if one occurred
+			if (apicTimer)
+				kernelApicEndOfInterrupt();
+			else
+				kernelPicEndOfInterrupt(INTERRUPT_NUM_SYSTIMER);
+		}
+		else
+		{
+			// Reset the "switched by call" flag
+			cpu->switchedByCall = 0;
+		}
+
+		// Set up a new time slice.  It might be shortened if there's a
+		// kernel timer due to expire.
+		sliceLength = nextSliceLength(nextProcess);
+		setSliceTimer(cpu, sliceLength);
+
+		// In the final part, we do the actual context switch.  We resume
+		// here on the next timer interrupt or yield.
+		switchContext(cpu->schedulerProc, nextProcess);
+
+		// Continue to loop
+	}
+
+	// If we get here, then the scheduler is supposed to shut down
+	schedulerShutdown();
+
+	// We should never get here
+	return (status = 0);
+}
+
+
+__attribute__((noreturn))
+static void apScheduler(void)
+{
+	// This is the scheduler of an application processor.  It's a lot simpler
+	// than the boot processor's, since the boot processor takes care of all
+	// the timers, CPU usage accounting, and so on.  It runs at the end of
+	// each time slice (by the APIC timer, or else a reschedule interrupt from
+	// the boot processor), when the boot processor has a new process for us,
+	// or when a process yields or needs to go back to the boot processor to
+	// run kernel code.
+
+	cpuState *cpu = thisCpu();
+	kernelProcess *nextProcess = NULL;
+	kernelProcess *previousProcess = NULL;
+	unsigned timeUsed = 0;
+	int wakeBsp = 0;
+
+	cpu->online = 1;
+
+	while (!schedulerStop)
+	{
+		processorDisableInts();
+
+		previousProcess = nextProcess;
+		wakeBsp = 0;
+
+		timeUsed = sliceTimeUsed(cpu);
+
+		kernelSpinLockGet(&schedulerLock);
+
+		if (previousProcess)
+		{
+			previousProcess->cpuTime += timeUsed;
+			previousProcess->lastSlice = schedulerTimeslices;
+
+			if (previousProcess->state == proc_running)
+				changeProcessState(previousProcess, proc_ready);
+
+			// Does it need to go back to the boot processor?
+			if (previousProcess->migrate)
+			{
+				releaseFpu(cpu, previousProcess);
+				moveProcessCpu(previousProcess, 0);
+				previousProcess->migrate = 0;
+				wakeBsp = (cpus[0].currentProcess == cpus[0].idleProc);
+			}
+
+			// Only now is it safe for another processor to run it
+			previousProcess->runningCpu = -1;
 		}
 
-		// We should now have selected a process to run.  If not, we should
-		// re-start the old one.  This should only be likely to happen if some
-		// goombah kills the idle thread.
+		nextProcess = chooseNextProcess(cpu);
 		if (!nextProcess)
-			nextProcess = kernelCurrentProcess;
+			nextProcess = cpu->idleProc;
 
-		// Update some info about the next process
 		nextProcess->waitTime = 0;
-		nextProcess->state = proc_running;
+		changeProcessState(nextProcess, proc_running);
+		nextProcess->runningCpu = cpu->cpuNum;
 
-		// Export (to the rest of the multitasker) the pointer to the
-		// currently selected process.
-		kernelCurrentProcess = nextProcess;
+		kernelSpinLockRelease(&schedulerLock);
 
-		if (!schedulerSwitchedByCall)
-			// Acknowledge the timer interrupt if one occurred
-			kernelPicEndOfInterrupt(INTERRUPT_NUM_SYSTIMER);
+		if (wakeBsp)
+			kernelApicSendIpi(cpus[0].apicId, IPI_VECTOR_RESCHEDULE);
+
+		if (!cpu->switchedByCall)
+			// Acknowledge the reschedule interrupt
+			kernelApicEndOfInterrupt();
 		else
-			// Reset the "switched by call" flag
-			schedulerSwitchedByCall = 0;
+			cpu->switchedByCall = 0;
 
-		// Set up a new time slice - PIT single countdown.
-		while (kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */,
-			TIME_SLICE_LENGTH) < 0)
-		{
-			kernelError(kernel_warn, "The scheduler was unable to control "
-				"the system timer");
-		}
+		// The idle thread doesn't need to be interrupted
+		if (nextProcess == cpu->idleProc)
+			setSliceTimer(cpu, 0);
+		else
+			setSliceTimer(cpu, TIME_SLICE_LENGTH);
 
-		// In the final part, we do the actual context switch.
+		switchContext(cpu->schedulerProc, nextProcess);
+	}
 
-		// Mark the exception handler and scheduler tasks as not busy so they
-		// can be jumped back to.
-		if (exceptionProc)
-			markTaskBusy(exceptionProc->tssSelector, 0);
-		markTaskBusy(schedulerProc->tssSelector, 0);
+	// The system is shutting down.  Take ourselves offline.
+	if (apicTimer)
+		kernelApicTimerSet(0);
 
-		// Mark the next task as not busy and jump to it.
-		markTaskBusy(nextProcess->tssSelector, 0);
-		processorFarJump(nextProcess->tssSelector);
+	if (nextProcess)
+		nextProcess->runningCpu = -1;
 
-		// Continue to loop
-	}
+	cpu->online = 0;
 
-	// If we get here, then the scheduler is supposed to shut down
-	schedulerShutdown();
+	while (1)
+		processorStop();
+}
+
+
+static int setupCpuTss(cpuState *cpu)
+{
+	// Set up the TSS of a processor.  We don't use hardware task switching;
+	// the TSS only supplies the supervisor stack for privilege level changes,
+	// and the I/O permission bitmap.
+
+	int status = 0;
+
+	memset((void *) cpu->tss, 0, sizeof(kernelTSS));
+	cpu->tss->SS0 = PRIV_STACK;
+	cpu->tss->IOMapBase = sizeof(kernelTSS);
+	cpu->tss->IOMapEnd = 0xFF;
+
+	status = kernelDescriptorRequest((kernelSelector *) &cpu->tssSelector);
+	if ((status < 0) || !cpu->tssSelector)
+		return (status);
+
+	status = kernelDescriptorSet(
+		cpu->tssSelector,			// TSS selector number
+		(void *) cpu->tss,			// Starts at...
+		(sizeof(kernelTSS) - 1),	// Limit of the TSS segment
+		1,							// Present in memory
+		PRIVILEGE_SUPERVISOR,		// TSSs are supervisor privilege level
+		0,							// TSSs are system segs
+		0x9,						// TSS, 32-bit, non-busy
+		0,							// 0 for SMALL size granularity
+		0);							// Must be 0 in TSS
+	if (status < 0)
+	{
+		kernelDescriptorRelease(cpu->tssSelector);
+		cpu->tssSelector = 0;
+		return (status);
+	}
 
-	// We should never get here
 	return (status = 0);
 }
 
 
-static int schedulerInitialize(void)
+static int createSchedulerProcess(cpuState *cpu, void *function)
 {
-	// This function will do all of the necessary initialization for the
-	// scheduler.  Returns 0 on success, negative otherwise
-
 	// The scheduler needs to make a task (but not a fully-fledged process)
 	// for itself.
 
 	int status = 0;
-	int interrupts = 0;
 	processImage schedImage = {
-		scheduler, scheduler,
+		function, function,
 		NULL, 0xFFFFFFFF,
 		NULL, 0xFFFFFFFF,
 		0xFFFFFFFF,
@@ -1571,16 +2866,38 @@ static int schedulerInitialize(void)
 	if (status < 0)
 		return (status);
 
-	schedulerProc = getProcessById(status);
+	cpu->schedulerProc = getProcessById(status);
 
 	// The scheduler process doesn't sit in the normal process queue
-	removeProcessFromQueue(schedulerProc);
+	removeProcessFromQueue(cpu->schedulerProc);
 
 	// Interrupts should always be disabled for this task
-	schedulerProc->taskStateSegment.EFLAGS = 0x00000002;
+	cpu->schedulerProc->context.EFLAGS = 0x00000002;
+
+	cpu->schedulerProc->cpu = cpu->cpuNum;
+
+	return (status = 0);
+}
+
+
+static int schedulerInitialize(void)
+{
+	// This function will do all of the necessary initialization for the
+	// scheduler.  Returns 0 on success, negative otherwise
+
+	int status = 0;
+	int interrupts = 0;
+	cpuState *cpu = &cpus[0];
+
+	cpu->cpuNum = 0;
+	cpu->tss = &bootCpuTSS;
+	processorGetCR3(cpu->loadedCR3);
+	cpu->currentProcess = kernelCurrentProcess;
+	cpu->sliceStart = kernelCpuTimestamp();
 
-	// Not busy
-	markTaskBusy(schedulerProc->tssSelector, 0);
+	status = createSchedulerProcess(cpu, scheduler);
+	if (status < 0)
+		return (status);
 
 	kernelDebug(debug_multitasker, "Multitasker initialize scheduler");
 
@@ -1598,34 +2915,52 @@ static int schedulerInitialize(void)
 		return (status = ERR_NOTINITIALIZED);
 	}
 
-	// Install a task gate for the interrupt, which will be the scheduler's
-	// timer interrupt.  After this point, our new scheduler task will run
-	// with every clock tick
-	status = kernelInterruptHook(INTERRUPT_NUM_SYSTIMER, NULL,
-		schedulerProc->tssSelector);
+	status = setupCpuTss(cpu);
 	if (status < 0)
 	{
 		processorRestoreInts(interrupts);
 		return (status);
 	}
 
-	// The scheduler task should now be set up to run.  We should set up the
-	// kernel task to resume operation
+	kernelDebug(debug_multitasker, "Multitasker load task reg");
+	processorLoadTaskReg(cpu->tssSelector);
 
-	// Before we load the kernel's selector into the task reg, mark it as not
-	// busy, since one cannot load the task register with a busy TSS selector
-	markTaskBusy(kernelProc->tssSelector, 0);
+	// The interrupts that the processors send each other
+	kernelDescriptorSetIDTInterruptGate(IPI_VECTOR_RESCHEDULE,
+		&rescheduleInterrupt);
+	kernelDescriptorSetIDTInterruptGate(IPI_VECTOR_TLBFLUSH,
+		&tlbShootdownInterrupt);
 
-	// Make the kernel's Task State Segment be the current one.  In reality,
-	// it IS still the currently running code
-	kernelDebug(debug_multitasker, "Multitasker load task reg");
-	processorLoadTaskReg(kernelProc->tssSelector);
+	// Use the local APIC timer if we can.  In that case we don't need the
+	// system timer interrupt any more, so it's masked off.
+	if (kernelApicTimerInitialize(APIC_VECTOR_TIMER) >= 0)
+	{
+		kernelDebug(debug_multitasker, "Multitasker using APIC timer");
+		kernelDescriptorSetIDTInterruptGate(APIC_VECTOR_TIMER,
+			&apicTimerInterrupt);
+		kernelPicMask(INTERRUPT_NUM_SYSTIMER, 0);
+		apicTimer = 1;
+	}
+	else
+	{
+		// Install our handler for the timer interrupt.  After this point, the
+		// scheduler will run with every clock tick
+		status = kernelInterruptHook(INTERRUPT_NUM_SYSTIMER,
+			&schedulerTimerInterrupt, 0);
+		if (status < 0)
+		{
+			processorRestoreInts(interrupts);
+			return (status);
+		}
+	}
+
+	cpu->online = 1;
 
 	// Make note that the multitasker has been enabled.
 	multitaskingEnabled = 1;
 
 	// Set up the initial timer countdown
-	kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */, TIME_SLICE_LENGTH);
+	setSliceTimer(cpu, TIME_SLICE_LENGTH);
 
 	processorRestoreInts(interrupts);
 
@@ -1669,7 +3004,7 @@ static int createKernelProcess(void *kernelStack, unsigned kernelStackSize)
 		return (status = ERR_NOSUCHPROCESS);
 
 	// Interrupts are initially disabled for the kernel
-	kernelProc->taskStateSegment.EFLAGS = 0x00000002;
+	kernelProc->context.EFLAGS = 0x00000002;
 
 	// Set the current process to initially be the kernel process
 	kernelCurrentProcess = kernelProc;
@@ -1686,7 +3021,7 @@ static int createKernelProcess(void *kernelStack, unsigned kernelStackSize)
 	kernelProc->textOutputStream = kernelTextGetConsoleOutput();
 
 	// Make the kernel process runnable
-	kernelProc->state = proc_ready;
+	setProcessState(kernelProc, proc_ready);
 
 	// Return success
 	return (status = 0);
@@ -1771,13 +3106,22 @@ static int fpuExceptionHandler(void)
 	//		FP operation, and we need to restore the state.
 
 	int status = 0;
+	cpuState *cpu = thisCpu();
+	kernelProcess *proc = NULL;
 	unsigned short fpuReg = 0;
 
 	//kernelDebug(debug_multitasker, "Multitasker FPU exception start");
 
 	processorClearTaskSwitched();
 
-	if (fpuProcess && (fpuProcess == kernelCurrentProcess))
+	// The boot processor's current process is the kernel's idea of the
+	// current process
+	if (cpu->cpuNum)
+		proc = cpu->currentProcess;
+	else
+		proc = kernelCurrentProcess;
+
+	if (cpu->fpuProcess && (cpu->fpuProcess == proc))
 	{
 		// This was the last process to use the FPU.  The state should be the
 		// same as it was, so there's nothing to do.
@@ -1793,8 +3137,11 @@ static int fpuExceptionHandler(void)
 		processorGetFpuStatus(fpuReg);
 	}
 
-	// Save the FPU state for the previous process
-	if (fpuProcess)
+	// Save the FPU state for the previous process.  Hold the scheduler lock
+	// so that it can't be deleted while we do it.
+	kernelSpinLockGet(&schedulerLock);
+
+	if (cpu->fpuProcess)
 	{
 		// Save FPU state
 		//kernelDebug(debug_multitasker, "Multitasker switch FPU ownership "
@@ -1802,34 +3149,22 @@ static int fpuExceptionHandler(void)
 		//	kernelCurrentProcess->name);
 		//kernelDebug(debug_multitasker, "Multitasker save FPU state for %s",
 		//	fpuProcess->name);
-		processorFpuStateSave(fpuProcess->fpuState[0]);
-		fpuProcess->fpuStateSaved = 1;
+		fpuStateSave(cpu->fpuProcess);
+		cpu->fpuProcess = NULL;
 	}
 
-	if (kernelCurrentProcess->fpuStateSaved)
-	{
-		// Restore the FPU state
-		//kernelDebug(debug_multitasker, "Multitasker restore FPU state for "
-		//	"%s", kernelCurrentProcess->name);
-		processorFpuStateRestore(kernelCurrentProcess->fpuState[0]);
-	}
-	else
-	{
-		// No saved state for the FPU.  Initialize it.
-		//kernelDebug(debug_multitasker, "Multitasker initialize FPU for %s",
-		//	kernelCurrentProcess->name);
-		processorFpuInit();
-		processorGetFpuControl(fpuReg);
-		// Mask FPU exceptions.
-		fpuReg |= 0x3F;
-		processorSetFpuControl(fpuReg);
-	}
+	kernelSpinLockRelease(&schedulerLock);
 
-	kernelCurrentProcess->fpuStateSaved = 0;
+	// Restore the FPU state, or initialize it if there's no saved state
+	//kernelDebug(debug_multitasker, "Multitasker restore FPU state for "
+	//	"%s", kernelCurrentProcess->name);
+	fpuStateRestore(proc);
+
+	proc->fpuStateSaved = 0;
 
 	processorFpuClearEx();
 
-	fpuProcess = kernelCurrentProcess;
+	cpu->fpuProcess = proc;
 
 	//kernelDebug(debug_multitasker, "Multitasker FPU exception end");
 	return (status = 0);
@@ -1948,6 +3283,9 @@ int kernelMultitaskerInitialize(void *kernelStack, unsigned kernelStackSize)
 	cr0 = ((cr0 & ~0x04U) | 0x22);
 	processorSetCR0(cr0);
 
+	// Enable saving of SSE/AVX state, if the processor supports it
+	fpuDetect();
+
 	// We need to create the kernel's own process.
 	status = createKernelProcess(kernelStack, kernelStackSize);
 	if (status < 0)
@@ -1960,7 +3298,7 @@ int kernelMultitaskerInitialize(void *kernelStack, unsigned kernelStackSize)
 		return (status);
 
 	// Create an "idle" thread to consume all unused cycles
-	status = spawnIdleThread();
+	status = spawnIdleThread(&cpus[0]);
 	if (status < 0)
 		return (status);
 
@@ -1990,6 +3328,8 @@ int kernelMultitaskerShutdown(int nice)
 	// multitasker will just stop.  Returns 0 on success, negative otherwise.
 
 	int status = 0;
+	uquad_t timeout = 0;
+	int count;
 
 	// Make sure multitasking has been enabled
 	if (!multitaskingEnabled)
@@ -2001,9 +3341,25 @@ int kernelMultitaskerShutdown(int nice)
 	if (nice)
 		kernelMultitaskerKillAll();
 
-	// Set the schedulerStop flag to stop the scheduler
+	// Set the schedulerStop flag to stop the schedulers
 	schedulerStop = 1;
 
+	// Stop the application processors
+	for (count = 1; count < numCpus; count ++)
+	{
+		if (!cpus[count].online)
+			continue;
+
+		kernelApicSendIpi(cpus[count].apicId, IPI_VECTOR_RESCHEDULE);
+
+		timeout = (kernelCpuGetMs() + 100);
+		while (cpus[count].online && (kernelCpuGetMs() < timeout))
+			processorPause();
+
+		if (cpus[count].online)
+			kernelError(kernel_warn, "Processor %d did not stop", count);
+	}
+
 	// Yield control back to the scheduler, so that it can stop
 	kernelMultitaskerYield();
 
@@ -2011,7 +3367,7 @@ int kernelMultitaskerShutdown(int nice)
 	multitaskingEnabled = 0;
 
 	// Deallocate the stack used by the scheduler
-	kernelMemoryRelease(schedulerProc->userStack);
+	kernelMemoryRelease(cpus[0].schedulerProc->userStack);
 
 	// Print a message
 	kernelLog("Multitasking stopped");
@@ -2022,6 +3378,16 @@ int kernelMultitaskerShutdown(int nice)
 
 void kernelException(int num, unsigned address)
 {
+	// The application processors only save and restore FPU state for
+	// themselves.  Any other exception is handled on the boot processor.
+	if ((num == EXCEPTION_DEVNOTAVAIL) && thisCpu()->cpuNum)
+	{
+		fpuExceptionHandler();
+		return;
+	}
+
+	kernelMultitaskerKernelEnter();
+
 	// If we are already processing one, then it's a double-fault and we are
 	// totally finished
 	if (processingException)
@@ -2047,7 +3413,7 @@ void kernelException(int num, unsigned address)
 	// If multitasking is enabled, switch to the exception thread.  Otherwise
 	// just call the exception handler as a function.
 	if (multitaskingEnabled)
-		processorFarJump(exceptionProc->tssSelector);
+		switchContext(kernelCurrentProcess, exceptionProc);
 	else
 		exceptionHandler();
 
@@ -2055,6 +3421,28 @@ void kernelException(int num, unsigned address)
 }
 
 
+void kernelExceptionPageFault(unsigned address, void *faultAddress,
+	unsigned errorCode)
+{
+	// A page fault.  If it's in memory that's been reserved but not yet
+	// populated, the memory manager populates it and the process carries on.
+	// Otherwise it's handled like any other exception.
+
+	kernelMultitaskerKernelEnter();
+
+	if (multitaskingEnabled && !processingException &&
+		!kernelProcessingInterrupt() &&
+		(kernelMemoryPageFault(kernelCurrentProcess->processId,
+			faultAddress, errorCode) >= 0))
+		return;
+
+	kernelDebug(debug_multitasker, "Multitasker page fault at address %p "
+		"(error code %x)", faultAddress, errorCode);
+
+	kernelException(EXCEPTION_PAGE, address);
+}
+
+
 void kernelMultitaskerDumpProcessList(void)
 {
 	// This function is used to dump an internal listing of the current
@@ -2239,7 +3627,7 @@ int kernelMultitaskerSpawn(void *startAddress, const char *name, int argc,
 		execImage.argv[count + 1] = argv[count];
 
 	// OK, now we should create the new process
-	processId = createNewProcess(name, kernelCurrentProcess->priority,
+	processId = createNewProcess(name, kernelCurrentProcess->basePriority,
 		kernelCurrentProcess->privilege, &execImage,
 		0 /* no page directory */);
 	if (processId < 0)
@@ -2262,7 +3650,7 @@ int kernelMultitaskerSpawn(void *startAddress, const char *name, int argc,
 	// Since we assume that the thread is invoked as a function call, subtract
 	// additional bytes from the stack pointer to account for the space where
 	// the return address would normally go.
-	newProcess->taskStateSegment.ESP -= sizeof(void *);
+	newProcess->context.ESP -= sizeof(void *);
 
 	// Share the environment of the parent
 	if (newProcess->environment)
@@ -2287,7 +3675,7 @@ int kernelMultitaskerSpawn(void *startAddress, const char *name, int argc,
 	newProcess->textOutputStream = kernelCurrentProcess->textOutputStream;
 
 	// Make the new thread runnable
-	newProcess->state = proc_ready;
+	setProcessState(newProcess, proc_ready);
 
 	// Return the new process' Id.
 	return (newProcess->processId);
@@ -2532,7 +3920,7 @@ int kernelMultitaskerSetProcessState(int processId, processState newState)
 	}
 
 	// Set the state value of the process
-	changeProcess->state = newState;
+	setProcessState(changeProcess, newState);
 
 	return (status);
 }
@@ -2640,8 +4028,14 @@ int kernelMultitaskerSetProcessPriority(int processId, int newPriority)
 		// Not a legal priority value
 		return (status = ERR_INVALID);
 
-	// Set the priority value of the process
-	changeProcess->priority = newPriority;
+	// Set the base priority value of the process.  If it is currently
+	// running at a higher, inherited priority because it holds a lock that
+	// someone is waiting for, it keeps that until it releases the lock.
+	if (changeProcess->priority < changeProcess->basePriority)
+		setPriority(changeProcess, min(newPriority, changeProcess->priority));
+	else
+		setPriority(changeProcess, newPriority);
+	changeProcess->basePriority = newPriority;
 
 	return (status = 0);
 }
@@ -2969,104 +4363,308 @@ int kernelMultitaskerDuplicateIo(int firstPid, int secondPid, int clear)
 		secondProcess->textInputStream = input;
 		input->ownerPid = secondPid;
 
-		// Remember the current input attributes
-		memcpy((void *) &secondProcess->oldInputAttrs, (void *) &input->attrs,
-			sizeof(kernelTextInputStreamAttrs));
+		// Remember the current input attributes
+		memcpy((void *) &secondProcess->oldInputAttrs, (void *) &input->attrs,
+			sizeof(kernelTextInputStreamAttrs));
+
+		if (clear)
+			kernelTextInputStreamRemoveAll(input);
+	}
+
+	if (output)
+		secondProcess->textOutputStream = output;
+
+	return (status = 0);
+}
+
+
+int kernelMultitaskerGetProcessorTime(clock_t *clk)
+{
+	// Returns processor time used by a process since its start.  This value
+	// is the number of timer ticks from the system timer.
+
+	int status = 0;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (!clk)
+		return (status = ERR_NULLPARAMETER);
+
+	// Return the processor time of the current process
+	*clk = kernelCurrentProcess->cpuTime;
+
+	return (status = 0);
+}
+
+
+void kernelMultitaskerYield(void)
+{
+	// This function will yield control from the current running thread back
+	// to the scheduler.
+
+	int interrupts = 0;
+	cpuState *cpu = NULL;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+		// We can't yield if we're not multitasking yet
+		return;
+
+	// Don't do this inside an interrupt
+	if (kernelProcessingInterrupt())
+		return;
+
+	// We accomplish a yield by switching to the scheduler's context.  The
+	// scheduler sees this almost as if the current timeslice had expired.
+	processorSuspendInts(interrupts);
+	cpu = thisCpu();
+	cpu->switchedByCall = 1;
+	switchContext(cpu->currentProcess, cpu->schedulerProc);
+	processorRestoreInts(interrupts);
+}
+
+
+void kernelMultitaskerWait(unsigned milliseconds)
+{
+	// This function will put a process into the waiting state for *at least*
+	// the specified number of milliseconds, and yield control back to the
+	// scheduler
+
+	int status = 0;
+	int interrupts = 0;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+	{
+		// We can't wait properly if we're not multitasking yet, but we can
+		// try to spin
+		kernelDebugError("Cannot wait() before multitasking is enabled.  "
+			"Spinning.");
+		kernelCpuSpinMs(milliseconds);
+		return;
+	}
+
+	// Don't do this inside an interrupt
+	if (kernelProcessingInterrupt())
+	{
+		kernelPanic("Cannot wait() inside an interrupt handler (%d)",
+			kernelInterruptGetCurrent());
+	}
+
+	// Make sure the current process isn't NULL
+	if (!kernelCurrentProcess)
+	{
+		// Can't return an error code, but we can't perform the specified
+		// action either
+		return;
+	}
+
+	// Set the wait until time
+	kernelCurrentProcess->waitUntil = (kernelCpuGetMs() + milliseconds);
+	kernelCurrentProcess->waitForProcess = 0;
+
+	processorSuspendInts(interrupts);
+
+	// Set the current process to "waiting", and set a timer to wake it up
+	setProcessState(kernelCurrentProcess, proc_waiting);
+	status = timerInsert(&kernelCurrentProcess->waitTimer, milliseconds,
+		waitTimerExpired, (void *) kernelCurrentProcess);
+	if (status < 0)
+	{
+		// No free timers.  Stay ready, and yield until the time has come.
+		setProcessState(kernelCurrentProcess, proc_ready);
+	}
+
+	processorRestoreInts(interrupts);
+
+	// And yield
+	kernelMultitaskerYield();
+
+	if (status < 0)
+	{
+		while (kernelCpuGetMs() < kernelCurrentProcess->waitUntil)
+			kernelMultitaskerYield();
+	}
+}
+
+
+void kernelMultitaskerLockWait(lock *waitLock, unsigned milliseconds)
+{
+	// Put the current process to sleep until the lock is handed to it by
+	// kernelMultitaskerLockWake(), or the specified number of milliseconds
+	// have passed (so that the caller can check whether the holder is still
+	// viable).  The first time, the process joins the back of the lock's
+	// queue, and it keeps its place there until the lock is handed to it, or
+	// it calls kernelMultitaskerLockCancel().  Called by the lock functions
+	// with interrupts disabled.
+
+	int status = 0;
+	lockWaitQueue *queue = NULL;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled || !kernelCurrentProcess)
+		return;
+
+	if (kernelCurrentProcess->waitLock != waitLock)
+	{
+		queue = lockQueueFind(waitLock, kernelCurrentProcess->pageDirectory,
+			1 /* create */);
+		if (queue)
+		{
+			kernelCurrentProcess->nextLockWaiter = NULL;
+			if (queue->last)
+				queue->last->nextLockWaiter = kernelCurrentProcess;
+			else
+				queue->first = kernelCurrentProcess;
+			queue->last = kernelCurrentProcess;
+
+			kernelCurrentProcess->waitLock = waitLock;
+		}
+	}
+
+	inheritPriority(kernelCurrentProcess);
+	kernelCurrentProcess->waitUntil = (kernelCpuGetMs() + milliseconds);
+	kernelCurrentProcess->waitForProcess = 0;
+
+	setProcessState(kernelCurrentProcess, proc_waiting);
+	status = timerInsert(&kernelCurrentProcess->waitTimer, milliseconds,
+		waitTimerExpired, (void *) kernelCurrentProcess);
+	if (status < 0)
+		// No free timers.  Stay ready, and just yield.
+		setProcessState(kernelCurrentProcess, proc_ready);
+
+	kernelMultitaskerYield();
+}
+
+
+int kernelMultitaskerLockWake(lock *wakeLock)
+{
+	// Wake up the process that has been waiting longest for the lock, and
+	// return its process ID (to which the caller hands the lock), or 0 if
+	// there are no waiters.  Called by the lock functions with interrupts
+	// disabled.
+
+	lockWaitQueue *queue = NULL;
+	kernelProcess *wakeProcess = NULL;
+	kernelProcess *waiter = NULL;
+
+	if (!multitaskingEnabled || !kernelCurrentProcess)
+		return (0);
 
-		if (clear)
-			kernelTextInputStreamRemoveAll(input);
+	queue = lockQueueFind(wakeLock, kernelCurrentProcess->pageDirectory, 0);
+	if (!queue || !queue->first)
+		return (0);
+
+	wakeProcess = queue->first;
+
+	// The woken process now holds the lock, so it inherits the priority of
+	// any others still waiting for it
+	for (waiter = wakeProcess->nextLockWaiter; waiter;
+		waiter = waiter->nextLockWaiter)
+	{
+		if (waiter->priority < wakeProcess->priority)
+			setPriority(wakeProcess, waiter->priority);
 	}
 
-	if (output)
-		secondProcess->textOutputStream = output;
+	lockQueueRemove(queue, wakeProcess);
 
-	return (status = 0);
+	if (wakeProcess->state == proc_waiting)
+		setProcessState(wakeProcess, proc_ready);
+
+	return (wakeProcess->processId);
 }
 
 
-int kernelMultitaskerGetProcessorTime(clock_t *clk)
+int kernelMultitaskerLockWaiting(lock *waitLock)
 {
-	// Returns processor time used by a process since its start.  This value
-	// is the number of timer ticks from the system timer.
-
-	int status = 0;
+	// Returns 1 if any processes are waiting for the lock.  The lock
+	// structure is shared with user space, so its waiters are only recorded
+	// in its queue, here.
 
-	// Make sure multitasking has been enabled
-	if (!multitaskingEnabled)
-		return (status = ERR_NOTINITIALIZED);
+	lockWaitQueue *queue = NULL;
+	int waiting = 0;
+	int interrupts = 0;
 
-	if (!clk)
-		return (status = ERR_NULLPARAMETER);
+	if (!multitaskingEnabled || !kernelCurrentProcess)
+		return (waiting = 0);
 
-	// Return the processor time of the current process
-	*clk = kernelCurrentProcess->cpuTime;
+	processorSuspendInts(interrupts);
+	queue = lockQueueFind(waitLock, kernelCurrentProcess->pageDirectory, 0);
+	waiting = (queue && queue->first);
+	processorRestoreInts(interrupts);
 
-	return (status = 0);
+	return (waiting);
 }
 
 
-void kernelMultitaskerYield(void)
+void kernelMultitaskerLockCancel(lock *waitLock)
 {
-	// This function will yield control from the current running thread back
-	// to the scheduler.
+	// The current process is no longer waiting for the lock (it took the
+	// lock itself, or gave up), so it leaves the lock's queue, if it's in
+	// it.  Called by the lock functions with interrupts disabled.
 
-	// Make sure multitasking has been enabled
-	if (!multitaskingEnabled)
-		// We can't yield if we're not multitasking yet
-		return;
+	lockWaitQueue *queue = NULL;
 
-	// Don't do this inside an interrupt
-	if (kernelProcessingInterrupt())
+	if (!multitaskingEnabled || !kernelCurrentProcess ||
+		(kernelCurrentProcess->waitLock != waitLock))
+	{
 		return;
+	}
 
-	// We accomplish a yield by doing a far call to the scheduler's task.  The
-	// scheduler sees this almost as if the current timeslice had expired.
-	schedulerSwitchedByCall = 1;
-	processorFarJump(schedulerProc->tssSelector);
+	queue = lockQueueFind(waitLock, kernelCurrentProcess->pageDirectory, 0);
+	if (queue)
+		lockQueueRemove(queue, kernelCurrentProcess);
+
+	kernelCurrentProcess->waitLock = NULL;
 }
 
 
-void kernelMultitaskerWait(unsigned milliseconds)
+void kernelMultitaskerLockRestorePriority(void)
 {
-	// This function will put a process into the waiting state for *at least*
-	// the specified number of milliseconds, and yield control back to the
-	// scheduler
+	// Called when the current process releases a lock.  If it had been
+	// running at a priority inherited from waiters, drop back to its own
+	// priority, or to the highest priority of anyone still waiting for other
+	// locks that it holds.  Only locks with waiters have queues, so those are
+	// all we need to look at.  Called with interrupts disabled.
+
+	int newPriority = 0;
+	lockWaitQueue *queue = NULL;
+	kernelProcess *waiter = NULL;
+	int count;
 
-	// Make sure multitasking has been enabled
-	if (!multitaskingEnabled)
+	if (!multitaskingEnabled || !kernelCurrentProcess ||
+		(kernelCurrentProcess->priority >= kernelCurrentProcess->basePriority))
 	{
-		// We can't wait properly if we're not multitasking yet, but we can
-		// try to spin
-		kernelDebugError("Cannot wait() before multitasking is enabled.  "
-			"Spinning.");
-		kernelCpuSpinMs(milliseconds);
 		return;
 	}
 
-	// Don't do this inside an interrupt
-	if (kernelProcessingInterrupt())
-	{
-		kernelPanic("Cannot wait() inside an interrupt handler (%d)",
-			kernelInterruptGetCurrent());
-	}
+	newPriority = kernelCurrentProcess->basePriority;
 
-	// Make sure the current process isn't NULL
-	if (!kernelCurrentProcess)
+	for (count = 0; count < LOCK_WAIT_BUCKETS; count ++)
 	{
-		// Can't return an error code, but we can't perform the specified
-		// action either
-		return;
-	}
-
-	// Set the wait until time
-	kernelCurrentProcess->waitUntil = (kernelCpuGetMs() + milliseconds);
-	kernelCurrentProcess->waitForProcess = 0;
+		for (queue = lockWaitHash[count]; queue; queue = queue->next)
+		{
+			// A lock in user memory can only be looked at from within the
+			// same address space
+			if ((queue->pageDirectory && (queue->pageDirectory !=
+					kernelCurrentProcess->pageDirectory)) ||
+				(queue->lock->processId != kernelCurrentProcess->processId))
+			{
+				continue;
+			}
 
-	// Set the current process to "waiting"
-	kernelCurrentProcess->state = proc_waiting;
+			for (waiter = queue->first; waiter;
+				waiter = waiter->nextLockWaiter)
+			{
+				if (waiter->priority < newPriority)
+					newPriority = waiter->priority;
+			}
+		}
+	}
 
-	// And yield
-	kernelMultitaskerYield();
+	setPriority(kernelCurrentProcess, newPriority);
 }
 
 
@@ -3117,7 +4715,7 @@ int kernelMultitaskerBlock(int processId)
 	kernelCurrentProcess->waitUntil = 0;
 
 	// Set the current process to "waiting"
-	kernelCurrentProcess->state = proc_waiting;
+	setProcessState(kernelCurrentProcess, proc_waiting);
 
 	// And yield
 	kernelMultitaskerYield();
@@ -3164,7 +4762,7 @@ int kernelMultitaskerDetach(void)
 		parentProcess->waitForProcess = 0;
 
 		// Make it runnable
-		parentProcess->state = proc_ready;
+		setProcessState(parentProcess, proc_ready);
 	}
 
 	return (status = 0);
@@ -3222,13 +4820,21 @@ int kernelMultitaskerKillProcess(int processId, int force)
 		return (status = ERR_INVALID);
 	}
 
+	// Nor the idle threads of the application processors
+	if (killProcess->cpu && (killProcess == cpus[killProcess->cpu].idleProc))
+	{
+		kernelError(kernel_error, "It's not possible to kill the idle "
+			"thread of processor %d", killProcess->cpu);
+		return (status = ERR_INVALID);
+	}
+
 	// If a thread is trying to kill its parent, we won't do that here.
 	// Instead we will mark it as 'finished' and let the kernel clean us all
 	// up later
 	if ((kernelCurrentProcess->type == proc_thread) &&
 		(processId == kernelCurrentProcess->parentProcessId))
 	{
-		killProcess->state = proc_finished;
+		setProcessState(killProcess, proc_finished);
 		while (1)
 			kernelMultitaskerYield();
 	}
@@ -3237,7 +4843,10 @@ int kernelMultitaskerKillProcess(int processId, int force)
 
 	// Mark the process as stopped in the process queue, so that the scheduler
 	// will not inadvertently select it to run while we're destroying it.
-	killProcess->state = proc_stopped;
+	setProcessState(killProcess, proc_stopped);
+
+	// If it was waiting for a lock, it isn't any more
+	lockWaitAbandon(killProcess);
 
 	// We must loop through the list of existing processes, looking for any
 	// other processes whose states depend on this one (such as child threads
@@ -3265,7 +4874,7 @@ int kernelMultitaskerKillProcess(int processId, int force)
 			{
 				processQueue[count]->blockingExitCode = ERR_KILLED;
 				processQueue[count]->waitForProcess = 0;
-				processQueue[count]->state = proc_ready;
+				setProcessState(processQueue[count], proc_ready);
 			}
 
 			continue;
@@ -3327,13 +4936,13 @@ int kernelMultitaskerKillProcess(int processId, int force)
 		// its resources won't be 'lost'
 		kernelError(kernel_error, "Couldn't delete process %d: \"%s\"",
 			killProcess->processId, killProcess->name);
-		killProcess->state = proc_zombie;
+		setProcessState(killProcess, proc_zombie);
 		return (status);
 	}
 
 	// If the target process is the idle process, spawn another one
-	if (killProcess == idleProc)
-		spawnIdleThread();
+	if (killProcess == cpus[0].idleProc)
+		spawnIdleThread(&cpus[0]);
 
 	// Done.  Return success
 	return (status = 0);
@@ -3379,7 +4988,7 @@ int kernelMultitaskerKillAll(void)
 	for (count = 0; count < numQueued; count ++)
 	{
 		if (PROC_KILLABLE(processQueue[count]))
-			processQueue[count]->state = proc_stopped;
+			setProcessState(processQueue[count], proc_stopped);
 	}
 
 	for (count = 0; count < numQueued; )
@@ -3448,7 +5057,7 @@ int kernelMultitaskerTerminate(int retCode)
 			// its blockingExitCode field
 			parent->blockingExitCode = retCode;
 			parent->waitForProcess = 0;
-			parent->state = proc_ready;
+			setProcessState(parent, proc_ready);
 
 			// Done.
 		}
@@ -3460,7 +5069,7 @@ int kernelMultitaskerTerminate(int retCode)
 		// are finished
 		if (!kernelCurrentProcess->descendentThreads)
 			// Terminate
-			kernelCurrentProcess->state = proc_finished;
+			setProcessState(kernelCurrentProcess, proc_finished);
 
 		kernelMultitaskerYield();
 	}
@@ -3543,7 +5152,7 @@ int kernelMultitaskerSignal(int processId, int sig)
 		!(signalProcess->signalStream.buffer))
 	{
 		// Not handled.  Terminate the process.
-		signalProcess->state = proc_finished;
+		setProcessState(signalProcess, proc_finished);
 		return (status = 0);
 	}
 
@@ -3622,8 +5231,16 @@ int kernelMultitaskerGetIoPerm(int processId, int portNum)
 	if (portNum >= IO_PORTS)
 		return (status = ERR_BOUNDS);
 
+	// Supervisor processes can always use I/O ports
+	if (ioProcess->processorPrivilege == PRIVILEGE_SUPERVISOR)
+		return (status = 1);
+
+	// No I/O permission bitmap means no permissions were ever granted
+	if (!ioProcess->ioMap)
+		return (status = 0);
+
 	// If the bit is set, permission is not granted.
-	if (GET_PORT_BIT(ioProcess->taskStateSegment.IOMap, portNum))
+	if (GET_PORT_BIT(ioProcess->ioMap, portNum))
 		return (status = 0);
 	else
 		return (status = 1);
@@ -3636,6 +5253,8 @@ int kernelMultitaskerSetIoPerm(int processId, int portNum, int yesNo)
 
 	int status = 0;
 	kernelProcess *ioProcess = NULL;
+	int interrupts = 0;
+	int count;
 
 	// Make sure multitasking has been enabled
 	if (!multitaskingEnabled)
@@ -3653,10 +5272,38 @@ int kernelMultitaskerSetIoPerm(int processId, int portNum, int yesNo)
 	if (portNum >= IO_PORTS)
 		return (status = ERR_BOUNDS);
 
+	if (!ioProcess->ioMap)
+	{
+		// Nothing to do if we're denying permission
+		if (!yesNo)
+			return (status = 0);
+
+		// Allocate the process' I/O permission bitmap, with access to all
+		// ports turned off by default
+		ioProcess->ioMap = kernelMalloc(PORTS_BYTES);
+		if (!ioProcess->ioMap)
+			return (status = ERR_MEMORY);
+
+		memset(ioProcess->ioMap, 0xFF, PORTS_BYTES);
+	}
+
+	processorSuspendInts(interrupts);
+
 	if (yesNo)
-		UNSET_PORT_BIT(ioProcess->taskStateSegment.IOMap, portNum);
+		UNSET_PORT_BIT(ioProcess->ioMap, portNum);
 	else
-		SET_PORT_BIT(ioProcess->taskStateSegment.IOMap, portNum);
+		SET_PORT_BIT(ioProcess->ioMap, portNum);
+
+	// If the bitmap is the one loaded in the TSS, refresh it
+	for (count = 0; count < numCpus; count ++)
+	{
+		if (cpus[count].ioMapProcess == ioProcess)
+			cpus[count].ioMapProcess = NULL;
+	}
+	if (ioProcess == kernelCurrentProcess)
+		loadIoMap(&cpus[0], ioProcess);
+
+	processorRestoreInts(interrupts);
 
 	return (status = 0);
 }
@@ -3761,6 +5408,115 @@ int kernelMultitaskerStackTrace(int processId)
 }
 
 
+int kernelMultitaskerSchedTrace(int enable)
+{
+	// Turn the scheduler trace on or off.  Turning it on discards any events
+	// that haven't been read.  The event buffer is kept once it's allocated.
+
+	int status = 0;
+	schedTraceEvent *events = NULL;
+	int interrupts = 0;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (enable && !schedTrace.events)
+	{
+		events = kernelMalloc(SCHEDTRACE_EVENTS * sizeof(schedTraceEvent));
+		if (!events)
+			return (status = ERR_MEMORY);
+	}
+
+	processorSuspendInts(interrupts);
+	kernelSpinLockGet(&schedulerLock);
+
+	if (enable)
+	{
+		if (!schedTrace.events)
+		{
+			schedTrace.events = events;
+			events = NULL;
+		}
+
+		schedTrace.first = schedTrace.count = 0;
+	}
+
+	schedTrace.enabled = enable;
+
+	kernelSpinLockRelease(&schedulerLock);
+	processorRestoreInts(interrupts);
+
+	// If someone else installed a buffer first, we don't need ours.  We can't
+	// allocate or free memory while holding the scheduler lock.
+	if (events)
+		kernelFree(events);
+
+	return (status = 0);
+}
+
+
+int kernelMultitaskerSchedTraceRead(schedTraceEvent *buffer,
+	unsigned maxEvents)
+{
+	// Remove up to maxEvents of the oldest scheduler trace events, and copy
+	// them into the buffer with their times converted to microseconds.
+	// Returns the number of events copied.
+
+	schedTraceEvent events[64];
+	uquad_t freq = 0;
+	int interrupts = 0;
+	unsigned numEvents = 0;
+	unsigned total = 0;
+	unsigned count;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+		return (ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!buffer)
+		return (ERR_NULLPARAMETER);
+
+	freq = (kernelCpuTimestampFreq() / US_PER_SEC);
+	if (!freq)
+		return (ERR_NOTINITIALIZED);
+
+	// Copy them out in chunks, so that we're not touching the caller's
+	// memory while holding the scheduler lock
+	while (total < maxEvents)
+	{
+		processorSuspendInts(interrupts);
+		kernelSpinLockGet(&schedulerLock);
+
+		numEvents = min(schedTrace.count, min((maxEvents - total), 64));
+		for (count = 0; count < numEvents; count ++)
+		{
+			memcpy(&events[count], (void *)
+				&schedTrace.events[schedTrace.first],
+				sizeof(schedTraceEvent));
+			schedTrace.first = ((schedTrace.first + 1) % SCHEDTRACE_EVENTS);
+		}
+		schedTrace.count -= numEvents;
+
+		kernelSpinLockRelease(&schedulerLock);
+		processorRestoreInts(interrupts);
+
+		if (!numEvents)
+			break;
+
+		for (count = 0; count < numEvents; count ++)
+			events[count].time /= freq;
+
+		memcpy(&buffer[total], events, (numEvents *
+			sizeof(schedTraceEvent)));
+		total += numEvents;
+	}
+
+	return (total);
+}
+
+
 int kernelMultitaskerPropagateEnvironment(const char *variable)
 {
 	// Allows the current process to set and overwrite its descendent
@@ -3790,3 +5546,198 @@ int kernelMultitaskerPropagateEnvironment(const char *variable)
 	return (status);
 }
 
+
+
+int kernelMultitaskerAddCpu(int apicId)
+{
+	// Called on the boot processor to set up the scheduler state of an
+	// application processor, before it's started with
+	// kernelMultitaskerStartCpu().  Returns the new processor number on
+	// success, negative otherwise.
+
+	int status = 0;
+	cpuState *cpu = NULL;
+	int cpuNum = numCpus;
+	int bootApicId = 0;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (cpuNum >= MAX_CPUS)
+		return (status = ERR_NOFREE);
+
+	// The boot processor's APIC ID, for interrupts sent to it
+	if (cpuNum == 1)
+	{
+		bootApicId = kernelApicGetId();
+		if (bootApicId >= 0)
+			cpus[0].apicId = bootApicId;
+	}
+
+	cpu = &cpus[cpuNum];
+	memset((void *) cpu, 0, sizeof(cpuState));
+	cpu->cpuNum = cpuNum;
+	cpu->apicId = apicId;
+	cpu->loadedCR3 = kernelProc->context.CR3;
+
+	cpu->tss = kernelMalloc(sizeof(kernelTSS));
+	if (!cpu->tss)
+		return (status = ERR_MEMORY);
+
+	status = setupCpuTss(cpu);
+	if (status < 0)
+	{
+		kernelFree((void *) cpu->tss);
+		return (status);
+	}
+
+	status = createSchedulerProcess(cpu, apScheduler);
+	if (status < 0)
+	{
+		kernelDescriptorRelease(cpu->tssSelector);
+		kernelFree((void *) cpu->tss);
+		return (status);
+	}
+
+	// The processor is usable (by thisCpu(), for example) from here on
+	numCpus += 1;
+
+	status = spawnIdleThread(cpu);
+	if (status < 0)
+	{
+		numCpus -= 1;
+		kernelDescriptorRelease(cpu->tssSelector);
+		kernelFree((void *) cpu->tss);
+		return (status);
+	}
+
+	return (status = cpuNum);
+}
+
+
+void kernelMultitaskerStartCpu(int cpuNum)
+{
+	// Called on an application processor, once its descriptor tables and
+	// local APIC are set up, to start its scheduler.  Doesn't return.
+
+	cpuState *cpu = &cpus[cpuNum];
+	unsigned bootEsp = 0;
+
+	processorDisableInts();
+	processorLoadTaskReg(cpu->tssSelector);
+	processorGetCR3(cpu->loadedCR3);
+	fpuCpuInitialize();
+
+	if (apicTimer)
+		kernelApicTimerInitialize(APIC_VECTOR_TIMER);
+
+	cpu->currentProcess = cpu->schedulerProc;
+	createStartFrame(cpu->schedulerProc);
+	processorSwitchContext(&bootEsp, cpu->schedulerProc->context.savedESP);
+
+	// We should never get here
+	while (1)
+		processorStop();
+}
+
+
+int kernelMultitaskerGetNumCpus(void)
+{
+	// Returns the number of processors that are running processes
+
+	int online = 0;
+	int count;
+
+	for (count = 0; count < numCpus; count ++)
+	{
+		if (cpus[count].online)
+			online += 1;
+	}
+
+	return (online);
+}
+
+
+void kernelMultitaskerKernelEnter(void)
+{
+	// Called when the current process enters the kernel, by way of an API
+	// call or an exception.  The kernel only runs on the boot processor, so
+	// if we're on one of the application processors, have its scheduler
+	// hand the process over.  We continue on the boot processor when it next
+	// chooses us to run.
+
+	int interrupts = 0;
+	cpuState *cpu = NULL;
+
+	if (!multitaskingEnabled)
+		return;
+
+	processorSuspendInts(interrupts);
+
+	cpu = thisCpu();
+
+	if (cpu->cpuNum)
+	{
+		cpu->currentProcess->migrate = 1;
+		cpu->switchedByCall = 1;
+		switchContext(cpu->currentProcess, cpu->schedulerProc);
+	}
+
+	processorRestoreInts(interrupts);
+}
+
+
+void kernelMultitaskerTlbShootdown(unsigned pageDir, void *virtual,
+	unsigned pages)
+{
+	// Called on the boot processor after changing the page mappings of the
+	// page directory, to flush the mappings from the TLBs of any application
+	// processors that might have them cached.  If 'pages' is zero, the page
+	// directory is being deleted.  Don't call this with the scheduler lock
+	// held.
+
+	unsigned cpuMask = 0;
+	uquad_t timeout = 0;
+	int count;
+
+	if (numCpus < 2)
+		return;
+
+	kernelSpinLockGet(&tlbShootdownLock);
+
+	for (count = 1; count < numCpus; count ++)
+	{
+		// Kernel memory is mapped in every address space
+		if (cpus[count].online &&
+			((pages && ((unsigned) virtual >= KERNEL_VIRTUAL_ADDRESS)) ||
+				(cpus[count].loadedCR3 == pageDir)))
+		{
+			cpuMask |= (1 << count);
+		}
+	}
+
+	if (cpuMask)
+	{
+		tlbShootdown.pageDir = pageDir;
+		tlbShootdown.virtual = virtual;
+		tlbShootdown.pages = pages;
+		tlbShootdown.pending = cpuMask;
+
+		for (count = 1; count < numCpus; count ++)
+		{
+			if (cpuMask & (1 << count))
+				kernelApicSendIpi(cpus[count].apicId, IPI_VECTOR_TLBFLUSH);
+		}
+
+		timeout = (kernelCpuGetMs() + 1000);
+		while (tlbShootdown.pending && (kernelCpuGetMs() < timeout))
+			processorPause();
+
+		if (tlbShootdown.pending)
+			kernelError(kernel_warn, "TLB shootdown timed out (processors "
+				"%x)", tlbShootdown.pending);
+	}
+
+	kernelSpinLockRelease(&tlbShootdownLock);
+}
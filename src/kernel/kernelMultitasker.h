@@ -32,7 +32,7 @@
 #include <sys/variable.h>
 
 // Definitions
-#define MAX_PROCESSES				((GDT_SIZE - RES_GLOBAL_DESCRIPTORS))
+#define MAX_PROCESSES				4096
 #define PRIORITY_LEVELS				8
 #define DEFAULT_STACK_SIZE			(32 * 1024)
 #define DEFAULT_SUPER_STACK_SIZE	(32 * 1024)
@@ -41,7 +41,14 @@
 #define CPU_PERCENT_TIMESLICES		(TIME_SLICES_PER_SEC / 2) // every 1/2 sec
 #define PRIORITY_RATIO				3
 #define PRIORITY_DEFAULT			((PRIORITY_LEVELS / 2) - 1)
-#define FPU_STATE_LEN				108
+#define MAX_TIMERS					(MAX_PROCESSES * 2)
+#define MIN_TIME_SLICE_LENGTH		(SYSTIMER_FREQ_HZ / 1000) // ~1ms
+#define MIN_APIC_SLICE_LENGTH		(SYSTIMER_FREQ_HZ / 20000) // ~50us
+#define MAX_IDLE_SLICE_LENGTH		SYSTIMER_FREQ_HZ // 1 sec
+#define SCHEDTRACE_EVENTS			8192
+// Big enough for the XSAVE area with x87, SSE and AVX state, plus alignment
+#define FPU_STATE_LEN				832
+#define FPU_STATE_ALIGN				64
 #define IO_PORTS					65536
 #define PORTS_BYTES					(IO_PORTS / 8)
 #define IOBITMAP_OFFSET				0x68
@@ -66,6 +73,8 @@
 #define EXCEPTION_FLOAT				16
 #define EXCEPTION_ALIGNCHECK		17
 #define EXCEPTION_MACHCHECK			18
+#define EXCEPTION_SIMD				19
+#define EXCEPTIONS					20
 
 // A structure representing x86 TSSes (Task State Sements)
 typedef volatile struct {
@@ -97,17 +106,48 @@ typedef volatile struct {
 	unsigned short pad;
 	unsigned short IOMapBase;
 	unsigned char IOMap[PORTS_BYTES];
+	unsigned char IOMapEnd;
 
 } __attribute__((packed)) kernelTSS;
 
-// A structure for processes
+// The processor context of a process.  There is only one TSS (see above),
+// which is used for privilege level changes, and context switches are done
+// in software by saving and restoring the stack pointer.  The initial
+// register values are only used to start the process.
+typedef volatile struct {
+	unsigned savedESP;		// Kernel stack pointer when switched out
+	unsigned ESP0;			// Top of the supervisor stack
+	unsigned CR3;
+	unsigned EIP;
+	unsigned EFLAGS;
+	unsigned ESP;
+	unsigned CS;
+	unsigned DS;
+	unsigned SS;
+
+} kernelProcessContext;
+
+// A structure for kernel timers.  When a timer expires, its function is
+// called by the scheduler with interrupts disabled, so it must be quick and
+// must not block.  A zeroed timer is not pending.  The expiry time is in
+// microseconds (see kernelCpuGetUs()).
 typedef volatile struct {
+	unsigned long long expiry;
+	void (*function)(void *);
+	void *data;
+	int heapPosition;
+
+} kernelTimer;
+
+// A structure for processes
+typedef volatile struct _kernelProcess {
 	char name[MAX_PROCNAME_LENGTH];
 	processImage execImage;
 	int userId;
 	int processId;
 	processType type;
 	int priority;
+	int basePriority;
 	int privilege;
 	int processorPrivilege;
 	int parentProcessId;
@@ -117,7 +157,10 @@ typedef volatile struct {
 	unsigned lastSlice;
 	unsigned waitTime;
 	unsigned long long waitUntil;
+	kernelTimer waitTimer;
 	int waitForProcess;
+	lock *waitLock;
+	volatile struct _kernelProcess *nextLockWaiter;
 	int blockingExitCode;
 	processState state;
 	void *userStack;
@@ -125,8 +168,8 @@ typedef volatile struct {
 	void *superStack;
 	unsigned superStackSize;
 	kernelPageDirectory *pageDirectory;
-	kernelSelector tssSelector;
-	kernelTSS taskStateSegment;
+	kernelProcessContext context;
+	unsigned char *ioMap;
 	char currentDirectory[MAX_PATH_LENGTH];
 	variableList *environment;
 	kernelTextInputStream *textInputStream;
@@ -134,10 +177,23 @@ typedef volatile struct {
 	kernelTextOutputStream *textOutputStream;
 	unsigned signalMask;
 	stream signalStream;
-	unsigned char fpuState[FPU_STATE_LEN];
+	unsigned char fpuState[FPU_STATE_LEN + FPU_STATE_ALIGN];
 	int fpuStateSaved;
 	loaderSymbolTable *symbols;
 
+	// Linkage for the scheduler's per-priority ready queues
+	int readyLevel;
+	volatile struct _kernelProcess *prevReady;
+	volatile struct _kernelProcess *nextReady;
+
+	// The processor whose ready queues the process is in, and the one it's
+	// actually running on (or -1).  Kernel code only runs on the boot
+	// processor, so 'migrate' asks the scheduler of an application processor
+	// to send a process that's entering the kernel back.
+	int cpu;
+	int runningCpu;
+	int migrate;
+
 } kernelProcess;
 
 // When in system calls, processes will be allowed to access information
@@ -148,6 +204,7 @@ extern kernelProcess *kernelCurrentProcess;
 int kernelMultitaskerInitialize(void *, unsigned);
 int kernelMultitaskerShutdown(int);
 void kernelException(int, unsigned);
+void kernelExceptionPageFault(unsigned, void *, unsigned);
 void kernelMultitaskerDumpProcessList(void);
 int kernelMultitaskerGetCurrentProcessId(void);
 int kernelMultitaskerGetProcess(int, process *);
@@ -175,6 +232,11 @@ int kernelMultitaskerDuplicateIo(int, int, int);
 int kernelMultitaskerGetProcessorTime(clock_t *);
 void kernelMultitaskerYield(void);
 void kernelMultitaskerWait(unsigned);
+void kernelMultitaskerLockWait(lock *, unsigned);
+int kernelMultitaskerLockWake(lock *);
+int kernelMultitaskerLockWaiting(lock *);
+void kernelMultitaskerLockCancel(lock *);
+void kernelMultitaskerLockRestorePriority(void);
 int kernelMultitaskerBlock(int);
 int kernelMultitaskerDetach(void);
 int kernelMultitaskerKillProcess(int, int);
@@ -190,7 +252,14 @@ kernelPageDirectory *kernelMultitaskerGetPageDir(int);
 loaderSymbolTable *kernelMultitaskerGetSymbols(int);
 int kernelMultitaskerSetSymbols(int, loaderSymbolTable *);
 int kernelMultitaskerStackTrace(int);
+int kernelMultitaskerSchedTrace(int);
+int kernelMultitaskerSchedTraceRead(schedTraceEvent *, unsigned);
 int kernelMultitaskerPropagateEnvironment(const char *);
+int kernelMultitaskerAddCpu(int);
+void kernelMultitaskerStartCpu(int);
+int kernelMultitaskerGetNumCpus(void);
+void kernelMultitaskerKernelEnter(void);
+void kernelMultitaskerTlbShootdown(unsigned, void *, unsigned);
 
 #define _KERNELMULTITASKER_H
 #endif
@@ -37,6 +37,7 @@
 #include "kernelNetworkStream.h"
 #include "kernelNetworkUdp.h"
 #include "kernelRtc.h"
+#include "kernelSlab.h"
 #include "kernelVariableList.h"
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +49,7 @@ static kernelNetworkDevice *devices[NETWORK_MAX_DEVICES];
 static int numDevices = 0;
 static int netThreadPid = 0;
 static int networkStop = 0;
+static kernelSlabCache packetCache;
 static int initialized = 0;
 static int enabled = 0;
 
@@ -508,6 +510,12 @@ int kernelNetworkInitialize(void)
 		// Nothing to do.  No error.
 		return (status = 0);
 
+	// Create the cache for network packets
+	status = kernelSlabCacheCreate(&packetCache, "network packets",
+		sizeof(kernelNetworkPacket));
+	if (status < 0)
+		return (status);
+
 	hostName = kernelMalloc(NETWORK_MAX_HOSTNAMELENGTH);
 	if (!hostName)
 		return (status = ERR_MEMORY);
@@ -727,11 +735,12 @@ kernelNetworkPacket *kernelNetworkPacketGet(void)
 
 	kernelNetworkPacket *packet = NULL;
 
-	packet = kernelMalloc(sizeof(kernelNetworkPacket));
+	packet = kernelSlabAlloc(&packetCache);
 	if (!packet)
 		return (packet);
 
-	// Can't set packet->release to kernelFree(), because that's a macro
+	// With no release function, kernelNetworkPacketRelease() returns it to
+	// the cache
 
 	packet->refCount = 1;
 
@@ -775,7 +784,7 @@ void kernelNetworkPacketRelease(kernelNetworkPacket *packet)
 		if (packet->release)
 			packet->release(packet);
 		else
-			kernelFree(packet);
+			kernelSlabFree(&packetCache, packet);
 	}
 }
 
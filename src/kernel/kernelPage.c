@@ -49,6 +49,12 @@ static volatile int numberPageTables = 0;
 // The physical memory location where we'll store the kernel's paging data.
 static unsigned long kernelPagingData = 0;
 
+// A kernel page that we can point at any physical page, in order to clear it
+// without mapping it properly (see kernelPageClearPhysical())
+static void *clearWindow = NULL;
+static volatile unsigned *clearWindowEntry = NULL;
+
+static volatile int largePages = 0;
 static volatile int initialized = 0;
 
 // Macros used internally
@@ -134,8 +140,12 @@ static int findFreeTableNumber(kernelPageDirectory *directory)
 
 	for ( ; tableNumber < maxTables; tableNumber ++)
 	{
-		if (!findPageTable(directory, tableNumber))
+		// Skip any that are mapped as large pages
+		if (!findPageTable(directory, tableNumber) &&
+			!directory->virtual->table[tableNumber])
+		{
 			return (tableNumber);
+		}
 	}
 
 	return (tableNumber = -1);
@@ -375,8 +385,11 @@ static int deletePageTable(kernelPageDirectory *directory,
 	kernelTable->virtual->page[kernelPageNumber] = NULL;
 	kernelTable->freePages++;
 
-	// Clear the TLB entry for the table's virtual memory
+	// Clear the TLB entry for the table's virtual memory, here and on any
+	// other processors
 	processorClearAddressCache(table->virtual);
+	kernelMultitaskerTlbShootdown((unsigned) kernelPageDir->physical,
+		(void *) table->virtual, 1);
 
 	// Release the physical memory used by the table
 	status = kernelMemoryReleasePhysical((unsigned) table->physical);
@@ -445,13 +458,28 @@ static int findPageTableEntry(kernelPageDirectory *directory,
 	table = findPageTable(directory, tableNumber);
 	if (!table)
 	{
+		if (directory->virtual->table[tableNumber] & PAGEFLAG_LARGE)
+		{
+			// A large page.  Work out the address of the small page
+			// within it.
+			*entry = ((directory->virtual->table[tableNumber] &
+				~(PAGE_LARGE_SIZE - 1)) + (pageNumber * MEMORY_PAGE_SIZE));
+			return (status = 0);
+		}
+
 		// We're hosed.  This table should already exist.
 		kernelError(kernel_error, "No page table %d", tableNumber);
 		return (status = ERR_NODATA);
 	}
 
-	// Grab the value from the page table
-	*entry = (table->virtual->page[pageNumber] & 0xFFFFF000);
+	// Grab the value from the page table.  Entries that aren't present
+	// (reserved, or paged out to swap) have no physical address.
+	*entry = table->virtual->page[pageNumber];
+	if (*entry & PAGEFLAG_PRESENT)
+		*entry &= 0xFFFFF000;
+	else
+		*entry = 0;
+
 	return (status = 0);
 }
 
@@ -488,6 +516,22 @@ static int arePagesAt(kernelPageDirectory *directory, int numPages,
 	{
 		// Get a pointer to this page table.
 		table = findPageTable(directory, tableNumber);
+
+		if (!table && (directory->virtual->table[tableNumber] &
+			PAGEFLAG_LARGE))
+		{
+			// It's a large page, so all of its pages are used
+			if (!used)
+				return (0);
+
+			numberOk += (PAGE_PAGES_PER_TABLE - pageNumber);
+			if (numberOk >= numPages)
+				return (1);
+
+			pageNumber = 0;
+			continue;
+		}
+
 		if (!table)
 		{
 			// Create the page table
@@ -520,6 +564,59 @@ static int arePagesAt(kernelPageDirectory *directory, int numPages,
 }
 
 
+static int mapLarge(unsigned physicalAddress, void **virtualAddress,
+	unsigned size)
+{
+	// Map whole, aligned 4MB ranges of physical memory into the kernel's
+	// address space as large pages.  They don't need page tables, and each
+	// one only takes up a single TLB entry.
+
+	int status = 0;
+	int numTables = (size / PAGE_LARGE_SIZE);
+	int tableNumber = 0;
+	int numberFree = 0;
+	int count1, count2;
+
+	// Find a run of unused page directory entries
+	for (tableNumber = getTableNumber(KERNEL_VIRTUAL_ADDRESS);
+		tableNumber < PAGE_TABLES_PER_DIR; tableNumber ++)
+	{
+		if (kernelPageDir->virtual->table[tableNumber] ||
+			findPageTable(kernelPageDir, tableNumber))
+		{
+			numberFree = 0;
+			continue;
+		}
+
+		numberFree += 1;
+		if (numberFree >= numTables)
+			break;
+	}
+
+	if (tableNumber >= PAGE_TABLES_PER_DIR)
+		return (status = ERR_NOFREE);
+
+	tableNumber -= (numTables - 1);
+
+	for (count1 = 0; count1 < numTables; count1 ++)
+	{
+		// Set the 'global' bit, so that it stays in the TLBs during a
+		// context switch.  Like the kernel's page tables, it needs to be
+		// shared with all of the other page directories.
+		for (count2 = 0; count2 < numberPageDirectories; count2 ++)
+		{
+			pageDirList[count2]->virtual->table[tableNumber + count1] =
+				((physicalAddress + (count1 * PAGE_LARGE_SIZE)) |
+					PAGEFLAG_LARGE | PAGEFLAG_GLOBAL | PAGEFLAG_WRITABLE |
+					PAGEFLAG_PRESENT);
+		}
+	}
+
+	*virtualAddress = (void *)(tableNumber << 22);
+	return (status = 0);
+}
+
+
 static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 	void **virtualAddress, unsigned size, int flags)
 {
@@ -550,10 +647,19 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 	if (physicalAddress % MEMORY_PAGE_SIZE)
 		return (status = ERR_ALIGN);
 
+	// If the kernel is mapping whole, aligned 4MB ranges of physical memory,
+	// we can use large pages
+	if (largePages && (directory == kernelPageDir) &&
+		(flags == PAGE_MAP_ANY) && !(physicalAddress % PAGE_LARGE_SIZE) &&
+		!(size % PAGE_LARGE_SIZE))
+	{
+		return (status = mapLarge(physicalAddress, virtualAddress, size));
+	}
+
 	// Determine how many pages we need to map
 	numPages = getNumPages(size);
 
-	if (flags == PAGE_MAP_ANY)
+	if ((flags == PAGE_MAP_ANY) || (flags == PAGE_MAP_RESERVE))
 	{
 		// Are there enough free pages in this page directory (plus 1 for the
 		// next page table)?  If not, add more page tables until we have
@@ -634,6 +740,10 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 		if (directory->privilege != PRIVILEGE_SUPERVISOR)
 			pageTable->virtual->page[pageNumber] |= PAGEFLAG_USER;
 
+		// If we're only reserving it, it's not present yet
+		if (flags == PAGE_MAP_RESERVE)
+			pageTable->virtual->page[pageNumber] = PAGEFLAG_RESERVED;
+
 		// Decrease the count of free pages
 		pageTable->freePages--;
 
@@ -663,6 +773,8 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 	unsigned tableNumber = 0;
 	unsigned pageNumber = 0;
 	unsigned numPages = 0;
+	void *startAddress = virtualAddress;
+	int count;
 
 	// Make sure that our arguments are reasonable.  The wrapper functions
 	// that are used to call us from external locations do not check them.
@@ -695,6 +807,23 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 			tableNumber = getTableNumber(virtualAddress);
 
 			pageTable = findPageTable(directory, tableNumber);
+
+			if (!pageTable && !pageNumber &&
+				(numPages >= PAGE_PAGES_PER_TABLE) &&
+				(directory->virtual->table[tableNumber] & PAGEFLAG_LARGE))
+			{
+				// The whole of a large page.  Remove it from all of the page
+				// directories.
+				for (count = 0; count < numberPageDirectories; count ++)
+					pageDirList[count]->virtual->table[tableNumber] = NULL;
+
+				processorClearAddressCache(virtualAddress);
+
+				virtualAddress += PAGE_LARGE_SIZE;
+				numPages -= PAGE_PAGES_PER_TABLE;
+				continue;
+			}
+
 			if (!pageTable)
 				// We're hosed.  This table should already exist.
 				return (status = ERR_NOSUCHENTRY);
@@ -723,6 +852,10 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 		// Loop again
 	}
 
+	// Other processors might have the pages cached in their TLBs as well
+	kernelMultitaskerTlbShootdown((unsigned) directory->physical,
+		startAddress, getNumPages(size));
+
 	// Return success
 	return (status = 0);
 }
@@ -810,6 +943,9 @@ static int deletePageDirectory(kernelPageDirectory *directory)
 	if (directory->numberShares)
 		return (status = ERR_BUSY);
 
+	// Make sure no other processor is still using it
+	kernelMultitaskerTlbShootdown((unsigned) directory->physical, NULL, 0);
+
 	// Deallocate the dynamic memory that this directory is occupying
 	kernelMemoryReleasePhysical((unsigned) directory->physical);
 
@@ -1067,17 +1203,50 @@ static void shareKernelPages(kernelPageDirectory *directory)
 
 
 static int setPageAttrs(kernelPageDirectory *directory, int set,
-	unsigned char flags, void *virtualAddress, int pages)
+	unsigned flags, void *virtualAddress, int pages)
 {
 	// This allows the setting/clearing of page attributes
 
 	int status = 0;
 	kernelPageTable *pageTable = NULL;
+	int tableNumber = 0;
 	int pageNumber = 0;
+	void *startAddress = virtualAddress;
+	int numPages = pages;
+	int largeFlags = (flags & 0x0FFF & ~PAGEFLAG_LARGE);
+	int count;
 
 	while (pages > 0)
 	{
-		pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+		tableNumber = getTableNumber(virtualAddress);
+		pageNumber = getPageNumber(virtualAddress);
+
+		pageTable = findPageTable(directory, tableNumber);
+
+		if (!pageTable &&
+			(directory->virtual->table[tableNumber] & PAGEFLAG_LARGE))
+		{
+			// A large page.  The attributes are in the page directory entry,
+			// and they apply to the whole thing.  Like the mapping itself,
+			// they need to be the same in all of the page directories.
+			for (count = 0; count < numberPageDirectories; count ++)
+			{
+				if (set)
+					pageDirList[count]->virtual->table[tableNumber] |=
+						largeFlags;
+				else
+					pageDirList[count]->virtual->table[tableNumber] &=
+						~largeFlags;
+			}
+
+			processorClearAddressCache(virtualAddress);
+
+			virtualAddress += ((PAGE_PAGES_PER_TABLE - pageNumber) *
+				MEMORY_PAGE_SIZE);
+			pages -= (PAGE_PAGES_PER_TABLE - pageNumber);
+			continue;
+		}
+
 		if (!pageTable)
 		{
 			kernelError(kernel_error, "Virtual address %08x has no page "
@@ -1085,8 +1254,6 @@ static int setPageAttrs(kernelPageDirectory *directory, int set,
 			return (status = ERR_NOSUCHENTRY);
 		}
 
-		pageNumber = getPageNumber(virtualAddress);
-
 		for ( ; (pages > 0) && (pageNumber < PAGE_PAGES_PER_TABLE);
 			pageNumber ++)
 		{
@@ -1102,11 +1269,16 @@ static int setPageAttrs(kernelPageDirectory *directory, int set,
 			else
 				pageTable->virtual->page[pageNumber] &= ~(flags & 0x0FFF);
 
+			processorClearAddressCache(virtualAddress);
+
 			virtualAddress += MEMORY_PAGE_SIZE;
 			pages -= 1;
 		}
 	}
 
+	kernelMultitaskerTlbShootdown((unsigned) directory->physical,
+		startAddress, numPages);
+
 	return (status = 0);
 }
 
@@ -1129,6 +1301,9 @@ int kernelPageInitialize(unsigned kernelMemory)
 	// success, negative on error.
 
 	int status = 0;
+	kernelPageTable *table = NULL;
+	unsigned cr0 = 0, cr4 = 0;
+	unsigned cpuIdLimit = 0, rega = 0, regb = 0, regc = 0, regd = 0;
 	int count;
 
 	// Clear out the memory we'll use to keep track of all the page
@@ -1159,6 +1334,45 @@ int kernelPageInitialize(unsigned kernelMemory)
 	if (status < 0)
 		return (status);
 
+	// Reserve a page of the kernel's address space for clearing physical
+	// pages.  It doesn't matter what it points at to begin with.
+	if (map(kernelPageDir, 0, &clearWindow, MEMORY_PAGE_SIZE,
+		PAGE_MAP_ANY) >= 0)
+	{
+		table = findPageTable(kernelPageDir, getTableNumber(clearWindow));
+		if (table)
+			clearWindowEntry =
+				&table->virtual->page[getPageNumber(clearWindow)];
+	}
+
+	// Set CR0[WP], so that the kernel can't write to read-only user pages
+	// either.  Otherwise, when the kernel copied data out to a process, it
+	// would write straight through to pages shared copy-on-write.
+	processorGetCR0(cr0);
+	processorSetCR0(cr0 | 0x00010000);
+
+	// If the processor supports them, turn on large (4MB) pages, and global
+	// pages.  The kernel's mappings are all marked global, so that they stay
+	// in the TLBs when we switch address spaces.  The application processors
+	// get the same CR4 when they start.
+	processorId(0, cpuIdLimit, regb, regc, regd);
+	if (cpuIdLimit >= 1)
+	{
+		processorId(1, rega, regb, regc, regd);
+		processorGetCR4(cr4);
+
+		if (regd & X86_CPUID1_EDX_PSE)
+		{
+			cr4 |= X86_CR4_PSE;
+			largePages = 1;
+		}
+
+		if (regd & X86_CPUID1_EDX_PGE)
+			cr4 |= X86_CR4_PGE;
+
+		processorSetCR4(cr4);
+	}
+
 	// Make note that we're initialized
 	initialized = 1;
 
@@ -1475,6 +1689,505 @@ int kernelPageUnmap(int processId, void *virtualAddress, unsigned size)
 }
 
 
+int kernelPageReserve(int processId, void **virtualAddress, unsigned size)
+{
+	// Reserve a range of free pages in an address space, at the first
+	// available virtual address, without mapping any memory there.  The
+	// pages can be populated one at a time with kernelPageMapReserved(), and
+	// released with kernelPageUnmap().
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->dirLock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	status = map(directory, 0, virtualAddress, size, PAGE_MAP_RESERVE);
+
+	kernelLockRelease(&directory->dirLock);
+	return (status);
+}
+
+
+int kernelPageMapReserved(int processId, unsigned physicalAddress,
+	void *virtualAddress, int writable)
+{
+	// Map a physical page at a virtual address that was reserved using
+	// kernelPageReserve().  Returns ERR_NOSUCHENTRY if the page isn't (or
+	// is no longer) reserved.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned pageNumber = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	if ((physicalAddress % MEMORY_PAGE_SIZE) ||
+		((unsigned long) virtualAddress % MEMORY_PAGE_SIZE))
+	{
+		return (status = ERR_ALIGN);
+	}
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->dirLock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	pageNumber = getPageNumber(virtualAddress);
+
+	if (pageTable &&
+		(pageTable->virtual->page[pageNumber] == PAGEFLAG_RESERVED))
+	{
+		// Not-present entries aren't cached in the TLBs, so there's nothing
+		// to invalidate
+		pageTable->virtual->page[pageNumber] = (physicalAddress |
+			PAGEFLAG_PRESENT);
+
+		if (writable)
+			pageTable->virtual->page[pageNumber] |= PAGEFLAG_WRITABLE;
+
+		if (directory->privilege != PRIVILEGE_SUPERVISOR)
+			pageTable->virtual->page[pageNumber] |= PAGEFLAG_USER;
+
+		status = 0;
+	}
+	else
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (status);
+}
+
+
+unsigned kernelPageGetCopyOnWrite(int processId, void *virtualAddress)
+{
+	// If the page at the virtual address is shared copy-on-write, return its
+	// physical address.  Otherwise, return 0.
+
+	unsigned physical = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned entry = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (physical = 0);
+
+	if (kernelProcessingInterrupt())
+		return (physical = 0);
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (physical = 0);
+
+	if (kernelLockGet(&directory->dirLock) < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (physical = 0);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	if (pageTable)
+	{
+		entry = pageTable->virtual->page[getPageNumber(virtualAddress)];
+
+		if ((entry & PAGEFLAG_PRESENT) && (entry & PAGEFLAG_COPYONWRITE))
+			physical = (entry & 0xFFFFF000);
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (physical);
+}
+
+
+int kernelPageMapCopy(int processId, unsigned oldPhysical,
+	unsigned newPhysical, void *virtualAddress)
+{
+	// Replace a page that's shared copy-on-write with the process' own,
+	// writable copy.  Returns ERR_NOSUCHENTRY if the page isn't (or is no
+	// longer) the shared one.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned pageNumber = 0;
+	unsigned entry = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	if ((newPhysical % MEMORY_PAGE_SIZE) ||
+		((unsigned long) virtualAddress % MEMORY_PAGE_SIZE))
+	{
+		return (status = ERR_ALIGN);
+	}
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->dirLock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	pageNumber = getPageNumber(virtualAddress);
+
+	if (pageTable)
+		entry = pageTable->virtual->page[pageNumber];
+
+	if ((entry & PAGEFLAG_PRESENT) && (entry & PAGEFLAG_COPYONWRITE) &&
+		((entry & 0xFFFFF000) == oldPhysical))
+	{
+		// Keep the other attributes of the page
+		pageTable->virtual->page[pageNumber] = (newPhysical |
+			(entry & ~(0xFFFFF000 | PAGEFLAG_COPYONWRITE)) |
+			PAGEFLAG_WRITABLE);
+
+		processorClearAddressCache(virtualAddress);
+		kernelMultitaskerTlbShootdown((unsigned) directory->physical,
+			virtualAddress, 1);
+
+		status = 0;
+	}
+	else
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (status);
+}
+
+
+int kernelPageTestAccessed(int processId, void *virtualAddress)
+{
+	// Test and clear the 'accessed' bit of a present page, for deciding
+	// which pages can be paged out.  Returns 1 if the page was accessed since
+	// the last time, 0 if not, or negative if it isn't present.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned pageNumber = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->dirLock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	pageNumber = getPageNumber(virtualAddress);
+
+	if (pageTable &&
+		(pageTable->virtual->page[pageNumber] & PAGEFLAG_PRESENT))
+	{
+		status = ((pageTable->virtual->page[pageNumber] &
+			PAGEFLAG_ACCESSED) != 0);
+
+		if (status)
+		{
+			// The processors set the bit without locking the page table, so
+			// clear it atomically.  We don't bother shooting down the other
+			// processors' TLBs; at worst, the page looks cold a little early.
+			processorAtomicClearBit(&pageTable->virtual->page[pageNumber],
+				5 /* accessed */);
+			processorClearAddressCache(virtualAddress);
+		}
+	}
+	else
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (status);
+}
+
+
+int kernelPageEvict(int processId, unsigned physicalAddress,
+	void *virtualAddress, unsigned slot)
+{
+	// Take a populated page out of the address space, so that its physical
+	// page can be reused.  If the page has been written, the entry records
+	// the swap slot that the caller will write its contents to, and we
+	// return 1 (or ERR_BUSY if the slot is 0, meaning there isn't one).
+	// Otherwise it's just reserved again, so that it's populated afresh when
+	// it's next touched, and we return 0.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned pageNumber = 0;
+	unsigned entry = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	if (slot > (0xFFFFF000 >> 12))
+		return (status = ERR_BOUNDS);
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->dirLock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	pageNumber = getPageNumber(virtualAddress);
+
+	if (pageTable)
+		entry = pageTable->virtual->page[pageNumber];
+
+	if (!(entry & PAGEFLAG_PRESENT) ||
+		((entry & 0xFFFFF000) != physicalAddress))
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+	else if (!slot && (entry & PAGEFLAG_DIRTY))
+	{
+		status = ERR_BUSY;
+	}
+	else
+	{
+		// Clear the present bit first, atomically, so that no processor can
+		// set the dirty bit after we've looked at it
+		processorAtomicClearBit(&pageTable->virtual->page[pageNumber],
+			0 /* present */);
+		entry = pageTable->virtual->page[pageNumber];
+
+		if (!(entry & PAGEFLAG_DIRTY))
+		{
+			pageTable->virtual->page[pageNumber] = PAGEFLAG_RESERVED;
+			status = 0;
+		}
+		else if (slot)
+		{
+			pageTable->virtual->page[pageNumber] = ((slot << 12) |
+				PAGEFLAG_SWAPPED | PAGEFLAG_RESERVED);
+			status = 1;
+		}
+		else
+		{
+			// It was written just now, and there's nowhere to put it.  Put
+			// it back the way it was.
+			pageTable->virtual->page[pageNumber] = (entry | PAGEFLAG_PRESENT);
+			status = ERR_BUSY;
+		}
+
+		if (status >= 0)
+		{
+			processorClearAddressCache(virtualAddress);
+			kernelMultitaskerTlbShootdown((unsigned) directory->physical,
+				virtualAddress, 1);
+		}
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (status);
+}
+
+
+int kernelPageGetSwapped(int processId, void *virtualAddress, unsigned *slot)
+{
+	// Returns 1 if the page at the virtual address has been paged out to
+	// swap, along with its swap slot number, or 0 otherwise.
+
+	int swapped = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned entry = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (swapped = 0);
+
+	if (kernelProcessingInterrupt())
+		return (swapped = 0);
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (swapped = 0);
+
+	if (kernelLockGet(&directory->dirLock) < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (swapped = 0);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	if (pageTable)
+	{
+		entry = pageTable->virtual->page[getPageNumber(virtualAddress)];
+
+		if (!(entry & PAGEFLAG_PRESENT) && (entry & PAGEFLAG_SWAPPED))
+		{
+			*slot = (entry >> 12);
+			swapped = 1;
+		}
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (swapped);
+}
+
+
+int kernelPageMapSwapped(int processId, unsigned physicalAddress,
+	void *virtualAddress, unsigned slot)
+{
+	// Map a physical page, which has been read back from the swap slot, at a
+	// virtual address that was paged out to it.  Returns ERR_NOSUCHENTRY if
+	// the page isn't (or is no longer) in that slot.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	unsigned pageNumber = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	if ((physicalAddress % MEMORY_PAGE_SIZE) ||
+		((unsigned long) virtualAddress % MEMORY_PAGE_SIZE))
+	{
+		return (status = ERR_ALIGN);
+	}
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->dirLock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	pageNumber = getPageNumber(virtualAddress);
+
+	if (pageTable && (pageTable->virtual->page[pageNumber] == ((slot << 12) |
+		PAGEFLAG_SWAPPED | PAGEFLAG_RESERVED)))
+	{
+		// Only written pages get paged out, so it's writable.  Mark it dirty,
+		// since its contents no longer match the file, or zeros, that it was
+		// first populated with.
+		pageTable->virtual->page[pageNumber] = (physicalAddress |
+			PAGEFLAG_DIRTY | PAGEFLAG_WRITABLE | PAGEFLAG_PRESENT);
+
+		if (directory->privilege != PRIVILEGE_SUPERVISOR)
+			pageTable->virtual->page[pageNumber] |= PAGEFLAG_USER;
+
+		status = 0;
+	}
+	else
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+
+	kernelLockRelease(&directory->dirLock);
+	return (status);
+}
+
+
+int kernelPageClearPhysical(unsigned physicalAddress)
+{
+	// Clear a page of physical memory that isn't mapped anywhere, by pointing
+	// our reserved window page at it.  This doesn't need to wait for any
+	// locks, so the idle thread can use it, but it must only be called from
+	// one thread on the boot processor (that's the only place kernel code
+	// touches the window).
+
+	int status = 0;
+
+	// Have we been initialized?
+	if (!initialized || !clearWindowEntry)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (physicalAddress % MEMORY_PAGE_SIZE)
+		return (status = ERR_ALIGN);
+
+	*clearWindowEntry = (physicalAddress | (*clearWindowEntry & 0xFFF));
+	processorClearAddressCache(clearWindow);
+
+	memset(clearWindow, 0, MEMORY_PAGE_SIZE);
+
+	return (status = 0);
+}
+
+
 int kernelPageMapped(int processId, void *virtualAddress, unsigned size)
 {
 	// This function returns 1 if the range of pages are mapped, 0 if some or
@@ -1563,6 +2276,11 @@ unsigned kernelPageGetPhysical(int processId, void *virtualAddress)
 			virtualAddress);
 		return (address = NULL);
 	}
+	else if (!address)
+	{
+		// Not mapped, or reserved but not populated
+		return (address = NULL);
+	}
 	else
 	{
 		return (address + ((unsigned long) virtualAddress %
@@ -1614,7 +2332,7 @@ void *kernelPageFindFree(int processId, unsigned size)
 }
 
 
-int kernelPageSetAttrs(int processId, int set, unsigned char flags,
+int kernelPageSetAttrs(int processId, int set, unsigned flags,
 	void *virtualAddress, unsigned size)
 {
 	// This is a wrapper for setPageAttrs() which allows the setting/clearing
@@ -28,6 +28,7 @@
 // x86 constants
 #define PAGE_TABLES_PER_DIR		1024
 #define PAGE_PAGES_PER_TABLE	1024
+#define PAGE_LARGE_SIZE			(PAGE_PAGES_PER_TABLE * MEMORY_PAGE_SIZE)
 
 // Page entry bitfield values for x86, but we'll make them global.
 #define PAGEFLAG_PRESENT		0x0001
@@ -35,11 +36,30 @@
 #define PAGEFLAG_USER			0x0004
 #define PAGEFLAG_WRITETHROUGH	0x0008
 #define PAGEFLAG_CACHEDISABLE	0x0010
+#define PAGEFLAG_ACCESSED		0x0020
+#define PAGEFLAG_DIRTY			0x0040
+// In a page directory entry, maps a 4MB page instead of a page table
+#define PAGEFLAG_LARGE			0x0080
 #define PAGEFLAG_GLOBAL			0x0100
+// One of the bits the processor leaves for us.  A page table entry with only
+// this bit set is reserved, and gets populated when it's first touched.
+#define PAGEFLAG_RESERVED		0x0200
+// Another.  A read-only page with this bit set is shared, and gets copied
+// when it's first written.
+#define PAGEFLAG_COPYONWRITE	0x0400
+// The last one.  A reserved page with this bit set has been paged out to
+// swap, and the rest of the entry is its swap slot number.
+#define PAGEFLAG_SWAPPED		0x0800
+
+// Page fault error code bits
+#define PAGEFAULT_PRESENT		0x01
+#define PAGEFAULT_WRITE			0x02
+#define PAGEFAULT_USER			0x04
 
 // Page mapping schemes
 #define PAGE_MAP_ANY			0x01
 #define PAGE_MAP_EXACT			0x02
+#define PAGE_MAP_RESERVE		0x03
 
 //#define PAGE_DEBUG
 
@@ -95,10 +115,19 @@ int kernelPageDeleteDirectory(int);
 int kernelPageMap(int, unsigned, void *, unsigned);
 int kernelPageMapToFree(int, unsigned, void **, unsigned);
 int kernelPageUnmap(int, void *, unsigned);
+int kernelPageReserve(int, void **, unsigned);
+int kernelPageMapReserved(int, unsigned, void *, int);
+unsigned kernelPageGetCopyOnWrite(int, void *);
+int kernelPageMapCopy(int, unsigned, unsigned, void *);
+int kernelPageTestAccessed(int, void *);
+int kernelPageEvict(int, unsigned, void *, unsigned);
+int kernelPageGetSwapped(int, void *, unsigned *);
+int kernelPageMapSwapped(int, unsigned, void *, unsigned);
+int kernelPageClearPhysical(unsigned);
 int kernelPageMapped(int, void *, unsigned);
 unsigned kernelPageGetPhysical(int, void *);
 void *kernelPageFindFree(int, unsigned);
-int kernelPageSetAttrs(int, int, unsigned char, void *, unsigned);
+int kernelPageSetAttrs(int, int, unsigned, void *, unsigned);
 
 #ifdef PAGE_DEBUG
 void kernelPageTableDebug(int);
@@ -127,7 +127,7 @@ static int readWriteSectors(int diskNum, uquad_t logicalSector,
 	length = (numSectors * RAMDISK_SECTOR_SIZE);
 
 	// Wait for a lock
-	status = kernelLockGet(&physical->lock);
+	status = kernelRwLockGet(&physical->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status);
 
@@ -141,7 +141,7 @@ static int readWriteSectors(int diskNum, uquad_t logicalSector,
 	// We are finished.  The data should be transferred.
 
 	// Unlock
-	kernelLockRelease(&physical->lock);
+	kernelRwLockRelease(&physical->lock, RWLOCK_WRITE);
 
 	return (status = 0);
 }
@@ -187,7 +187,9 @@ static kernelDiskOps ramDiskOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL,	// driverSubmit
+	NULL	// driverPoll
 };
 
 
@@ -339,14 +341,14 @@ int kernelDiskRamDiskDestroy(const char *name)
 	numDisks -= 1;
 
 	// Wait for a lock on the disk
-	status = kernelLockGet(&physical->lock);
+	status = kernelRwLockGet(&physical->lock, RWLOCK_WRITE);
 	if (status < 0)
 		return (status);
 
 	// Remove it from the system's disks
 	kernelDiskRemoveDevice(&ramDisk->dev);
 
-	kernelLockRelease(&physical->lock);
+	kernelRwLockRelease(&physical->lock, RWLOCK_WRITE);
 
 	kernelLog("RAM disk %s destroyed", physical->name);
 
@@ -54,6 +54,8 @@ static int numControllers = 0;
 static void **oldIntHandlers = NULL;
 static int numOldHandlers = 0;
 
+static int ncqRecover(ahciController *, int);
+
 
 #ifdef DEBUG
 static inline void debugAhciCapReg(ahciRegs *regs)
@@ -702,6 +704,70 @@ static int initializePorts(ahciController *controller)
 }
 
 
+static void ncqComplete(ahciController *controller, int portNum, int status)
+{
+	// Complete the queued (NCQ) commands on a port that have finished, or,
+	// if the status is an error, all of them, and wake up their submitters.
+
+	ahciPort *port = &controller->port[portNum];
+	ahciPortRegs *portRegs = &controller->regs->port[portNum];
+	kernelDiskRequest *request = NULL;
+	unsigned slots = 0;
+	int wake[AHCI_MAX_SLOTS];
+	int numWake = 0;
+	int count;
+
+	kernelSpinLockGet(&port->slotLock);
+
+	// The device clears a command's SACT bit when it has finished it
+	slots = port->activeSlots;
+	if (status >= 0)
+		slots &= ~(portRegs->SACT | portRegs->CI);
+
+	for (count = 0; count < AHCI_MAX_SLOTS; count ++)
+	{
+		if (!(slots & (1 << count)))
+			continue;
+
+		request = port->slotRequest[count];
+		port->slotRequest[count] = NULL;
+
+		// Once it's marked done, the submitter can free it
+		wake[numWake++] = request->waitProcess;
+		request->status = status;
+		request->done = 1;
+	}
+
+	port->activeSlots &= ~slots;
+
+	kernelSpinLockRelease(&port->slotLock);
+
+	for (count = 0; count < numWake; count ++)
+	{
+		if (wake[count] != KERNELPROCID)
+			kernelMultitaskerSetProcessState(wake[count], proc_ioready);
+	}
+}
+
+
+static void ncqTimeout(ahciController *controller, int portNum)
+{
+	// Queued (NCQ) commands on the port have timed out.  Stop the port, so
+	// that the device can't still be transferring their data, and complete
+	// them all with an error.  The port must be locked, and then recovered.
+
+	ahciPort *port = &controller->port[portNum];
+
+	kernelError(kernel_error, "Queued commands timed out on disk %d:%d",
+		controller->num, portNum);
+
+	startStopPortCommands(controller, portNum, 0);
+
+	port->ncqError = 1;
+	ncqComplete(controller, portNum, ERR_TIMEOUT);
+}
+
+
 static void interruptHandler(void)
 {
 	// This is the AHCI interrupt handler.  It will be called whenever the
@@ -712,6 +778,7 @@ static void interruptHandler(void)
 	void *address = NULL;
 	int interruptNum = 0;
 	ahciController *controller = NULL;
+	unsigned ncqPorts = 0;
 	int serviced = 0;
 	int controllerCount, portCount;
 
@@ -774,6 +841,25 @@ static void interruptHandler(void)
 							(controller->regs->port[portCount].IS &
 								AHCI_PXIS_RWCBITS);
 
+						// If there are queued commands outstanding on this
+						// port, the interrupt is for them.  If there was an
+						// error, the device has aborted all of them.
+						if (controller->port[portCount].activeSlots)
+						{
+							if (controller->port[portCount].interruptStatus &
+								AHCI_PXIS_ERROR)
+							{
+								controller->port[portCount].ncqError = 1;
+								ncqComplete(controller, portCount, ERR_IO);
+							}
+							else
+							{
+								ncqComplete(controller, portCount, 0);
+							}
+
+							ncqPorts |= (1 << portCount);
+						}
+
 						// If a process is waiting for an interrupt from this
 						// port, wake it up
 						if (controller->port[portCount].waitProcess)
@@ -786,8 +872,11 @@ static void interruptHandler(void)
 					}
 				}
 
-				// Record the controller interrupt status and clear the bit(s)
-				controller->portInterrupts |= controller->regs->IS;
+				// Record the controller interrupt status (except for queued
+				// commands, which aren't waited for that way) and clear the
+				// bit(s)
+				controller->portInterrupts |= (controller->regs->IS &
+					~ncqPorts);
 				controller->regs->IS |=	controller->regs->IS;
 
 				serviced = 1;
@@ -1114,6 +1203,42 @@ static unsigned allocCommandTable(int numPrds, unsigned *commandTablePhysical,
 }
 
 
+static int allocSlotTables(ahciController *controller, int portNum,
+	int numSlots)
+{
+	// Allocate a command table for each of the slots we'll use for queued
+	// commands, so that submitting one doesn't have to
+
+	int status = 0;
+	ahciPort *port = &controller->port[portNum];
+	unsigned commandTableSize = 0;
+	kernelIoMemory ioMem;
+	int count;
+
+	commandTableSize = (sizeof(ahciCommandTable) + (AHCI_NCQ_MAXPRDS *
+		sizeof(ahciPrd)));
+
+	status = kernelMemoryGetIo((numSlots * commandTableSize),
+		DISK_CACHE_ALIGN, 0 /* not low memory */, "ahci ncq cmdtables",
+		&ioMem);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Couldn't allocate command table memory");
+		return (status);
+	}
+
+	for (count = 0; count < numSlots; count ++)
+	{
+		port->slotTable[count] = (ioMem.virtual +
+			(count * commandTableSize));
+		port->slotTablePhysical[count] = (ioMem.physical +
+			(count * commandTableSize));
+	}
+
+	return (status = 0);
+}
+
+
 static unsigned makeCommandFis(ahciCommandTable *cmdTable,
 	unsigned short features, unsigned short sectorCount,
 	unsigned short lbaLow, unsigned short lbaMid, unsigned short lbaHigh,
@@ -1275,6 +1400,45 @@ static int errorRecovery(ahciController *controller, int portNum)
 }
 
 
+static int waitQueuedCommands(ahciController *controller, int portNum)
+{
+	// Other commands can't be issued while queued (NCQ) ones are
+	// outstanding, so wait for those to finish, and recover the port if any
+	// of them failed.  The port must be locked.
+
+	int status = 0;
+	ahciPort *port = &controller->port[portNum];
+	uquad_t startTime = kernelCpuGetMs();
+	int procId = 0;
+
+	while (port->activeSlots)
+	{
+		if (kernelCpuGetMs() > (startTime + AHCI_NCQ_TIMEOUT))
+		{
+			ncqTimeout(controller, portNum);
+			break;
+		}
+
+		// The interrupt handler will wake us up as they complete
+		procId = kernelMultitaskerGetCurrentProcessId();
+		if (procId != KERNELPROCID)
+		{
+			port->waitProcess = procId;
+			kernelMultitaskerWait(10);
+		}
+	}
+
+	// Their interrupts have all been dealt with
+	controller->portInterrupts &= ~(1 << portNum);
+	port->interruptStatus = 0;
+
+	if (port->ncqError)
+		status = ncqRecover(controller, portNum);
+
+	return (status);
+}
+
+
 static int issueCommand(ahciController *controller, int portNum,
 	unsigned short feature, unsigned short sectorCount, unsigned short lbaLow,
 	unsigned short lbaMid, unsigned short lbaHigh, unsigned char dev,
@@ -1300,6 +1464,10 @@ static int issueCommand(ahciController *controller, int portNum,
 	if (!timeout)
 		timeout = MS_PER_SEC;
 
+	status = waitQueuedCommands(controller, portNum);
+	if (status < 0)
+		return (status);
+
 	// Find a free command slot.
 	slotNum = findCommandSlot(controller, portNum);
 	if (slotNum < 0)
@@ -1475,6 +1643,46 @@ out:
 }
 
 
+static int ncqRecover(ahciController *controller, int portNum)
+{
+	// After a queued (NCQ) command fails, the device aborts all of the
+	// others, and won't accept any more until the port has been restarted
+	// and the NCQ error log has been read.  The port must be locked, with no
+	// queued commands outstanding.
+
+	int status = 0;
+	ahciPortRegs *portRegs = &controller->regs->port[portNum];
+	unsigned char logData[512];
+
+	kernelError(kernel_error, "Queued command error on disk %d:%d",
+		controller->num, portNum);
+
+	controller->port[portNum].ncqError = 0;
+
+	startStopPortCommands(controller, portNum, 0);
+	portRegs->SERR |= AHCI_PXSERR_ALL;
+	status = startStopPortCommands(controller, portNum, 1);
+	if (status < 0)
+		return (status);
+
+	// Read the NCQ command error log (page 10h)
+	status = issueCommand(controller, portNum, 0, 1, 0x10, 0, 0, 0,
+		ATA_READLOG_EXT, NULL, logData, sizeof(logData), 0 /* read */,
+		0 /* default timeout */);
+	if (status < 0)
+		return (status);
+
+	if (!(logData[0] & 0x80))
+	{
+		kernelDebug(debug_io, "AHCI port %d command in slot %d failed, "
+			"status=0x%02x error=0x%02x", portNum, (logData[0] & 0x1F),
+			logData[2], logData[3]);
+	}
+
+	return (status = 0);
+}
+
+
 static int setTransferMode(ahciController *controller, int portNum,
 	ataDmaMode *mode, ataIdentifyData *identData)
 {
@@ -1526,6 +1734,7 @@ static int detectDisks(kernelDriver *driver, kernelDevice *controllerDevice,
 	ataDmaMode *dmaModes = kernelAtaGetDmaModes();
 	ataFeature *features = kernelAtaGetFeatures();
 	char value[80];
+	int queueDepth = 0;
 	int portNum, count;
 
 	kernelDebug(debug_io, "AHCI detect disks");
@@ -1882,6 +2091,34 @@ static int detectDisks(kernelDriver *driver, kernelDevice *controllerDevice,
 			}
 		}
 
+		// Native command queuing needs DMA and 48-bit addressing, and
+		// support from both the controller and the device.
+		//
+		// word 75:	bits 0-4 indicate the maximum queue depth, minus 1
+		// word 76:	bit 8 indicates NCQ supported
+		//
+		if ((controller->regs->CAP & AHCI_CAP_SNCQ) &&
+			!(physicalDisk->type & DISKTYPE_SATACDROM) &&
+			(DISK(diskNum)->featureFlags & ATA_FEATURE_DMA) &&
+			(DISK(diskNum)->featureFlags & ATA_FEATURE_48BIT) &&
+			(identData.field.sataCaps != 0xFFFF) &&
+			(identData.field.sataCaps & 0x0100))
+		{
+			queueDepth = ((identData.field.queueDepth & 0x1F) + 1);
+			queueDepth = min(queueDepth,
+				(int)(((controller->regs->CAP & AHCI_CAP_NCS) >> 8) + 1));
+
+			if ((queueDepth > 1) &&
+				(allocSlotTables(controller, portNum, queueDepth) >= 0))
+			{
+				DISK(diskNum)->featureFlags |= ATA_FEATURE_NCQ;
+				physicalDisk->queueDepth = queueDepth;
+
+				kernelLog("AHCI: Disk %d:%d NCQ queue depth %d",
+					controller->num, portNum, queueDepth);
+			}
+		}
+
 		// Initialize the variable list for attributes of the disk.
 		status = kernelVariableListCreate(&diskDevice->device.attrs);
 		if (status >= 0)
@@ -1917,6 +2154,9 @@ static int detectDisks(kernelDriver *driver, kernelDevice *controllerDevice,
 			if (DISK(diskNum)->featureFlags & ATA_FEATURE_48BIT)
 				strcat(value, ",48-bit");
 
+			if (DISK(diskNum)->featureFlags & ATA_FEATURE_NCQ)
+				strcat(value, ",NCQ");
+
 			kernelVariableListSet(&diskDevice->device.attrs, "disk.features",
 				value);
 		}
@@ -2563,6 +2803,143 @@ static int driverWriteSectors(int diskNum, uquad_t logicalSector,
 }
 
 
+static int driverSubmit(int diskNum, kernelDiskRequest *request)
+{
+	// Start a read or write as a queued (NCQ) command, and return without
+	// waiting for it.  The interrupt handler completes it.
+
+	int status = 0;
+	ahciController *controller = DISK_CTRL(diskNum);
+	ahciDisk *dsk = DISK(diskNum);
+	ahciPort *port = NULL;
+	ahciPortRegs *portRegs = NULL;
+	int write = 0;
+	unsigned bytes = 0;
+	unsigned numPrds = 0;
+	int slotNum = -1;
+	ahciCommandTable *commandTable = NULL;
+	unsigned fisLen = 0;
+	ahciCommandHeader *commandHeader = NULL;
+	int count;
+
+	if (!controller || !dsk)
+	{
+		kernelError(kernel_error, "No such disk %d:%d", (diskNum >> 8),
+			(diskNum & 0xFF));
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	if (!(dsk->featureFlags & ATA_FEATURE_NCQ))
+		return (status = ERR_NOTIMPLEMENTED);
+
+	// Too big for one queued command?
+	if (request->numSectors > AHCI_NCQ_MAXSECTORS)
+		return (status = ERR_RANGE);
+
+	bytes = (request->numSectors * dsk->physical.sectorSize);
+	if (bytes > (AHCI_NCQ_MAXPRDS * AHCI_PRD_MAXDATA))
+		return (status = ERR_RANGE);
+
+	write = ((request->mode & IOMODE_WRITE)? 1 : 0);
+
+	kernelDebug(debug_io, "AHCI disk on port %d queue %s %llu at %llu",
+		dsk->portNum, (write? "write" : "read"), request->numSectors,
+		request->startSector);
+
+	port = &controller->port[dsk->portNum];
+	portRegs = &controller->regs->port[dsk->portNum];
+
+	// Wait for a lock on the port
+	status = kernelLockGet(&port->lock);
+	if (status < 0)
+		return (status);
+
+	// If the port needs recovering from an error, the caller can issue this
+	// one the ordinary way, which will do that
+	if (port->ncqError)
+	{
+		status = ERR_BUSY;
+		goto out;
+	}
+
+	// Find a free slot and reserve it
+	kernelSpinLockGet(&port->slotLock);
+
+	for (count = 0; count < dsk->physical.queueDepth; count ++)
+	{
+		if (!port->slotRequest[count] &&
+			!((portRegs->SACT | portRegs->CI) & (1 << count)))
+		{
+			slotNum = count;
+			port->slotRequest[slotNum] = request;
+			break;
+		}
+	}
+
+	kernelSpinLockRelease(&port->slotLock);
+
+	if (slotNum < 0)
+	{
+		status = ERR_NOFREE;
+		goto out;
+	}
+
+	kernelDebug(debug_io, "AHCI port %d queue using command slot %d",
+		dsk->portNum, slotNum);
+
+	commandTable = port->slotTable[slotNum];
+	memset((void *) commandTable, 0, (sizeof(ahciCommandTable) +
+		(AHCI_NCQ_MAXPRDS * sizeof(ahciPrd))));
+
+	// For queued commands, the sector count goes in the features register,
+	// and the tag (which is the slot number) in the sector count register.
+	// The features register should be set to 0 if the count is 65536.
+	fisLen = makeCommandFis(commandTable,
+		((request->numSectors == AHCI_NCQ_MAXSECTORS)? 0 :
+			request->numSectors), (slotNum << 3),
+		(request->startSector & 0xFFFF),
+		((request->startSector >> 16) & 0xFFFF),
+		((request->startSector >> 32) & 0xFFFF), 0x40,
+		(write? ATA_WRITEFPDMA : ATA_READFPDMA));
+
+	numPrds = ((bytes + (AHCI_PRD_MAXDATA - 1)) / AHCI_PRD_MAXDATA);
+
+	status = setupPrds(commandTable->prd, numPrds, request->data, bytes);
+	if (status < 0)
+	{
+		port->slotRequest[slotNum] = NULL;
+		goto out;
+	}
+
+	// Set up the command header
+	commandHeader = &port->commandList->command[slotNum];
+	memset((void *) commandHeader, 0, sizeof(ahciCommandHeader));
+	commandHeader->fisLen = ((fisLen >> 2) & 0x1F);
+	commandHeader->write = write;
+	commandHeader->prdDescTableEnts = numPrds;
+	commandHeader->cmdTablePhysAddr = port->slotTablePhysical[slotNum];
+
+	// Tell the controller to process the command.  Only write our own bits;
+	// writing back others that were set when we read the registers could
+	// re-issue commands that have since completed.  Hold the slot lock so
+	// that the interrupt handler doesn't see the command before it's marked
+	// active.
+	kernelSpinLockGet(&port->slotLock);
+	portRegs->SACT = (1 << slotNum);
+	portRegs->CI = (1 << slotNum);
+	port->activeSlots |= (1 << slotNum);
+	kernelSpinLockRelease(&port->slotLock);
+
+	status = 0;
+
+out:
+	// Unlock the port
+	kernelLockRelease(&port->lock);
+
+	return (status);
+}
+
+
 static int driverFlush(int diskNum)
 {
 	// If write caching is enabled for this disk, flush the cache
@@ -2607,6 +2984,64 @@ static int driverFlush(int diskNum)
 }
 
 
+static int driverPoll(int diskNum)
+{
+	// Submitted (NCQ) commands only complete when the device interrupts, so
+	// check whether any has been outstanding longer than the timeout.  If
+	// so, fail them all and recover the port; the disk code will then issue
+	// them again the ordinary way.
+
+	int status = 0;
+	ahciController *controller = DISK_CTRL(diskNum);
+	ahciDisk *dsk = DISK(diskNum);
+	ahciPort *port = NULL;
+	uquad_t currentTime = kernelCpuGetMs();
+	int expired = 0;
+	int count;
+
+	if (!controller || !dsk)
+		return (status = ERR_NOSUCHENTRY);
+
+	port = &controller->port[dsk->portNum];
+
+	if (!port->activeSlots)
+		return (status = 0);
+
+	// Wait for a lock on the port
+	status = kernelLockGet(&port->lock);
+	if (status < 0)
+		return (status);
+
+	kernelSpinLockGet(&port->slotLock);
+
+	for (count = 0; count < AHCI_MAX_SLOTS; count ++)
+	{
+		if ((port->activeSlots & (1 << count)) &&
+			(currentTime > (port->slotRequest[count]->queueTime +
+				AHCI_NCQ_TIMEOUT)))
+		{
+			expired = 1;
+			break;
+		}
+	}
+
+	kernelSpinLockRelease(&port->slotLock);
+
+	if (expired)
+	{
+		ncqTimeout(controller, dsk->portNum);
+
+		// With nothing outstanding now, this recovers the port
+		status = waitQueuedCommands(controller, dsk->portNum);
+	}
+
+	// Unlock the port
+	kernelLockRelease(&port->lock);
+
+	return (status);
+}
+
+
 static kernelDiskOps ahciOps = {
 	NULL,	// driverSetMotorState
 	driverSetLockState,
@@ -2615,7 +3050,9 @@ static kernelDiskOps ahciOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	driverFlush
+	driverFlush,
+	driverSubmit,
+	driverPoll
 };
 
 
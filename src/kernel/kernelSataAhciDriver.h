@@ -30,6 +30,7 @@
 #define AHCI_VERSION_1_1	0x00010100
 #define AHCI_VERSION_1_2	0x00010200
 #define AHCI_MAX_PORTS		32
+#define AHCI_MAX_SLOTS		32
 #define AHCI_CMDLIST_SIZE	0x400
 #define AHCI_CMDLIST_ALIGN	AHCI_CMDLIST_SIZE
 #define AHCI_RECVFIS_SIZE	0x100
@@ -37,6 +38,11 @@
 #define AHCI_PRD_MAXDATA	0x00400000
 #define AHCI_CMDTABLE_ALIGN	0x80
 
+// Limits for native command queuing (NCQ)
+#define AHCI_NCQ_MAXSECTORS	65536
+#define AHCI_NCQ_MAXPRDS	8
+#define AHCI_NCQ_TIMEOUT	10000	// Milliseconds
+
 // Bit definitions for HBA registers that we're interested in
 
 // HBA capabilities (CAP)
@@ -301,6 +307,15 @@ typedef volatile struct {
 	unsigned interruptStatus;
 	lock lock;
 
+	// Queued (NCQ) commands outstanding.  Each slot in use has a disk request
+	// and its own command table.
+	spinLock slotLock;
+	unsigned activeSlots;
+	kernelDiskRequest *slotRequest[AHCI_MAX_SLOTS];
+	ahciCommandTable *slotTable[AHCI_MAX_SLOTS];
+	unsigned slotTablePhysical[AHCI_MAX_SLOTS];
+	int ncqError;
+
 } ahciPort;
 
 typedef struct {
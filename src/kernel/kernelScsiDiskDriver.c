@@ -1160,7 +1160,9 @@ static kernelDiskOps scsiOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL,	// driverSubmit
+	NULL	// driverPoll
 };
 
 
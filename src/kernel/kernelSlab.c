@@ -0,0 +1,346 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2018 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelSlab.c
+//
+
+// This file contains the kernel's caches of fixed-size objects.  Subsystems
+// that allocate and free lots of objects of one type can create a cache for
+// it, and get them without going through the general heap.  Each cache also
+// keeps statistics, so that we can see how much memory each type is using.
+
+#include "kernelSlab.h"
+#include "kernelError.h"
+#include "kernelInterrupt.h"
+#include "kernelLock.h"
+#include "kernelMemory.h"
+#include <string.h>
+
+static kernelSlabCache *caches = NULL;
+static lock cachesLock;
+
+
+static inline void slabRemove(kernelSlab **list, kernelSlab *slab)
+{
+	// Remove a slab from one of the cache's lists
+
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+
+static inline void slabAdd(kernelSlab **list, kernelSlab *slab)
+{
+	// Add a slab to the head of one of the cache's lists
+
+	slab->prev = NULL;
+	slab->next = *list;
+
+	if (*list)
+		(*list)->prev = slab;
+
+	*list = slab;
+}
+
+
+static kernelSlab *newSlab(kernelSlabCache *cache)
+{
+	// Get memory for a new slab, and put all of its object slots on its free
+	// list.
+
+	kernelSlab *slab = NULL;
+	void *slot = NULL;
+	void *object = NULL;
+	int count;
+
+	// The memory is cleared for us
+	slab = kernelMemoryGetSystem(cache->slabSize, cache->name);
+	if (!slab)
+		return (slab);
+
+	slab->cache = cache;
+
+	for (count = (cache->objectsPerSlab - 1); count >= 0; count --)
+	{
+		slot = ((void *) slab + sizeof(kernelSlab) +
+			(count * cache->slotSize));
+
+		*((kernelSlab **) slot) = slab;
+
+		object = (slot + sizeof(kernelSlab *));
+		*((void **) object) = slab->freeObjects;
+		slab->freeObjects = object;
+	}
+
+	cache->numSlabs += 1;
+
+	return (slab);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+//
+//  Below here, the functions are exported for external use
+//
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+int kernelSlabCacheCreate(kernelSlabCache *cache, const char *name,
+	unsigned objectSize)
+{
+	// Set up a cache for objects of the supplied size.  The cache structure
+	// is supplied by the caller (usually it's static).  Calling this for a
+	// cache that's already been created does nothing.
+
+	int status = 0;
+
+	// Check params
+	if (!cache || !name)
+		return (status = ERR_NULLPARAMETER);
+
+	if (!objectSize)
+		return (status = ERR_INVALID);
+
+	if (cache->objectsPerSlab)
+		// Already created
+		return (status = 0);
+
+	memset((void *) cache, 0, sizeof(kernelSlabCache));
+
+	strncpy(cache->name, name, SLAB_MAX_NAMELENGTH);
+	cache->name[SLAB_MAX_NAMELENGTH - 1] = '\0';
+
+	// Free objects hold the free list pointer
+	if (objectSize < sizeof(void *))
+		objectSize = sizeof(void *);
+
+	cache->objectSize = objectSize;
+
+	// Each slot is the back pointer to the slab, plus the object, rounded up
+	// to a nice boundary
+	cache->slotSize = (sizeof(kernelSlab *) + objectSize);
+	if (cache->slotSize % sizeof(int))
+		cache->slotSize += (sizeof(int) - (cache->slotSize % sizeof(int)));
+
+	// A slab is a page, unless that wouldn't hold a reasonable number of
+	// objects
+	cache->slabSize = (sizeof(kernelSlab) +
+		(SLAB_MIN_OBJECTS * cache->slotSize));
+	if (cache->slabSize < MEMORY_BLOCK_SIZE)
+		cache->slabSize = MEMORY_BLOCK_SIZE;
+	else if (cache->slabSize % MEMORY_BLOCK_SIZE)
+		cache->slabSize += (MEMORY_BLOCK_SIZE -
+			(cache->slabSize % MEMORY_BLOCK_SIZE));
+
+	cache->objectsPerSlab = ((cache->slabSize - sizeof(kernelSlab)) /
+		cache->slotSize);
+
+	// Add it to the list of caches, for statistics
+	status = kernelLockGet(&cachesLock);
+	if (status < 0)
+		return (status);
+
+	cache->nextCache = caches;
+	caches = cache;
+
+	kernelLockRelease(&cachesLock);
+
+	return (status = 0);
+}
+
+
+void *kernelSlabAlloc(kernelSlabCache *cache)
+{
+	// Allocate an object from the cache.  Like kernelMalloc(), the memory is
+	// cleared.
+
+	kernelSlab *slab = NULL;
+	void *object = NULL;
+
+	// Check params
+	if (!cache || !cache->objectsPerSlab)
+		return (object = NULL);
+
+	if (kernelProcessingInterrupt())
+		return (object = NULL);
+
+	if (kernelLockGet(&cache->lock) < 0)
+		return (object = NULL);
+
+	// Use a partially-used slab if there is one, then the empty one we keep
+	// in reserve, and finally a new one.
+	slab = cache->partial;
+	if (!slab)
+	{
+		if (cache->empty)
+		{
+			slab = cache->empty;
+			cache->empty = NULL;
+		}
+		else
+		{
+			slab = newSlab(cache);
+			if (!slab)
+			{
+				kernelLockRelease(&cache->lock);
+				kernelError(kernel_error, "Unable to allocate a slab for %s",
+					cache->name);
+				return (object = NULL);
+			}
+		}
+
+		slabAdd(&cache->partial, slab);
+	}
+
+	// Take the first free object
+	object = slab->freeObjects;
+	slab->freeObjects = *((void **) object);
+	slab->usedObjects += 1;
+
+	if (!slab->freeObjects)
+	{
+		// The slab is full
+		slabRemove(&cache->partial, slab);
+		slabAdd(&cache->full, slab);
+	}
+
+	cache->usedObjects += 1;
+	cache->allocs += 1;
+
+	kernelLockRelease(&cache->lock);
+
+	memset(object, 0, cache->objectSize);
+
+	return (object);
+}
+
+
+int kernelSlabFree(kernelSlabCache *cache, void *object)
+{
+	// Return an object to the cache.
+
+	int status = 0;
+	kernelSlab *slab = NULL;
+	kernelSlab *releaseSlab = NULL;
+
+	// Check params
+	if (!cache || !object)
+		return (status = ERR_NULLPARAMETER);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	slab = ((kernelSlab **) object)[-1];
+	if (!slab || (slab->cache != cache))
+	{
+		kernelError(kernel_error, "Object %p is not from the %s cache",
+			object, cache->name);
+		return (status = ERR_INVALID);
+	}
+
+	status = kernelLockGet(&cache->lock);
+	if (status < 0)
+		return (status);
+
+	if (!slab->freeObjects)
+	{
+		// The slab was full, and now it won't be
+		slabRemove(&cache->full, slab);
+		slabAdd(&cache->partial, slab);
+	}
+
+	*((void **) object) = slab->freeObjects;
+	slab->freeObjects = object;
+	slab->usedObjects -= 1;
+
+	cache->usedObjects -= 1;
+	cache->frees += 1;
+
+	if (!slab->usedObjects)
+	{
+		// The slab is completely free.  Keep one in reserve, and give any
+		// others back.
+		slabRemove(&cache->partial, slab);
+
+		if (!cache->empty)
+		{
+			cache->empty = slab;
+		}
+		else
+		{
+			releaseSlab = slab;
+			cache->numSlabs -= 1;
+		}
+	}
+
+	kernelLockRelease(&cache->lock);
+
+	if (releaseSlab)
+		kernelMemoryReleaseSystem(releaseSlab);
+
+	return (status = 0);
+}
+
+
+int kernelSlabGetStats(memoryCacheStats *stats, int maxCaches)
+{
+	// Fill in the statistics for up to maxCaches caches.  Returns the number
+	// filled in.
+
+	int status = 0;
+	kernelSlabCache *cache = NULL;
+	int numCaches = 0;
+
+	// Check params
+	if (!stats)
+		return (status = ERR_NULLPARAMETER);
+
+	status = kernelLockGet(&cachesLock);
+	if (status < 0)
+		return (status);
+
+	for (cache = caches; (cache && (numCaches < maxCaches));
+		cache = cache->nextCache)
+	{
+		strncpy(stats[numCaches].name, cache->name,
+			MEMORY_MAX_CACHENAME_LENGTH);
+		stats[numCaches].objectSize = cache->objectSize;
+		stats[numCaches].numSlabs = cache->numSlabs;
+		stats[numCaches].totalObjects = (cache->numSlabs *
+			cache->objectsPerSlab);
+		stats[numCaches].usedObjects = cache->usedObjects;
+		stats[numCaches].allocs = cache->allocs;
+		stats[numCaches].frees = cache->frees;
+		stats[numCaches].memory = (cache->numSlabs * cache->slabSize);
+		numCaches += 1;
+	}
+
+	kernelLockRelease(&cachesLock);
+
+	return (numCaches);
+}
+
@@ -0,0 +1,76 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2018 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelSlab.h
+//
+
+// This header file contains definitions for the kernel's caches of
+// fixed-size objects.
+
+#if !defined(_KERNELSLAB_H)
+
+#include <sys/lock.h>
+#include <sys/memory.h>
+
+#define SLAB_MAX_NAMELENGTH		MEMORY_MAX_CACHENAME_LENGTH
+#define SLAB_MIN_OBJECTS		8
+
+struct _kernelSlabCache;
+
+// A slab is one or more pages of memory, divided into object slots.  Each
+// slot begins with a pointer back to its slab, so that objects can be freed
+// without searching.
+typedef struct _kernelSlab {
+	struct _kernelSlabCache *cache;
+	struct _kernelSlab *prev;
+	struct _kernelSlab *next;
+	void *freeObjects;
+	int usedObjects;
+
+} kernelSlab;
+
+// A cache of objects of one size.  Slabs with some free objects are on the
+// 'partial' list, slabs with no free objects are on the 'full' list, and up
+// to one completely free slab is kept in reserve.
+typedef struct _kernelSlabCache {
+	char name[SLAB_MAX_NAMELENGTH];
+	unsigned objectSize;
+	unsigned slotSize;
+	unsigned slabSize;
+	int objectsPerSlab;
+	kernelSlab *partial;
+	kernelSlab *full;
+	kernelSlab *empty;
+	lock lock;
+	unsigned numSlabs;
+	unsigned usedObjects;
+	unsigned allocs;
+	unsigned frees;
+	struct _kernelSlabCache *nextCache;
+
+} kernelSlabCache;
+
+// Functions exported by kernelSlab.c
+int kernelSlabCacheCreate(kernelSlabCache *, const char *, unsigned);
+void *kernelSlabAlloc(kernelSlabCache *);
+int kernelSlabFree(kernelSlabCache *, void *);
+int kernelSlabGetStats(memoryCacheStats *, int);
+
+#define _KERNELSLAB_H
+#endif
+
@@ -1224,7 +1224,9 @@ static kernelDiskOps usbAtapiOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	NULL,	// driverWriteSectors
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL,	// driverSubmit
+	NULL	// driverPoll
 };
 
 
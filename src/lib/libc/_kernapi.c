@@ -988,6 +988,27 @@ _X_ int memoryGetBlocks(memoryBlock *blocksArray, unsigned buffSize _U_, int ker
 	return (_syscall(_fnum_memoryGetBlocks, &blocksArray));
 }
 
+_X_ void *memoryReserve(unsigned size, const char *desc _U_)
+{
+	// Proto: void *kernelMemoryReserve(unsigned, const char *);
+	// Desc : Reserve 'size' bytes of virtual memory, adding the (optional) description 'desc', and return a pointer to it.  Physical memory is only allocated for each page when it's first touched, and is cleared (like 'calloc').  Memory reserved using this function is not physically contiguous.  Release it using memoryRelease().
+	return ((void *)(long) _syscall(_fnum_memoryReserve, &size));
+}
+
+_X_ void *memoryMapFile(file *theFile, unsigned offset _U_, unsigned size _U_, int flags _U_)
+{
+	// Proto: void *kernelMemoryMapFile(file *, unsigned, unsigned, int);
+	// Desc : Map 'size' bytes of the open file 'theFile', starting at 'offset' (which must be a multiple of the memory page size), into memory, and return a pointer to it.  Pages are only read from the file when they're first touched.  If 'flags' contains MEMORY_MAP_PRIVATE, the memory is writable, but changes are not written back to the file.  Otherwise it's read-only.  Release it using memoryRelease().
+	return ((void *)(long) _syscall(_fnum_memoryMapFile, &theFile));
+}
+
+_X_ int memoryGetCacheStats(memoryCacheStats *stats, int maxCaches _U_)
+{
+	// Proto: int kernelSlabGetStats(memoryCacheStats *, int);
+	// Desc : Returns statistics for up to 'maxCaches' of the kernel's object caches in the array 'stats'.  Returns the number of caches filled in.
+	return (_syscall(_fnum_memoryGetCacheStats, &stats));
+}
+
 
 //
 // Multitasker functions
@@ -1210,6 +1231,20 @@ _X_ int multitaskerStackTrace(int processId)
 	return (_syscall(_fnum_multitaskerStackTrace, &processId));
 }
 
+_X_ int multitaskerSchedTrace(int enable)
+{
+	// Proto: int kernelMultitaskerSchedTrace(int);
+	// Desc : Turn the scheduler trace on (non-zero 'enable') or off.  Turning it on discards any unread events.  This function requires supervisor privilege.
+	return (_syscall(_fnum_multitaskerSchedTrace, &enable));
+}
+
+_X_ int multitaskerSchedTraceRead(schedTraceEvent *buffer, unsigned maxEvents _U_)
+{
+	// Proto: int kernelMultitaskerSchedTraceRead(schedTraceEvent *, unsigned);
+	// Desc : Remove up to 'maxEvents' of the oldest scheduler trace events and copy them into 'buffer'.  Returns the number of events copied.  This function requires supervisor privilege.
+	return (_syscall(_fnum_multitaskerSchedTraceRead, &buffer));
+}
+
 
 //
 // Loader functions
@@ -22,7 +22,6 @@
 // This is the standard "calloc" function, as found in standard C libraries
 
 #include <stdlib.h>
-#include <string.h>
 
 
 void *_calloc(size_t items, size_t itemSize, const char *function)
@@ -38,12 +37,9 @@ void *_calloc(size_t items, size_t itemSize, const char *function)
 	// Total size is (items * itemSize)
 	totalSize = (items * itemSize);
 
+	// Our malloc() always returns cleared memory
 	memoryPointer = _malloc(totalSize, function);
 
-	if (memoryPointer)
-		// Clear the memory
-		memset(memoryPointer, 0, totalSize);
-
 	// Return this value, whether or not we were successful
 	return (memoryPointer);
 }
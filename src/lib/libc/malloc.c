@@ -22,6 +22,22 @@
 // These functions comprise Visopsys heap memory management system.  It relies
 // upon the kernelMemory code, and does similar things, but instead of whole
 // memory pages, it allocates arbitrary-sized chunks.
+//
+// Free blocks are kept in segregated lists ('bins') by size.  Small sizes
+// each have their own bin, so that most small allocations are satisfied by
+// taking the first block from the right bin.  Larger sizes share a bin per
+// power of 2, which is searched for the first block that fits.  All blocks
+// are also hashed by start address, so that a block can be found quickly
+// when it's freed, and free blocks are hashed by end address as well, so
+// that they can be merged with their neighbours.
+//
+// Memory is always clear when it's handed out.  New heap memory from the
+// kernel is already clear, so rather than clearing memory when it's freed,
+// we mark the free block as 'dirty', and clear it only if and when it's
+// allocated again.
+//
+// Large user heaps are reserved rather than allocated, so that the kernel
+// only gives them physical memory as they're touched.
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,11 +46,27 @@
 #include <sys/memory.h>
 #include <sys/api.h>
 
+// Sizes up to MALLOC_SMALL_MAX each have a bin.  Above that, there's a bin
+// for each power of 2.
+#define MALLOC_SMALL_MAX		256
+#define MALLOC_SMALL_BINS		((int)(MALLOC_SMALL_MAX / sizeof(int)))
+#define MALLOC_LARGE_BINS		24
+#define MALLOC_BINS				(MALLOC_SMALL_BINS + MALLOC_LARGE_BINS)
+#define MALLOC_BINMAP_WORDS		((MALLOC_BINS + 31) / 32)
+#define MALLOC_HASH_BUCKETS		512
+
+// User heaps at least this big are reserved, and paged in on demand
+#define MALLOC_RESERVE_MIN		(1024 * 1024)
+
 static mallocBlock *usedBlockList = NULL;
-static mallocBlock *freeBlockList = NULL;
+static mallocBlock *freeBins[MALLOC_BINS];
+static unsigned freeBinMap[MALLOC_BINMAP_WORDS];
+static mallocBlock *startHash[MALLOC_HASH_BUCKETS];
+static mallocBlock *endHash[MALLOC_HASH_BUCKETS];
 static mallocBlock *vacantBlockList = NULL;
 static volatile unsigned totalBlocks = 0;
 static volatile unsigned vacantBlocks = 0;
+static volatile unsigned usedBlocks = 0;
 static volatile unsigned totalMemory = 0;
 static volatile unsigned usedMemory = 0;
 static lock blocksLock;
@@ -43,8 +75,8 @@ unsigned mallocHeapMultiple = USER_MEMORY_HEAP_MULTIPLE;
 mallocKernelOps mallocKernOps;
 
 #define USEDLIST_REF (&usedBlockList)
-#define FREELIST_REF (&freeBlockList)
 #define blockEnd(block) (block->start + (block->size - 1))
+#define hashBucket(address) (((address) / sizeof(int)) % MALLOC_HASH_BUCKETS)
 
 // Malloc debugging messages are off by default even in a debug build.
 #undef DEBUG
@@ -94,6 +126,13 @@ static inline void *memory_get(unsigned size, const char *desc)
 }
 
 
+static inline void *memory_reserve(unsigned size, const char *desc)
+{
+	debug("Reserve memory of size %u", size);
+	return (memoryReserve(size, desc));
+}
+
+
 static inline int memory_release(void *start)
 {
 	debug("Release memory block at %p", start);
@@ -122,86 +161,182 @@ static inline void lock_release(lock *lk)
 }
 
 
-static inline void insertBlock(mallocBlock **list, mallocBlock *insBlock,
-	mallocBlock *nextBlock)
+static inline void pushBlock(mallocBlock **list, mallocBlock *block)
 {
-	// Stick the first block in front of the second block
+	// Put the block at the head of the list
 
-	debug("Insert block %08x->%08x (%u) before %08x->%08x (%u)",
-		insBlock->start, blockEnd(insBlock), insBlock->size, nextBlock->start,
-		blockEnd(nextBlock), nextBlock->size);
+	block->prev = NULL;
+	block->next = *list;
 
-	insBlock->prev = nextBlock->prev;
-	insBlock->next = nextBlock;
+	if (*list)
+		(*list)->prev = block;
 
-	if (nextBlock->prev)
-		nextBlock->prev->next = insBlock;
+	*list = block;
+}
 
-	nextBlock->prev = insBlock;
 
-	if (nextBlock == *list)
-		*list = insBlock;
+static inline void removeBlock(mallocBlock **list, mallocBlock *block)
+{
+	// Remove a block from a list
+
+	if (block->prev)
+		block->prev->next = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+
+	if (block == *list)
+		*list = block->next;
+
+	block->prev = NULL;
+	block->next = NULL;
 }
 
 
-static inline void appendBlock(mallocBlock *appBlock, mallocBlock *prevBlock)
+static void hashInsert(mallocBlock **hash, unsigned address,
+	mallocBlock *block)
 {
-	// Stick the first block behind the second block
-
-	debug("Append block %08x->%08x (%u) after %08x->%08x (%u)",
-		appBlock->start, blockEnd(appBlock), appBlock->size,
-		prevBlock->start, blockEnd(prevBlock), prevBlock->size);
+	// Add the block to the start or end address hash
 
-	appBlock->prev = prevBlock;
-	appBlock->next = prevBlock->next;
+	int bucket = hashBucket(address);
 
-	if (prevBlock->next)
-		prevBlock->next->prev = appBlock;
+	if (hash == startHash)
+	{
+		block->startNext = hash[bucket];
+	}
+	else
+	{
+		block->endNext = hash[bucket];
+	}
 
-	prevBlock->next = appBlock;
+	hash[bucket] = block;
 }
 
 
-static int sortInsertBlock(mallocBlock **list, mallocBlock *block)
+static void hashRemove(mallocBlock **hash, unsigned address,
+	mallocBlock *block)
 {
-	// Find the correct (sorted) place for in the block list for this block.
+	// Remove the block from the start or end address hash
 
-	int status = 0;
-	mallocBlock *nextBlock = NULL;
-
-	debug("Sort insert block %08x->%08x (%u) in %s list", block->start,
-		blockEnd(block), block->size, ((list == USEDLIST_REF)? "used" :
-			"free"));
+	mallocBlock **link = &hash[hashBucket(address)];
 
-	if (*list)
+	while (*link)
 	{
-		nextBlock = *list;
+		if (*link == block)
+		{
+			*link = ((hash == startHash)? block->startNext : block->endNext);
+			return;
+		}
 
-		while (nextBlock)
+		link = ((hash == startHash)? &(*link)->startNext :
+			&(*link)->endNext);
+	}
+}
+
+
+static mallocBlock *hashFind(mallocBlock **hash, unsigned address)
+{
+	// Find the block with the supplied start or end address
+
+	mallocBlock *block = hash[hashBucket(address)];
+
+	while (block)
+	{
+		if (hash == startHash)
 		{
-			if (nextBlock->start > block->start)
-			{
-				insertBlock(list, block, nextBlock);
-				break;
-			}
+			if (block->start == address)
+				return (block);
 
-			if (!nextBlock->next)
-			{
-				appendBlock(block, nextBlock);
-				break;
-			}
+			block = block->startNext;
+		}
+		else
+		{
+			if (blockEnd(block) == address)
+				return (block);
 
-			nextBlock = nextBlock->next;
+			block = block->endNext;
 		}
 	}
-	else
+
+	return (block = NULL);
+}
+
+
+static int binIndex(unsigned size)
+{
+	// Returns the free block bin for the supplied size
+
+	int bin = 0;
+
+	if (size <= MALLOC_SMALL_MAX)
+		return (bin = ((size / sizeof(int)) - 1));
+
+	bin = MALLOC_SMALL_BINS;
+	size /= (MALLOC_SMALL_MAX * 2);
+
+	while (size && (bin < (MALLOC_BINS - 1)))
 	{
-		block->prev = NULL;
-		block->next = NULL;
-		*list = block;
+		size >>= 1;
+		bin += 1;
 	}
 
-	return (status = 0);
+	return (bin);
+}
+
+
+static int nextBin(int bin)
+{
+	// Returns the first non-empty free block bin after the supplied one, or
+	// negative if there aren't any
+
+	unsigned bits = 0;
+	int word;
+
+	bin += 1;
+
+	for (word = (bin / 32); word < MALLOC_BINMAP_WORDS; word ++)
+	{
+		bits = freeBinMap[word];
+
+		// Ignore the bins before the one we want, in its word
+		if (word == (bin / 32))
+			bits &= (0xFFFFFFFF << (bin % 32));
+
+		if (bits)
+			return ((word * 32) + __builtin_ctz(bits));
+	}
+
+	return (bin = -1);
+}
+
+
+static void addFree(mallocBlock *block)
+{
+	// Add the block to the appropriate free block bin, and the hashes
+
+	int bin = binIndex(block->size);
+
+	block->used = 0;
+
+	pushBlock(&freeBins[bin], block);
+	freeBinMap[bin / 32] |= (1 << (bin % 32));
+
+	hashInsert(startHash, block->start, block);
+	hashInsert(endHash, blockEnd(block), block);
+}
+
+
+static void removeFree(mallocBlock *block)
+{
+	// Remove the block from its free block bin and the hashes
+
+	int bin = binIndex(block->size);
+
+	removeBlock(&freeBins[bin], block);
+	if (!freeBins[bin])
+		freeBinMap[bin / 32] &= ~(1 << (bin % 32));
+
+	hashRemove(startHash, block->start, block);
+	hashRemove(endHash, blockEnd(block), block);
 }
 
 
@@ -275,36 +410,10 @@ static mallocBlock *getBlock(void)
 }
 
 
-static void removeBlock(mallocBlock **list, mallocBlock *block)
-{
-	// Remove a block from a list
-
-	debug("Remove block %08x->%08x (%u) from %s list", block->start,
-		blockEnd(block), block->size, ((list == USEDLIST_REF)? "used" :
-			"free"));
-
-	if (block->prev)
-		block->prev->next = block->next;
-	if (block->next)
-		block->next->prev = block->prev;
-
-	if (block == *list)
-		*list = block->next;
-
-	block->prev = NULL;
-	block->next = NULL;
-
-	return;
-}
-
-
-static void putBlock(mallocBlock **list, mallocBlock *block)
+static void putBlock(mallocBlock *block)
 {
 	// This function gets called when a block is no longer needed.  We
-	// zero out its fields and move it to the end of the used blocks.
-
-	// Remove the block from the list.
-	removeBlock(list, block);
+	// zero out its fields and move it to the vacant blocks.
 
 	// Clear it
 	memset(block, 0, sizeof(mallocBlock));
@@ -319,17 +428,16 @@ static void putBlock(mallocBlock **list, mallocBlock *block)
 }
 
 
-static int createBlock(mallocBlock **list, unsigned start, unsigned size,
-	unsigned heapAlloc, unsigned heapAllocSize)
+static int createFree(unsigned start, unsigned size, unsigned heapAlloc,
+	unsigned heapAllocSize, int dirty)
 {
-	// Creates a used or free block in the supplied block list.
+	// Creates a free block
 
 	int status = 0;
 	mallocBlock *block = NULL;
 
-	debug("Create block %08x-%08x (%u) in %s list", start,
-		(start + (size - 1)), size, ((list == USEDLIST_REF)? "used" :
-			"free"));
+	debug("Create free block %08x-%08x (%u)", start, (start + (size - 1)),
+		size);
 
 	block = getBlock();
 	if (!block)
@@ -339,8 +447,11 @@ static int createBlock(mallocBlock **list, unsigned start, unsigned size,
 	block->size = size;
 	block->heapAlloc = heapAlloc;
 	block->heapAllocSize = heapAllocSize;
+	block->dirty = dirty;
+
+	addFree(block);
 
-	return (status = sortInsertBlock(list, block));
+	return (status = 0);
 }
 
 
@@ -365,6 +476,8 @@ static int growHeap(unsigned minSize)
 	// Get the heap memory
 	if (visopsys_in_kernel)
 		newHeap = memory_get(minSize, "kernel heap");
+	else if (minSize >= MALLOC_RESERVE_MIN)
+		newHeap = memory_reserve(minSize, "user heap");
 	else
 		newHeap = memory_get(minSize, "user heap");
 
@@ -376,53 +489,43 @@ static int growHeap(unsigned minSize)
 
 	totalMemory += minSize;
 
-	// Add it as a single free block
-	return (createBlock(FREELIST_REF, (unsigned) newHeap, minSize,
-		(unsigned) newHeap, minSize));
+	// Add it as a single free block.  The memory is cleared for us.
+	return (createFree((unsigned) newHeap, minSize, (unsigned) newHeap,
+		minSize, 0 /* clean */));
 }
 
 
 static mallocBlock *findFree(unsigned size)
 {
-	// This is a best-fit algorithm to search the free block list for the free
-	// block that's closest to the size requested.  We do it this way in order
-	// to (hopefully) reduce memory fragmentation - i.e. reduce heap memory
-	// usage - at the possible expense of slightly longer searches.
+	// Find a free block that's at least the size requested.  If the size
+	// has its own bin, any block in it is the right size.  Otherwise, search
+	// the bin for the first block that's big enough.  Failing that, any
+	// block from a larger bin will do.
 
-	mallocBlock *block = freeBlockList;
-	mallocBlock *closestBlock = NULL;
+	mallocBlock *block = NULL;
+	int bin = binIndex(size);
 
 	debug("Search for free block of at least %u", size);
 
-	while (block)
+	for (block = freeBins[bin]; block; block = block->next)
 	{
-		// If the block is exactly the right size, return it
-		if (block->size == size)
+		if (block->size >= size)
 		{
 			debug("Found free block of size %u", block->size);
 			return (block);
 		}
-
-		// If the block is closer in size than any others, remember it
-		if (block->size > size)
-		{
-			if (!closestBlock || (block->size < closestBlock->size))
-				closestBlock = block;
-		}
-
-		block = block->next;
 	}
 
-	if (closestBlock)
+	bin = nextBin(bin);
+	if (bin >= 0)
 	{
-		debug("Found free block of size %u", closestBlock->size);
-		return (closestBlock);
-	}
-	else
-	{
-		debug("No block found");
-		return (block = NULL);
+		block = freeBins[bin];
+		debug("Found free block of size %u", block->size);
+		return (block);
 	}
+
+	debug("No block found");
+	return (block = NULL);
 }
 
 
@@ -462,34 +565,41 @@ static void *allocateBlock(unsigned size, const char *function)
 		}
 	}
 
-	// Remove it from the free list
-	removeBlock(FREELIST_REF, block);
-
-	block->function = function;
-	block->process = procid();
-
-	// Add it to the used block list
-	sortInsertBlock(USEDLIST_REF, block);
-	if (status < 0)
-		return (NULL);
+	// Remove it from the free lists
+	removeFree(block);
 
 	// If part of this block will be unused, we will need to create a free
 	// block for the remainder
 	if (block->size > size)
 	{
 		remainder = (block->size - size);
-		block->size = size;
 
 		debug("Split block of size %u from remainder of size %u", size,
 			remainder);
 
-		if (createBlock(FREELIST_REF, (block->start + size), remainder,
-			block->heapAlloc, block->heapAllocSize) < 0)
+		if (createFree((block->start + size), remainder, block->heapAlloc,
+			block->heapAllocSize, block->dirty) < 0)
 		{
+			addFree(block);
 			return (NULL);
 		}
+
+		block->size = size;
 	}
 
+	// Clear the memory, unless we know it's clear already
+	if (block->dirty)
+		memset((void *) block->start, 0, size);
+
+	block->used = 1;
+	block->function = function;
+	block->process = procid();
+
+	// Add it to the used block list
+	pushBlock(USEDLIST_REF, block);
+	hashInsert(startHash, block->start, block);
+
+	usedBlocks += 1;
 	usedMemory += size;
 
 	return ((void *) block->start);
@@ -498,92 +608,84 @@ static void *allocateBlock(unsigned size, const char *function)
 
 static void mergeFree(mallocBlock *block)
 {
-	// Merge this free block with the previous and/or next blocks if they
-	// are also free.
+	// Merge this (not yet listed) free block with the previous and/or next
+	// blocks, if they are also free.
+
+	mallocBlock *neighbour = NULL;
 
-	// Check whether we're contiguous with the previous block
-	if (block->prev && (block->prev->heapAlloc == block->heapAlloc) &&
-		(blockEnd(block->prev) == (block->start - 1)))
+	// Is there a free block that ends right before this one?
+	neighbour = hashFind(endHash, (block->start - 1));
+	if (neighbour && (neighbour->heapAlloc == block->heapAlloc))
 	{
-		block->start = block->prev->start;
-		block->size += block->prev->size;
-		putBlock(FREELIST_REF, block->prev);
+		removeFree(neighbour);
+		block->start = neighbour->start;
+		block->size += neighbour->size;
+		block->dirty |= neighbour->dirty;
+		putBlock(neighbour);
 	}
 
-	// Check whether we're contiguous with the next block
-	if (block->next && (block->next->heapAlloc == block->heapAlloc) &&
-		(blockEnd(block) == (block->next->start - 1)))
+	// Is there a free block that starts right after this one?
+	neighbour = hashFind(startHash, (blockEnd(block) + 1));
+	if (neighbour && !neighbour->used &&
+		(neighbour->heapAlloc == block->heapAlloc))
 	{
-		block->size += block->next->size;
-		putBlock(FREELIST_REF, block->next);
+		removeFree(neighbour);
+		block->size += neighbour->size;
+		block->dirty |= neighbour->dirty;
+		putBlock(neighbour);
 	}
 }
 
 
-static void cleanupHeap(mallocBlock *block)
-{
-	// If the supplied free block comprises an entire heap allocation,
-	// return that heap memory and get rid of the block.
-
-	if (block->size != block->heapAllocSize)
-		return;
-
-	// Looks like we can return this memory.
-	debug("Release heap memory allocation %08x->%08x (%u)", block->start,
-		blockEnd(block), block->size);
-
-	memory_release((void *) block->start);
-	totalMemory -= block->size;
-	putBlock(FREELIST_REF, block);
-}
-
-
 static int deallocateBlock(void *start, const char *function)
 {
 	// Find an allocated (used) block and deallocate it.
 
 	int status = 0;
-	mallocBlock *block = usedBlockList;
+	mallocBlock *block = hashFind(startHash, (unsigned) start);
 
-	while (block)
+	if (!block || !block->used)
 	{
-		if (block->start == (unsigned) start)
-		{
-			// Remove it from the used list
-			removeBlock(USEDLIST_REF, block);
-
-			// Clear out the memory
-			memset(start, 0, block->size);
-
-			block->process = 0;
-			block->function = NULL;
+		error("No such memory block %08x to deallocate (%s)",
+			(unsigned) start, function);
+		return (status = ERR_NOSUCHENTRY);
+	}
 
-			// Add it to the free block list
-			sortInsertBlock(FREELIST_REF, block);
-			if (status < 0)
-				return (status);
+	// Remove it from the used list
+	removeBlock(USEDLIST_REF, block);
+	hashRemove(startHash, block->start, block);
 
-			usedMemory -= block->size;
+	// Don't clear the memory until it's allocated again
+	block->dirty = 1;
 
-			// Merge free blocks on either side of this one
-			mergeFree(block);
+	block->used = 0;
+	block->process = 0;
+	block->function = NULL;
 
-			// Can the heap be deallocated?
-			cleanupHeap(block);
+	usedBlocks -= 1;
+	usedMemory -= block->size;
 
-			// Don't try to use 'block' after this point, it might have
-			// disappeared.
-			block = NULL;
+	// Merge free blocks on either side of this one
+	mergeFree(block);
 
-			return (status = 0);
-		}
+	// If the free block now comprises an entire heap allocation, return that
+	// heap memory and get rid of the block.
+	if (block->size == block->heapAllocSize)
+	{
+		debug("Release heap memory allocation %08x->%08x (%u)", block->start,
+			blockEnd(block), block->size);
 
-		block = block->next;
+		memory_release((void *) block->start);
+		totalMemory -= block->size;
+		putBlock(block);
+	}
+	else
+	{
+		// Add it to the free lists
+		addFree(block);
 	}
 
-	error("No such memory block %08x to deallocate (%s)", (unsigned) start,
-		function);
-	return (status = ERR_NOSUCHENTRY);
+	return (status = 0);
 }
 
 
@@ -624,109 +726,90 @@ static int checkPointer(mallocBlock *block)
 }
 
 
-static int checkBlocks(void)
+static int checkList(mallocBlock **list, int bin)
 {
+	// Check the links of the used block list, or a free block bin, and
+	// make sure each block is where it ought to be in the hashes
+
 	int status = 0;
-	mallocBlock **lists[2] = {
-		FREELIST_REF, USEDLIST_REF,
-	};
-	const char *listName = NULL;
-	mallocBlock *block = NULL;
-	mallocBlock *prev = NULL;
-	mallocBlock *next = NULL;
-	int count;
+	const char *listName = ((list == USEDLIST_REF)? "used" : "free");
+	mallocBlock *block = *list;
 
-	for (count = 0; count < 2; count ++)
+	while (block)
 	{
-		if (lists[count] == FREELIST_REF)
-			listName = "free";
-		else if (lists[count] == USEDLIST_REF)
-			listName = "used";
-		else
-			listName = "unknown";
+		status = checkPointer(block);
+		if (status < 0)
+			return (status);
 
-		block = *lists[count];
+		if (block->prev && (block->prev->next != block))
+		{
+			error("Previous block does not point to current block "
+				"%08x->%08x (%u) in %s list", block->start, blockEnd(block),
+				block->size, listName);
+			return (status = ERR_BADDATA);
+		}
 
-		while (block)
+		if (block->next && (block->next->prev != block))
 		{
-			status = checkPointer(block);
-			if (status < 0)
-				return (status);
+			error("Next block does not point to current block %08x->%08x "
+				"(%u) in %s list", block->start, blockEnd(block),
+				block->size, listName);
+			return (status = ERR_BADDATA);
+		}
 
-			if (block->prev)
+		if (block->used != (list == USEDLIST_REF))
+		{
+			error("Block %08x->%08x (%u) in %s list has the wrong state",
+				block->start, blockEnd(block), block->size, listName);
+			return (status = ERR_BADDATA);
+		}
+
+		if (hashFind(startHash, block->start) != block)
+		{
+			error("Block %08x->%08x (%u) in %s list is not in the start "
+				"hash", block->start, blockEnd(block), block->size,
+				listName);
+			return (status = ERR_BADDATA);
+		}
+
+		if (list != USEDLIST_REF)
+		{
+			if (binIndex(block->size) != bin)
 			{
-				prev = block->prev;
-
-				status = checkPointer(prev);
-				if (status < 0)
-					return (status);
-
-				if (prev->next != block)
-				{
-					error("Previous block %08x->%08x (%u) does not point to "
-						"current block %08x->%08x (%u) in %s list",
-						prev->start, blockEnd(prev), prev->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (prev->start >= block->start)
-				{
-					error("Previous block %08x->%08x (%u) does not start "
-						"before current block %08x->%08x (%u) in %s list",
-						prev->start, blockEnd(prev), prev->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (blockEnd(prev) >= block->start)
-				{
-					error("Previous block %08x->%08x (%u) end overlaps "
-						"current block %08x->%08x (%u) in %s list",
-						prev->start, blockEnd(prev), prev->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
+				error("Free block %08x->%08x (%u) is in the wrong bin %d",
+					block->start, blockEnd(block), block->size, bin);
+				return (status = ERR_BADDATA);
 			}
 
-			if (block->next)
+			if (hashFind(endHash, blockEnd(block)) != block)
 			{
-				next = block->next;
-
-				status = checkPointer(next);
-				if (status < 0)
-					return (status);
-
-				if (next->prev != block)
-				{
-					error("Next block %08x->%08x (%u) does not point to "
-						"current block %08x->%08x (%u) in %s list",
-						next->start, blockEnd(next), next->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (block->start >= next->start)
-				{
-					error("Next block %08x->%08x (%u) does not start after "
-						"current block %08x->%08x (%u) in %s list",
-						next->start, blockEnd(next), next->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (blockEnd(block) >= next->start)
-				{
-					error("Current block %08x->%08x (%u) end overlaps next "
-						"block %08x->%08x (%u) in %s list", block->start,
-						blockEnd(block), block->size, next->start,
-						blockEnd(next), next->size, listName);
-					return (status = ERR_BADDATA);
-				}
+				error("Free block %08x->%08x (%u) is not in the end hash",
+					block->start, blockEnd(block), block->size);
+				return (status = ERR_BADDATA);
 			}
-
-			block = block->next;
 		}
+
+		block = block->next;
+	}
+
+	return (status = 0);
+}
+
+
+static int checkBlocks(void)
+{
+	int status = 0;
+	int count;
+
+	status = checkList(USEDLIST_REF, -1);
+	if (status < 0)
+		return (status);
+
+	for (count = 0; count < MALLOC_BINS; count ++)
+	{
+		status = checkList(&freeBins[count], count);
+		if (status < 0)
+			return (status);
 	}
 
 	return (status = 0);
@@ -744,7 +827,8 @@ static int checkBlocks(void)
 
 void *_doMalloc(unsigned size, const char *function)
 {
-	// These are the guts of malloc() and kernelMalloc()
+	// These are the guts of malloc() and kernelMalloc().  The memory is
+	// cleared.
 
 	int status = 0;
 	void *address = NULL;
@@ -868,7 +952,7 @@ int _mallocBlockInfo(void *start, memoryBlock *meBlock)
 	// the structure with information about it.
 
 	int status = 0;
-	mallocBlock *maBlock = usedBlockList;
+	mallocBlock *maBlock = NULL;
 
 	// Check params
 	if (!start || !meBlock)
@@ -881,17 +965,13 @@ int _mallocBlockInfo(void *start, memoryBlock *meBlock)
 		return (errno = status);
 	}
 
-	// Loop through the used block list
-	while (maBlock)
+	// Look it up in the start address hash
+	maBlock = hashFind(startHash, (unsigned) start);
+	if (maBlock && maBlock->used)
 	{
-		if (maBlock->start == (unsigned) start)
-		{
-			mallocBlock2MemoryBlock(maBlock, meBlock);
-			lock_release(&blocksLock);
-			return (status = 0);
-		}
-
-		maBlock = maBlock->next;
+		mallocBlock2MemoryBlock(maBlock, meBlock);
+		lock_release(&blocksLock);
+		return (status = 0);
 	}
 
 	lock_release(&blocksLock);
@@ -906,7 +986,6 @@ int _mallocGetStats(memoryStats *stats)
 	// Return malloc memory usage statistics
 
 	int status = 0;
-	mallocBlock *block = usedBlockList;
 
 	// Check params
 	if (!stats)
@@ -923,12 +1002,7 @@ int _mallocGetStats(memoryStats *stats)
 	}
 
 	stats->totalBlocks = totalBlocks;
-	stats->usedBlocks = 0;
-	while (block)
-	{
-		stats->usedBlocks += 1;
-		block = block->next;
-	}
+	stats->usedBlocks = usedBlocks;
 	stats->totalMemory = totalMemory;
 	stats->usedMemory = usedMemory;
 
@@ -943,7 +1017,8 @@ int _mallocGetBlocks(memoryBlock *blocksArray, int doBlocks)
 	// Fill a memoryBlock array with 'doBlocks' used malloc blocks information
 
 	int status = 0;
-	mallocBlock *block = usedBlockList;
+	mallocBlock *block = NULL;
+	int numBlocks = 0;
 	int count;
 
 	// Check params
@@ -953,6 +1028,9 @@ int _mallocGetBlocks(memoryBlock *blocksArray, int doBlocks)
 		return (status = ERR_NULLPARAMETER);
 	}
 
+	if (doBlocks <= 0)
+		return (status = 0);
+
 	status = lock_get(&blocksLock);
 	if (status < 0)
 	{
@@ -960,11 +1038,29 @@ int _mallocGetBlocks(memoryBlock *blocksArray, int doBlocks)
 		return (errno = status);
 	}
 
-	// Loop through the used block list
-	for (count = 0; (block && (count < doBlocks)); count ++)
+	// Loop through the used block list, which is in no particular order.
+	// Insert each block in order of start address, and if there are more
+	// than will fit, keep the lowest ones.
+	for (block = usedBlockList; block; block = block->next)
 	{
+		if (numBlocks >= doBlocks)
+		{
+			if (block->start >= blocksArray[doBlocks - 1].startLocation)
+				continue;
+
+			// Drop the highest one to make room
+			numBlocks -= 1;
+		}
+
+		for (count = numBlocks; ((count > 0) &&
+			(blocksArray[count - 1].startLocation > block->start)); count --)
+		{
+			memcpy(&blocksArray[count], &blocksArray[count - 1],
+				sizeof(memoryBlock));
+		}
+
 		mallocBlock2MemoryBlock(block, &blocksArray[count]);
-		block = block->next;
+		numBlocks += 1;
 	}
 
 	lock_release(&blocksLock);
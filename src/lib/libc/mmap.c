@@ -0,0 +1,86 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2018 J. Andrew McLaughlin
+//
+//  This library is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation; either version 2.1 of the License, or (at
+//  your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+//  General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this library; if not, write to the Free Software Foundation,
+//  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  mmap.c
+//
+
+// This is the standard "mmap" function, as found in standard C libraries
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <sys/api.h>
+#include <sys/cdefs.h>
+
+
+void *mmap(void *addr __attribute__((unused)), size_t length, int prot,
+	int flags, int fd, off_t offset)
+{
+	// Map part of a file into memory.  Pages are read from the file when
+	// they're first touched.  Changes are never written back to the file, so
+	// only private mappings can be writable.  The address is only a hint,
+	// which we ignore.
+
+	int status = 0;
+	fileDescType type = filedesc_unknown;
+	void *data = NULL;
+	void *mem = NULL;
+
+	if (visopsys_in_kernel)
+	{
+		errno = ERR_BUG;
+		return (MAP_FAILED);
+	}
+
+	if (!length || (flags & MAP_FIXED) ||
+		!(flags & (MAP_SHARED | MAP_PRIVATE)))
+	{
+		errno = ERR_INVALID;
+		return (MAP_FAILED);
+	}
+
+	if ((prot & PROT_WRITE) && !(flags & MAP_PRIVATE))
+	{
+		errno = ERR_NOTIMPLEMENTED;
+		return (MAP_FAILED);
+	}
+
+	// Look up the file descriptor
+	status = _fdget(fd, &type, &data);
+	if (status < 0)
+	{
+		errno = status;
+		return (MAP_FAILED);
+	}
+
+	if (type != filedesc_filestream)
+	{
+		errno = ERR_INVALID;
+		return (MAP_FAILED);
+	}
+
+	mem = memoryMapFile(&((fileStream *) data)->f, offset, length,
+		((prot & PROT_WRITE)? MEMORY_MAP_PRIVATE : MEMORY_MAP_READONLY));
+	if (!mem)
+	{
+		errno = ERR_MEMORY;
+		return (MAP_FAILED);
+	}
+
+	return (mem);
+}
+
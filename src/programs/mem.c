@@ -33,7 +33,7 @@ Usage:
 
 This command prints a listing of memory allocations, plus a summary at the
 end.  If the (optional) '-k' parameter is supplied, then 'mem' will display
-system (kernel) memory usage instead.
+system (kernel) memory usage instead, including the kernel's object caches.
 
 Options:
 -k  : Show kernel memory usage
@@ -64,6 +64,8 @@ int main(int argc, char *argv[])
 	int kernelMem = 0;
 	memoryStats stats;
 	memoryBlock *blocksArray = NULL;
+	memoryCacheStats caches[MEMORY_MAX_CACHES];
+	int numCaches = 0;
 	unsigned totalFree = 0;
 	unsigned percentUsed = 0;
 	unsigned count;
@@ -150,6 +152,36 @@ int main(int argc, char *argv[])
 		stats.usedBlocks, stats.totalMemory, stats.usedMemory, percentUsed,
 		totalFree, (100 - percentUsed));
 
+	if (!kernelMem)
+	{
+		// Reserved memory is only partly in use, so it isn't in the totals
+		// above until it's touched
+		printf(_("Reserved    : %u Kb - %u Kb resident\n"),
+			(stats.reservedMemory >> 10), (stats.residentMemory >> 10));
+
+		if (stats.swapTotal)
+			printf(_("Swap        : %u Kb - %u Kb used\n"),
+				(stats.swapTotal >> 10), (stats.swapUsed >> 10));
+	}
+	else
+	{
+		// Kernel object caches get their memory from the system, so they
+		// aren't in the heap totals
+		numCaches = memoryGetCacheStats(caches, MEMORY_MAX_CACHES);
+		if (numCaches > 0)
+		{
+			printf(_(" --- Object caches ---\n"));
+			for (count = 0; count < (unsigned) numCaches; count ++)
+			{
+				printf("%s", caches[count].name);
+				textSetColumn(24);
+				printf(_("size %u, %u/%u used, %u Kb\n"),
+					caches[count].objectSize, caches[count].usedObjects,
+					caches[count].totalObjects, (caches[count].memory >> 10));
+			}
+		}
+	}
+
 	return (status = 0);
 }
 
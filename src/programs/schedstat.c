@@ -0,0 +1,314 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2018 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  schedstat.c
+//
+
+// This is a command for viewing scheduler latency statistics
+
+/* This is the text that appears when a user requests help about this program
+<help>
+
+ -- schedstat --
+
+Show scheduling latency statistics for the running processes
+
+Usage:
+  schedstat [-s seconds]
+
+This command turns on the kernel's scheduler trace for a few seconds, and
+then prints two histograms for each process that ran in that time: the run
+queue latency (how long the process waited between becoming ready and
+getting the CPU) and the slice usage (how long it ran each time it got the
+CPU).  The times are in microseconds.  Only privileged users can trace the
+scheduler.
+
+Options:
+-s <seconds>  : Trace for the specified number of seconds (default 5)
+
+</help>
+*/
+
+#include <errno.h>
+#include <libintl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/api.h>
+#include <sys/env.h>
+
+#define _(string) gettext(string)
+
+#define DEFAULT_SECONDS		5
+#define READ_INTERVAL_MS	250
+#define READ_EVENTS			1024
+#define MAX_TRACE_PROCS		100
+#define HISTOGRAM_BUCKETS	21	// Powers of 2, up to about 1 second
+#define BAR_WIDTH			40
+
+typedef struct {
+	int processId;
+	unsigned long long readyTime;
+	unsigned long long runTime;
+	unsigned latency[HISTOGRAM_BUCKETS];
+	unsigned slices[HISTOGRAM_BUCKETS];
+
+} traceProc;
+
+static traceProc *procs = NULL;
+static int numProcs = 0;
+
+
+static traceProc *findProc(int processId)
+{
+	// Find the statistics for the process, or start new ones
+
+	int count;
+
+	for (count = 0; count < numProcs; count ++)
+	{
+		if (procs[count].processId == processId)
+			return (&procs[count]);
+	}
+
+	if (numProcs >= MAX_TRACE_PROCS)
+		return (NULL);
+
+	memset(&procs[numProcs], 0, sizeof(traceProc));
+	procs[numProcs].processId = processId;
+
+	return (&procs[numProcs++]);
+}
+
+
+static void addSample(unsigned *histogram, unsigned long long time)
+{
+	// Count the time (in microseconds) in the histogram bucket for its power
+	// of 2
+
+	int bucket = 0;
+
+	while ((time > 1) && (bucket < (HISTOGRAM_BUCKETS - 1)))
+	{
+		time >>= 1;
+		bucket += 1;
+	}
+
+	histogram[bucket] += 1;
+}
+
+
+static void processEvent(schedTraceEvent *event)
+{
+	traceProc *proc = findProc(event->processId);
+
+	if (!proc)
+		return;
+
+	switch (event->type)
+	{
+		case SCHEDTRACE_WAKEUP:
+			proc->readyTime = event->time;
+			break;
+
+		case SCHEDTRACE_SWITCHIN:
+			if (proc->readyTime)
+				addSample(proc->latency, (event->time - proc->readyTime));
+			proc->readyTime = 0;
+			proc->runTime = event->time;
+			break;
+
+		case SCHEDTRACE_SWITCHOUT:
+			if (proc->runTime)
+				addSample(proc->slices, (event->time - proc->runTime));
+			proc->runTime = 0;
+
+			// If it was preempted, it's waiting in the run queue again
+			if ((event->state == proc_ready) ||
+				(event->state == proc_ioready))
+			{
+				proc->readyTime = event->time;
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+static void printHistogram(const char *title, unsigned *histogram)
+{
+	unsigned max = 0;
+	int first = -1, last = -1;
+	int count1, count2;
+
+	for (count1 = 0; count1 < HISTOGRAM_BUCKETS; count1 ++)
+	{
+		if (histogram[count1])
+		{
+			if (first < 0)
+				first = count1;
+			last = count1;
+			if (histogram[count1] > max)
+				max = histogram[count1];
+		}
+	}
+
+	if (first < 0)
+		return;
+
+	printf("  %s\n", title);
+
+	for (count1 = first; count1 <= last; count1 ++)
+	{
+		printf("  %8u-%-8u %7u ", (count1? (1U << count1) : 0),
+			((1U << (count1 + 1)) - 1), histogram[count1]);
+
+		for (count2 = 0; count2 < (int)((histogram[count1] * BAR_WIDTH) /
+			max); count2 ++)
+		{
+			printf("*");
+		}
+
+		printf("\n");
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	// This command will turn on the scheduler trace, collect events for a
+	// while, and print latency information about the processes.
+
+	int status = 0;
+	char opt;
+	int seconds = DEFAULT_SECONDS;
+	schedTraceEvent *events = NULL;
+	int waits = 0;
+	int numEvents = 0;
+	process proc;
+	int count;
+
+	setlocale(LC_ALL, getenv(ENV_LANG));
+	textdomain("schedstat");
+
+	// Check options
+	while (strchr("s:?", (opt = getopt(argc, argv, "s:"))))
+	{
+		switch (opt)
+		{
+			case 's':
+				// How long to trace for
+				if (!optarg || (atoi(optarg) <= 0))
+				{
+					fprintf(stderr, "%s", _("Missing or invalid seconds "
+						"argument for '-s' option\n"));
+					errno = status = ERR_INVALID;
+					perror(argv[0]);
+					return (status);
+				}
+				seconds = atoi(optarg);
+				break;
+
+			case ':':
+				fprintf(stderr, _("Missing parameter for %s option\n"),
+					argv[optind - 1]);
+				errno = status = ERR_NULLPARAMETER;
+				perror(argv[0]);
+				return (status);
+
+			default:
+				fprintf(stderr, _("Unknown option '%c'\n"), optopt);
+				errno = status = ERR_INVALID;
+				perror(argv[0]);
+				return (status);
+		}
+	}
+
+	procs = malloc(MAX_TRACE_PROCS * sizeof(traceProc));
+	events = malloc(READ_EVENTS * sizeof(schedTraceEvent));
+	if (!procs || !events)
+	{
+		errno = status = ERR_MEMORY;
+		goto out;
+	}
+
+	status = multitaskerSchedTrace(1);
+	if (status < 0)
+	{
+		errno = status;
+		goto out;
+	}
+
+	printf(_("Tracing the scheduler for %d seconds...\n"), seconds);
+
+	// Read the events as we go, so that the kernel's buffer doesn't fill up
+	waits = ((seconds * 1000) / READ_INTERVAL_MS);
+	while (1)
+	{
+		numEvents = multitaskerSchedTraceRead(events, READ_EVENTS);
+		if (numEvents < 0)
+		{
+			errno = status = numEvents;
+			break;
+		}
+
+		for (count = 0; count < numEvents; count ++)
+			processEvent(&events[count]);
+
+		if (numEvents < READ_EVENTS)
+		{
+			if (waits-- <= 0)
+				break;
+
+			multitaskerWait(READ_INTERVAL_MS);
+		}
+	}
+
+	multitaskerSchedTrace(0);
+
+	if (status < 0)
+		goto out;
+
+	for (count = 0; count < numProcs; count ++)
+	{
+		if (multitaskerGetProcess(procs[count].processId, &proc) < 0)
+			strcpy(proc.name, _("(exited)"));
+
+		printf("\n\"%s\"  PID=%d\n", proc.name, procs[count].processId);
+		printHistogram(_("Run queue latency (us):"), procs[count].latency);
+		printHistogram(_("Slice usage (us):"), procs[count].slices);
+	}
+
+	status = 0;
+
+out:
+	if (status < 0)
+		perror(argv[0]);
+
+	if (events)
+		free(events);
+	if (procs)
+		free(procs);
+
+	return (status);
+}
+